@@ -6,6 +6,7 @@ class CCoinControl
 {
 public:
     CTxDestination destChange;
+    int nCoinSelection; // CoinSelectionStrategy, -1 to use the wallet's -coinselection
 
     CCoinControl()
     {
@@ -15,6 +16,7 @@ public:
     void SetNull()
     {
         destChange = CNoDestination();
+        nCoinSelection = -1;
         setSelected.clear();
     }
     
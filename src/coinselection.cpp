@@ -0,0 +1,395 @@
+// Copyright (c) 2014 The UltimateSecureCash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinselection.h"
+#include "util.h"
+
+#include <algorithm>
+#include <limits>
+
+
+const char* GetCoinSelectionName(int nStrategy)
+{
+    switch (nStrategy)
+    {
+        case COINSELECT_DEFAULT:        return "default";
+        case COINSELECT_KNAPSACK:       return "knapsack";
+        case COINSELECT_BNB:            return "bnb";
+        case COINSELECT_LARGEST_FIRST:  return "largestfirst";
+        case COINSELECT_CONSOLIDATE:    return "consolidate";
+    };
+    return "unknown";
+};
+
+bool ParseCoinSelection(const std::string& str, int& nStrategy)
+{
+    for (int i = COINSELECT_DEFAULT; i <= COINSELECT_CONSOLIDATE; ++i)
+    {
+        if (str != GetCoinSelectionName(i))
+            continue;
+        nStrategy = i;
+        return true;
+    };
+    return false;
+};
+
+struct CompareCandidateValueDesc
+{
+    bool operator()(const CSelectCandidate& a, const CSelectCandidate& b) const
+    {
+        return a.nValue > b.nValue;
+    }
+};
+
+class CSelectBudget
+{
+public:
+    CSelectBudget(const CCoinSelectionParams& params)
+    {
+        nTries = 0;
+        nMaxTries = params.nMaxTries;
+        nDeadline = params.nMaxTime > 0 ? GetTimeMicros() + params.nMaxTime : 0;
+        fTimedOut = false;
+    };
+
+    bool OutOfTime()
+    {
+        if (!fTimedOut && nDeadline && GetTimeMicros() > nDeadline)
+            fTimedOut = true;
+        return fTimedOut;
+    };
+
+    unsigned int nTries;
+    unsigned int nMaxTries;
+    int64_t nDeadline;
+    bool fTimedOut;
+};
+
+static void SelectCandidate(const CSelectCandidate& c, CCoinSelectionResult& result)
+{
+    result.vSelected.push_back(c.nIndex);
+    result.nValue += c.nValue;
+};
+
+static void ApproximateBestSubset(const std::vector<CSelectCandidate>& vValue, int64_t nTotalLower, int64_t nTargetValue,
+    std::vector<char>& vfBest, int64_t& nBest, CSelectBudget& budget, int iterations = 1000)
+{
+    std::vector<char> vfIncluded;
+
+    vfBest.assign(vValue.size(), true);
+    nBest = nTotalLower;
+
+    // -- always make one pass, so a search started late still improves on taking everything
+    for (int nRep = 0; nRep < iterations && nBest != nTargetValue && (nRep == 0 || !budget.OutOfTime()); nRep++)
+    {
+        vfIncluded.assign(vValue.size(), false);
+        int64_t nTotal = 0;
+        bool fReachedTarget = false;
+        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
+        {
+            for (unsigned int i = 0; i < vValue.size(); i++)
+            {
+                if (nPass == 0 ? rand() % 2 : !vfIncluded[i])
+                {
+                    nTotal += vValue[i].nValue;
+                    vfIncluded[i] = true;
+                    if (nTotal >= nTargetValue)
+                    {
+                        fReachedTarget = true;
+                        if (nTotal < nBest)
+                        {
+                            nBest = nTotal;
+                            vfBest = vfIncluded;
+                        }
+                        nTotal -= vValue[i].nValue;
+                        vfIncluded[i] = false;
+                    }
+                }
+            }
+        }
+    }
+};
+
+static bool SelectKnapsack(std::vector<CSelectCandidate>& vCandidates, int64_t nTargetValue,
+    const CCoinSelectionParams& params, CCoinSelectionResult& result, CSelectBudget& budget)
+{
+    result.nStrategy = COINSELECT_KNAPSACK;
+
+    // List of values less than target
+    int nLowestLarger = -1;
+    std::vector<CSelectCandidate> vValue;
+    int64_t nTotalLower = 0;
+
+    std::random_shuffle(vCandidates.begin(), vCandidates.end(), GetRandInt);
+
+    for (unsigned int i = 0; i < vCandidates.size(); ++i)
+    {
+        const CSelectCandidate& c = vCandidates[i];
+        if (c.nValue == nTargetValue)
+        {
+            SelectCandidate(c, result);
+            return true;
+        } else
+        if (c.nValue < nTargetValue + params.nMinChange)
+        {
+            vValue.push_back(c);
+            nTotalLower += c.nValue;
+        } else
+        if (nLowestLarger < 0 || c.nValue < vCandidates[nLowestLarger].nValue)
+        {
+            nLowestLarger = i;
+        };
+    };
+
+    if (nTotalLower == nTargetValue)
+    {
+        for (unsigned int i = 0; i < vValue.size(); ++i)
+            SelectCandidate(vValue[i], result);
+        return true;
+    };
+
+    if (nTotalLower < nTargetValue)
+    {
+        if (nLowestLarger < 0)
+            return false;
+        SelectCandidate(vCandidates[nLowestLarger], result);
+        return true;
+    };
+
+    // Solve subset sum by stochastic approximation
+    std::sort(vValue.begin(), vValue.end(), CompareCandidateValueDesc());
+    std::vector<char> vfBest;
+    int64_t nBest;
+
+    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, budget);
+    if (nBest != nTargetValue && nTotalLower >= nTargetValue + params.nMinChange && !budget.fTimedOut)
+        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + params.nMinChange, vfBest, nBest, budget);
+
+    // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
+    //                                   or the next bigger coin is closer), return the bigger coin
+    if (nLowestLarger >= 0
+        && ((nBest != nTargetValue && nBest < nTargetValue + params.nMinChange)
+            || vCandidates[nLowestLarger].nValue <= nBest))
+    {
+        SelectCandidate(vCandidates[nLowestLarger], result);
+        return true;
+    };
+
+    for (unsigned int i = 0; i < vValue.size(); i++)
+        if (vfBest[i])
+            SelectCandidate(vValue[i], result);
+
+    if (fDebug && GetBoolArg("-printpriority"))
+    {
+        //// debug print
+        LogPrintf("SelectCoins() best subset: ");
+        for (unsigned int i = 0; i < vValue.size(); i++)
+            if (vfBest[i])
+                LogPrintf("%s ", FormatMoney(vValue[i].nValue).c_str());
+        LogPrintf("total %s\n", FormatMoney(nBest).c_str());
+    };
+
+    return true;
+};
+
+/** Depth first search for the subset closest to nTargetValue that stays within
+ *  nCostOfChange of it, so no change output is needed.
+ *  Candidates are explored largest first. A branch is cut when the remaining
+ *  value can no longer reach the target or the selection has overshot the window.
+ */
+static bool SelectBnB(std::vector<CSelectCandidate>& vCandidates, int64_t nTargetValue,
+    const CCoinSelectionParams& params, CCoinSelectionResult& result, CSelectBudget& budget)
+{
+    result.nStrategy = COINSELECT_BNB;
+
+    int64_t nUpper = nTargetValue + params.nCostOfChange;
+
+    std::sort(vCandidates.begin(), vCandidates.end(), CompareCandidateValueDesc());
+
+    // -- any single candidate above the window can't be part of a match
+    unsigned int nFirst = 0;
+    while (nFirst < vCandidates.size() && vCandidates[nFirst].nValue > nUpper)
+        nFirst++;
+
+    int64_t nAvailable = 0;
+    for (unsigned int i = nFirst; i < vCandidates.size(); ++i)
+        nAvailable += vCandidates[i].nValue;
+
+    if (nAvailable < nTargetValue)
+        return false;
+
+    std::vector<char> vfSelected, vfBest;   // vfSelected[i] refers to vCandidates[nFirst + i]
+    vfSelected.reserve(vCandidates.size() - nFirst);
+    int64_t nCurrent = 0;
+    int64_t nBestExcess = std::numeric_limits<int64_t>::max();
+    unsigned int nBestInputs = 0, nInputs = 0;
+
+    for (; budget.nTries < budget.nMaxTries; budget.nTries++)
+    {
+        if ((budget.nTries & 0x3ff) == 0 && budget.OutOfTime())
+            break;
+
+        bool fBacktrack = false;
+        if (nCurrent + nAvailable < nTargetValue
+            || nCurrent > nUpper)
+        {
+            fBacktrack = true;
+        } else
+        if (nCurrent >= nTargetValue)
+        {
+            int64_t nExcess = nCurrent - nTargetValue;
+            if (nExcess < nBestExcess
+                || (nExcess == nBestExcess && nInputs < nBestInputs))
+            {
+                vfBest = vfSelected;
+                nBestExcess = nExcess;
+                nBestInputs = nInputs;
+            };
+            if (nBestExcess == 0)
+                break;
+            fBacktrack = true;
+        };
+
+        if (fBacktrack)
+        {
+            // -- walk back past omitted candidates, then omit the last one included
+            while (!vfSelected.empty() && !vfSelected.back())
+            {
+                vfSelected.pop_back();
+                nAvailable += vCandidates[nFirst + vfSelected.size()].nValue;
+            };
+
+            if (vfSelected.empty())
+                break; // searched everything
+
+            vfSelected.back() = false;
+            nCurrent -= vCandidates[nFirst + vfSelected.size() - 1].nValue;
+            nInputs--;
+            continue;
+        };
+
+        const CSelectCandidate& c = vCandidates[nFirst + vfSelected.size()];
+        nAvailable -= c.nValue;
+
+        // -- omitting a candidate and then including one of equal value is a repeat of a branch already searched
+        if (!vfSelected.empty() && !vfSelected.back()
+            && c.nValue == vCandidates[nFirst + vfSelected.size() - 1].nValue)
+        {
+            vfSelected.push_back(false);
+        } else
+        {
+            vfSelected.push_back(true);
+            nCurrent += c.nValue;
+            nInputs++;
+        };
+    };
+
+    if (vfBest.empty())
+        return false;
+
+    for (unsigned int i = 0; i < vfBest.size(); ++i)
+        if (vfBest[i])
+            SelectCandidate(vCandidates[nFirst + i], result);
+
+    return true;
+};
+
+static bool SelectLargestFirst(std::vector<CSelectCandidate>& vCandidates, int64_t nTargetValue,
+    const CCoinSelectionParams& params, CCoinSelectionResult& result, CSelectBudget& budget)
+{
+    result.nStrategy = COINSELECT_LARGEST_FIRST;
+
+    std::sort(vCandidates.begin(), vCandidates.end(), CompareCandidateValueDesc());
+
+    for (unsigned int i = 0; i < vCandidates.size() && result.nValue < nTargetValue; ++i)
+        SelectCandidate(vCandidates[i], result);
+
+    return result.nValue >= nTargetValue;
+};
+
+static bool SelectConsolidate(std::vector<CSelectCandidate>& vCandidates, int64_t nTargetValue,
+    const CCoinSelectionParams& params, CCoinSelectionResult& result, CSelectBudget& budget)
+{
+    // -- cover the target with as few inputs as possible, then spend the smallest outputs
+    //    into the change while they are worth more than the fee to spend them
+    if (!SelectLargestFirst(vCandidates, nTargetValue, params, result, budget))
+        return false;
+
+    result.nStrategy = COINSELECT_CONSOLIDATE;
+
+    int64_t nInputFee = (params.nFeePerKB * COINSELECT_INPUT_SIZE) / 1000;
+    unsigned int nSize = params.nBaseSize + COINSELECT_OUTPUT_SIZE
+        + result.vSelected.size() * COINSELECT_INPUT_SIZE;
+
+    // -- vCandidates is sorted largest first and the first nTaken are already selected
+    unsigned int nTaken = result.vSelected.size();
+    for (unsigned int i = vCandidates.size(); i-- > nTaken; )
+    {
+        if (result.vSelected.size() >= params.nMaxInputs
+            || (params.nMaxSize && nSize + COINSELECT_INPUT_SIZE > params.nMaxSize))
+            break;
+        if (vCandidates[i].nValue <= nInputFee)
+            continue;
+        SelectCandidate(vCandidates[i], result);
+        nSize += COINSELECT_INPUT_SIZE;
+    };
+
+    return true;
+};
+
+void EstimateSelectionFee(const CCoinSelectionParams& params, CCoinSelectionResult& result)
+{
+    result.nEstimatedSize = params.nBaseSize
+        + result.vSelected.size() * COINSELECT_INPUT_SIZE
+        + (result.fChange ? COINSELECT_OUTPUT_SIZE : 0);
+
+    // -- same rule as CreateTransaction, fee per started 1000 bytes
+    result.nEstimatedFee = std::max(params.nFeePerKB * (1 + (int64_t)result.nEstimatedSize / 1000), params.nMinFee);
+};
+
+bool SelectCandidates(std::vector<CSelectCandidate>& vCandidates, int64_t nTargetValue,
+    const CCoinSelectionParams& params, CCoinSelectionResult& result)
+{
+    result.SetNull();
+
+    CSelectBudget budget(params);
+    bool fFound = false;
+
+    switch (params.nStrategy)
+    {
+        case COINSELECT_BNB:
+            fFound = SelectBnB(vCandidates, nTargetValue, params, result, budget);
+            break;
+        case COINSELECT_LARGEST_FIRST:
+            fFound = SelectLargestFirst(vCandidates, nTargetValue, params, result, budget);
+            break;
+        case COINSELECT_CONSOLIDATE:
+            fFound = SelectConsolidate(vCandidates, nTargetValue, params, result, budget);
+            break;
+        case COINSELECT_DEFAULT:
+            if ((fFound = SelectBnB(vCandidates, nTargetValue, params, result, budget)))
+                break;
+            result.SetNull();
+            // fall through
+        case COINSELECT_KNAPSACK:
+        default:
+            fFound = SelectKnapsack(vCandidates, nTargetValue, params, result, budget);
+            break;
+    };
+
+    result.nTries = budget.nTries;
+    result.fTimedOut = budget.fTimedOut;
+
+    if (!fFound)
+    {
+        result.vSelected.clear();
+        result.nValue = 0;
+        return false;
+    };
+
+    result.fChange = result.nValue - nTargetValue > params.nCostOfChange;
+    EstimateSelectionFee(params, result);
+
+    return true;
+};
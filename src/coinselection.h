@@ -0,0 +1,119 @@
+// Copyright (c) 2014 The UltimateSecureCash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file license.txt or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef COINSELECTION_H
+#define COINSELECTION_H
+
+#include <string>
+#include <vector>
+#include <inttypes.h>
+
+#include "state.h"
+
+/** Coin selection strategies, selectable per transaction through CCoinControl
+ *  or wallet wide with -coinselection.
+ */
+enum CoinSelectionStrategy
+{
+    COINSELECT_DEFAULT          = 0,    // branch and bound for a changeless match, then knapsack
+    COINSELECT_KNAPSACK         = 1,    // stochastic subset sum, as before
+    COINSELECT_BNB              = 2,    // branch and bound only, fails if no changeless match
+    COINSELECT_LARGEST_FIRST    = 3,    // fewest inputs
+    COINSELECT_CONSOLIDATE      = 4,    // largest first, then sweep small outputs into the change
+};
+
+// -- rough serialised sizes used for estimates, a p2pkh input and output
+static const unsigned int COINSELECT_TX_OVERHEAD    = 14;  // version, time, locktime, vin/vout counts
+static const unsigned int COINSELECT_INPUT_SIZE     = 148;
+static const unsigned int COINSELECT_OUTPUT_SIZE    = 34;
+
+static const unsigned int DEFAULT_COINSELECT_MAX_TRIES      = 100000;
+static const int64_t      DEFAULT_COINSELECT_MAX_TIME       = 250000; // microseconds
+static const unsigned int DEFAULT_COINSELECT_MAX_INPUTS     = 500;
+
+const char* GetCoinSelectionName(int nStrategy);
+bool ParseCoinSelection(const std::string& str, int& nStrategy);
+
+/** A spendable output as seen by the selector, nIndex refers back into the caller's coin list. */
+class CSelectCandidate
+{
+public:
+    CSelectCandidate() : nValue(0), nIndex(0) {};
+    CSelectCandidate(int64_t nValueIn, uint32_t nIndexIn) : nValue(nValueIn), nIndex(nIndexIn) {};
+
+    int64_t nValue;
+    uint32_t nIndex;
+};
+
+class CCoinSelectionParams
+{
+public:
+    CCoinSelectionParams()
+    {
+        SetNull();
+    };
+
+    void SetNull()
+    {
+        nStrategy = COINSELECT_KNAPSACK;
+        nMinChange = CENT;
+        nCostOfChange = 0;
+        nFeePerKB = MIN_TX_FEE;
+        nMinFee = MIN_TX_FEE;
+        nBaseSize = COINSELECT_TX_OVERHEAD + COINSELECT_OUTPUT_SIZE;
+        nMaxSize = 0;
+        nMaxInputs = DEFAULT_COINSELECT_MAX_INPUTS;
+        nMaxTries = DEFAULT_COINSELECT_MAX_TRIES;
+        nMaxTime = DEFAULT_COINSELECT_MAX_TIME;
+    };
+
+    int nStrategy;
+    int64_t nMinChange;         // knapsack aims for at least this much change
+    int64_t nCostOfChange;      // branch and bound accepts this much excess rather than add a change output
+    int64_t nFeePerKB;          // fee per started 1000 bytes, for estimates
+    int64_t nMinFee;
+    unsigned int nBaseSize;     // size of the transaction without inputs or change
+    unsigned int nMaxSize;      // 0 for no limit
+    unsigned int nMaxInputs;    // consolidation stops adding extra inputs here
+    unsigned int nMaxTries;     // branch and bound search steps
+    int64_t nMaxTime;           // microseconds for the whole selection, 0 for no limit
+};
+
+class CCoinSelectionResult
+{
+public:
+    CCoinSelectionResult()
+    {
+        SetNull();
+    };
+
+    void SetNull()
+    {
+        vSelected.clear();
+        nStrategy = COINSELECT_DEFAULT;
+        nValue = 0;
+        fChange = false;
+        nEstimatedSize = 0;
+        nEstimatedFee = 0;
+        nTries = 0;
+        fTimedOut = false;
+    };
+
+    std::vector<uint32_t> vSelected;    // nIndex of the chosen candidates
+    int nStrategy;                      // strategy that produced the selection
+    int64_t nValue;
+    bool fChange;                       // false if the excess is small enough to leave to the fee
+    unsigned int nEstimatedSize;
+    int64_t nEstimatedFee;
+    unsigned int nTries;
+    bool fTimedOut;
+};
+
+/** Select from vCandidates to cover nTargetValue. vCandidates is reordered. */
+bool SelectCandidates(std::vector<CSelectCandidate>& vCandidates, int64_t nTargetValue,
+    const CCoinSelectionParams& params, CCoinSelectionResult& result);
+
+void EstimateSelectionFee(const CCoinSelectionParams& params, CCoinSelectionResult& result);
+
+#endif // COINSELECTION_H
@@ -65,5 +65,10 @@ inline int myclosesocket(SOCKET& hSocket)
 }
 #define closesocket(s)      myclosesocket(s)
 
+// Edge-triggered epoll for the socket handler thread, select() elsewhere
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define USE_EPOLL 1
+#endif
+
 
 #endif
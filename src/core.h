@@ -411,6 +411,14 @@ public:
     int nLeastDepth;
     int nCompromised;
 
+    // stored in txdb, key is nValue, nOwned and nLeastDepth are not kept
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nValue);
+        READWRITE(nExists);
+        READWRITE(nSpends);
+        READWRITE(nCompromised);
+    )
 };
 
 
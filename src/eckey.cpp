@@ -6,6 +6,10 @@
 
 #include "eckey.h"
 
+// Built once by ECC_Start(), keys copy the group and share its generator precomputation.
+// This only saves OpenSSL rebuilding the curve for each key, ECDSA itself is unchanged.
+static EC_GROUP *pgroupSecp256k1 = NULL;
+
 // anonymous namespace with local implementation code (OpenSSL interaction)
 namespace {
 
@@ -122,6 +126,59 @@ err:
 
 }; // end of anonymous namespace
 
+EC_KEY *NewSecp256k1Key()
+{
+    if (!pgroupSecp256k1)
+        return EC_KEY_new_by_curve_name(NID_secp256k1);
+
+    EC_KEY *pkey = EC_KEY_new();
+    if (pkey == NULL)
+        return NULL;
+    if (!EC_KEY_set_group(pkey, pgroupSecp256k1))
+    {
+        EC_KEY_free(pkey);
+        return NULL;
+    };
+    return pkey;
+}
+
+const EC_GROUP *GetSecp256k1Group()
+{
+    return pgroupSecp256k1;
+}
+
+bool ECC_Start()
+{
+    if (pgroupSecp256k1)
+        return true;
+
+    EC_GROUP *group = EC_GROUP_new_by_curve_name(NID_secp256k1);
+    if (group == NULL)
+        return false;
+
+    // Precompute multiples of the generator, used by every sign and verify
+    BN_CTX *ctx = BN_CTX_new();
+    bool fOk = ctx && EC_GROUP_precompute_mult(group, ctx);
+    if (ctx)
+        BN_CTX_free(ctx);
+    if (!fOk)
+    {
+        EC_GROUP_free(group);
+        return false;
+    };
+
+    pgroupSecp256k1 = group;
+    return true;
+}
+
+void ECC_Stop()
+{
+    EC_GROUP *group = pgroupSecp256k1;
+    pgroupSecp256k1 = NULL;
+    if (group)
+        EC_GROUP_free(group);
+}
+
 void CECKey::GetSecretBytes(unsigned char vch[32]) const
 {
     const BIGNUM *bn = EC_KEY_get0_private_key(pkey);
@@ -296,8 +353,8 @@ bool TweakSecret(unsigned char vchSecretOut[32], const unsigned char vchSecretIn
     BIGNUM *bnSecret = BN_CTX_get(ctx);
     BIGNUM *bnTweak = BN_CTX_get(ctx);
     BIGNUM *bnOrder = BN_CTX_get(ctx);
-    EC_GROUP *group = EC_GROUP_new_by_curve_name(NID_secp256k1);
-    EC_GROUP_get_order(group, bnOrder, ctx); // what a grossly inefficient way to get the (constant) group order...
+    EC_GROUP *group = pgroupSecp256k1 ? NULL : EC_GROUP_new_by_curve_name(NID_secp256k1);
+    EC_GROUP_get_order(group ? group : pgroupSecp256k1, bnOrder, ctx);
     BN_bin2bn(vchTweak, 32, bnTweak);
     if (BN_cmp(bnTweak, bnOrder) >= 0)
         ret = false; // extremely unlikely
@@ -309,7 +366,8 @@ bool TweakSecret(unsigned char vchSecretOut[32], const unsigned char vchSecretIn
     int nBits = BN_num_bits(bnSecret);
     memset(vchSecretOut, 0, 32);
     BN_bn2bin(bnSecret, &vchSecretOut[32-(nBits+7)/8]);
-    EC_GROUP_free(group);
+    if (group)
+        EC_GROUP_free(group);
     BN_CTX_end(ctx);
     BN_CTX_free(ctx);
     return ret;
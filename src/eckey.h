@@ -14,6 +14,12 @@
 
 #include "key.h"
 
+// Create an EC_KEY on secp256k1, sharing the group set up by ECC_Start() when available
+EC_KEY *NewSecp256k1Key();
+
+// The secp256k1 group set up by ECC_Start(), NULL if not started
+const EC_GROUP *GetSecp256k1Group();
+
 // RAII Wrapper around OpenSSL's EC_KEY
 class CECKey {
 private:
@@ -21,7 +27,7 @@ private:
 
 public:
     CECKey() {
-        pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+        pkey = NewSecp256k1Key();
         assert(pkey != NULL);
     }
 
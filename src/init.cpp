@@ -110,6 +110,7 @@ bool Finalise()
     };
     
     finaliseRingSigs();
+    ECC_Stop();
     
     if (nNodeMode == NT_FULL)
     {
@@ -202,6 +203,16 @@ std::string HelpMessage()
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n";
     strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n";
+    strUsage += "  -dbwritecache=<n>      " + strprintf(_("Hold up to <n> megabytes of chain database writes in memory between flushes (default: %d, 0 = write every block)"), DEFAULT_DB_WRITE_CACHE) + "\n";
+    strUsage += "  -dbwritebuffer=<n>     " + strprintf(_("Set database write buffer size in megabytes (default: %d)"), DEFAULT_DB_WRITE_BUFFER) + "\n";
+    strUsage += "  -dbmaxopenfiles=<n>    " + strprintf(_("Allow the database to keep up to <n> files open (default: %d)"), DEFAULT_DB_MAX_OPEN_FILES) + "\n";
+    strUsage += "  -dbblocksize=<n>       " + strprintf(_("Set database block size in kilobytes (default: %d)"), DEFAULT_DB_BLOCK_SIZE) + "\n";
+    strUsage += "  -dbcompression         " + _("Compress database blocks, if supported (default: 1)") + "\n";
+    strUsage += "  -mapblockfiles         " + _("Read blocks through read-only memory mappings of the block files (default: 1 on 64 bit systems)") + "\n";
+    strUsage += "  -dbbulkload            " + strprintf(_("Use write buffers of at least %d megabytes for the chain database (default: 1 when reindexing or creating it)"), DB_BULK_LOAD_WRITE_BUFFER) + "\n";
+    strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (up to %d, 0 = auto, <0 = leave that many cores free, default: 0)"), MAX_SCRIPTCHECK_THREADS) + "\n";
+    strUsage += "  -ringmembercache=<n>   " + strprintf(_("Keep at most <n> decoded ring members cached for ring signature verification (default: %u)"), DEFAULT_RING_MEMBER_CACHE_SIZE) + "\n";
+    strUsage += "  -maxsigcachesize=<n>   " + strprintf(_("Limit the valid signature cache to <n> MiB (default: %d)"), DEFAULT_MAX_SIG_CACHE_SIZE) + "\n";
     strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through socks proxy") + "\n";
@@ -228,6 +239,10 @@ std::string HelpMessage()
     strUsage += "  -softbantime=<n>       " + _("Number of seconds to keep soft banned peers from reconnecting (default: 3600)") + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n";
+    strUsage += "  -invrateinbound=<n>    " + _("Maximum transaction announcements per second to inbound peers (default: 7)") + "\n";
+    strUsage += "  -invrateoutbound=<n>   " + _("Maximum transaction announcements per second to outbound peers (default: 14)") + "\n";
+    strUsage += "  -invratethin=<n>       " + _("Maximum transaction announcements per second to thin peers (default: 7)") + "\n";
+    strUsage += "  -msghandlerthreads=<n> " + strprintf(_("Number of threads verifying received messages for the message handler (0-8, default: %d)"), DEFAULT_MSGHANDLER_THREADS) + "\n";
 #ifdef USE_UPNP
 #if USE_UPNP
     strUsage += "  -upnp                  " + _("Use UPnP to map the listening port (default: 1 when listening)") + "\n";
@@ -238,6 +253,7 @@ std::string HelpMessage()
     strUsage += "  -detachdb              " + _("Detach block and address databases. Increases shutdown time (default: 0)") + "\n";
     strUsage += "  -paytxfee=<amt>        " + _("Fee per KB to add to transactions you send") + "\n";
     strUsage += "  -mininput=<amt>        " + _("When creating transactions, ignore inputs with value less than this (default: 0.01)") + "\n";
+    strUsage += "  -coinselection=<strategy> " + _("How to choose inputs: default, knapsack, bnb, largestfirst or consolidate (default: default)") + "\n";
     if (!fHaveGUI)
     {
         strUsage += "  -server                " + _("Accept command line and JSON-RPC commands") + "\n";
@@ -261,6 +277,7 @@ std::string HelpMessage()
     strUsage += "  -rpcpassword=<pw>      " + _("Password for JSON-RPC connections") + "\n";
     strUsage += "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 51736 or testnet: 51996)") + "\n";
     strUsage += "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n";
+    strUsage += "  -rpcmetrics            " + _("Serve network message metrics in the Prometheus text format at /metrics on the RPC port (default: 0)") + "\n";
     
     if (!fHaveGUI)
     {
@@ -387,6 +404,17 @@ bool AppInit2(boost::thread_group& threadGroup)
     nMinerSleep = GetArg("-minersleep", 500);
 
     fUseFastIndex = GetBoolArg("-fastindex", true);
+    fMapBlockFiles = GetBoolArg("-mapblockfiles", fMapBlockFiles);
+
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", 0);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else
+    if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
     // Largest block you're willing to create.
     // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
@@ -546,8 +574,18 @@ bool AppInit2(boost::thread_group& threadGroup)
             return InitError(strprintf(_("Invalid amount for -mininput=<amount>: '%s'"), mapArgs["-mininput"].c_str()));
     };
 
+    if (mapArgs.count("-coinselection"))
+    {
+        if (!ParseCoinSelection(mapArgs["-coinselection"], nCoinSelection))
+            return InitError(strprintf(_("Invalid strategy for -coinselection=<strategy>: '%s'"), mapArgs["-coinselection"].c_str()));
+    };
+
 
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
+    // Initialize elliptic curve code
+    if (!ECC_Start())
+        return InitError(_("Failed to set up the secp256k1 elliptic curve group."));
+
     // Sanity check
     if (!InitSanityCheck())
         return InitError(_("Initialization sanity check failed. UltimateSecureCash is shutting down."));
@@ -660,6 +698,20 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (fNoSmsg)
         nLocalServices &= ~(SMSG_RELAY);
 
+    // -- thin nodes never connect full blocks
+    if (nNodeMode == NT_THIN)
+        nScriptCheckThreads = 0;
+
+    if (nScriptCheckThreads)
+    {
+        LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+        for (int i = 0; i < nScriptCheckThreads-1; i++)
+        {
+            threadGroup.create_thread(&ThreadScriptCheck);
+            threadGroup.create_thread(&ThreadBlockCheck);
+        };
+    };
+
     if (initialiseRingSigs() != 0)
         return InitError("initialiseRingSigs() failed.");
 
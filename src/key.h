@@ -544,4 +544,12 @@ public:
 /** Check that required EC support is available at runtime */
 bool ECC_InitSanityCheck(void);
 
+/** Set up the shared secp256k1 group and generator precomputation, call once at startup.
+ *  Until then, and after ECC_Stop(), keys fall back to building the curve per use.
+ *  Signing and verification still go through OpenSSL's ECDSA, there is no libsecp256k1 backend. */
+bool ECC_Start(void);
+
+/** Release the shared secp256k1 group, no CECKey may be in use */
+void ECC_Stop(void);
+
 #endif
@@ -6,6 +6,9 @@
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/unordered_map.hpp>
 
 #include "alert.h"
 #include "checkpoints.h"
@@ -16,6 +19,7 @@
 #include "ui_interface.h"
 #include "kernel.h"
 #include "smessage.h"
+#include "checkqueue.h"
 
 
 using namespace std;
@@ -90,6 +94,8 @@ const string strMessageMagic = "UltimateSecureCash Signed Message:\n";
 int64_t nTransactionFee = MIN_TX_FEE;
 int64_t nReserveBalance = 0;
 int64_t nMinimumInputValue = 0;
+int nScriptCheckThreads = 0;
+bool fMapBlockFiles = sizeof(void*) >= 8; // mapping the block files needs a 64 bit address space
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -145,6 +151,10 @@ void SyncWithWallets(const CTransaction& tx, const CBlock* pblock, bool fUpdate,
 {
     if (!fConnect)
     {
+        // -- depths change, cached balances are recounted on the next query
+        BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+            pwallet->InvalidateTxCaches();
+
         // ppcoin: wallets need to refund inputs when disconnecting coinstake
         if (tx.IsCoinStake())
         {
@@ -172,6 +182,10 @@ void SyncWithWalletsThin(const CTransaction& tx, const uint256& blockhash, bool
 {
     if (!fConnect)
     {
+        // -- depths change, cached balances are recounted on the next query
+        BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+            pwallet->InvalidateTxCaches();
+
         // ppcoin: wallets need to refund inputs when disconnecting coinstake
         if (tx.IsCoinStake())
         {
@@ -2190,7 +2204,7 @@ bool CTransaction::FetchInputs(CTxDB& txdb, const map<uint256, CTxIndex>& mapTes
     return true;
 }
 
-static bool CheckAnonInputAB(CTxDB &txdb, const CTxIn &txin, int i, int nRingSize, std::vector<uint8_t> &vchImage, uint256 &preimage, int64_t &nCoinValue)
+static bool CheckAnonInputAB(CTxDB &txdb, const CTxIn &txin, int i, int nRingSize, std::vector<uint8_t> &vchImage, uint256 &preimage, int64_t &nCoinValue, std::vector<CRingSigCheck> &vRingChecks)
 {
     const CScript &s = txin.scriptSig;
 
@@ -2198,9 +2212,7 @@ static bool CheckAnonInputAB(CTxDB &txdb, const CTxIn &txin, int i, int nRingSiz
     CAnonOutput ao;
     CTxIndex txindex;
 
-    ec_point pSigC;
-    pSigC.resize(EC_SECRET_SIZE);
-    memcpy(&pSigC[0], &s[2], EC_SECRET_SIZE);
+    const unsigned char *pSigC    = &s[2];
     const unsigned char *pSigS    = &s[2 + EC_SECRET_SIZE];
     const unsigned char *pPubkeys = &s[2 + EC_SECRET_SIZE + EC_SECRET_SIZE * nRingSize];
     for (int ri = 0; ri < nRingSize; ++ri)
@@ -2230,22 +2242,22 @@ static bool CheckAnonInputAB(CTxDB &txdb, const CTxIn &txin, int i, int nRingSiz
         };
     };
 
-    if (verifyRingSignatureAB(vchImage, preimage, nRingSize, pPubkeys, pSigC, pSigS) != 0)
-    {
-        LogPrintf("CheckAnonInputsAB(): Error input %d verifyRingSignatureAB() failed.\n", i);
-        return false;
-    };
+    vRingChecks.push_back(CRingSigCheck(RING_SIG_2, vchImage, preimage, nRingSize, pPubkeys, pSigC, pSigS, i));
 
     return true;
 };
 
-bool CTransaction::CheckAnonInputs(CTxDB& txdb, int64_t& nSumValue, bool& fInvalid, bool fCheckExists)
+bool CTransaction::CheckAnonInputs(CTxDB& txdb, int64_t& nSumValue, bool& fInvalid, bool fCheckExists, std::vector<CRingSigCheck> *pvRingChecks)
 {
     AssertLockHeld(cs_main);
     // - fCheckExists should only run for anonInputs entering this node
+    // - ring signatures are verified together after the inputs, or left to the caller if pvRingChecks is set
 
     fInvalid = false; // TODO: is it acceptable to not find ring members?
 
+    std::vector<CRingSigCheck> vRingChecksTx;
+    std::vector<CRingSigCheck> &vRingChecks = pvRingChecks ? *pvRingChecks : vRingChecksTx;
+
     nSumValue = 0;
 
     uint256 preimage;
@@ -2309,7 +2321,7 @@ bool CTransaction::CheckAnonInputs(CTxDB& txdb, int64_t& nSumValue, bool& fInval
         if (nRingSize > 1 && s.size() == 2 + EC_SECRET_SIZE + (EC_SECRET_SIZE + EC_COMPRESSED_SIZE) * nRingSize)
         {
             // ringsig AB
-            if (!CheckAnonInputAB(txdb, txin, i, nRingSize, vchImage, preimage, nCoinValue))
+            if (!CheckAnonInputAB(txdb, txin, i, nRingSize, vchImage, preimage, nCoinValue, vRingChecks))
             {
                 fInvalid = true; return false;
             };
@@ -2358,15 +2370,21 @@ bool CTransaction::CheckAnonInputs(CTxDB& txdb, int64_t& nSumValue, bool& fInval
             };
         };
 
-        if (verifyRingSignature(vchImage, preimage, nRingSize, pPubkeys, pSigc, pSigr) != 0)
-        {
-            LogPrintf("CheckAnonInputs(): Error input %d verifyRingSignature() failed.\n", i);
-            fInvalid = true; return false;
-        };
+        vRingChecks.push_back(CRingSigCheck(RING_SIG_1, vchImage, preimage, nRingSize, pPubkeys, pSigc, pSigr, i));
 
         nSumValue += nCoinValue;
     };
 
+    if (pvRingChecks)
+        return true;
+
+    size_t nFailed;
+    if (verifyRingSignatures(vRingChecks, nFailed) != 0)
+    {
+        LogPrintf("CheckAnonInputs(): Error input %d ring signature failed to verify.\n", vRingChecks[nFailed].nInput);
+        fInvalid = true; return false;
+    };
+
     return true;
 };
 
@@ -2420,7 +2438,7 @@ unsigned int CTransaction::GetP2SHSigOpCount(const MapPrevTx& inputs) const
 }
 
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags)
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, std::vector<CScriptCheck> *pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -2492,6 +2510,13 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             // still computed and checked, and any change will be caught at the next checkpoint.
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
+                if (pvChecks)
+                {
+                    // Defer to the caller's check queue, txPrev is a copy so take the scriptPubKey now
+                    CScriptCheck check(txPrev, *this, i, flags, 0);
+                    pvChecks->push_back(CScriptCheck());
+                    check.swap(pvChecks->back());
+                } else
                 // Verify signature
                 if (!VerifySignature(txPrev, *this, i, flags, 0))
                 {
@@ -2528,9 +2553,11 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
 
         if (nVersion == ANON_TXN_VERSION)
         {
+            // -- every caller has verified the ring signatures before ConnectInputs, only the sum is needed here
             int64_t nSumAnon;
             bool fInvalid;
-            if (!CheckAnonInputs(txdb, nSumAnon, fInvalid, true))
+            std::vector<CRingSigCheck> vRingChecksVerified;
+            if (!CheckAnonInputs(txdb, nSumAnon, fInvalid, true, &vRingChecksVerified))
             {
                 //if (fInvalid)
                 DoS(100, error("ConnectInputs() : CheckAnonInputs found invalid tx %s", GetHash().ToString().substr(0,10).c_str()));
@@ -2564,6 +2591,70 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
     return true;
 }
 
+bool CScriptCheck::operator()() const
+{
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, nHashType))
+        return error("CScriptCheck() : %s VerifySignature failed on input %u", ptxTo->GetHash().ToString(), nIn);
+    return true;
+}
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck()
+{
+    RenameThread("shadow-scriptch");
+    scriptcheckqueue.Thread();
+}
+
+bool CBlockCheck::operator()() const
+{
+    pblock->CheckBlock(true, true, true, nBestHeight, nAdjustedTime);
+    return true;
+}
+
+// -- one block per batch, a block is a lot of work
+static CCheckQueue<CBlockCheck> blockcheckqueue(1);
+
+void ThreadBlockCheck()
+{
+    RenameThread("shadow-blockch");
+    blockcheckqueue.Thread();
+}
+
+// The chain state CheckBlock depends on, read once under cs_main so the checks can run without it.
+static void GetCheckBlockContext(int& nBestHeightOut, int64_t& nAdjustedTimeOut)
+{
+    LOCK(cs_main);
+    nBestHeightOut = nBestHeight;
+    nAdjustedTimeOut = GetAdjustedTime();
+}
+
+// Run the context free CheckBlock on blocks received from the network, before cs_main is taken.
+// ProcessBlock skips CheckBlock for the blocks that passed. Called from the message handler thread only.
+static void PreCheckBlocks(const std::vector<CBlock>& vBlocks)
+{
+    int nCheckHeight;
+    int64_t nCheckTime;
+    GetCheckBlockContext(nCheckHeight, nCheckTime);
+
+    if (!nScriptCheckThreads || vBlocks.size() < 2)
+    {
+        BOOST_FOREACH(const CBlock& block, vBlocks)
+            block.CheckBlock(true, true, true, nCheckHeight, nCheckTime);
+        return;
+    };
+
+    std::vector<CBlockCheck> vChecks;
+    vChecks.reserve(vBlocks.size());
+    BOOST_FOREACH(const CBlock& block, vBlocks)
+        vChecks.push_back(CBlockCheck(block, nCheckHeight, nCheckTime));
+
+    CCheckQueueControl<CBlockCheck> control(&blockcheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+}
+
 bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
 {
     // Disconnect in reverse order
@@ -2614,6 +2705,12 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     else
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
+    // Script checks of all transactions are collected and run on the worker threads
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
+    // Ring signatures of all anon inputs are verified together once the block's inputs are known
+    std::vector<CRingSigCheck> vRingChecks;
+
     map<uint256, CTxIndex> mapQueuedChanges;
     int64_t nFees = 0;
     int64_t nAnonIn = 0;
@@ -2681,7 +2778,7 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
                     if (txout.IsAnonOutput())
                         nAnonOut += txout.nValue;
 
-                if (!tx.CheckAnonInputs(txdb, nTxAnonIn, fInvalid, true))
+                if (!tx.CheckAnonInputs(txdb, nTxAnonIn, fInvalid, true, &vRingChecks))
                 {
                     if (fInvalid)
                         return error("ConnectBlock() : CheckAnonInputs found invalid tx %s", tx.GetHash().ToString().substr(0,10).c_str());
@@ -2701,13 +2798,22 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (tx.IsCoinStake())
                 nStakeReward = nTxValueOut - nTxValueIn;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags))
+            std::vector<CScriptCheck> vChecks;
+            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
+            control.Add(vChecks);
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
     }
 
+    size_t nRingFailed;
+    if (verifyRingSignatures(vRingChecks, nRingFailed) != 0)
+        return error("ConnectBlock() : ring signature %u of %u, input %d failed to verify", nRingFailed, vRingChecks.size(), vRingChecks[nRingFailed].nInput);
+
+    if (!control.Wait())
+        return DoS(100, error("ConnectBlock() : script verification failed"));
+
     if (IsProofOfWork())
     {
         int64_t nReward = Params().GetProofOfWorkReward(pindex->nHeight, nFees);
@@ -3435,11 +3541,20 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
 
 
 
-bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) const
+bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig, int nBestHeightIn, int64_t nAdjustedTimeIn) const
 {
     // These are checks that are independent of context
     // that can be verified before saving an orphan block.
 
+    if (fChecked)
+        return true;
+
+    if (nBestHeightIn < 0)
+    {
+        nBestHeightIn = nBestHeight;
+        nAdjustedTimeIn = GetAdjustedTime();
+    };
+
     // Size limits
     if (vtx.empty() || vtx.size() > MAX_BLOCK_SIZE || ::GetSerializeSize(*this, SER_NETWORK, PROTOCOL_VERSION) > MAX_BLOCK_SIZE)
         return DoS(100, error("CheckBlock() : size limits failed"));
@@ -3449,7 +3564,7 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
         return DoS(50, error("CheckBlock() : proof of work failed"));
 
     // Check timestamp
-    if (GetBlockTime() > FutureDrift(GetAdjustedTime(), nBestHeight + 1))
+    if (GetBlockTime() > FutureDrift(nAdjustedTimeIn, nBestHeightIn + 1))
         return error("CheckBlock() : block timestamp too far in the future");
 
     // First transaction must be coinbase, the rest must not be
@@ -3473,7 +3588,7 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
                 return DoS(100, error("CheckBlock() : more than one coinstake"));
 
         // Check proof-of-stake block signature
-        if (fCheckSig && !CheckBlockSignature())
+        if (fCheckSig && !CheckBlockSignature(nBestHeightIn))
             return DoS(100, error("CheckBlock() : bad proof-of-stake block signature"));
     }
 
@@ -3511,6 +3626,8 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
     if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
         return DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
 
+    if (fCheckPOW && fCheckMerkleRoot && fCheckSig)
+        fChecked = true;
 
     return true;
 }
@@ -3737,7 +3854,8 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock, uint256& hash)
         {
             CBlock block;
             {
-                CDataStream ss(mi->second->vchBlock, SER_DISK, CLIENT_VERSION);
+                const std::vector<unsigned char>& vchBlock = mi->second->vchBlock;
+                CBufferReader ss((const char*)&vchBlock[0], (const char*)&vchBlock[0] + vchBlock.size(), SER_DISK, CLIENT_VERSION);
                 ss >> block;
             }
             block.BuildMerkleTree();
@@ -3899,7 +4017,7 @@ bool CBlock::SignBlock(CWallet& wallet, int64_t nFees)
     return false;
 }
 
-bool CBlock::CheckBlockSignature() const
+bool CBlock::CheckBlockSignature(int nBestHeightIn) const
 {
     if (IsProofOfWork())
         return vchBlockSig.empty();
@@ -3920,7 +4038,7 @@ bool CBlock::CheckBlockSignature() const
         valtype& vchPubKey = vSolutions[0];
         return CPubKey(vchPubKey).Verify(GetHash(), vchBlockSig);
     }
-    else if (Params().IsProtocolV3(pindexBest->nHeight))
+    else if (Params().IsProtocolV3(nBestHeightIn))
     {
         // Block signing key also can be encoded in the nonspendable output
         // This allows to not pollute UTXO set with useless outputs e.g. in case of multisig staking
@@ -4010,6 +4128,51 @@ FILE* OpenBlockFile(bool fHeaderFile, unsigned int nFile, unsigned int nBlockPos
     return file;
 }
 
+// Read-only mappings of the block files, by (fHeaderFile, nFile)
+static CCriticalSection cs_mappedBlockFiles;
+static std::map<std::pair<bool, unsigned int>, boost::shared_ptr<boost::interprocess::mapped_region> > mapMappedBlockFiles;
+
+bool MapBlockFile(bool fHeaderFile, unsigned int nFile, unsigned int nBlockPos, bool fRemap, CBlockFileView& view)
+{
+    if (!fMapBlockFiles
+        || (nFile < 1) || (nFile == (unsigned int) -1))
+        return false;
+
+    std::pair<bool, unsigned int> key = std::make_pair(fHeaderFile, nFile);
+    boost::shared_ptr<boost::interprocess::mapped_region> pregion;
+
+    LOCK(cs_mappedBlockFiles);
+    std::map<std::pair<bool, unsigned int>, boost::shared_ptr<boost::interprocess::mapped_region> >::iterator mi = mapMappedBlockFiles.find(key);
+    if (mi != mapMappedBlockFiles.end())
+        pregion = mi->second;
+
+    if (!pregion || fRemap || nBlockPos >= pregion->get_size())
+    {
+        // - blocks are only ever appended, so map again only when the file grew
+        string strBlockFn = strprintf(fHeaderFile ? "blk_hdr%04u.dat": "blk%04u.dat", nFile);
+        boost::filesystem::path pathBlockFile = GetDataDir() / strBlockFn;
+        try {
+            boost::uintmax_t nFileSize = boost::filesystem::file_size(pathBlockFile);
+            if (nBlockPos >= nFileSize
+                || (pregion && nFileSize <= pregion->get_size()))
+                return false;
+
+            boost::interprocess::file_mapping mapping(pathBlockFile.string().c_str(), boost::interprocess::read_only);
+            pregion.reset(new boost::interprocess::mapped_region(mapping, boost::interprocess::read_only, 0, nFileSize));
+        } catch (std::exception &e)
+        {
+            LogPrintf("MapBlockFile() : Mapping %s failed, %s\n", strBlockFn, e.what());
+            return false;
+        };
+        mapMappedBlockFiles[key] = pregion;
+    };
+
+    view.pregion = pregion;
+    view.pbegin = (const char*)pregion->get_address() + nBlockPos;
+    view.pend = (const char*)pregion->get_address() + pregion->get_size();
+    return true;
+}
+
 FILE* AppendBlockFile(bool fHeaderFile, unsigned int& nFileRet, const char* fmode)
 {
     nFileRet = 0;
@@ -4369,160 +4532,713 @@ string GetWarnings(string strFor)
 
 //////////////////////////////////////////////////////////////////////////////
 //
-// Messages
+// Block download scheduler
+//
+// Hashes from getblocks inventories are queued in chain order and the blocks
+// are requested from every suitable peer at once, at most
+// MAX_BLOCKS_IN_FLIGHT_PER_PEER each and no further than BLOCK_DOWNLOAD_WINDOW
+// ahead of the next block to validate. Blocks arriving out of order are held
+// until their turn, so ProcessBlock sees them in chain order and no orphans
+// or getblocks rounds are caused by the parallel download.
+// Everything here requires cs_main.
 //
 
+class CBlockInFlight
+{
+public:
+    NodeId nodeId;
+    int64_t nTime;
+};
 
-bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
+class CBlockDownloaded
 {
-    switch (inv.type)
-    {
-    case MSG_TX:
-        {
-        bool txInMap = false;
-        txInMap = mempool.exists(inv.hash);
-        return txInMap ||
-               mapOrphanTransactions.count(inv.hash) ||
-               txdb.ContainsTx(inv.hash);
-        }
+public:
+    NodeId nodeId;
+    CBlock block;
+};
 
-    case MSG_BLOCK:
-        return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
-    }
-    // Don't know what it is, just say we already got one
-    return true;
+class CBlockDownloadPeer
+{
+public:
+    CBlockDownloadPeer() : nBlocksInFlight(0), nLastReceived(0), nStallingUntil(0) {}
+    int nBlocksInFlight;
+    int64_t nLastReceived;  // or when the first block was requested
+    int64_t nStallingUntil; // no requests to this peer before
+};
+
+bool static AlreadyHave(CTxDB& txdb, const CInv& inv);
+
+static std::deque<uint256> vBlocksToDownload;       // front is validated next
+static std::set<uint256> setBlocksToDownload;
+static std::map<uint256, CBlockInFlight> mapBlocksInFlight;
+static std::map<uint256, CBlockDownloaded> mapBlocksDownloaded;
+static size_t nBlocksDownloadedBytes = 0;
+static std::map<NodeId, CBlockDownloadPeer> mapBlockDownloadPeers;
+static NodeId nodeBlockHashSource = -1;             // peer expected to send the next hashes
+static int64_t nTimeBlockHashRequest = 0;
+static int nFrontBlockTimeouts = 0;
+
+static void BlockDownloadReset()
+{
+    vBlocksToDownload.clear();
+    setBlocksToDownload.clear();
+    mapBlocksInFlight.clear();
+    mapBlocksDownloaded.clear();
+    nBlocksDownloadedBytes = 0;
+    mapBlockDownloadPeers.clear();
+    nodeBlockHashSource = -1;
+    nTimeBlockHashRequest = 0;
+    nFrontBlockTimeouts = 0;
 }
 
-bool static AlreadyHaveThin(CTxDB& txdb, const CInv& inv)
+// Drop the requests in flight to a peer, they are handed to other peers
+static void BlockDownloadReleasePeer(NodeId nodeId)
 {
-    switch (inv.type)
+    std::map<uint256, CBlockInFlight>::iterator it = mapBlocksInFlight.begin();
+    while (it != mapBlocksInFlight.end())
     {
-    case MSG_TX:
-        {
-        bool txInMap = false;
-        txInMap = mempool.exists(inv.hash);
-        return txInMap
-            || mapOrphanTransactions.count(inv.hash)
-            || txdb.ContainsTx(inv.hash);
-        }
+        if (it->second.nodeId == nodeId)
+            mapBlocksInFlight.erase(it++);
+        else
+            ++it;
+    };
 
-    case MSG_BLOCK:
-        return mapBlockThinIndex.count(inv.hash)
-            || mapOrphanBlockThins.count(inv.hash);
+    std::map<NodeId, CBlockDownloadPeer>::iterator mi = mapBlockDownloadPeers.find(nodeId);
+    if (mi != mapBlockDownloadPeers.end())
+        mi->second.nBlocksInFlight = 0;
+}
 
-    case MSG_FILTERED_BLOCK:
-        return mapBlockThinIndex.count(inv.hash)
-            || mapOrphanBlockThins.count(inv.hash);
-    }
-    // Don't know what it is, just say we already got one
-    return true;
+static bool IsBlockDownloadPeer(CNode* pnode)
+{
+    return pnode->nTypeInd == NT_FULL
+        && !pnode->fClient
+        && !pnode->fOneShot
+        && !pnode->fDisconnect
+        && pnode->fSuccessfullyConnected
+        && pnode->nVersion >= MIN_MBLK_VERSION
+        && pnode->nChainHeight > nBestHeight;
 }
 
-static void ProcessGetData(CNode* pfrom)
+// Queue the unknown block hashes of a getblocks inventory, returns false if
+// the scheduler doesn't take the inventory.
+static bool BlockDownloadQueue(CTxDB& txdb, CNode* pfrom, const std::vector<CInv>& vInv)
 {
-    if (fDebugNet)
-        LogPrintf("ProcessGetData\n");
+    if (!vBlocksToDownload.empty() && pfrom->GetId() != nodeBlockHashSource)
+        return false;
 
+    nodeBlockHashSource = pfrom->GetId();
+    nTimeBlockHashRequest = 0;
 
-    std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
+    for (std::vector<CInv>::const_iterator it = vInv.begin(); it != vInv.end(); ++it)
+    {
+        if (it->type != MSG_BLOCK
+            || setBlocksToDownload.count(it->hash)
+            || AlreadyHave(txdb, *it))
+            continue;
+        vBlocksToDownload.push_back(it->hash);
+        setBlocksToDownload.insert(it->hash);
+    };
 
-    vector<CInv> vNotFound;
-    vector<CInv> vMerkleBlocks;
+    return true;
+}
 
-    LOCK(cs_main);
-    std::vector<CBlock> vMultiBlock;
-    std::vector<CMBlkThinElement> vMultiBlockThin; // TODO: split ProcessGetDataThinPeer from ProcessGetData
-    uint32_t nMultiBlockBytes = 0;
+// Take a downloaded block, returns false if it wasn't requested by the scheduler
+static bool BlockDownloadReceived(CNode* pfrom, const CBlock& block, const uint256& hash)
+{
+    if (!setBlocksToDownload.count(hash))
+        return false;
 
-    while (it != pfrom->vRecvGetData.end()) {
-        // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->nSendSize >= SendBufferSize())
-            break;
+    std::map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.find(hash);
+    if (mi != mapBlocksInFlight.end())
+    {
+        CBlockDownloadPeer& peer = mapBlockDownloadPeers[mi->second.nodeId];
+        if (peer.nBlocksInFlight > 0)
+            peer.nBlocksInFlight--;
+        mapBlocksInFlight.erase(mi);
+    };
+    mapBlockDownloadPeers[pfrom->GetId()].nLastReceived = GetTime();
 
-        boost::this_thread::interruption_point();
+    if (!mapBlocksDownloaded.count(hash))
+    {
+        CBlockDownloaded& downloaded = mapBlocksDownloaded[hash];
+        downloaded.nodeId = pfrom->GetId();
+        downloaded.block = block;
+        nBlocksDownloadedBytes += ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    };
+    return true;
+}
 
-        const CInv &inv = *it;
-        it++;
+// Charge the peer a downloaded block came from, which may not be the peer being processed
+static void BlockDownloadMisbehaving(CNode* pfrom, NodeId nodeId, int nDoS)
+{
+    if (nDoS < 1)
+        return;
 
-        if (nNodeMode != NT_FULL
-            && inv.type != MSG_TX)
-        {
-            if (fDebug)
-                LogPrintf("strCommand getdata not for txn.\n");
+    if (pfrom->GetId() == nodeId)
+    {
+        pfrom->Misbehaving(nDoS);
+        return;
+    };
+
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if (pnode->GetId() != nodeId)
             continue;
-        };
+        pnode->Misbehaving(nDoS);
+        break;
+    };
+}
 
-        if (inv.type == MSG_BLOCK
-            || inv.type == MSG_FILTERED_BLOCK)
-        {
-            bool send = false;
-            CBlockIndex *pBlockIndex;
+// Validate the downloaded blocks at the front of the queue, the accepted
+// blocks are moved to vScan for SecureMsgScanBlock outside of cs_main
+static void BlockDownloadProcess(CNode* pfrom, std::vector<CBlock>& vScan)
+{
+    while (!vBlocksToDownload.empty())
+    {
+        boost::this_thread::interruption_point();
 
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+        uint256 hash = vBlocksToDownload.front();
+        std::map<uint256, CBlockDownloaded>::iterator mi = mapBlocksDownloaded.find(hash);
+        if (mi == mapBlocksDownloaded.end())
+        {
+            if (!mapBlockIndex.count(hash))
+                break;
+            // arrived by another route
+        } else if (mapBlockIndex.count(hash))
+        {
+            // downloaded, but arrived by another route first (relayed or compact block)
+            nBlocksDownloadedBytes -= std::min(nBlocksDownloadedBytes,
+                (size_t)::GetSerializeSize(mi->second.block, SER_NETWORK, PROTOCOL_VERSION));
+            mapBlocksDownloaded.erase(mi);
+        } else
+        {
+            CBlock& block = mi->second.block;
+            if (!mapBlockIndex.count(block.hashPrevBlock))
+            {
+                // the queued hashes don't connect to our chain, start over from getblocks
+                LogPrintf("Block download: %s does not connect, resetting the download queue.\n", hash.ToString());
+                BlockDownloadReset();
+                return;
+            };
 
-            if (mi != mapBlockIndex.end())
+            CNode* pnode = pfrom->GetId() == mi->second.nodeId ? pfrom : NULL;
+            if (!ProcessBlock(pnode, &block, hash))
             {
-                pBlockIndex = (*mi).second;
+                LogPrintf("Block download: %s failed, resetting the download queue.\n", hash.ToString());
+                BlockDownloadMisbehaving(pfrom, mi->second.nodeId, block.nDoS);
+                BlockDownloadReset();
+                return;
+            };
 
-                // If the requested block is at a height below our last
-                // checkpoint, only serve it if it's in the checkpointed chain
-                int nHeight = mi->second->nHeight;
-                CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
-                if (pcheckpoint && nHeight < pcheckpoint->nHeight)
-                {
-                    //if (!chainActive.Contains(mi->second))
+            BlockDownloadMisbehaving(pfrom, mi->second.nodeId, block.nDoS);
 
-                    // -- check if best chain contains block
-                    //    necessary? faster way? (mark unlinked blocks)
-                    CBlockIndex *pindex = pindexBest;
-                    while (pindex && pindex != mi->second && pindex->pprev)
-                        pindex = pindex->pprev;
+            nBlocksDownloadedBytes -= std::min(nBlocksDownloadedBytes,
+                (size_t)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
 
-                    if ((!pindex->pprev && pindex != mi->second)) // reached start of chain.
-                    {
-                        LogPrintf("ProcessGetData(): ignoring request for old block that isn't in the main chain\n");
-                    } else
-                    {
-                        send = true;
-                    };
-                } else
-                {
-                    send = true;
-                };
+            if (fSecMsgEnabled)
+            {
+                vScan.push_back(CBlock());
+                std::swap(vScan.back().vtx, block.vtx);
             };
+            mapBlocksDownloaded.erase(mi);
+        };
+
+        vBlocksToDownload.pop_front();
+        setBlocksToDownload.erase(hash);
+        mapBlocksInFlight.erase(hash);
+        nFrontBlockTimeouts = 0;
+    };
+}
+
+// Called from SendMessages: time out stalling peers, request blocks from pto
+// and ask for more hashes when the queue runs short.
+static void BlockDownloadRequest(CNode* pto, std::vector<CNode*>& vNodesCopy, std::vector<CInv>& vGetData, int64_t nTimeNow)
+{
+    if (vBlocksToDownload.empty())
+        return;
 
-            if (send)
+    // Forget peers that are gone
+    std::map<NodeId, CBlockDownloadPeer>::iterator it = mapBlockDownloadPeers.begin();
+    while (it != mapBlockDownloadPeers.end())
+    {
+        bool fFound = false;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->GetId() == it->first && !pnode->fDisconnect)
             {
-                // Send block from disk
-                CBlock block;
-                if (!block.ReadFromDisk(pBlockIndex))
-                {
-                    LogPrintf("Error: block.ReadFromDisk failed - Terminating.");
-                    exit(1);
-                };
+                fFound = true;
+                break;
+            };
+        if (fFound)
+        {
+            ++it;
+            continue;
+        };
+        BlockDownloadReleasePeer(it->first);
+        mapBlockDownloadPeers.erase(it++);
+    };
 
-                if (inv.type == MSG_BLOCK)
-                {
-                    if (pfrom->nVersion >= MIN_MBLK_VERSION)
-                    {
-                        uint32_t nBlockBytes = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    CBlockDownloadPeer& peer = mapBlockDownloadPeers[pto->GetId()];
 
-                        if (vMultiBlock.size() >= MAX_MULTI_BLOCK_ELEMENTS
-                            || nMultiBlockBytes + nBlockBytes > MAX_MULTI_BLOCK_SIZE)
-                        {
-                            pfrom->PushMessage("mblk", vMultiBlock);
-                            vMultiBlock.clear();
-                            nMultiBlockBytes = 0;
-                        }
+    // Time out a stalling peer
+    if (peer.nBlocksInFlight > 0
+        && nTimeNow - peer.nLastReceived > BLOCK_DOWNLOAD_TIMEOUT)
+    {
+        LogPrintf("Block download: peer %s stalled with %d blocks in flight.\n", pto->addrName, peer.nBlocksInFlight);
 
-                        vMultiBlock.push_back(block);
-                        nMultiBlockBytes += nBlockBytes;
+        std::map<uint256, CBlockInFlight>::iterator mi = mapBlocksInFlight.find(vBlocksToDownload.front());
+        if (mi != mapBlocksInFlight.end() && mi->second.nodeId == pto->GetId()
+            && ++nFrontBlockTimeouts >= 3)
+        {
+            // nobody seems to have it
+            LogPrintf("Block download: %s timed out repeatedly, resetting the download queue.\n", vBlocksToDownload.front().ToString());
+            BlockDownloadReset();
+            return;
+        };
+
+        BlockDownloadReleasePeer(pto->GetId());
+        peer.nStallingUntil = nTimeNow + 2 * BLOCK_DOWNLOAD_TIMEOUT;
+    };
+
+    if (!IsBlockDownloadPeer(pto) || nTimeNow < peer.nStallingUntil)
+        return;
+
+    // Request blocks inside the window
+    if (peer.nBlocksInFlight < (int)MAX_BLOCKS_IN_FLIGHT_PER_PEER)
+    {
+        size_t nWindow = std::min(vBlocksToDownload.size(), (size_t)BLOCK_DOWNLOAD_WINDOW);
+        for (size_t i = 0; i < nWindow && peer.nBlocksInFlight < (int)MAX_BLOCKS_IN_FLIGHT_PER_PEER; ++i)
+        {
+            const uint256& hash = vBlocksToDownload[i];
+            if (mapBlocksInFlight.count(hash) || mapBlocksDownloaded.count(hash))
+                continue;
+
+            // only the block needed next while the held blocks are over the limit
+            if (i > 0 && nBlocksDownloadedBytes > MAX_BLOCK_DOWNLOAD_BUFFER)
+                break;
+
+            if (peer.nBlocksInFlight == 0)
+                peer.nLastReceived = nTimeNow;
+
+            CBlockInFlight& inFlight = mapBlocksInFlight[hash];
+            inFlight.nodeId = pto->GetId();
+            inFlight.nTime = nTimeNow;
+            peer.nBlocksInFlight++;
+            vGetData.push_back(CInv(MSG_BLOCK, hash));
+        };
+    };
+
+    // Ask for the next hashes before the queue runs dry
+    if (vBlocksToDownload.size() < BLOCK_DOWNLOAD_WINDOW
+        && (nTimeBlockHashRequest == 0 || nTimeNow - nTimeBlockHashRequest > BLOCK_DOWNLOAD_TIMEOUT)
+        && pto->nChainHeight > nBestHeight + (int)vBlocksToDownload.size())
+    {
+        CBlockLocator locator;
+        locator.SetAhead(vBlocksToDownload.back(), pindexBest);
+        pto->PushMessage("getblocks", locator, uint256(0));
+        nodeBlockHashSource = pto->GetId();
+        nTimeBlockHashRequest = nTimeNow;
+    };
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Compact blocks
+//
+
+CBlockCompact::CBlockCompact(const CBlock& block)
+{
+    header = block;
+    vchBlockSig = block.vchBlockSig;
+    nSalt = GetRand(std::numeric_limits<uint64_t>::max());
+
+    // -- the peer can't have the coinbase or coinstake
+    for (uint32_t i = 0; i < block.vtx.size(); ++i)
+    {
+        const CTransaction& tx = block.vtx[i];
+        if (tx.IsCoinBase() || tx.IsCoinStake())
+            vPrefilledTxn.push_back(CPrefilledTx(i, tx));
+        else
+            vShortTxIds.push_back(GetShortTxId(tx.GetHash(), nSalt));
+    };
+}
+
+uint64_t CBlockCompact::GetShortTxId(const uint256& txid, uint64_t nSalt)
+{
+    // salted per message so colliding txids can't be made ahead of time
+    return Hash(BEGIN(txid), END(txid), BEGIN(nSalt), END(nSalt)).Get64();
+}
+
+int CBlockCompact::FillBlock(CBlock& block, std::vector<uint32_t>& vMissing) const
+{
+    AssertLockHeld(cs_main);
+
+    uint32_t nTx = vShortTxIds.size() + vPrefilledTxn.size();
+    if (nTx == 0 || nTx > MAX_BLOCK_SIZE / 60)
+        return CMPCT_FILL_INVALID;
+
+    block.SetNull();
+    *(CBlockHeader*)&block = header;
+    block.vchBlockSig = vchBlockSig;
+    block.vtx.resize(nTx);
+
+    std::vector<bool> vHave(nTx, false);
+    BOOST_FOREACH(const CPrefilledTx& prefilled, vPrefilledTxn)
+    {
+        if (prefilled.nIndex >= nTx || vHave[prefilled.nIndex])
+            return CMPCT_FILL_INVALID;
+        block.vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+    };
+
+    std::map<uint64_t, uint32_t> mapShortIds;
+    uint32_t nShortId = 0;
+    for (uint32_t i = 0; i < nTx; ++i)
+    {
+        if (vHave[i])
+            continue;
+        // duplicate short ids, the full block is needed
+        if (!mapShortIds.insert(std::make_pair(vShortTxIds[nShortId++], i)).second)
+            return CMPCT_FILL_COLLISION;
+    };
+
+    // -- a short id matching more than one known txn is left missing
+    std::set<uint32_t> setAmbiguous;
+    std::map<uint64_t, uint32_t>::iterator mi;
+    {
+        LOCK(mempool.cs);
+        for (std::map<uint256, CTransaction>::const_iterator it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
+        {
+            if ((mi = mapShortIds.find(GetShortTxId(it->first, nSalt))) == mapShortIds.end())
+                continue;
+            if (vHave[mi->second])
+                setAmbiguous.insert(mi->second);
+            block.vtx[mi->second] = it->second;
+            vHave[mi->second] = true;
+        };
+    }
+
+    for (std::map<uint256, CTransaction>::const_iterator it = mapOrphanTransactions.begin(); it != mapOrphanTransactions.end(); ++it)
+    {
+        if ((mi = mapShortIds.find(GetShortTxId(it->first, nSalt))) == mapShortIds.end())
+            continue;
+        if (vHave[mi->second])
+            setAmbiguous.insert(mi->second);
+        block.vtx[mi->second] = it->second;
+        vHave[mi->second] = true;
+    };
+
+    vMissing.clear();
+    for (uint32_t i = 0; i < nTx; ++i)
+    {
+        if (!vHave[i] || setAmbiguous.count(i))
+            vMissing.push_back(i);
+    };
+
+    return CMPCT_FILL_OK;
+}
+
+class CPartialBlock
+{
+public:
+    NodeId nodeId;
+    int64_t nTime;
+    CBlock block;
+    std::vector<uint32_t> vMissing;
+};
+
+// Compact blocks waiting for a blocktxn reply, requires cs_main
+static std::map<uint256, CPartialBlock> mapPartialBlocks;
+
+static void RequestFullBlock(CNode* pfrom, const uint256& hash)
+{
+    std::vector<CInv> vGetData;
+    vGetData.push_back(CInv(MSG_BLOCK, hash));
+    pfrom->PushMessage("getdata", vGetData);
+}
+
+// Handle a block rebuilt from a cmpctblock message, the block is moved to
+// vScan for SecureMsgScanBlock outside of cs_main
+static void ProcessCompactBlock(CNode* pfrom, CBlock& block, std::vector<CBlock>& vScan)
+{
+    AssertLockHeld(cs_main);
+
+    uint256 hashBlock = block.GetHash();
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+    {
+        // a short id matched the wrong txn, not the peer's fault
+        LogPrint("net", "Compact block %s does not match its merkle root, asking for the full block.\n", hashBlock.ToString());
+        RequestFullBlock(pfrom, hashBlock);
+        return;
+    };
+
+    mapAlreadyAskedFor.erase(CInv(MSG_CMPCT_BLOCK, hashBlock));
+
+    if (!block.CheckBlock())
+    {
+        if (block.nDoS)
+            pfrom->Misbehaving(block.nDoS);
+        LogPrintf("cmpctblock: CheckBlock failed for %s\n", hashBlock.ToString());
+        return;
+    };
+
+    if (BlockDownloadReceived(pfrom, block, hashBlock))
+    {
+        BlockDownloadProcess(pfrom, vScan);
+        return;
+    };
+
+    if (ProcessBlock(pfrom, &block, hashBlock))
+        mapAlreadyAskedFor.erase(CInv(MSG_BLOCK, hashBlock));
+    if (block.nDoS)
+        pfrom->Misbehaving(block.nDoS);
+    if (fSecMsgEnabled)
+    {
+        vScan.push_back(CBlock());
+        std::swap(vScan.back().vtx, block.vtx);
+    };
+}
+
+// Ask for the full block when a getblocktxn goes unanswered
+static void PartialBlocksTimeout(CNode* pto, int64_t nTimeNow)
+{
+    std::map<uint256, CPartialBlock>::iterator it = mapPartialBlocks.begin();
+    while (it != mapPartialBlocks.end())
+    {
+        if (nTimeNow - it->second.nTime > 2 * PARTIAL_BLOCK_TIMEOUT)
+        {
+            // the peer is gone
+            mapPartialBlocks.erase(it++);
+            continue;
+        };
+        if (it->second.nodeId != pto->GetId()
+            || nTimeNow - it->second.nTime < PARTIAL_BLOCK_TIMEOUT)
+        {
+            ++it;
+            continue;
+        };
+        LogPrint("net", "Timed out waiting for txns of compact block %s from peer %s\n", it->first.ToString(), pto->addrName);
+        RequestFullBlock(pto, it->first);
+        mapPartialBlocks.erase(it++);
+    };
+}
+
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// Messages
+//
+
+
+bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
+{
+    switch (inv.type)
+    {
+    case MSG_TX:
+        {
+        bool txInMap = false;
+        txInMap = mempool.exists(inv.hash);
+        return txInMap ||
+               mapOrphanTransactions.count(inv.hash) ||
+               txdb.ContainsTx(inv.hash);
+        }
+
+    case MSG_BLOCK:
+    case MSG_CMPCT_BLOCK:
+        return mapBlockIndex.count(inv.hash) ||
+               mapOrphanBlocks.count(inv.hash);
+    }
+    // Don't know what it is, just say we already got one
+    return true;
+}
+
+bool static AlreadyHaveThin(CTxDB& txdb, const CInv& inv)
+{
+    switch (inv.type)
+    {
+    case MSG_TX:
+        {
+        bool txInMap = false;
+        txInMap = mempool.exists(inv.hash);
+        return txInMap
+            || mapOrphanTransactions.count(inv.hash)
+            || txdb.ContainsTx(inv.hash);
+        }
+
+    case MSG_BLOCK:
+        return mapBlockThinIndex.count(inv.hash)
+            || mapOrphanBlockThins.count(inv.hash);
+
+    case MSG_FILTERED_BLOCK:
+        return mapBlockThinIndex.count(inv.hash)
+            || mapOrphanBlockThins.count(inv.hash);
+    }
+    // Don't know what it is, just say we already got one
+    return true;
+}
+
+// Messages for the blocks at the tip, which most peers ask for at about the
+// same time, serialized once and queued to every peer. Requires cs_main.
+static std::map<CInv, CSharedMessage> mapSharedBlockMsgs;
+static std::deque<CInv> vSharedBlockMsgs;
+static const unsigned int MAX_SHARED_BLOCK_MSGS = 8;
+
+static bool SendSharedBlockMessage(CNode* pfrom, const CInv& inv, CBlockIndex* pindex,
+    std::vector<CBlock>& vMultiBlock, uint32_t& nMultiBlockBytes)
+{
+    if ((inv.type != MSG_BLOCK && inv.type != MSG_CMPCT_BLOCK)
+        || pfrom->nVersion < MIN_MBLK_VERSION
+        || pindex->nHeight + 1 < nBestHeight)
+        return false;
+
+    std::map<CInv, CSharedMessage>::iterator mi = mapSharedBlockMsgs.find(inv);
+    if (mi == mapSharedBlockMsgs.end())
+    {
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return false;
+
+        CSharedMessage msg;
+        if (inv.type == MSG_BLOCK)
+            msg = MakeSharedMessage("mblk", std::vector<CBlock>(1, block));
+        else
+            msg = MakeSharedMessage("cmpctblock", CBlockCompact(block));
+
+        if (vSharedBlockMsgs.size() >= MAX_SHARED_BLOCK_MSGS)
+        {
+            mapSharedBlockMsgs.erase(vSharedBlockMsgs.front());
+            vSharedBlockMsgs.pop_front();
+        };
+        vSharedBlockMsgs.push_back(inv);
+        mi = mapSharedBlockMsgs.insert(std::make_pair(inv, msg)).first;
+    };
+
+    // -- keep the blocks in the order they were asked for
+    if (!vMultiBlock.empty())
+    {
+        pfrom->PushMessage("mblk", vMultiBlock);
+        vMultiBlock.clear();
+        nMultiBlockBytes = 0;
+    };
+
+    pfrom->PushSharedMessage(mi->second);
+    return true;
+}
+
+static void ProcessGetData(CNode* pfrom)
+{
+    if (fDebugNet)
+        LogPrintf("ProcessGetData\n");
+
+
+    std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
+
+    vector<CInv> vNotFound;
+    vector<CInv> vMerkleBlocks;
+
+    LOCK(cs_main);
+    std::vector<CBlock> vMultiBlock;
+    std::vector<CMBlkThinElement> vMultiBlockThin; // TODO: split ProcessGetDataThinPeer from ProcessGetData
+    uint32_t nMultiBlockBytes = 0;
+
+    while (it != pfrom->vRecvGetData.end()) {
+        // Don't bother if send buffer is too full to respond anyway
+        if (pfrom->nSendSize >= SendBufferSize())
+            break;
+
+        boost::this_thread::interruption_point();
+
+        const CInv &inv = *it;
+        it++;
+
+        if (nNodeMode != NT_FULL
+            && inv.type != MSG_TX)
+        {
+            if (fDebug)
+                LogPrintf("strCommand getdata not for txn.\n");
+            continue;
+        };
+
+        if (inv.type == MSG_BLOCK
+            || inv.type == MSG_FILTERED_BLOCK
+            || inv.type == MSG_CMPCT_BLOCK)
+        {
+            bool send = false;
+            CBlockIndex *pBlockIndex;
+
+            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
+
+            if (mi != mapBlockIndex.end())
+            {
+                pBlockIndex = (*mi).second;
+
+                // If the requested block is at a height below our last
+                // checkpoint, only serve it if it's in the checkpointed chain
+                int nHeight = mi->second->nHeight;
+                CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+                if (pcheckpoint && nHeight < pcheckpoint->nHeight)
+                {
+                    //if (!chainActive.Contains(mi->second))
+
+                    // -- check if best chain contains block
+                    //    necessary? faster way? (mark unlinked blocks)
+                    CBlockIndex *pindex = pindexBest;
+                    while (pindex && pindex != mi->second && pindex->pprev)
+                        pindex = pindex->pprev;
+
+                    if ((!pindex->pprev && pindex != mi->second)) // reached start of chain.
+                    {
+                        LogPrintf("ProcessGetData(): ignoring request for old block that isn't in the main chain\n");
+                    } else
+                    {
+                        send = true;
+                    };
+                } else
+                {
+                    send = true;
+                };
+            };
+
+            if (send
+                && !SendSharedBlockMessage(pfrom, inv, pBlockIndex, vMultiBlock, nMultiBlockBytes))
+            {
+                // Send block from disk
+                CBlock block;
+                if (!block.ReadFromDisk(pBlockIndex))
+                {
+                    LogPrintf("Error: block.ReadFromDisk failed - Terminating.");
+                    exit(1);
+                };
+
+                if (inv.type == MSG_BLOCK)
+                {
+                    if (pfrom->nVersion >= MIN_MBLK_VERSION)
+                    {
+                        uint32_t nBlockBytes = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+
+                        if (vMultiBlock.size() >= MAX_MULTI_BLOCK_ELEMENTS
+                            || nMultiBlockBytes + nBlockBytes > MAX_MULTI_BLOCK_SIZE)
+                        {
+                            pfrom->PushMessage("mblk", vMultiBlock);
+                            vMultiBlock.clear();
+                            nMultiBlockBytes = 0;
+                        }
+
+                        vMultiBlock.push_back(block);
+                        nMultiBlockBytes += nBlockBytes;
                     } else
                     {
                         pfrom->PushMessage("block", block);
                     }
                 } else
+                if (inv.type == MSG_CMPCT_BLOCK)
+                {
+                    CBlockCompact cmpctBlock(block);
+                    pfrom->PushMessage("cmpctblock", cmpctBlock);
+                } else
                 {
                     // MSG_FILTERED_BLOCK)
                     LOCK(pfrom->cs_filter);
@@ -4580,18 +5296,18 @@ static void ProcessGetData(CNode* pfrom)
                     // else
                         // no response
                 };
-
-                // Trigger them to send a getblocks request for the next batch of inventory
-                if (inv.hash == pfrom->hashContinue)
-                {
-                    // Bypass PushInventory, this must send even if redundant,
-                    // and we want it right after the last block so they don't
-                    // wait for other stuff first.
-                    std::vector<CInv> vInv;
-                    vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
-                    pfrom->PushMessage("inv", vInv);
-                    pfrom->hashContinue = 0;
-                }
+            }
+
+            // Trigger them to send a getblocks request for the next batch of inventory
+            if (send && inv.hash == pfrom->hashContinue)
+            {
+                // Bypass PushInventory, this must send even if redundant,
+                // and we want it right after the last block so they don't
+                // wait for other stuff first.
+                std::vector<CInv> vInv;
+                vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+                pfrom->PushMessage("inv", vInv);
+                pfrom->hashContinue = 0;
             }
         }
         else if (inv.IsKnownType())
@@ -4643,7 +5359,7 @@ static void ProcessGetData(CNode* pfrom)
             };
         } else
         {
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         };
     };
@@ -4815,1219 +5531,1592 @@ static int ProcessMerkleBlock(CNode* pfrom, CMerkleBlockIncoming& merkleBlock, s
         LogPrintf("Added incoming merkle block.\n");
 
 
-    // -- check txns in mempool
-    //    txns recieved in mempool will not be resent after the merkleblock
-    CTransaction txMp;
-    for (uint32_t i = 0; i < merkleBlock.vMatch.size(); ++i)
+    // -- check txns in mempool
+    //    txns recieved in mempool will not be resent after the merkleblock
+    CTransaction txMp;
+    for (uint32_t i = 0; i < merkleBlock.vMatch.size(); ++i)
+    {
+        if (!mempool.lookup(merkleBlock.vMatch[i], txMp))
+            continue;
+
+        if (fDebugChain)
+            LogPrintf("Found txn match in mempool.\n");
+
+        BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+            pwallet->AddToWalletIfInvolvingMe(txMp, merkleBlock.vMatch[i], (void*)&hashBlock, true);
+
+        mempool.remove(txMp);
+        merkleBlock.nProcessed++;
+        break;
+    };
+
+    if (pvTxns)
+    {
+        for (uint32_t i = 0; i < pvTxns->size(); ++i)
+        {
+            CTransaction &txMp = (*pvTxns)[i];
+            uint256 txnhash = txMp.GetHash();
+            BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+                pwallet->AddToWalletIfInvolvingMe(txMp, txnhash, (void*)&hashBlock, true);
+
+            /*
+            // necessary?
+            for (uint32_t i = 0; i < merkleBlock.vMatch.size(); ++i)
+                if (merkleBlock.vMatch[i] == txnhash)
+                    merkleBlock.nProcessed++;
+            */
+        };
+    } else
+    if (merkleBlock.nProcessed < merkleBlock.vMatch.size())
+        vIncomingMerkleBlocks.push_back(merkleBlock);
+
+    //for (uint32_t i = 0; i < merkleBlock.vMatch.size(); ++i)
+    //    LogPrintf("vMatch %d %s\n", i, merkleBlock.vMatch[i].ToString().c_str());
+    return 0;
+};
+
+/*
+void static ThreadCloseSocket(void* parg)
+{
+    // -- Hack: give socket some time to send buffer before closing
+
+    CNode* pcloseNode = (CNode*)parg;
+
+    MilliSleep(256);
+
+    // -- loop incase pcloseNode is gone by now
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if (pnode != pcloseNode)
+            continue;
+
+        pnode->fDisconnect = true;
+        break;
+    };
+}
+*/
+static bool SetNodeType(CNode* pfrom, int nTypeInd)
+{
+    if (fDebugNet)
+        LogPrintf("SetNodeType %d\n", nTypeInd);
+
+    if (nTypeInd < NT_FULL
+        || nTypeInd >= NT_UNKNOWN)
+    {
+        LogPrintf("Rejected peer %s: Using unknown node type %d.\n", pfrom->addr.ToString().c_str(), nTypeInd);
+        pfrom->fDisconnect = true;
+        return false;
+    };
+
+    if (nTypeInd != NT_FULL
+        && !(nLocalServices & THIN_SUPPORT))
+    {
+        LogPrintf("Rejected peer %s: This node does not support thin peers.\n", pfrom->addr.ToString().c_str());
+        pfrom->fDisconnect = true;
+        return false;
+    };
+
+    pfrom->nTypeInd = nTypeInd;
+
+    int nMax = nMaxThinPeers;
+    // -- check available thin slots
+    if (pfrom->nTypeInd != NT_FULL)
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->nTypeInd != NT_FULL)
+                nMax--;
+
+            if (nMax < 1)
+            {
+                LogPrintf("Rejected peer %s: Max thin peers (%d) reached.\n", pfrom->addr.ToString().c_str(), nMaxThinPeers);
+
+                pfrom->PushMessage("reject", _("conn"), (unsigned char)REJ_MAX_THIN_PEERS, _("max"));
+                pfrom->TryFlushSend(); // -- SocketSendData could be called by EndMessage(), try again in case it was not
+
+                //if (!NewThread(ThreadCloseSocket, pfrom))
+                pfrom->fDisconnect = true;
+                return false;
+            }
+        }
+    }
+
+
+    switch (pfrom->nTypeInd)
+    {
+        case NT_THIN:
+            pfrom->fRelayTxes = false; // set to true after we get the first filter* message
+            break;
+
+        case NT_FULL:
+        default:
+            pfrom->fRelayTxes = true;
+            break;
+    };
+
+    return true;
+}
+
+
+static bool ProcessVersionMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    // Each connection can only send one version message
+    if (pfrom->nVersion != 0)
+    {
+        pfrom->Misbehaving(1);
+        return false;
+    }
+
+    int64_t nTime;
+    CAddress addrMe;
+    CAddress addrFrom;
+    uint64_t nNonce = 1;
+    vRecv >> pfrom->nVersion >> pfrom->nServices >> nTime >> addrMe;
+    if (pfrom->nVersion < MIN_PEER_PROTO_VERSION)
+    {
+        // disconnect from peers older than this proto version
+        LogPrintf("Peer %s using obsolete version %i; disconnecting\n", pfrom->addr.ToString(), pfrom->nVersion);
+        pfrom->PushMessage("reject", strCommand, REJECT_OBSOLETE, strprintf("node < %d", MIN_PEER_PROTO_VERSION));
+        pfrom->fDisconnect = true;
+        return false;
+    }
+
+    if (nNodeMode != NT_FULL
+        && !(pfrom->nServices & THIN_SUPPORT))
+    {
+        LogPrintf("Peer %s does not support thin clients.\n", pfrom->addr.ToString());
+
+        pfrom->PushMessage("reject", _("conn"), (unsigned char) REJ_NEED_THIN_SUPPORT, _("thin"));
+        pfrom->TryFlushSend();      // SocketSendData could be called by EndMessage(), try again in case it was not
+
+        // -- seems like closesocket (on linux at least) doesn't always wait for data to be sent before destroying the connection
+        //if (!NewThread(ThreadCloseSocket, pfrom))
+        pfrom->fDisconnect = true;
+
+        return false;
+    }
+
+    if (!vRecv.empty())
+        vRecv >> addrFrom >> nNonce;
+    if (!vRecv.empty())
+        vRecv >> pfrom->strSubVer;
+    if (!vRecv.empty())
+        vRecv >> pfrom->nChainHeight;
+
+    // -- peers should inform node of their mode (FULL/THIN)
+    if (!vRecv.empty())
+    {
+        int nNodeType;
+
+        vRecv >> nNodeType;
+        if (!SetNodeType(pfrom, nNodeType))
+            return false;
+    } else
+    {
+        pfrom->fRelayTxes = true;
+    };
+
+    if (pfrom->fInbound && addrMe.IsRoutable())
+    {
+        pfrom->addrLocal = addrMe;
+        SeenLocal(addrMe);
+    };
+
+    // Disconnect if we connected to ourself
+    if (nNonce == nLocalHostNonce && nNonce > 1)
+    {
+        LogPrintf("connected to self at %s, disconnecting\n", pfrom->addr.ToString());
+        pfrom->fDisconnect = true;
+        return true;
+    }
+
+    // record my external IP reported by peer
+    if (addrFrom.IsRoutable() && addrMe.IsRoutable())
+    {
+        addrSeenByPeer = addrMe;
+        AddLocal(addrSeenByPeer, LOCAL_BIND);
+    }
+
+    // Be shy and don't send version until we hear
+    if (pfrom->fInbound)
+        pfrom->PushVersion();
+
+    pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
+
+    int64_t nTimeOffset = nTime - GetTime();
+    pfrom->nTimeOffset = nTimeOffset;
+    if (GetBoolArg("-synctime", true))
+        AddTimeData(pfrom->addr, nTime);
+
+    // Change version
+    pfrom->PushMessage("verack");
+    pfrom->ssSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+
+    if (!pfrom->fInbound)
+    {
+        // Advertise our address
+        if (!fNoListen && !IsInitialBlockDownload())
+        {
+            CAddress addr = GetLocalAddress(&pfrom->addr);
+            if (addr.IsRoutable())
+                pfrom->PushAddress(addr);
+        }
+
+        // Get recent addresses
+        if (pfrom->fOneShot || pfrom->nVersion >= CADDR_TIME_VERSION || addrman.size() < 1000)
+        {
+            pfrom->PushMessage("getaddr");
+            pfrom->fGetAddr = true;
+        }
+        addrman.Good(pfrom->addr);
+    } else {
+        if (((CNetAddr)pfrom->addr) == (CNetAddr)addrFrom)
+        {
+            addrman.Add(addrFrom, addrFrom);
+            addrman.Good(addrFrom);
+        }
+    }
+
+    // Ask the first connected node for block updates
+    static int nAskedForBlocks = 0;
+
+    if (nNodeMode == NT_FULL)
+    {
+        if (pfrom->nTypeInd == NT_FULL && !pfrom->fClient &&
+           !pfrom->fOneShot && !fImporting &&
+           (pfrom->nChainHeight > (nBestHeight - 144)) &&
+           (nAskedForBlocks < 1 || vNodes.size() <= 1))
+        {
+            nAskedForBlocks++;
+            pfrom->PushGetBlocks(pindexBest, uint256(0));
+        };
+    } else
+    {
+        // -- TODO it should be able to request headers from thin clients, but providing headers should be optional for a thin client
+        if (pfrom->nTypeInd == NT_FULL && !pfrom->fClient && !pfrom->fOneShot)
+        {
+            if ((pfrom->nChainHeight > (nBestHeight - 144))
+                && (nAskedForBlocks < 1 || vNodes.size() <= 1))
+            {
+                nAskedForBlocks++;
+                ChangeNodeState(NS_GET_HEADERS);
+                pfrom->PushGetHeaders(pindexBestHeader, uint256(0));
+            } else
+            if (nNodeState == NS_STARTUP
+                && nAskedForBlocks < 1)
+            {
+                ChangeNodeState(NS_GET_FILTERED_BLOCKS);
+            };
+        };
+    };
+
+    // Relay alerts
+    {
+        LOCK(cs_mapAlerts);
+        BOOST_FOREACH(PAIRTYPE(const uint256, CAlert)& item, mapAlerts)
+            item.second.RelayTo(pfrom);
+    }
+
+    pfrom->fSuccessfullyConnected = true;
+
+    LogPrint("net", "receive version message: version %d, blocks=%d, us=%s, them=%s, peer=%s\n", pfrom->nVersion, pfrom->nChainHeight, addrMe.ToString(), addrFrom.ToString(), pfrom->addr.ToString());
+
+    cPeerBlockCounts.input(pfrom->nChainHeight);
+
+    return true;
+}
+
+static bool ProcessVerackMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+
+    // -- connection is most probably accepted when receive verack
+
+    if (nNodeMode != NT_FULL
+        && pwalletMain->pBloomFilter)
+    {
+        LOCK(pwalletMain->cs_wallet);
+        pfrom->PushMessage("filterload", *pwalletMain->pBloomFilter);
+    };
+
+    return true;
+}
+
+static bool ProcessAddrMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    vector<CAddress> vAddr;
+    vRecv >> vAddr;
+
+    // Don't want addr from older versions unless seeding
+    if (pfrom->nVersion < CADDR_TIME_VERSION && addrman.size() > 1000)
+        return true;
+    if (vAddr.size() > 1000)
+    {
+        pfrom->Misbehaving(20);
+        return error("message addr size() = %u", vAddr.size());
+    }
+
+    // Store the new addresses
+    vector<CAddress> vAddrOk;
+    int64_t nNow = GetAdjustedTime();
+    int64_t nSince = nNow - 10 * 60;
+    BOOST_FOREACH(CAddress& addr, vAddr)
+    {
+        boost::this_thread::interruption_point();
+
+        if (addr.nTime <= 100000000 || addr.nTime > nNow + 10 * 60)
+            addr.nTime = nNow - 5 * 24 * 60 * 60;
+        pfrom->AddAddressKnown(addr);
+        bool fReachable = IsReachable(addr);
+        if (addr.nTime > nSince && !pfrom->fGetAddr && vAddr.size() <= 10 && addr.IsRoutable())
+        {
+            // Relay to a limited number of other nodes
+            {
+                LOCK(cs_vNodes);
+                // Use deterministic randomness to send to the same nodes for 24 hours
+                // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                static uint256 hashSalt;
+                if (hashSalt == 0)
+                    hashSalt = GetRandHash();
+                uint64_t hashAddr = addr.GetHash();
+                uint256 hashRand = hashSalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
+                hashRand = Hash(BEGIN(hashRand), END(hashRand));
+                multimap<uint256, CNode*> mapMix;
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                {
+                    if (pnode->nVersion < CADDR_TIME_VERSION)
+                        continue;
+                    unsigned int nPointer;
+                    memcpy(&nPointer, &pnode, sizeof(nPointer));
+                    uint256 hashKey = hashRand ^ nPointer;
+                    hashKey = Hash(BEGIN(hashKey), END(hashKey));
+                    mapMix.insert(make_pair(hashKey, pnode));
+                }
+                int nRelayNodes = fReachable ? 2 : 1; // limited relaying of addresses outside our network(s)
+                for (multimap<uint256, CNode*>::iterator mi = mapMix.begin(); mi != mapMix.end() && nRelayNodes-- > 0; ++mi)
+                    ((*mi).second)->PushAddress(addr);
+            }
+        }
+        // Do not store addresses outside our network
+        if (fReachable)
+            vAddrOk.push_back(addr);
+    }
+    addrman.Add(vAddrOk, pfrom->addr, 2 * 60 * 60);
+    if (vAddr.size() < 1000)
+        pfrom->fGetAddr = false;
+    if (pfrom->fOneShot)
+        pfrom->fDisconnect = true;
+
+    return true;
+}
+
+static bool ProcessInvMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    vector<CInv> vInv;
+    vRecv >> vInv;
+    if (vInv.size() > MAX_INV_SZ)
+    {
+        pfrom->Misbehaving(20);
+        return error("message inv size() = %u", vInv.size());
+    }
+
+    // find last block in inv vector
+    unsigned int nLastBlock = (unsigned int)(-1);
+    for (unsigned int nInv = 0; nInv < vInv.size(); nInv++) {
+        if (vInv[vInv.size() - 1 - nInv].type == MSG_BLOCK) {
+            nLastBlock = vInv.size() - 1 - nInv;
+            break;
+        }
+    }
+
+    LOCK(cs_main);
+
+    if (nNodeMode == NT_FULL)
     {
-        if (!mempool.lookup(merkleBlock.vMatch[i], txMp))
-            continue;
+        CTxDB txdb("r");
 
-        if (fDebugChain)
-            LogPrintf("Found txn match in mempool.\n");
+        // -- a getblocks reply goes to the block download scheduler, blocks in it are not asked for singly
+        bool fScheduled = false;
+        unsigned int nBlockInvs = 0;
+        for (unsigned int nInv = 0; nInv < vInv.size(); nInv++)
+            if (vInv[nInv].type == MSG_BLOCK)
+                nBlockInvs++;
+        if (nBlockInvs > 1)
+            fScheduled = !vBlocksToDownload.empty()
+                || (IsBlockDownloadPeer(pfrom) && !fImporting);
+        if (fScheduled)
+            BlockDownloadQueue(txdb, pfrom, vInv);
 
-        BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-            pwallet->AddToWalletIfInvolvingMe(txMp, merkleBlock.vMatch[i], (void*)&hashBlock, true);
+        for (uint32_t nInv = 0; nInv < vInv.size(); nInv++)
+        {
+            const CInv &inv = vInv[nInv];
 
-        mempool.remove(txMp);
-        merkleBlock.nProcessed++;
-        break;
-    };
+            boost::this_thread::interruption_point();
 
-    if (pvTxns)
-    {
-        for (uint32_t i = 0; i < pvTxns->size(); ++i)
-        {
-            CTransaction &txMp = (*pvTxns)[i];
-            uint256 txnhash = txMp.GetHash();
-            BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-                pwallet->AddToWalletIfInvolvingMe(txMp, txnhash, (void*)&hashBlock, true);
+            // -- don't mark as known if block from thin peer, need to send merkleblock later if accepted
+            if (pfrom->nTypeInd != NT_THIN || inv.type != MSG_BLOCK)
+                pfrom->AddInventoryKnown(inv);
 
-            /*
-            // necessary?
-            for (uint32_t i = 0; i < merkleBlock.vMatch.size(); ++i)
-                if (merkleBlock.vMatch[i] == txnhash)
-                    merkleBlock.nProcessed++;
-            */
+            bool fAlreadyHave = AlreadyHave(txdb, inv);
+            LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
+
+            if (!fAlreadyHave) {
+                if (inv.type == MSG_BLOCK
+                    && (fScheduled || setBlocksToDownload.count(inv.hash)
+                        || (!vBlocksToDownload.empty() && IsInitialBlockDownload())))
+                    ; // requested by BlockDownloadRequest
+                else
+                if (inv.type == MSG_BLOCK
+                    && !fImporting
+                    && pfrom->nVersion >= MIN_CMPCT_VERSION
+                    && pfrom->nTypeInd == NT_FULL
+                    && !IsInitialBlockDownload())
+                    pfrom->AskFor(CInv(MSG_CMPCT_BLOCK, inv.hash)); // new tip, peers should have most of its txns
+                else
+                if (!fImporting)
+                    pfrom->AskFor(inv);
+            } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
+                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(inv.hash));
+            } else if (nInv == nLastBlock) {
+                // In case we are on a very long side-chain, it is possible that we already have
+                // the last block in an inv bundle sent in response to getblocks. Try to detect
+                // this situation and push another getblocks to continue.
+                pfrom->PushGetBlocks(mapBlockIndex[inv.hash], uint256(0));
+                if (fDebug)
+                    LogPrintf("force request: %s\n", inv.ToString());
+            }
+
+            // Track requests for our stuff
+            Inventory(inv.hash);
         };
     } else
-    if (merkleBlock.nProcessed < merkleBlock.vMatch.size())
-        vIncomingMerkleBlocks.push_back(merkleBlock);
+    {
+        CTxDB txdb("r");
+        for (uint32_t nInv = 0; nInv < vInv.size(); nInv++)
+        {
+            CInv &inv = vInv[nInv];
 
-    //for (uint32_t i = 0; i < merkleBlock.vMatch.size(); ++i)
-    //    LogPrintf("vMatch %d %s\n", i, merkleBlock.vMatch[i].ToString().c_str());
-    return 0;
-};
+            boost::this_thread::interruption_point();
+            pfrom->AddInventoryKnown(inv);
 
-/*
-void static ThreadCloseSocket(void* parg)
-{
-    // -- Hack: give socket some time to send buffer before closing
+            bool fAlreadyHave = AlreadyHaveThin(txdb, inv);
+            if (fDebug)
+                LogPrintf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
 
-    CNode* pcloseNode = (CNode*)parg;
+            if (nNodeMode != NT_FULL
+                && inv.type == MSG_BLOCK)
+                inv.type = MSG_FILTERED_BLOCK;
 
-    MilliSleep(256);
+            if (!fAlreadyHave)
+            {
+                pfrom->AskFor(inv);
+            } else
+            if (inv.type == MSG_BLOCK
+                && mapOrphanBlockThins.count(inv.hash))
+            {
+                pfrom->PushGetBlocks(pindexBestHeader, GetOrphanHeaderRoot(mapOrphanBlockThins[inv.hash]));
+            } else
+            if (nInv == nLastBlock)
+            {
+                // In case we are on a very long side-chain, it is possible that we already have
+                // the last block in an inv bundle sent in response to getblocks. Try to detect
+                // this situation and push another getblocks to continue.
+                if (mapBlockThinIndex.count(inv.hash))
+                {
+                    pfrom->PushGetBlocks(mapBlockThinIndex[inv.hash], uint256(0));
+                } else
+                if (!fThinFullIndex)
+                {
+                    pfrom->PushGetBlocks(inv.hash, uint256(0));
+                };
 
-    // -- loop incase pcloseNode is gone by now
-    LOCK(cs_vNodes);
-    BOOST_FOREACH(CNode* pnode, vNodes)
-    {
-        if (pnode != pcloseNode)
-            continue;
+                if (fDebug)
+                    LogPrintf("force request: %s\n", inv.ToString().c_str());
+            };
 
-        pnode->fDisconnect = true;
-        break;
+            // Track requests for our stuff
+            Inventory(inv.hash);
+        };
     };
+
+    return true;
 }
-*/
-static bool SetNodeType(CNode* pfrom, int nTypeInd)
-{
-    if (fDebugNet)
-        LogPrintf("SetNodeType %d\n", nTypeInd);
 
-    if (nTypeInd < NT_FULL
-        || nTypeInd >= NT_UNKNOWN)
+static bool ProcessGetDataMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    vector<CInv> vInv;
+    vRecv >> vInv;
+    if (vInv.size() > MAX_INV_SZ)
     {
-        LogPrintf("Rejected peer %s: Using unknown node type %d.\n", pfrom->addr.ToString().c_str(), nTypeInd);
-        pfrom->fDisconnect = true;
-        return false;
-    };
+        pfrom->Misbehaving(20);
+        return error("message getdata size() = %u", vInv.size());
+    }
 
-    if (nTypeInd != NT_FULL
-        && !(nLocalServices & THIN_SUPPORT))
-    {
-        LogPrintf("Rejected peer %s: This node does not support thin peers.\n", pfrom->addr.ToString().c_str());
-        pfrom->fDisconnect = true;
-        return false;
-    };
+    if (fDebug || (vInv.size() != 1))
+        LogPrint("net", "received getdata (%u invsz)\n", vInv.size());
 
-    pfrom->nTypeInd = nTypeInd;
+    if ((fDebug && vInv.size() > 0) || (vInv.size() == 1))
+        LogPrint("net", "received getdata for: %s\n", vInv[0].ToString());
 
-    int nMax = nMaxThinPeers;
-    // -- check available thin slots
-    if (pfrom->nTypeInd != NT_FULL)
-    {
-        LOCK(cs_vNodes);
-        BOOST_FOREACH(CNode* pnode, vNodes)
-        {
-            if (pnode->nTypeInd != NT_FULL)
-                nMax--;
+    pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
+    ProcessGetData(pfrom);
 
-            if (nMax < 1)
-            {
-                LogPrintf("Rejected peer %s: Max thin peers (%d) reached.\n", pfrom->addr.ToString().c_str(), nMaxThinPeers);
+    return true;
+}
 
-                pfrom->PushMessage("reject", _("conn"), (unsigned char)REJ_MAX_THIN_PEERS, _("max"));
-                pfrom->TryFlushSend(); // -- SocketSendData could be called by EndMessage(), try again in case it was not
+static bool ProcessGetBlocksMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    CBlockLocator locator;
+    uint256 hashStop;
+    vRecv >> locator >> hashStop;
 
-                //if (!NewThread(ThreadCloseSocket, pfrom))
-                pfrom->fDisconnect = true;
-                return false;
-            }
-        }
-    }
+    LOCK(cs_main);
 
+    // Find the last block the caller has in the main chain
+    CBlockIndex* pindex = locator.GetBlockIndex();
 
-    switch (pfrom->nTypeInd)
+    // Send the rest of the chain
+    if (pindex)
+        pindex = pindex->pnext;
+    int nLimit = 500;
+    LogPrint("net", "getblocks %d to %s limit %d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), nLimit);
+    for (; pindex; pindex = pindex->pnext)
     {
-        case NT_THIN:
-            pfrom->fRelayTxes = false; // set to true after we get the first filter* message
+        if (pindex->GetBlockHash() == hashStop)
+        {
+            LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
             break;
-
-        case NT_FULL:
-        default:
-            pfrom->fRelayTxes = true;
+        }
+        pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+        if (--nLimit <= 0)
+        {
+            // When this block is requested, we'll send an inv that'll make them
+            // getblocks the next batch of inventory.
+            LogPrint("net", "  getblocks stopping at limit %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            pfrom->hashContinue = pindex->GetBlockHash();
             break;
-    };
+        }
+    }
 
     return true;
 }
 
-
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+static bool ProcessGetHeadersMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
-    RandAddSeedPerfmon();
-    LogPrint("net", "received: %s (%u bytes)\n", strCommand, vRecv.size());
-    if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
+    // -- full nodes don't request headers
+    if (pfrom->nTypeInd == NT_FULL
+        && !SetNodeType(pfrom, NT_THIN))
+        return false;
+
+
+    CBlockLocator locator;
+    uint256 hashStop;
+    vRecv >> locator >> hashStop;
+
+    LOCK(cs_main);
+
+    CBlockIndex* pindex = NULL;
+    if (locator.IsNull())
     {
-        LogPrintf("dropmessagestest DROPPING RECV MESSAGE\n");
-        return true;
+        // If locator is null, return the hashStop block
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+        if (mi == mapBlockIndex.end())
+            return true;
+        pindex = (*mi).second;
+    }
+    else
+    {
+        // Find the last block the caller has in the main chain
+        pindex = locator.GetBlockIndex();
+        if (pindex)
+            pindex = pindex->pnext;
     }
 
-    if (strCommand == "version")
+    vector<CBlock> vHeaders;
+    int nLimit = MAX_GETHEADERS_SZ;
+    LogPrint("net", "getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString());
+    for (; pindex; pindex = pindex->pnext)
     {
-        // Each connection can only send one version message
-        if (pfrom->nVersion != 0)
-        {
-            pfrom->Misbehaving(1);
-            return false;
-        }
+        vHeaders.push_back(pindex->GetBlockHeader());
+        if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
+            break;
+    }
+    pfrom->PushMessage("headers", vHeaders);
 
-        int64_t nTime;
-        CAddress addrMe;
-        CAddress addrFrom;
-        uint64_t nNonce = 1;
-        vRecv >> pfrom->nVersion >> pfrom->nServices >> nTime >> addrMe;
-        if (pfrom->nVersion < MIN_PEER_PROTO_VERSION)
-        {
-            // disconnect from peers older than this proto version
-            LogPrintf("Peer %s using obsolete version %i; disconnecting\n", pfrom->addr.ToString(), pfrom->nVersion);
-            pfrom->PushMessage("reject", strCommand, REJECT_OBSOLETE, strprintf("node < %d", MIN_PEER_PROTO_VERSION));
-            pfrom->fDisconnect = true;
-            return false;
-        }
+    return true;
+}
 
-        if (nNodeMode != NT_FULL
-            && !(pfrom->nServices & THIN_SUPPORT))
-        {
-            LogPrintf("Peer %s does not support thin clients.\n", pfrom->addr.ToString());
+static bool ProcessTxMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    vector<uint256> vWorkQueue;
+    vector<uint256> vEraseQueue;
 
-            pfrom->PushMessage("reject", _("conn"), (unsigned char) REJ_NEED_THIN_SUPPORT, _("thin"));
-            pfrom->TryFlushSend();      // SocketSendData could be called by EndMessage(), try again in case it was not
+    CTransaction tx;
+    vRecv >> tx;
 
-            // -- seems like closesocket (on linux at least) doesn't always wait for data to be sent before destroying the connection
-            //if (!NewThread(ThreadCloseSocket, pfrom))
-            pfrom->fDisconnect = true;
+    LOCK(cs_main);
 
-            return false;
-        }
+    CTxDB txdb("r");
 
-        if (!vRecv.empty())
-            vRecv >> addrFrom >> nNonce;
-        if (!vRecv.empty())
-            vRecv >> pfrom->strSubVer;
-        if (!vRecv.empty())
-            vRecv >> pfrom->nChainHeight;
+    if (nNodeMode == NT_FULL)
+    {
+        CInv inv(MSG_TX, tx.GetHash());
+        pfrom->AddInventoryKnown(inv);
 
-        // -- peers should inform node of their mode (FULL/THIN)
-        if (!vRecv.empty())
-        {
-            int nNodeType;
+        bool fMissingInputs = false;
 
-            vRecv >> nNodeType;
-            if (!SetNodeType(pfrom, nNodeType))
-                return false;
-        } else
-        {
-            pfrom->fRelayTxes = true;
-        };
+        mapAlreadyAskedFor.erase(inv);
 
-        if (pfrom->fInbound && addrMe.IsRoutable())
+        if (AcceptToMemoryPool(mempool, tx, txdb, &fMissingInputs))
         {
-            pfrom->addrLocal = addrMe;
-            SeenLocal(addrMe);
-        };
+            SyncWithWallets(tx, NULL, true);
+            RelayTransaction(tx, inv.hash);
+            vWorkQueue.push_back(inv.hash);
+            vEraseQueue.push_back(inv.hash);
+
+            // Recursively process any orphan transactions that depended on this one
+            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+            {
+                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
+                if (itByPrev == mapOrphanTransactionsByPrev.end())
+                    continue;
+                for (set<uint256>::iterator mi = itByPrev->second.begin();
+                     mi != itByPrev->second.end();
+                     ++mi)
+                {
+                    const uint256& orphanTxHash = *mi;
+                    CTransaction& orphanTx = mapOrphanTransactions[orphanTxHash];
+                    bool fMissingInputs2 = false;
+
+                    if (AcceptToMemoryPool(mempool, orphanTx, txdb, &fMissingInputs2))
+                    {
+                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanTxHash.ToString());
+                        SyncWithWallets(tx, NULL, true);
+                        RelayTransaction(orphanTx, orphanTxHash);
+                        vWorkQueue.push_back(orphanTxHash);
+                        vEraseQueue.push_back(orphanTxHash);
+                    }
+                    else if (!fMissingInputs2)
+                    {
+                        // invalid or too-little-fee orphan
+                        vEraseQueue.push_back(orphanTxHash);
+                        LogPrint("mempool", "   removed orphan tx %s\n", orphanTxHash.ToString());
+                    }
+                }
+            }
 
-        // Disconnect if we connected to ourself
-        if (nNonce == nLocalHostNonce && nNonce > 1)
+            BOOST_FOREACH(uint256 hash, vEraseQueue)
+                EraseOrphanTx(hash);
+        }
+        else if (fMissingInputs)
         {
-            LogPrintf("connected to self at %s, disconnecting\n", pfrom->addr.ToString());
-            pfrom->fDisconnect = true;
-            return true;
+            AddOrphanTx(tx);
+
+            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
+            if (nEvicted > 0)
+                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
         }
+    } else
+    {
+        uint256 txHash = tx.GetHash();
+
+        CInv inv(MSG_TX, txHash);
+        pfrom->AddInventoryKnown(inv);
+        mapAlreadyAskedFor.erase(inv);
 
-        // record my external IP reported by peer
-        if (addrFrom.IsRoutable() && addrMe.IsRoutable())
+        bool fProcessed = false;
+        std::vector<CMerkleBlockIncoming>::iterator it;
+        for (it = vIncomingMerkleBlocks.begin(); !fProcessed && it < vIncomingMerkleBlocks.end(); ++it)
         {
-            addrSeenByPeer = addrMe;
-            AddLocal(addrSeenByPeer, LOCAL_BIND);
-        }
+            for (uint32_t i = 0; i < it->vMatch.size(); ++i)
+            {
+                if (it->vMatch[i] != txHash)
+                    continue;
 
-        // Be shy and don't send version until we hear
-        if (pfrom->fInbound)
-            pfrom->PushVersion();
+                //LogPrintf("Found match.\n");
+                uint256 blockhash = it->header.GetHash();
 
-        pfrom->fClient = !(pfrom->nServices & NODE_NETWORK);
+                BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+                    pwallet->AddToWalletIfInvolvingMe(tx, txHash, (void*)&blockhash, true);
 
-        int64_t nTimeOffset = nTime - GetTime();
-        pfrom->nTimeOffset = nTimeOffset;
-        if (GetBoolArg("-synctime", true))
-            AddTimeData(pfrom->addr, nTime);
+                it->nProcessed++;
+                fProcessed = true;
+                if (it->nProcessed == it->vMatch.size())
+                    vIncomingMerkleBlocks.erase(it);
+                break;
 
-        // Change version
-        pfrom->PushMessage("verack");
-        pfrom->ssSend.SetVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+                //LogPrintf("vMatch %d %s\n", i, it->vMatch[i].ToString().c_str());
+            };
+        };
 
-        if (!pfrom->fInbound)
+        if (!fProcessed)
         {
-            // Advertise our address
-            if (!fNoListen && !IsInitialBlockDownload())
-            {
-                CAddress addr = GetLocalAddress(&pfrom->addr);
-                if (addr.IsRoutable())
-                    pfrom->PushAddress(addr);
-            }
+            if (fDebugChain)
+                LogPrintf("txn %s not found in merkleblock, adding to mempool.\n", txHash.ToString().c_str());
 
-            // Get recent addresses
-            if (pfrom->fOneShot || pfrom->nVersion >= CADDR_TIME_VERSION || addrman.size() < 1000)
-            {
-                pfrom->PushMessage("getaddr");
-                pfrom->fGetAddr = true;
-            }
-            addrman.Good(pfrom->addr);
-        } else {
-            if (((CNetAddr)pfrom->addr) == (CNetAddr)addrFrom)
+            // TODO: this is wasteful, test timedout first?
+
+            bool fMissingInputs = false;
+            if (AcceptToMemoryPool(mempool, tx, txdb, &fMissingInputs))
             {
-                addrman.Add(addrFrom, addrFrom);
-                addrman.Good(addrFrom);
+                //SyncWithWallets(tx, NULL, true);
+
+                bool added = false;
+                BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
+                    added = added | pwallet->AddToWalletIfInvolvingMe(tx, txHash, NULL, true);
+
+                if (added)
+                    RelayTransaction(tx, inv.hash);
+                else
+                    // -- not interested in txn if not for this wallet
+                    mempool.remove(tx);
             }
         }
+    }
 
-        // Ask the first connected node for block updates
-        static int nAskedForBlocks = 0;
+    if (tx.nDoS)
+        pfrom->Misbehaving(tx.nDoS);
 
-        if (nNodeMode == NT_FULL)
-        {
-            if (pfrom->nTypeInd == NT_FULL && !pfrom->fClient &&
-               !pfrom->fOneShot && !fImporting &&
-               (pfrom->nChainHeight > (nBestHeight - 144)) &&
-               (nAskedForBlocks < 1 || vNodes.size() <= 1))
-            {
-                nAskedForBlocks++;
-                pfrom->PushGetBlocks(pindexBest, uint256(0));
-            };
-        } else
+    return true;
+}
+
+static bool ProcessMultiBlockMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    std::vector<CBlock> vBlocks;
+    vRecv >> vBlocks; // TODO: use a plain byte buffer?
+    uint32_t nBlocks = vBlocks.size();
+
+    if (nBlocks > MAX_MULTI_BLOCK_ELEMENTS)
+    {
+        LogPrintf("Warning: Peer sent too many blocks in mblk %u.\n", vRecv.size());
+        pfrom->Misbehaving(10);
+        return false;
+    };
+
+    LogPrintf("Received mblk %d\n", nBlocks);
+    nTimeLastMblkRecv = GetTime();
+
+    // -- context free checks first, on the block check threads and without cs_main
+    PreCheckBlocks(vBlocks);
+
+    std::vector<CBlock> vScan;
+    {
+        LOCK(cs_main);
+        for (uint32_t i = 0; i < nBlocks; ++i)
         {
-            // -- TODO it should be able to request headers from thin clients, but providing headers should be optional for a thin client
-            if (pfrom->nTypeInd == NT_FULL && !pfrom->fClient && !pfrom->fOneShot)
+            CBlock &block = vBlocks[i];
+
+            uint256 hashBlock = block.GetHash();
+            //LogPrintf("received block %s\n", hashBlock.ToString().substr(0,20).c_str());
+            // block.print();
+
+            CInv inv(MSG_BLOCK, hashBlock);
+
+            // -- if peer is thin, it will want the (merkle) block sent if accepted
+            if (pfrom->nTypeInd == NT_FULL)
+                pfrom->AddInventoryKnown(inv);
+
+            if (!block.fChecked)
             {
-                if ((pfrom->nChainHeight > (nBestHeight - 144))
-                    && (nAskedForBlocks < 1 || vNodes.size() <= 1))
-                {
-                    nAskedForBlocks++;
-                    ChangeNodeState(NS_GET_HEADERS);
-                    pfrom->PushGetHeaders(pindexBestHeader, uint256(0));
-                } else
-                if (nNodeState == NS_STARTUP
-                    && nAskedForBlocks < 1)
-                {
-                    ChangeNodeState(NS_GET_FILTERED_BLOCKS);
-                };
+                LogPrintf("mblk: CheckBlock failed for %s\n", hashBlock.ToString());
+                if (block.nDoS)
+                    pfrom->Misbehaving(block.nDoS);
+                continue;
             };
-        };
 
-        // Relay alerts
-        {
-            LOCK(cs_mapAlerts);
-            BOOST_FOREACH(PAIRTYPE(const uint256, CAlert)& item, mapAlerts)
-                item.second.RelayTo(pfrom);
-        }
+            // -- requested by the download scheduler, validated in chain order by BlockDownloadProcess
+            if (BlockDownloadReceived(pfrom, block, hashBlock))
+                continue;
 
-        pfrom->fSuccessfullyConnected = true;
+            if (ProcessBlock(pfrom, &block, hashBlock))
+                mapAlreadyAskedFor.erase(inv);
 
-        LogPrint("net", "receive version message: version %d, blocks=%d, us=%s, them=%s, peer=%s\n", pfrom->nVersion, pfrom->nChainHeight, addrMe.ToString(), addrFrom.ToString(), pfrom->addr.ToString());
+            if (block.nDoS)
+                pfrom->Misbehaving(block.nDoS);
 
-        cPeerBlockCounts.input(pfrom->nChainHeight);
-    }
+            if (fSecMsgEnabled)
+            {
+                vScan.push_back(CBlock());
+                std::swap(vScan.back().vtx, block.vtx);
+            };
+        };
 
+        BlockDownloadProcess(pfrom, vScan);
+    } // cs_main
 
-    else if (pfrom->nVersion == 0)
+    // -- public keys are collected after cs_main is released
+    for (std::vector<CBlock>::iterator it = vScan.begin(); it != vScan.end(); ++it)
+        SecureMsgScanBlock(*it);
 
-    {
-        // Must have a version message before anything else
-        pfrom->Misbehaving(1);
-        return false;
-    }
+    return true;
+}
 
+static bool ProcessMultiBlockThinMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    std::vector<CMBlkThinElement> vMultiBlockThin;
+    vRecv >> vMultiBlockThin; // TODO: use a plain byte buffer?
+    uint32_t nBlocks = vMultiBlockThin.size();
 
-    else if (strCommand == "verack")
+    if (nBlocks > MAX_MULTI_BLOCK_THIN_ELEMENTS)
     {
-        pfrom->SetRecvVersion(min(pfrom->nVersion, PROTOCOL_VERSION));
+        LogPrintf("Warning: Peer sent too many blocks in mblkt %u.\n", vRecv.size());
+        pfrom->Misbehaving(10);
+        return false;
+    };
 
-        // -- connection is most probably accepted when receive verack
+    LogPrintf("Received mblkt %d\n", nBlocks);
 
-        if (nNodeMode != NT_FULL
-            && pwalletMain->pBloomFilter)
+    std::vector<CTransaction> vTxns;
+    {
+        LOCK(cs_main);
+        for (uint32_t i = 0; i < nBlocks; ++i)
         {
-            LOCK(pwalletMain->cs_wallet);
-            pfrom->PushMessage("filterload", *pwalletMain->pBloomFilter);
+            CMerkleBlockIncoming mbi = CMerkleBlockIncoming(vMultiBlockThin[i].merkleBlock);
+            vTxns = vMultiBlockThin[i].vtx;
+            ProcessMerkleBlock(pfrom, mbi, &vTxns);
         };
-    } else
-    if (strCommand == "addr")
-    {
-        vector<CAddress> vAddr;
-        vRecv >> vAddr;
+    } // cs_main
 
-        // Don't want addr from older versions unless seeding
-        if (pfrom->nVersion < CADDR_TIME_VERSION && addrman.size() > 1000)
-            return true;
-        if (vAddr.size() > 1000)
-        {
-            pfrom->Misbehaving(20);
-            return error("message addr size() = %u", vAddr.size());
-        }
+    return true;
+}
 
-        // Store the new addresses
-        vector<CAddress> vAddrOk;
-        int64_t nNow = GetAdjustedTime();
-        int64_t nSince = nNow - 10 * 60;
-        BOOST_FOREACH(CAddress& addr, vAddr)
-        {
-            boost::this_thread::interruption_point();
+static bool ProcessBlockMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    CBlock block;
+    vRecv >> block;
+    uint256 hashBlock = block.GetHash();
 
-            if (addr.nTime <= 100000000 || addr.nTime > nNow + 10 * 60)
-                addr.nTime = nNow - 5 * 24 * 60 * 60;
-            pfrom->AddAddressKnown(addr);
-            bool fReachable = IsReachable(addr);
-            if (addr.nTime > nSince && !pfrom->fGetAddr && vAddr.size() <= 10 && addr.IsRoutable())
-            {
-                // Relay to a limited number of other nodes
-                {
-                    LOCK(cs_vNodes);
-                    // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint64_t hashAddr = addr.GetHash();
-                    uint256 hashRand = hashSalt ^ (hashAddr<<32) ^ ((GetTime()+hashAddr)/(24*60*60));
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    multimap<uint256, CNode*> mapMix;
-                    BOOST_FOREACH(CNode* pnode, vNodes)
-                    {
-                        if (pnode->nVersion < CADDR_TIME_VERSION)
-                            continue;
-                        unsigned int nPointer;
-                        memcpy(&nPointer, &pnode, sizeof(nPointer));
-                        uint256 hashKey = hashRand ^ nPointer;
-                        hashKey = Hash(BEGIN(hashKey), END(hashKey));
-                        mapMix.insert(make_pair(hashKey, pnode));
-                    }
-                    int nRelayNodes = fReachable ? 2 : 1; // limited relaying of addresses outside our network(s)
-                    for (multimap<uint256, CNode*>::iterator mi = mapMix.begin(); mi != mapMix.end() && nRelayNodes-- > 0; ++mi)
-                        ((*mi).second)->PushAddress(addr);
-                }
-            }
-            // Do not store addresses outside our network
-            if (fReachable)
-                vAddrOk.push_back(addr);
-        }
-        addrman.Add(vAddrOk, pfrom->addr, 2 * 60 * 60);
-        if (vAddr.size() < 1000)
-            pfrom->fGetAddr = false;
-        if (pfrom->fOneShot)
-            pfrom->fDisconnect = true;
-    }
+    LogPrint("net", "received block %s\n", hashBlock.ToString());
 
-    else if (strCommand == "inv")
-    {
-        vector<CInv> vInv;
-        vRecv >> vInv;
-        if (vInv.size() > MAX_INV_SZ)
-        {
-            pfrom->Misbehaving(20);
-            return error("message inv size() = %u", vInv.size());
-        }
+    CInv inv(MSG_BLOCK, hashBlock);
+    pfrom->AddInventoryKnown(inv);
 
-        // find last block in inv vector
-        unsigned int nLastBlock = (unsigned int)(-1);
-        for (unsigned int nInv = 0; nInv < vInv.size(); nInv++) {
-            if (vInv[vInv.size() - 1 - nInv].type == MSG_BLOCK) {
-                nLastBlock = vInv.size() - 1 - nInv;
-                break;
-            }
-        }
+    int nCheckHeight;
+    int64_t nCheckTime;
+    GetCheckBlockContext(nCheckHeight, nCheckTime);
+    block.CheckBlock(true, true, true, nCheckHeight, nCheckTime);
 
+    std::vector<CBlock> vScan;
+    {
         LOCK(cs_main);
 
-        if (nNodeMode == NT_FULL)
+        if (!block.fChecked)
         {
-            CTxDB txdb("r");
-            for (uint32_t nInv = 0; nInv < vInv.size(); nInv++)
-            {
-                const CInv &inv = vInv[nInv];
-
-                boost::this_thread::interruption_point();
-
-                // -- don't mark as known if block from thin peer, need to send merkleblock later if accepted
-                if (pfrom->nTypeInd != NT_THIN || inv.type != MSG_BLOCK)
-                    pfrom->AddInventoryKnown(inv);
-
-                bool fAlreadyHave = AlreadyHave(txdb, inv);
-                LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
-
-                if (!fAlreadyHave) {
-                    if (!fImporting)
-                        pfrom->AskFor(inv);
-                } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
-                    pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(inv.hash));
-                } else if (nInv == nLastBlock) {
-                    // In case we are on a very long side-chain, it is possible that we already have
-                    // the last block in an inv bundle sent in response to getblocks. Try to detect
-                    // this situation and push another getblocks to continue.
-                    pfrom->PushGetBlocks(mapBlockIndex[inv.hash], uint256(0));
-                    if (fDebug)
-                        LogPrintf("force request: %s\n", inv.ToString());
-                }
+            if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+            return error("block: CheckBlock failed for %s", hashBlock.ToString());
+        };
 
-                // Track requests for our stuff
-                Inventory(inv.hash);
-            };
+        if (BlockDownloadReceived(pfrom, block, hashBlock))
+        {
+            BlockDownloadProcess(pfrom, vScan);
         } else
         {
-            CTxDB txdb("r");
-            for (uint32_t nInv = 0; nInv < vInv.size(); nInv++)
+            if (ProcessBlock(pfrom, &block, hashBlock))
+                mapAlreadyAskedFor.erase(inv);
+            if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+            if (fSecMsgEnabled)
             {
-                CInv &inv = vInv[nInv];
-
-                boost::this_thread::interruption_point();
-                pfrom->AddInventoryKnown(inv);
+                vScan.push_back(CBlock());
+                std::swap(vScan.back().vtx, block.vtx);
+            };
+        };
+    } // cs_main
 
-                bool fAlreadyHave = AlreadyHaveThin(txdb, inv);
-                if (fDebug)
-                    LogPrintf("  got inventory: %s  %s\n", inv.ToString().c_str(), fAlreadyHave ? "have" : "new");
+    for (std::vector<CBlock>::iterator it = vScan.begin(); it != vScan.end(); ++it)
+        SecureMsgScanBlock(*it);
 
-                if (nNodeMode != NT_FULL
-                    && inv.type == MSG_BLOCK)
-                    inv.type = MSG_FILTERED_BLOCK;
+    return true;
+}
 
-                if (!fAlreadyHave)
-                {
-                    pfrom->AskFor(inv);
-                } else
-                if (inv.type == MSG_BLOCK
-                    && mapOrphanBlockThins.count(inv.hash))
-                {
-                    pfrom->PushGetBlocks(pindexBestHeader, GetOrphanHeaderRoot(mapOrphanBlockThins[inv.hash]));
-                } else
-                if (nInv == nLastBlock)
-                {
-                    // In case we are on a very long side-chain, it is possible that we already have
-                    // the last block in an inv bundle sent in response to getblocks. Try to detect
-                    // this situation and push another getblocks to continue.
-                    if (mapBlockThinIndex.count(inv.hash))
-                    {
-                        pfrom->PushGetBlocks(mapBlockThinIndex[inv.hash], uint256(0));
-                    } else
-                    if (!fThinFullIndex)
-                    {
-                        pfrom->PushGetBlocks(inv.hash, uint256(0));
-                    };
+static bool ProcessCompactBlockMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    CBlockCompact cmpctBlock;
+    vRecv >> cmpctBlock;
+    uint256 hashBlock = cmpctBlock.header.GetHash();
 
-                    if (fDebug)
-                        LogPrintf("force request: %s\n", inv.ToString().c_str());
-                };
+    LogPrint("net", "received cmpctblock %s, %u short ids\n", hashBlock.ToString(), cmpctBlock.vShortTxIds.size());
 
-                // Track requests for our stuff
-                Inventory(inv.hash);
-            };
-        };
-    }
+    // -- filling a block walks the mempool under cs_main, only do it when asked
+    if (pfrom->nVersion < MIN_CMPCT_VERSION
+        || !pfrom->setCmpctBlocksAsked.count(hashBlock))
+    {
+        LogPrint("net", "unrequested cmpctblock %s from peer %s\n", hashBlock.ToString(), pfrom->addrName);
+        return true;
+    };
 
+    pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hashBlock));
 
-    else if (strCommand == "getdata")
+    std::vector<CBlock> vScan;
     {
-        vector<CInv> vInv;
-        vRecv >> vInv;
-        if (vInv.size() > MAX_INV_SZ)
+        LOCK(cs_main);
+
+        if (mapBlockIndex.count(hashBlock)
+            || mapOrphanBlocks.count(hashBlock)
+            || mapPartialBlocks.count(hashBlock))
+            return true;
+
+        CBlock block;
+        std::vector<uint32_t> vMissing;
+        int nFill = cmpctBlock.FillBlock(block, vMissing);
+        if (nFill == CMPCT_FILL_COLLISION)
+        {
+            // can happen to an honest peer
+            LogPrint("net", "cmpctblock %s has colliding short ids, asking for the full block.\n", hashBlock.ToString());
+            RequestFullBlock(pfrom, hashBlock);
+            return true;
+        };
+        if (nFill != CMPCT_FILL_OK)
         {
             pfrom->Misbehaving(20);
-            return error("message getdata size() = %u", vInv.size());
-        }
+            return error("cmpctblock: malformed compact block %s", hashBlock.ToString());
+        };
 
-        if (fDebug || (vInv.size() != 1))
-            LogPrint("net", "received getdata (%u invsz)\n", vInv.size());
+        if (vMissing.empty())
+        {
+            ProcessCompactBlock(pfrom, block, vScan);
+        } else
+        if (mapPartialBlocks.size() >= MAX_PARTIAL_BLOCKS)
+        {
+            RequestFullBlock(pfrom, hashBlock);
+        } else
+        {
+            LogPrint("net", "cmpctblock %s missing %u of %u txns\n", hashBlock.ToString(), vMissing.size(), block.vtx.size());
 
-        if ((fDebug && vInv.size() > 0) || (vInv.size() == 1))
-            LogPrint("net", "received getdata for: %s\n", vInv[0].ToString());
+            CBlockTxnRequest req;
+            req.hashBlock = hashBlock;
+            req.vIndexes = vMissing;
+            pfrom->PushMessage("getblocktxn", req);
 
-        pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
-        ProcessGetData(pfrom);
-    }
+            CPartialBlock& partial = mapPartialBlocks[hashBlock];
+            partial.nodeId = pfrom->GetId();
+            partial.nTime = GetTime();
+            partial.block = block;
+            partial.vMissing.swap(vMissing);
+        };
+    } // cs_main
 
+    for (std::vector<CBlock>::iterator it = vScan.begin(); it != vScan.end(); ++it)
+        SecureMsgScanBlock(*it);
 
-    else if (strCommand == "getblocks")
-    {
-        if (nNodeMode != NT_FULL)
-        {
-            LogPrintf("[rem] strCommand getblocks\n");
-            return 0;
-        };
+    return true;
+}
 
-        CBlockLocator locator;
-        uint256 hashStop;
-        vRecv >> locator >> hashStop;
+static bool ProcessGetBlockTxnMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    CBlockTxnRequest req;
+    vRecv >> req;
 
+    CBlockTxn resp;
+    resp.hashBlock = req.hashBlock;
+    {
         LOCK(cs_main);
+        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.hashBlock);
+        if (mi == mapBlockIndex.end())
+        {
+            LogPrint("net", "getblocktxn for unknown block %s\n", req.hashBlock.ToString());
+            return true;
+        };
 
-        // Find the last block the caller has in the main chain
-        CBlockIndex* pindex = locator.GetBlockIndex();
+        CBlock block;
+        if (!block.ReadFromDisk(mi->second))
+            return error("getblocktxn: ReadFromDisk failed for %s", req.hashBlock.ToString());
 
-        // Send the rest of the chain
-        if (pindex)
-            pindex = pindex->pnext;
-        int nLimit = 500;
-        LogPrint("net", "getblocks %d to %s limit %d\n", (pindex ? pindex->nHeight : -1), hashStop.ToString(), nLimit);
-        for (; pindex; pindex = pindex->pnext)
+        BOOST_FOREACH(uint32_t nIndex, req.vIndexes)
         {
-            if (pindex->GetBlockHash() == hashStop)
-            {
-                LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-                break;
-            }
-            pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
-            if (--nLimit <= 0)
+            if (nIndex >= block.vtx.size())
             {
-                // When this block is requested, we'll send an inv that'll make them
-                // getblocks the next batch of inventory.
-                LogPrint("net", "  getblocks stopping at limit %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-                pfrom->hashContinue = pindex->GetBlockHash();
-                break;
-            }
-        }
-    }
-
-    else if (strCommand == "getheaders")
-    {
-        if (nNodeMode != NT_FULL)
-        {
-            LogPrintf("[rem] strCommand getheaders\n");
-            return false;
+                pfrom->Misbehaving(100);
+                return error("getblocktxn: index %u out of range for %s", nIndex, req.hashBlock.ToString());
+            };
+            resp.vtx.push_back(block.vtx[nIndex]);
         };
+    } // cs_main
 
-        // -- full nodes don't request headers
-        if (pfrom->nTypeInd == NT_FULL
-            && !SetNodeType(pfrom, NT_THIN))
-            return false;
+    pfrom->PushMessage("blocktxn", resp);
 
+    return true;
+}
 
-        CBlockLocator locator;
-        uint256 hashStop;
-        vRecv >> locator >> hashStop;
+static bool ProcessBlockTxnMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    CBlockTxn resp;
+    vRecv >> resp;
 
+    std::vector<CBlock> vScan;
+    {
         LOCK(cs_main);
-
-        CBlockIndex* pindex = NULL;
-        if (locator.IsNull())
+        std::map<uint256, CPartialBlock>::iterator mi = mapPartialBlocks.find(resp.hashBlock);
+        if (mi == mapPartialBlocks.end()
+            || mi->second.nodeId != pfrom->GetId())
         {
-            // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
-            if (mi == mapBlockIndex.end())
-                return true;
-            pindex = (*mi).second;
-        }
-        else
-        {
-            // Find the last block the caller has in the main chain
-            pindex = locator.GetBlockIndex();
-            if (pindex)
-                pindex = pindex->pnext;
-        }
+            LogPrint("net", "unrequested blocktxn for %s\n", resp.hashBlock.ToString());
+            return true;
+        };
+
+        CBlock block;
+        std::swap(block, mi->second.block);
+        std::vector<uint32_t> vMissing;
+        vMissing.swap(mi->second.vMissing);
+        mapPartialBlocks.erase(mi);
 
-        vector<CBlock> vHeaders;
-        int nLimit = MAX_GETHEADERS_SZ;
-        LogPrint("net", "getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString());
-        for (; pindex; pindex = pindex->pnext)
+        if (resp.vtx.size() != vMissing.size())
         {
-            vHeaders.push_back(pindex->GetBlockHeader());
-            if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
-                break;
-        }
-        pfrom->PushMessage("headers", vHeaders);
-    }
+            pfrom->Misbehaving(20);
+            RequestFullBlock(pfrom, resp.hashBlock);
+            return error("blocktxn: expected %u txns, got %u", vMissing.size(), resp.vtx.size());
+        };
 
+        for (uint32_t i = 0; i < vMissing.size(); ++i)
+            block.vtx[vMissing[i]] = resp.vtx[i];
 
-    else if (strCommand == "tx")
-    {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
+        ProcessCompactBlock(pfrom, block, vScan);
+    } // cs_main
 
-        CTransaction tx;
-        vRecv >> tx;
+    for (std::vector<CBlock>::iterator it = vScan.begin(); it != vScan.end(); ++it)
+        SecureMsgScanBlock(*it);
 
-        LOCK(cs_main);
+    return true;
+}
 
-        CTxDB txdb("r");
+static bool ProcessMerkleBlockMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (nNodeState != NS_READY
+        && nNodeState != NS_GET_FILTERED_BLOCKS)
+    {
+        if (fDebug)
+            LogPrintf("Ignoring merkleblock received in mode %s.\n", GetNodeStateName(nNodeState));
+        return false;
+    };
 
-        if (nNodeMode == NT_FULL)
-        {
-            CInv inv(MSG_TX, tx.GetHash());
-            pfrom->AddInventoryKnown(inv);
+    CMerkleBlockIncoming merkleBlock;
+    vRecv >> merkleBlock;
 
-            bool fMissingInputs = false;
+    ProcessMerkleBlock(pfrom, merkleBlock, NULL);
 
-            mapAlreadyAskedFor.erase(inv);
+    return true;
+}
 
-            if (AcceptToMemoryPool(mempool, tx, txdb, &fMissingInputs))
-            {
-                SyncWithWallets(tx, NULL, true);
-                RelayTransaction(tx, inv.hash);
-                vWorkQueue.push_back(inv.hash);
-                vEraseQueue.push_back(inv.hash);
+static bool ProcessHeadersMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (nNodeMode == NT_FULL)
+    {
+        LogPrintf("Warning: Peer sent headers to full node.\n");
+        pfrom->Misbehaving(10);
+        return false;
+    };
 
-                // Recursively process any orphan transactions that depended on this one
-                for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-                {
-                    map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                    if (itByPrev == mapOrphanTransactionsByPrev.end())
-                        continue;
-                    for (set<uint256>::iterator mi = itByPrev->second.begin();
-                         mi != itByPrev->second.end();
-                         ++mi)
-                    {
-                        const uint256& orphanTxHash = *mi;
-                        CTransaction& orphanTx = mapOrphanTransactions[orphanTxHash];
-                        bool fMissingInputs2 = false;
+    vector<CBlockThin> vHeaders;
+    vRecv >> vHeaders;
 
-                        if (AcceptToMemoryPool(mempool, orphanTx, txdb, &fMissingInputs2))
-                        {
-                            LogPrint("mempool", "   accepted orphan tx %s\n", orphanTxHash.ToString());
-                            SyncWithWallets(tx, NULL, true);
-                            RelayTransaction(orphanTx, orphanTxHash);
-                            vWorkQueue.push_back(orphanTxHash);
-                            vEraseQueue.push_back(orphanTxHash);
-                        }
-                        else if (!fMissingInputs2)
-                        {
-                            // invalid or too-little-fee orphan
-                            vEraseQueue.push_back(orphanTxHash);
-                            LogPrint("mempool", "   removed orphan tx %s\n", orphanTxHash.ToString());
-                        }
-                    }
-                }
+    if (fDebugChain)
+        LogPrintf("Received %u headers\n", vHeaders.size());
 
-                BOOST_FOREACH(uint256 hash, vEraseQueue)
-                    EraseOrphanTx(hash);
-            }
-            else if (fMissingInputs)
-            {
-                AddOrphanTx(tx);
+    if (vHeaders.size() == 0)
+    {
+        // -- no headers found, this node must be up to date.
+        if (nNodeState == NS_GET_HEADERS)
+            ChangeNodeState(NS_GET_FILTERED_BLOCKS);
+        return true;
+    };
 
-                // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-                unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
-                if (nEvicted > 0)
-                    LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-            }
+    if (vHeaders.size() > MAX_GETHEADERS_SZ)
+    {
+        LogPrintf("Warning: Peer sent too many headers %u.\n", vHeaders.size());
+        pfrom->Misbehaving(10);
+        return false;
+    };
+
+    for (std::vector<CBlockThin>::iterator it = vHeaders.begin(); it < vHeaders.end(); ++it)
+    {
+        if (!fThinFullIndex && pindexRear
+            && it->nTime < pindexRear->nTime)
+        {
+            if (fDebug)
+                LogPrintf("Warning: header %s is before chain index window.\n", it->GetHash().ToString().c_str());
+            pfrom->Misbehaving(10);
         } else
         {
-            uint256 txHash = tx.GetHash();
-
-            CInv inv(MSG_TX, txHash);
-            pfrom->AddInventoryKnown(inv);
-            mapAlreadyAskedFor.erase(inv);
-
-            bool fProcessed = false;
-            std::vector<CMerkleBlockIncoming>::iterator it;
-            for (it = vIncomingMerkleBlocks.begin(); !fProcessed && it < vIncomingMerkleBlocks.end(); ++it)
-            {
-                for (uint32_t i = 0; i < it->vMatch.size(); ++i)
-                {
-                    if (it->vMatch[i] != txHash)
-                        continue;
-
-                    //LogPrintf("Found match.\n");
-                    uint256 blockhash = it->header.GetHash();
+            LOCK(cs_main);
+            ProcessBlockThin(pfrom, &(*it));
+        };
+    };
 
-                    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-                        pwallet->AddToWalletIfInvolvingMe(tx, txHash, (void*)&blockhash, true);
+    if (nBestHeight < pfrom->nChainHeight)
+    {
+        pfrom->PushGetHeaders(pindexBestHeader, uint256(0));
+    } else
+    {
+        if (nNodeState == NS_GET_HEADERS)
+            ChangeNodeState(NS_GET_FILTERED_BLOCKS);
+    };
 
-                    it->nProcessed++;
-                    fProcessed = true;
-                    if (it->nProcessed == it->vMatch.size())
-                        vIncomingMerkleBlocks.erase(it);
-                    break;
+    return true;
+}
 
-                    //LogPrintf("vMatch %d %s\n", i, it->vMatch[i].ToString().c_str());
-                };
-            };
+static bool ProcessGetAddrMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    // Don't return addresses older than nCutOff timestamp
+    int64_t nCutOff = GetTime() - (nNodeLifespan * 24 * 60 * 60);
+    pfrom->vAddrToSend.clear();
+    vector<CAddress> vAddr = addrman.GetAddr();
+    BOOST_FOREACH(const CAddress &addr, vAddr)
+        if (addr.nTime > nCutOff)
+            pfrom->PushAddress(addr);
 
-            if (!fProcessed)
-            {
-                if (fDebugChain)
-                    LogPrintf("txn %s not found in merkleblock, adding to mempool.\n", txHash.ToString().c_str());
+    return true;
+}
 
-                // TODO: this is wasteful, test timedout first?
+static bool ProcessMempoolMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    LOCK2(cs_main, pfrom->cs_filter);
 
-                bool fMissingInputs = false;
-                if (AcceptToMemoryPool(mempool, tx, txdb, &fMissingInputs))
-                {
-                    //SyncWithWallets(tx, NULL, true);
+    std::vector<uint256> vtxid;
+    mempool.queryHashes(vtxid);
+    vector<CInv> vInv;
 
-                    bool added = false;
-                    BOOST_FOREACH(CWallet* pwallet, setpwalletRegistered)
-                        added = added | pwallet->AddToWalletIfInvolvingMe(tx, txHash, NULL, true);
+    BOOST_FOREACH(uint256& hash, vtxid)
+    {
+        CInv inv(MSG_TX, hash);
+        CTransaction tx;
+        bool fInMemPool = mempool.lookup(hash, tx);
+        if (!fInMemPool)
+            continue; // another thread removed since queryHashes, maybe...
 
-                    if (added)
-                        RelayTransaction(tx, inv.hash);
-                    else
-                        // -- not interested in txn if not for this wallet
-                        mempool.remove(tx);
-                }
-            }
-        }
+        // -- node requirements are packed into the top 32 bits of nServices
+        if (pfrom->pfilter
+            && !pfrom->pfilter->IsRelevantAndUpdate(tx))
+            continue;
 
-        if (tx.nDoS)
-            pfrom->Misbehaving(tx.nDoS);
+        vInv.push_back(inv);
 
-    } else
-    if (strCommand == "mblk" && !fImporting && !fReindexing)  // Ignore blocks received while importing
-    {
-        // multiblock
-        if (nNodeMode != NT_FULL)
+        if (vInv.size() == MAX_INV_SZ)
         {
-            LogPrintf("[rem] strCommand mblk, !NT_FULL\n");
-            return 0;
+            pfrom->PushMessage("inv", vInv);
+            vInv.clear();
         };
+    };
 
-        std::vector<CBlock> vBlocks;
-        vRecv >> vBlocks; // TODO: use a plain byte buffer?
-        uint32_t nBlocks = vBlocks.size();
+    if (vInv.size() > 0)
+        pfrom->PushMessage("inv", vInv);
 
-        if (nBlocks > MAX_MULTI_BLOCK_ELEMENTS)
-        {
-            LogPrintf("Warning: Peer sent too many blocks in mblk %u.\n", vRecv.size());
-            pfrom->Misbehaving(10);
-            return false;
-        };
+    return true;
+}
 
-        LogPrintf("Received mblk %d\n", nBlocks);
-        nTimeLastMblkRecv = GetTime();
+static bool ProcessPingMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    uint64_t nonce = 0;
+    vRecv >> nonce;
+    // Echo the message back with the nonce. This allows for two useful features:
+    //
+    // 1) A remote node can quickly check if the connection is operational
+    // 2) Remote nodes can measure the latency of the network thread. If this node
+    //    is overloaded it won't respond to pings quickly and the remote node can
+    //    avoid sending us more work, like chain download requests.
+    //
+    // The nonce stops the remote getting confused between different pings: without
+    // it, if the remote node sends a ping once per second and this node takes 5
+    // seconds to respond to each, the 5th ping the remote sends would appear to
+    // return very quickly.
+    pfrom->PushMessage("pong", nonce);
 
-        {
-            LOCK(cs_main);
-            for (uint32_t i = 0; i < nBlocks; ++i)
-            {
-                CBlock &block = vBlocks[i];
+    // -- keep the network height updated, needed for thin mode
+    int nPeerHeight;
+    vRecv >> nPeerHeight;
 
-                uint256 hashBlock = block.GetHash();
-                //LogPrintf("received block %s\n", hashBlock.ToString().substr(0,20).c_str());
-                // block.print();
+    LOCK(cs_main);
+    cPeerBlockCounts.input(nPeerHeight);
+    pfrom->nChainHeight = nPeerHeight;
 
-                CInv inv(MSG_BLOCK, hashBlock);
+    LogPrint("net", "peer %s chain height %d\n", pfrom->addr.ToString().c_str(), nPeerHeight);
 
-                // -- if peer is thin, it will want the (merkle) block sent if accepted
-                if (pfrom->nTypeInd == NT_FULL)
-                    pfrom->AddInventoryKnown(inv);
+    return true;
+}
 
+static bool ProcessPongMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    int64_t pingUsecEnd = nTimeReceived;
+    uint64_t nonce = 0;
+    size_t nAvail = vRecv.in_avail();
+    bool bPingFinished = false;
+    std::string sProblem;
 
-                if (ProcessBlock(pfrom, &block, hashBlock))
-                    mapAlreadyAskedFor.erase(inv);
+    if (nAvail >= sizeof(nonce)) {
+        vRecv >> nonce;
 
-                if (block.nDoS)
-                    pfrom->Misbehaving(block.nDoS);
+        // Only process pong message if there is an outstanding ping (old ping without nonce should never pong)
+        if (pfrom->nPingNonceSent != 0) {
+            if (nonce == pfrom->nPingNonceSent) {
+                // Matching pong received, this ping is no longer outstanding
+                bPingFinished = true;
+                int64_t pingUsecTime = pingUsecEnd - pfrom->nPingUsecStart;
+                if (pingUsecTime > 0) {
+                    // Successful ping time measurement, replace previous
+                    pfrom->nPingUsecTime = pingUsecTime;
+                } else {
+                    // This should never happen
+                    sProblem = "Timing mishap";
+                }
+            } else {
+                // Nonce mismatches are normal when pings are overlapping
+                sProblem = "Nonce mismatch";
+                if (nonce == 0) {
+                    // This is most likely a bug in another implementation somewhere, cancel this ping
+                    bPingFinished = true;
+                    sProblem = "Nonce zero";
+                }
+            }
+        } else {
+            sProblem = "Unsolicited pong without ping";
+        }
+    } else {
+        // This is most likely a bug in another implementation somewhere, cancel this ping
+        bPingFinished = true;
+        sProblem = "Short payload";
+    }
 
-                if (fSecMsgEnabled)
-                    SecureMsgScanBlock(block);
-            };
-        } // cs_main
-    } else
-    if (strCommand == "mblkt" && !fImporting && !fReindexing)  // Ignore blocks received while importing
-    {
-        // multiblock thin
-        if (nNodeMode == NT_FULL)
-        {
-            LogPrintf("[rem] strCommand mblkt, NT_FULL\n");
-            return 0;
-        };
+    if (!(sProblem.empty())) {
+        LogPrint("net", "pong %s %s: %s, %x expected, %x received, %zu bytes\n"
+            , pfrom->addr.ToString()
+            , pfrom->strSubVer
+            , sProblem
+            , pfrom->nPingNonceSent
+            , nonce
+            , nAvail);
+    }
+    if (bPingFinished) {
+        pfrom->nPingNonceSent = 0;
+    }
 
+    return true;
+}
 
-        std::vector<CMBlkThinElement> vMultiBlockThin;
-        vRecv >> vMultiBlockThin; // TODO: use a plain byte buffer?
-        uint32_t nBlocks = vMultiBlockThin.size();
+static bool ProcessAlertMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    CAlert alert;
+    vRecv >> alert;
 
-        if (nBlocks > MAX_MULTI_BLOCK_THIN_ELEMENTS)
+    uint256 alertHash = alert.GetHash();
+    if (pfrom->setKnown.count(alertHash) == 0)
+    {
+        if (alert.ProcessAlert())
         {
-            LogPrintf("Warning: Peer sent too many blocks in mblkt %u.\n", vRecv.size());
+            // Relay
+            pfrom->setKnown.insert(alertHash);
+            {
+                LOCK(cs_vNodes);
+                BOOST_FOREACH(CNode* pnode, vNodes)
+                    alert.RelayTo(pnode);
+            }
+        }
+        else {
+            // Small DoS penalty so peers that send us lots of
+            // duplicate/expired/invalid-signature/whatever alerts
+            // eventually get banned.
+            // This isn't a Misbehaving(100) (immediate ban) because the
+            // peer might be an older or different implementation with
+            // a different signature key, etc.
             pfrom->Misbehaving(10);
-            return false;
         };
+    };
 
-        LogPrintf("Received mblkt %d\n", nBlocks);
+    return true;
+}
 
-        std::vector<CTransaction> vTxns;
-        {
-            LOCK(cs_main);
-            for (uint32_t i = 0; i < nBlocks; ++i)
-            {
-                CMerkleBlockIncoming mbi = CMerkleBlockIncoming(vMultiBlockThin[i].merkleBlock);
-                vTxns = vMultiBlockThin[i].vtx;
-                ProcessMerkleBlock(pfrom, mbi, &vTxns);
-            };
-        } // cs_main
-    }
-    else if (strCommand == "block" && !fImporting && !fReindexing) // Ignore blocks received while importing
+static bool ProcessFilterLoadMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    // -- full nodes won't use filters, if a node does it is NT_THIN
+    if (pfrom->nTypeInd == NT_FULL
+        && !SetNodeType(pfrom, NT_THIN))
+        return false;
+
+    CBloomFilter filter;
+    vRecv >> filter;
+
+    if (!filter.IsWithinSizeConstraints())
     {
-        if (nNodeMode != NT_FULL)
-        {
-            LogPrintf("[rem] strCommand block, !NT_FULL\n");
-            return 0;
-        };
+        // There is no excuse for sending a too-large filter
+        pfrom->Misbehaving(100);
+    } else
+    if ((filter.nFlags & BLOOM_ACCEPT_STEALTH)
+        && !(nLocalServices & THIN_STEALTH))
+    {
+        // -- peer has requested that node forwards all stealth txns, node does not support this
 
-        CBlock block;
-        vRecv >> block;
-        uint256 hashBlock = block.GetHash();
+        if (fDebug)
+            LogPrintf("Warning: Peer %s requested merklebloks include all stealth txns, function disabled.\n", pfrom->addr.ToString().c_str());
+        filter.nFlags &= ~(BLOOM_ACCEPT_STEALTH);
+    };
 
-        LogPrint("net", "received block %s\n", hashBlock.ToString());
+    {
+        LOCK(pfrom->cs_filter);
+        delete pfrom->pfilter;
+        pfrom->pfilter = new CBloomFilter(filter);
+        pfrom->pfilter->UpdateEmptyFull();
+    };
 
-        CInv inv(MSG_BLOCK, hashBlock);
-        pfrom->AddInventoryKnown(inv);
+    if (fDebug)
+        LogPrintf("Loaded bloom filter of size %u for peer %s.\n", pfrom->pfilter->vData.size(), pfrom->addr.ToString().c_str());
 
-        LOCK(cs_main);
+    pfrom->fRelayTxes = true;
 
-        if (ProcessBlock(pfrom, &block, hashBlock))
-            mapAlreadyAskedFor.erase(inv);
-        if (block.nDoS) pfrom->Misbehaving(block.nDoS);
-        if (fSecMsgEnabled)
-            SecureMsgScanBlock(block);
-    } else
-    if (strCommand == "merkleblock")
-    {
-        if (nNodeState != NS_READY
-            && nNodeState != NS_GET_FILTERED_BLOCKS)
-        {
-            if (fDebug)
-                LogPrintf("Ignoring merkleblock received in mode %s.\n", GetNodeStateName(nNodeState));
-            return false;
-        };
+    return true;
+}
 
-        CMerkleBlockIncoming merkleBlock;
-        vRecv >> merkleBlock;
+static bool ProcessFilterAddMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (pfrom->nTypeInd == NT_FULL
+        && !SetNodeType(pfrom, NT_THIN))
+        return false;
 
-        ProcessMerkleBlock(pfrom, merkleBlock, NULL);
+    vector<unsigned char> vData;
+    vRecv >> vData;
 
+    // Nodes must NEVER send a data item > 520 bytes (the max size for a script data object,
+    // and thus, the maximum size any matched object can have) in a filteradd message
+    if (vData.size() > MAX_SCRIPT_ELEMENT_SIZE)
+    {
+        pfrom->Misbehaving(100);
     } else
-    if (strCommand == "headers")
     {
-        if (nNodeMode == NT_FULL)
+        LOCK(pfrom->cs_filter);
+        if (pfrom->pfilter)
         {
-            LogPrintf("Warning: Peer sent headers to full node.\n");
-            pfrom->Misbehaving(10);
-            return false;
+            if (!pfrom->pfilter->contains(vData))
+            {
+                pfrom->pfilter->insert(vData);
+                pfrom->pfilter->UpdateEmptyFull();
+                if (fDebug)
+                    LogPrintf("Added data to bloom filter of peer %s, is full %d.\n", pfrom->addr.ToString().c_str(), pfrom->pfilter->IsFull());
+            };
+        } else
+        {
+            pfrom->Misbehaving(100); // peer must send filterload first
         };
+    };
 
-        vector<CBlockThin> vHeaders;
-        vRecv >> vHeaders;
+    return true;
+}
 
-        if (fDebugChain)
-            LogPrintf("Received %u headers\n", vHeaders.size());
+static bool ProcessFilterClearMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    LOCK(pfrom->cs_filter);
+    delete pfrom->pfilter;
+    pfrom->pfilter = NULL;
+    //pfrom->pfilter = new CBloomFilter();
+    pfrom->fRelayTxes = true;
 
-        if (vHeaders.size() == 0)
-        {
-            // -- no headers found, this node must be up to date.
-            if (nNodeState == NS_GET_HEADERS)
-                ChangeNodeState(NS_GET_FILTERED_BLOCKS);
-            return true;
-        };
+    return true;
+}
 
-        if (vHeaders.size() > MAX_GETHEADERS_SZ)
-        {
-            LogPrintf("Warning: Peer sent too many headers %u.\n", vHeaders.size());
-            pfrom->Misbehaving(10);
-            return false;
-        };
+static bool ProcessRejectMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    string strMsg;
+    string strReason;
+    unsigned char ccode;
+    vRecv >> strMsg >> ccode >> strReason;
 
-        for (std::vector<CBlockThin>::iterator it = vHeaders.begin(); it < vHeaders.end(); ++it)
+    if (strMsg == "conn")
+    {
+        char *reason;
+        switch (ccode)
         {
-            if (!fThinFullIndex && pindexRear
-                && it->nTime < pindexRear->nTime)
-            {
-                if (fDebug)
-                    LogPrintf("Warning: header %s is before chain index window.\n", it->GetHash().ToString().c_str());
-                pfrom->Misbehaving(10);
-            } else
-            {
-                LOCK(cs_main);
-                ProcessBlockThin(pfrom, &(*it));
-            };
+            case REJ_NEED_THIN_SUPPORT:     reason = (char*)"Requires thin client support";             break;
+            case REJ_MAX_THIN_PEERS:        reason = (char*)"Peer is connected to max thin peers";      break;
+            default:                        reason = (char*)"unknown code";                             break;
         };
 
-        if (nBestHeight < pfrom->nChainHeight)
-        {
-            pfrom->PushGetHeaders(pindexBestHeader, uint256(0));
-        } else
-        {
-            if (nNodeState == NS_GET_HEADERS)
-                ChangeNodeState(NS_GET_FILTERED_BLOCKS);
-        };
-    }
-    else if ((strCommand == "getaddr") && (pfrom->fInbound))
-    {
-        // Don't return addresses older than nCutOff timestamp
-        int64_t nCutOff = GetTime() - (nNodeLifespan * 24 * 60 * 60);
-        pfrom->vAddrToSend.clear();
-        vector<CAddress> vAddr = addrman.GetAddr();
-        BOOST_FOREACH(const CAddress &addr, vAddr)
-            if (addr.nTime > nCutOff)
-                pfrom->PushAddress(addr);
-    }
-    else if (strCommand == "mempool")
+        LogPrintf("Peer %s rejected connection, code %d, reason: %s.\n", pfrom->addr.ToString().c_str(), ccode, reason);
+        pfrom->SoftBan(); // don't allow connecting again for a while
+    } else
+    if (fDebug)
     {
-        LOCK2(cs_main, pfrom->cs_filter);
-
-        std::vector<uint256> vtxid;
-        mempool.queryHashes(vtxid);
-        vector<CInv> vInv;
+        ostringstream ss;
+        ss << strMsg << " code " << itostr(ccode) << ": " << strReason;
 
-        BOOST_FOREACH(uint256& hash, vtxid)
+        if (strMsg == "block" || strMsg == "tx")
         {
-            CInv inv(MSG_TX, hash);
-            CTransaction tx;
-            bool fInMemPool = mempool.lookup(hash, tx);
-            if (!fInMemPool)
-                continue; // another thread removed since queryHashes, maybe...
+            uint256 hash;
+            vRecv >> hash;
+            ss << ": hash " << hash.ToString();
+        };
 
-            // -- node requirements are packed into the top 32 bits of nServices
-            if (pfrom->pfilter
-                && !pfrom->pfilter->IsRelevantAndUpdate(tx))
-                continue;
+        // Truncate to reasonable length and sanitize before printing:
+        string s = ss.str();
+        if (s.size() > 111)
+            s.erase(111, string::npos);
+        LogPrintf("Reject %s\n", SanitizeString(s).c_str());
+    };
 
-            vInv.push_back(inv);
+    return true;
+}
 
-            if (vInv.size() == MAX_INV_SZ)
-            {
-                pfrom->PushMessage("inv", vInv);
-                vInv.clear();
-            };
-        };
 
-        if (vInv.size() > 0)
-            pfrom->PushMessage("inv", vInv);
-    }
-    else if (strCommand == "ping")
-    {
-        uint64_t nonce = 0;
-        vRecv >> nonce;
-        // Echo the message back with the nonce. This allows for two useful features:
-        //
-        // 1) A remote node can quickly check if the connection is operational
-        // 2) Remote nodes can measure the latency of the network thread. If this node
-        //    is overloaded it won't respond to pings quickly and the remote node can
-        //    avoid sending us more work, like chain download requests.
-        //
-        // The nonce stops the remote getting confused between different pings: without
-        // it, if the remote node sends a ping once per second and this node takes 5
-        // seconds to respond to each, the 5th ping the remote sends would appear to
-        // return very quickly.
-        pfrom->PushMessage("pong", nonce);
-
-        // -- keep the network height updated, needed for thin mode
-        int nPeerHeight;
-        vRecv >> nPeerHeight;
+static bool ProcessSecureMsgMessage(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    if (fSecMsgEnabled)
+        SecureMsgReceiveData(pfrom, strCommand, vRecv);
 
-        LOCK(cs_main);
-        cPeerBlockCounts.input(nPeerHeight);
-        pfrom->nChainHeight = nPeerHeight;
+    return true;
+}
 
-        LogPrint("net", "peer %s chain height %d\n", pfrom->addr.ToString().c_str(), nPeerHeight);
-    }
-    else if (strCommand == "pong")
-    {
-        int64_t pingUsecEnd = nTimeReceived;
-        uint64_t nonce = 0;
-        size_t nAvail = vRecv.in_avail();
-        bool bPingFinished = false;
-        std::string sProblem;
 
-        if (nAvail >= sizeof(nonce)) {
-            vRecv >> nonce;
+enum
+{
+    MSG_HANDLER_FULL            = (1 << 0),     // accepted when running as a full node
+    MSG_HANDLER_THIN            = (1 << 1),     // accepted when running in thin mode
+    MSG_HANDLER_PRE_VERSION     = (1 << 3),     // allowed before the peer's version message
+    MSG_HANDLER_NO_IMPORT       = (1 << 4),     // ignored while importing or reindexing
+    MSG_HANDLER_INBOUND         = (1 << 5),     // only answered for inbound peers
+    MSG_HANDLER_SEEN            = (1 << 6),     // updates the last seen time of the peer's address
+
+    MSG_HANDLER_ANY             = MSG_HANDLER_FULL | MSG_HANDLER_THIN,
+};
 
-            // Only process pong message if there is an outstanding ping (old ping without nonce should never pong)
-            if (pfrom->nPingNonceSent != 0) {
-                if (nonce == pfrom->nPingNonceSent) {
-                    // Matching pong received, this ping is no longer outstanding
-                    bPingFinished = true;
-                    int64_t pingUsecTime = pingUsecEnd - pfrom->nPingUsecStart;
-                    if (pingUsecTime > 0) {
-                        // Successful ping time measurement, replace previous
-                        pfrom->nPingUsecTime = pingUsecTime;
-                    } else {
-                        // This should never happen
-                        sProblem = "Timing mishap";
-                    }
-                } else {
-                    // Nonce mismatches are normal when pings are overlapping
-                    sProblem = "Nonce mismatch";
-                    if (nonce == 0) {
-                        // This is most likely a bug in another implementation somewhere, cancel this ping
-                        bPingFinished = true;
-                        sProblem = "Nonce zero";
-                    }
-                }
-            } else {
-                sProblem = "Unsolicited pong without ping";
-            }
-        } else {
-            // This is most likely a bug in another implementation somewhere, cancel this ping
-            bPingFinished = true;
-            sProblem = "Short payload";
-        }
+typedef bool (*MessageHandlerFn)(CNode* pfrom, const std::string& strCommand, CDataStream& vRecv, int64_t nTimeReceived);
 
-        if (!(sProblem.empty())) {
-            LogPrint("net", "pong %s %s: %s, %x expected, %x received, %zu bytes\n"
-                , pfrom->addr.ToString()
-                , pfrom->strSubVer
-                , sProblem
-                , pfrom->nPingNonceSent
-                , nonce
-                , nAvail);
-        }
-        if (bPingFinished) {
-            pfrom->nPingNonceSent = 0;
-        }
-    }
+class CMessageHandler
+{
+public:
+    const char* pszCommand;
+    MessageHandlerFn fn;
+    uint32_t nFlags;
+    int nMaxPerMinute;  // 0 for no limit, further messages in the minute are dropped
+};
 
+static const CMessageHandler messageHandlers[] =
+{
+    // command          handler                             flags                                                           max/min
+    {"version",         ProcessVersionMessage,              MSG_HANDLER_ANY | MSG_HANDLER_PRE_VERSION | MSG_HANDLER_SEEN,   0},
+    {"verack",          ProcessVerackMessage,               MSG_HANDLER_ANY,                                                0},
+    {"addr",            ProcessAddrMessage,                 MSG_HANDLER_ANY | MSG_HANDLER_SEEN,                             0},
+    {"inv",             ProcessInvMessage,                  MSG_HANDLER_ANY | MSG_HANDLER_SEEN,                             0},
+    {"getdata",         ProcessGetDataMessage,              MSG_HANDLER_ANY | MSG_HANDLER_SEEN,                             0},
+    {"getblocks",       ProcessGetBlocksMessage,            MSG_HANDLER_FULL,                                               0},
+    {"getheaders",      ProcessGetHeadersMessage,           MSG_HANDLER_FULL,                                               0},
+    {"tx",              ProcessTxMessage,                   MSG_HANDLER_ANY,                                                0},
+    {"mblk",            ProcessMultiBlockMessage,           MSG_HANDLER_FULL | MSG_HANDLER_NO_IMPORT,                       0},
+    {"mblkt",           ProcessMultiBlockThinMessage,       MSG_HANDLER_THIN | MSG_HANDLER_NO_IMPORT,                       0},
+    {"block",           ProcessBlockMessage,                MSG_HANDLER_FULL | MSG_HANDLER_NO_IMPORT,                       0},
+    {"cmpctblock",      ProcessCompactBlockMessage,         MSG_HANDLER_FULL | MSG_HANDLER_NO_IMPORT,                       20},
+    {"getblocktxn",     ProcessGetBlockTxnMessage,          MSG_HANDLER_FULL,                                               20},
+    {"blocktxn",        ProcessBlockTxnMessage,             MSG_HANDLER_FULL | MSG_HANDLER_NO_IMPORT,                       20},
+    {"merkleblock",     ProcessMerkleBlockMessage,          MSG_HANDLER_ANY,                                                0},
+    {"headers",         ProcessHeadersMessage,              MSG_HANDLER_ANY,                                                0},
+    {"getaddr",         ProcessGetAddrMessage,              MSG_HANDLER_ANY | MSG_HANDLER_INBOUND,                          4},
+    {"mempool",         ProcessMempoolMessage,              MSG_HANDLER_ANY,                                                4},
+    {"ping",            ProcessPingMessage,                 MSG_HANDLER_ANY | MSG_HANDLER_SEEN,                             120},
+    {"pong",            ProcessPongMessage,                 MSG_HANDLER_ANY,                                                0},
+    {"alert",           ProcessAlertMessage,                MSG_HANDLER_ANY,                                                0},
+    {"filterload",      ProcessFilterLoadMessage,           MSG_HANDLER_ANY,                                                16},
+    {"filteradd",       ProcessFilterAddMessage,            MSG_HANDLER_ANY,                                                0},
+    {"filterclear",     ProcessFilterClearMessage,          MSG_HANDLER_ANY,                                                16},
+    {"reject",          ProcessRejectMessage,               MSG_HANDLER_ANY,                                                0},
+
+    {"smsgInv",         ProcessSecureMsgMessage,            MSG_HANDLER_ANY,                                                0},
+    {"smsgShow",        ProcessSecureMsgMessage,            MSG_HANDLER_ANY,                                                0},
+    {"smsgHave",        ProcessSecureMsgMessage,            MSG_HANDLER_ANY,                                                0},
+    {"smsgWant",        ProcessSecureMsgMessage,            MSG_HANDLER_ANY,                                                0},
+    {"smsgMsg",         ProcessSecureMsgMessage,            MSG_HANDLER_ANY,                                                0},
+    {"smsgMatch",       ProcessSecureMsgMessage,            MSG_HANDLER_ANY,                                                0},
+    {"smsgPing",        ProcessSecureMsgMessage,            MSG_HANDLER_ANY,                                                0},
+    {"smsgPong",        ProcessSecureMsgMessage,            MSG_HANDLER_ANY,                                                0},
+    {"smsgDisabled",    ProcessSecureMsgMessage,            MSG_HANDLER_ANY,                                                0},
+    {"smsgIgnore",      ProcessSecureMsgMessage,            MSG_HANDLER_ANY,                                                0},
+};
 
-    else if (strCommand == "alert")
-    {
-        CAlert alert;
-        vRecv >> alert;
+static const unsigned int MESSAGE_HANDLER_COUNT = sizeof(messageHandlers) / sizeof(messageHandlers[0]);
 
-        uint256 alertHash = alert.GetHash();
-        if (pfrom->setKnown.count(alertHash) == 0)
-        {
-            if (alert.ProcessAlert())
-            {
-                // Relay
-                pfrom->setKnown.insert(alertHash);
-                {
-                    LOCK(cs_vNodes);
-                    BOOST_FOREACH(CNode* pnode, vNodes)
-                        alert.RelayTo(pnode);
-                }
-            }
-            else {
-                // Small DoS penalty so peers that send us lots of
-                // duplicate/expired/invalid-signature/whatever alerts
-                // eventually get banned.
-                // This isn't a Misbehaving(100) (immediate ban) because the
-                // peer might be an older or different implementation with
-                // a different signature key, etc.
-                pfrom->Misbehaving(10);
-            };
-        };
-    } else
-    if (strCommand == "filterload")
+static const CMessageHandler* FindMessageHandler(const std::string& strCommand)
+{
+    // -- built on first use, only the message handler thread dispatches
+    static boost::unordered_map<std::string, const CMessageHandler*> mapHandlers;
+    if (mapHandlers.empty())
     {
-        // -- full nodes won't use filters, if a node does it is NT_THIN
-        if (pfrom->nTypeInd == NT_FULL
-            && !SetNodeType(pfrom, NT_THIN))
-            return false;
+        for (unsigned int i = 0; i < MESSAGE_HANDLER_COUNT; ++i)
+            mapHandlers[messageHandlers[i].pszCommand] = &messageHandlers[i];
+    };
 
-        CBloomFilter filter;
-        vRecv >> filter;
+    boost::unordered_map<std::string, const CMessageHandler*>::const_iterator mi = mapHandlers.find(strCommand);
+    if (mi == mapHandlers.end())
+        return NULL;
+    return mi->second;
+}
 
-        if (!filter.IsWithinSizeConstraints())
-        {
-            // There is no excuse for sending a too-large filter
-            pfrom->Misbehaving(100);
-        } else
-        if ((filter.nFlags & BLOOM_ACCEPT_STEALTH)
-            && !(nLocalServices & THIN_STEALTH))
-        {
-            // -- peer has requested that node forwards all stealth txns, node does not support this
+static bool CheckMessageRate(CNode* pfrom, const CMessageHandler* pHandler)
+{
+    if (pHandler->nMaxPerMinute < 1)
+        return true;
 
-            if (fDebug)
-                LogPrintf("Warning: Peer %s requested merklebloks include all stealth txns, function disabled.\n", pfrom->addr.ToString().c_str());
-            filter.nFlags &= ~(BLOOM_ACCEPT_STEALTH);
-        };
+    unsigned int nIndex = pHandler - &messageHandlers[0];
+    if (pfrom->vMsgRate.size() < MESSAGE_HANDLER_COUNT)
+        pfrom->vMsgRate.resize(MESSAGE_HANDLER_COUNT, std::make_pair((int64_t)0, 0));
 
-        {
-            LOCK(pfrom->cs_filter);
-            delete pfrom->pfilter;
-            pfrom->pfilter = new CBloomFilter(filter);
-            pfrom->pfilter->UpdateEmptyFull();
-        };
+    std::pair<int64_t, int>& rate = pfrom->vMsgRate[nIndex];
+    int64_t nNow = GetTime();
+    if (nNow - rate.first >= 60)
+    {
+        rate.first = nNow;
+        rate.second = 0;
+    };
 
-        if (fDebug)
-            LogPrintf("Loaded bloom filter of size %u for peer %s.\n", pfrom->pfilter->vData.size(), pfrom->addr.ToString().c_str());
+    return ++rate.second <= pHandler->nMaxPerMinute;
+}
 
-        pfrom->fRelayTxes = true;
-    } else
-    if (strCommand == "filteradd")
+bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+{
+    RandAddSeedPerfmon();
+    LogPrint("net", "received: %s (%u bytes)\n", strCommand, vRecv.size());
+    if (mapArgs.count("-dropmessagestest") && GetRand(atoi(mapArgs["-dropmessagestest"])) == 0)
     {
-        if (pfrom->nTypeInd == NT_FULL
-            && !SetNodeType(pfrom, NT_THIN))
-            return false;
+        LogPrintf("dropmessagestest DROPPING RECV MESSAGE\n");
+        return true;
+    }
 
-        vector<unsigned char> vData;
-        vRecv >> vData;
+    const CMessageHandler* pHandler = FindMessageHandler(strCommand);
 
-        // Nodes must NEVER send a data item > 520 bytes (the max size for a script data object,
-        // and thus, the maximum size any matched object can have) in a filteradd message
-        if (vData.size() > MAX_SCRIPT_ELEMENT_SIZE)
-        {
-            pfrom->Misbehaving(100);
-        } else
-        {
-            LOCK(pfrom->cs_filter);
-            if (pfrom->pfilter)
-            {
-                if (!pfrom->pfilter->contains(vData))
-                {
-                    pfrom->pfilter->insert(vData);
-                    pfrom->pfilter->UpdateEmptyFull();
-                    if (fDebug)
-                        LogPrintf("Added data to bloom filter of peer %s, is full %d.\n", pfrom->addr.ToString().c_str(), pfrom->pfilter->IsFull());
-                };
-            } else
-            {
-                pfrom->Misbehaving(100); // peer must send filterload first
-            };
-        };
-    } else
-    if (strCommand == "filterclear")
-    {
-        LOCK(pfrom->cs_filter);
-        delete pfrom->pfilter;
-        pfrom->pfilter = NULL;
-        //pfrom->pfilter = new CBloomFilter();
-        pfrom->fRelayTxes = true;
-    } else
-    if (strCommand == "reject")
+    if (pfrom->nVersion == 0
+        && (!pHandler || !(pHandler->nFlags & MSG_HANDLER_PRE_VERSION)))
     {
-        string strMsg;
-        string strReason;
-        unsigned char ccode;
-        vRecv >> strMsg >> ccode >> strReason;
+        // Must have a version message before anything else
+        pfrom->Misbehaving(1);
+        return false;
+    };
 
-        if (strMsg == "conn")
-        {
-            char *reason;
-            switch (ccode)
-            {
-                case REJ_NEED_THIN_SUPPORT:     reason = (char*)"Requires thin client support";             break;
-                case REJ_MAX_THIN_PEERS:        reason = (char*)"Peer is connected to max thin peers";      break;
-                default:                        reason = (char*)"unknown code";                             break;
-            };
+    if (!pHandler)
+        return true; // Ignore unknown commands for extensibility
 
-            LogPrintf("Peer %s rejected connection, code %d, reason: %s.\n", pfrom->addr.ToString().c_str(), ccode, reason);
-            pfrom->SoftBan(); // don't allow connecting again for a while
-        } else
-        if (fDebug)
-        {
-            ostringstream ss;
-            ss << strMsg << " code " << itostr(ccode) << ": " << strReason;
+    if (!(pHandler->nFlags & (nNodeMode == NT_FULL ? MSG_HANDLER_FULL : MSG_HANDLER_THIN)))
+    {
+        LogPrint("net", "Ignoring %s received in mode %s.\n", strCommand, GetNodeModeName(nNodeMode));
+        return false;
+    };
 
-            if (strMsg == "block" || strMsg == "tx")
-            {
-                uint256 hash;
-                vRecv >> hash;
-                ss << ": hash " << hash.ToString();
-            };
+    if ((pHandler->nFlags & MSG_HANDLER_NO_IMPORT)
+        && (fImporting || fReindexing))
+        return true; // Ignore blocks received while importing
 
-            // Truncate to reasonable length and sanitize before printing:
-            string s = ss.str();
-            if (s.size() > 111)
-                s.erase(111, string::npos);
-            LogPrintf("Reject %s\n", SanitizeString(s).c_str());
-        };
+    if ((pHandler->nFlags & MSG_HANDLER_INBOUND)
+        && !pfrom->fInbound)
+        return true;
 
-    } else
+    if (!CheckMessageRate(pfrom, pHandler))
     {
-        if (fSecMsgEnabled)
-            SecureMsgReceiveData(pfrom, strCommand, vRecv);
-
-        // Ignore unknown commands for extensibility
-    }
+        LogPrint("net", "Dropping %s from peer %s, over %d per minute.\n", strCommand, pfrom->addr.ToString(), pHandler->nMaxPerMinute);
+        return true;
+    };
 
+    bool fRet = pHandler->fn(pfrom, strCommand, vRecv, nTimeReceived);
 
     // Update the last seen time for this node's address
-    if (pfrom->fNetworkNode)
-        if (strCommand == "version" || strCommand == "addr" || strCommand == "inv" || strCommand == "getdata" || strCommand == "ping")
-            AddressCurrentlyConnected(pfrom->addr);
+    if (fRet
+        && pfrom->fNetworkNode
+        && (pHandler->nFlags & MSG_HANDLER_SEEN))
+        AddressCurrentlyConnected(pfrom->addr);
 
-
-    return true;
+    return fRet;
 }
 
 // requires LOCK(cs_vRecvMsg)
@@ -6095,20 +7184,20 @@ bool ProcessMessages(CNode* pfrom)
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
 
-        // Checksum
+        // Checksum, usually verified already by a msgcheck thread
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        if (nChecksum != hdr.nChecksum)
+        if (!msg.fChecked)
+            msg.CheckChecksum();
+        if (!msg.fChecksumOk)
         {
-            LogPrintf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
-               strCommand, nMessageSize, nChecksum, hdr.nChecksum);
+            LogPrintf("ProcessMessages(%s, %u bytes) : CHECKSUM ERROR hdr.nChecksum=%08x\n",
+               strCommand, nMessageSize, hdr.nChecksum);
             continue;
         }
 
         // Process message
         bool fRet = false;
+        int64_t nTimeStart = GetTimeMicros();
         try
         {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
@@ -6140,6 +7229,10 @@ bool ProcessMessages(CNode* pfrom)
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        // -- unknown commands share one entry, so a peer can't fill the stats with junk names
+        RecordMessageRecv(pfrom, FindMessageHandler(strCommand) ? strCommand : std::string("other"),
+            nMessageSize + CMessageHeader::HEADER_SIZE, GetTimeMicros() - nTimeStart);
+
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand, nMessageSize);
 
@@ -6147,8 +7240,12 @@ bool ProcessMessages(CNode* pfrom)
     }
 
     // In case the connection got shut down, its receive buffer was wiped
+    // the buffers of the erased messages go back to the receive pool
     if (!pfrom->fDisconnect)
+    {
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+        pfrom->RecalcRecvSize();
+    };
 
     return fOk;
 }
@@ -6256,41 +7353,48 @@ bool SendMessages(CNode* pto, std::vector<CNode*> &vNodesCopy, bool fSendTrickle
     std::vector<CInv> vInv;
     std::vector<CInv> vInvWait;
 
+    // -- transaction invs go out at Poisson distributed times to protect privacy, at most
+    //    nInvRate per second of the peer's class, blocks and other invs are not held back
+    int64_t nNowUsec = GetTimeMicros();
+    int nInvInterval = pto->fInbound ? INVENTORY_BROADCAST_INTERVAL : (INVENTORY_BROADCAST_INTERVAL + 1) / 2;
+    if (pto->nNextInvSend == 0)
+    {
+        PullRelayedInventory(pto); // first call only marks the peer's position in the relay queue
+        pto->nLastInvSend = nNowUsec;
+        pto->nNextInvSend = PoissonNextSend(nNowUsec, nInvInterval);
+    };
+
+    bool fSendTx = nNowUsec >= pto->nNextInvSend;
+    size_t nMaxTx = 0;
+    if (fSendTx)
+    {
+        PullRelayedInventory(pto);
+
+        int64_t nInvRate = pto->nTypeInd == NT_THIN ? GetArg("-invratethin", DEFAULT_INV_RATE_THIN)
+            : pto->fInbound ? GetArg("-invrateinbound", DEFAULT_INV_RATE_INBOUND)
+            : GetArg("-invrateoutbound", DEFAULT_INV_RATE_OUTBOUND);
+        nMaxTx = std::max((int64_t)1, nInvRate * (nNowUsec - pto->nLastInvSend) / 1000000);
+        pto->nLastInvSend = nNowUsec;
+        pto->nNextInvSend = PoissonNextSend(nNowUsec, nInvInterval);
+    };
+
     {
-        LOCK2(pwalletMain->cs_wallet, pto->cs_inventory);
+        LOCK(pto->cs_inventory);
         vInv.reserve(pto->vInventoryToSend.size());
-        vInvWait.reserve(pto->vInventoryToSend.size());
         BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
         {
             if (pto->setInventoryKnown.count(inv))
                 continue;
 
-            // trickle out tx inv to protect privacy
-            if (inv.type == MSG_TX && !fSendTrickle)
+            if (inv.type == MSG_TX)
             {
-                // 1/4 of tx invs blast to all immediately
-                static uint256 hashSalt;
-                if (hashSalt == 0)
-                    hashSalt = GetRandHash();
-                uint256 hashRand = inv.hash ^ hashSalt;
-                hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                bool fTrickleWait = ((hashRand & 3) != 0);
-
-                // always trickle our own transactions
-                if (!fTrickleWait)
-                {
-                    CWalletTx wtx;
-                    if (GetTransaction(inv.hash, wtx))
-                        if (wtx.fFromMe)
-                            fTrickleWait = true;
-                }
-
-                if (fTrickleWait)
+                if (!fSendTx || nMaxTx == 0)
                 {
                     vInvWait.push_back(inv);
                     continue;
-                }
-            }
+                };
+                nMaxTx--;
+            };
 
             // returns true if wasn't already contained in the set
             if (pto->setInventoryKnown.insert(inv).second)
@@ -6303,7 +7407,7 @@ bool SendMessages(CNode* pto, std::vector<CNode*> &vNodesCopy, bool fSendTrickle
                 }
             }
         }
-        pto->vInventoryToSend = vInvWait;
+        pto->vInventoryToSend.swap(vInvWait);
     }
     if (!vInv.empty())
         pto->PushMessage("inv", vInv);
@@ -6503,15 +7607,25 @@ bool SendMessages(CNode* pto, std::vector<CNode*> &vNodesCopy, bool fSendTrickle
                 vGetData.clear();
             }
             mapAlreadyAskedFor[inv] = nNow;
+            if (inv.type == MSG_CMPCT_BLOCK)
+                pto->setCmpctBlocksAsked.insert(inv.hash);
         }
         pto->mapAskFor.erase(pto->mapAskFor.begin());
     }
 
+    if (nNodeMode == NT_FULL)
+    {
+        BlockDownloadRequest(pto, vNodesCopy, vGetData, nTimeNow);
+        PartialBlocksTimeout(pto, nTimeNow);
+    };
+
     if (!vGetData.empty())
         pto->PushMessage("getdata", vGetData);
 
     // - If syncing and !get mblk in MBLK_RECEIVE_TIMEOUT send another getblocks to random peer
+    //   the download scheduler handles its own timeouts
     if (nNodeMode == NT_FULL
+        && vBlocksToDownload.empty()
         && nTimeLastMblkRecv > 0
         && pto->nChainHeight - nBestHeight > 256
         && nTimeNow - nTimeLastMblkRecv > MBLK_RECEIVE_TIMEOUT)
@@ -16,6 +16,8 @@
 
 #include <list>
 
+#include <boost/shared_ptr.hpp>
+
 class CWallet;
 class CWalletTx;
 
@@ -45,6 +47,20 @@ static const unsigned int MAX_MULTI_BLOCK_SIZE = 5120000;    // 5MiB, most likel
 static const unsigned int MAX_MULTI_BLOCK_ELEMENTS = 64;     // processing larger blocks is cpu intensive
 static const unsigned int MAX_MULTI_BLOCK_THIN_ELEMENTS = 128;
 
+/** Parallel block download: blocks in flight per peer, how far past the next block to validate
+ *  downloads may run, and the size of the downloaded blocks held for validation */
+static const unsigned int MAX_BLOCKS_IN_FLIGHT_PER_PEER = 2 * MAX_MULTI_BLOCK_ELEMENTS;
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+static const size_t MAX_BLOCK_DOWNLOAD_BUFFER = 64 * 1024 * 1024;
+static const int64_t BLOCK_DOWNLOAD_TIMEOUT = 30;  // seconds without a block while blocks are in flight
+
+/** Compact blocks waiting for missing txns, and how long to wait for them before asking for the full block */
+static const unsigned int MAX_PARTIAL_BLOCKS = 16;
+static const int64_t PARTIAL_BLOCK_TIMEOUT = 10;
+
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+
 /** No amount larger than this (in satoshi) is valid */
 static const int64_t MAX_MONEY = std::numeric_limits<int64_t>::max();
 inline bool MoneyRange(int64_t nValue) { return (nValue >= 0 && nValue <= MAX_MONEY); }
@@ -107,6 +123,8 @@ extern int64_t nTransactionFee;
 extern int64_t nReserveBalance;
 extern int64_t nMinimumInputValue;
 extern bool fUseFastIndex;
+extern bool fMapBlockFiles;
+extern int nScriptCheckThreads;
 
 extern bool fEnforceCanonical;
 
@@ -116,6 +134,7 @@ static const uint64_t nMinDiskSpace = 52428800;
 class CReserveKey;
 class CTxDB;
 class CTxIndex;
+class CScriptCheck;
 
 void RegisterWallet(CWallet* pwalletIn);
 void UnregisterWallet(CWallet* pwalletIn);
@@ -124,12 +143,56 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock, uint256& hash);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
 FILE* OpenBlockFile(bool fHeaderFile, unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(bool fHeaderFile, unsigned int& nFileRet, const char* fmode = "ab");
+
+/** Read-only view of a memory mapped block file, from a position to the end of the mapping */
+class CBlockFileView
+{
+public:
+    CBlockFileView() : pbegin(NULL), pend(NULL) {};
+
+    boost::shared_ptr<const void> pregion;  // keeps the mapping alive after a remap
+    const char* pbegin;
+    const char* pend;
+};
+
+/** Get a view of a block file from nBlockPos through its memory mapping, which is shared by
+ *  all readers and only remapped when fRemap is set and the file grew. */
+bool MapBlockFile(bool fHeaderFile, unsigned int nFile, unsigned int nBlockPos, bool fRemap, CBlockFileView& view);
+
+/** Unserialize obj straight from the memory mapping of a block file.
+ *  Returns false if the file isn't mapped or obj can't be read from it, the caller should
+ *  then fall back to OpenBlockFile. */
+template<typename T>
+bool ReadFromMappedBlockFile(bool fHeaderFile, unsigned int nFile, unsigned int nBlockPos, int nType, T& obj)
+{
+    CBlockFileView view;
+    for (int i = 0; i < 2; ++i)
+    {
+        // - the file may have grown since it was mapped, remap and retry once
+        if (!MapBlockFile(fHeaderFile, nFile, nBlockPos, i > 0, view))
+            return false;
+
+        try {
+            CBufferReader reader(view.pbegin, view.pend, nType, CLIENT_VERSION);
+            reader >> obj;
+            return true;
+        } catch (std::exception &e)
+        {
+            continue;
+        };
+    };
+    return false;
+}
 int LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
 CBlockIndex* FindBlockByHeight(int nHeight);
 CBlockThinIndex* FindBlockThinByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, std::vector<CNode*> &vNodesCopy, bool fSendTrickle);
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
+/** Run an instance of the block pre-check thread */
+void ThreadBlockCheck();
 
 bool LoadExternalBlockFile(int nFile, FILE* fileIn);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
@@ -239,6 +302,12 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+    // memory only: the hash of a transaction read from a stream is taken as it
+    // is read, those built up in place (wallet, miner) are hashed on every call.
+    // GetHash() never writes the memo, so it is safe from any thread.
+    uint256 hashCached;
+    bool fHashCached;
+
     CTransaction()
     {
         SetNull();
@@ -252,6 +321,13 @@ public:
         READWRITE(vin);
         READWRITE(vout);
         READWRITE(nLockTime);
+        if (fRead)
+        {
+            CTransaction* ptx = const_cast<CTransaction*>(this);
+            ptx->fHashCached = false;
+            ptx->hashCached = SerializeHash(*this);
+            ptx->fHashCached = true;
+        };
     )
 
     void SetNull()
@@ -262,6 +338,7 @@ public:
         vout.clear();
         nLockTime = 0;
         nDoS = 0;  // Denial-of-service prevention
+        fHashCached = false;
     }
 
     bool IsNull() const
@@ -271,9 +348,18 @@ public:
 
     uint256 GetHash() const
     {
+        if (fHashCached)
+            return hashCached;
         return SerializeHash(*this);
     }
 
+    // Call after modifying a transaction that was read from a stream, or
+    // copied from one, else GetHash() would return the stale memoised hash.
+    void ClearHashCache()
+    {
+        fHashCached = false;
+    }
+
     bool IsFinal(int nBlockHeight=0, int64_t nBlockTime=0) const
     {
         AssertLockHeld(cs_main);
@@ -390,6 +476,9 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        if (!pfileRet && ReadFromMappedBlockFile(false, pos.nFile, pos.nTxPos, SER_DISK, *this))
+            return true;
+
         CAutoFile filein = CAutoFile(OpenBlockFile(false, pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -470,7 +559,10 @@ public:
     bool FetchInputs(CTxDB& txdb, const std::map<uint256, CTxIndex>& mapTestPool,
                      bool fBlock, bool fMiner, MapPrevTx& inputsRet, bool& fInvalid);
 
-    bool CheckAnonInputs(CTxDB& txdb, int64_t& nSumValue, bool& fInvalid, bool fCheckExists);
+    /** Check the anon inputs and sum their values.
+        @param[out] pvRingChecks	if not NULL, ring signatures are appended here instead of being verified
+     */
+    bool CheckAnonInputs(CTxDB& txdb, int64_t& nSumValue, bool& fInvalid, bool fCheckExists, std::vector<CRingSigCheck> *pvRingChecks = NULL);
 
     /** Sanity check previous transactions, then, if all checks succeed,
         mark them as spent by this transaction.
@@ -481,11 +573,13 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
+        @param[out] pvChecks	if not NULL, script checks are appended here instead of being run
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS,
+                       std::vector<CScriptCheck> *pvChecks = NULL);
     bool CheckTransaction() const;
     bool GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64_t& nCoinAge) const;
 
@@ -498,6 +592,61 @@ protected:
 bool AcceptToMemoryPool(CTxMemPool &pool, CTransaction &tx, CTxDB& txdb, bool *pfMissingInputs=NULL);
 
 
+/** Closure representing one script verification
+ *  Note that this stores a pointer to the spending transaction, which must outlive the check */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    unsigned int nFlags;
+    int nHashType;
+
+public:
+    CScriptCheck() : ptxTo(NULL), nIn(0), nFlags(0), nHashType(0) {}
+    CScriptCheck(const CTransaction& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) {}
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check)
+    {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nFlags, check.nFlags);
+        std::swap(nHashType, check.nHashType);
+    }
+};
+
+/** Closure running the context free CheckBlock on a block received from the network.
+ *  Always succeeds, the result is left in the block's fChecked and nDoS, which must outlive the check.
+ *  nBestHeight and nAdjustedTime are taken under cs_main before the check is queued. */
+class CBlockCheck
+{
+private:
+    const CBlock *pblock;
+    int nBestHeight;
+    int64_t nAdjustedTime;
+
+public:
+    CBlockCheck() : pblock(NULL), nBestHeight(0), nAdjustedTime(0) {}
+    CBlockCheck(const CBlock& blockIn, int nBestHeightIn, int64_t nAdjustedTimeIn)
+        : pblock(&blockIn), nBestHeight(nBestHeightIn), nAdjustedTime(nAdjustedTimeIn) {}
+
+    bool operator()() const;
+
+    void swap(CBlockCheck &check)
+    {
+        std::swap(pblock, check.pblock);
+        std::swap(nBestHeight, check.nBestHeight);
+        std::swap(nAdjustedTime, check.nAdjustedTime);
+    }
+};
+
+
 
 /** A transaction with a merkle branch linking it to the block chain. */
 class CMerkleTx : public CTransaction
@@ -663,6 +812,15 @@ public:
     unsigned int nBits;
     unsigned int nNonce;
 
+    // memory only, must follow nNonce: GetHash() hashes the fields above in
+    // place. The hash of a header read from a stream is taken as it is read,
+    // with a copy of the fields it covers. The memo is only used while the
+    // fields still match, so headers can be modified freely, and GetHash()
+    // never writes it, so it is safe from any thread.
+    uint256 hashCached;
+    unsigned char vchHashedFields[80];
+    bool fHashCached;
+
     CBlockHeader()
     {
         SetHdrNull();
@@ -676,6 +834,7 @@ public:
         nTime = 0;
         nBits = 0;
         nNonce = 0;
+        fHashCached = false;
     }
 
     IMPLEMENT_SERIALIZE
@@ -687,6 +846,13 @@ public:
         READWRITE(nTime);
         READWRITE(nBits);
         READWRITE(nNonce);
+        if (fRead)
+        {
+            CBlockHeader* pheader = const_cast<CBlockHeader*>(this);
+            pheader->hashCached = ComputeHash();
+            memcpy(pheader->vchHashedFields, BEGIN(nVersion), sizeof(vchHashedFields));
+            pheader->fHashCached = true;
+        };
     )
 
     bool IsNull() const
@@ -694,12 +860,19 @@ public:
         return (nBits == 0);
     }
 
-    uint256 GetHash() const
+    uint256 ComputeHash() const
     {
         if (nVersion > 6)
             return Hash(BEGIN(nVersion), END(nNonce));
-        else
-            return scrypt_blockhash(CVOIDBEGIN(nVersion));
+        return scrypt_blockhash(CVOIDBEGIN(nVersion));
+    }
+
+    uint256 GetHash() const
+    {
+        if (fHashCached
+            && memcmp(vchHashedFields, BEGIN(nVersion), sizeof(vchHashedFields)) == 0)
+            return hashCached;
+        return ComputeHash();
     }
 
     int64_t GetBlockTime() const
@@ -740,6 +913,9 @@ public:
     mutable int nDoS;
     bool DoS(int nDoSIn, bool fIn) const { nDoS += nDoSIn; return fIn; }
 
+    // memory only, set when the full CheckBlock passed
+    mutable bool fChecked;
+
     CBlock()
     {
         SetNull();
@@ -761,6 +937,8 @@ public:
             const_cast<CBlock*>(this)->vtx.clear();
             const_cast<CBlock*>(this)->vchBlockSig.clear();
         }
+        if (fRead)
+            const_cast<CBlock*>(this)->fChecked = false;
     )
 
     void SetNull()
@@ -770,6 +948,7 @@ public:
         vchBlockSig.clear();
         vMerkleTree.clear();
         nDoS = 0;
+        fChecked = false;
     }
 
     void UpdateTime(const CBlockIndex* pindexPrev);
@@ -890,20 +1069,24 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(false, nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
+        int nType = SER_DISK | (fReadTransactions ? 0 : SER_BLOCKHEADERONLY);
+        if (!ReadFromMappedBlockFile(false, nFile, nBlockPos, nType, *this))
+        {
+            SetNull();
 
-        // Read block
-        try {
-            filein >> *this;
-        }
-        catch (std::exception &e) {
-            return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
-        }
+            // Open history file to read
+            CAutoFile filein = CAutoFile(OpenBlockFile(false, nFile, nBlockPos, "rb"), nType, CLIENT_VERSION);
+            if (!filein)
+                return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+
+            // Read block
+            try {
+                filein >> *this;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            }
+        };
 
         // Check the header
         if (fReadTransactions && IsProofOfWork() && !CheckProofOfWork(GetHash(), nBits))
@@ -947,10 +1130,12 @@ public:
     bool ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions=true);
     bool SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew);
     bool AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const uint256& hashProof);
-    bool CheckBlock(bool fCheckPOW=true, bool fCheckMerkleRoot=true, bool fCheckSig=true) const;
+    // nBestHeightIn < 0 reads nBestHeight and the adjusted time, cs_main must be held
+    bool CheckBlock(bool fCheckPOW=true, bool fCheckMerkleRoot=true, bool fCheckSig=true,
+        int nBestHeightIn=-1, int64_t nAdjustedTimeIn=0) const;
     bool AcceptBlock();
     bool SignBlock(CWallet& keystore, int64_t nFees);
-    bool CheckBlockSignature() const;
+    bool CheckBlockSignature(int nBestHeightIn) const;
 
     bool GetHashProof(uint256& hashProof);
 
@@ -1056,6 +1241,10 @@ public:
     {
         SetHdrNull();
 
+        if (ReadFromMappedBlockFile(false, nFile, nBlockPos, SER_DISK, *this))
+            return true;
+        SetHdrNull();
+
         // Open history file to read
         CAutoFile filein = CAutoFile(OpenBlockFile(false, nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
@@ -1778,6 +1967,13 @@ public:
         vHave.push_back(Params().HashGenesisBlock());
     }
 
+    void SetAhead(const uint256& hashAhead, const CBlockIndex* pindex)
+    {
+        // hashAhead isn't connected yet, the peer continues after it if it knows it
+        Set(pindex);
+        vHave.insert(vHave.begin(), hashAhead);
+    }
+
     void SetThin(const uint256& fromHash)
     {
         // if the block is before the thin index 'window'
@@ -2133,4 +2329,85 @@ public:
     )
 };
 
+class CPrefilledTx
+{
+public:
+    uint32_t nIndex;
+    CTransaction tx;
+
+    CPrefilledTx() : nIndex(0) {};
+    CPrefilledTx(uint32_t nIndexIn, const CTransaction& txIn) : nIndex(nIndexIn), tx(txIn) {};
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nIndex);
+        READWRITE(tx);
+    )
+};
+
+enum CompactBlockFillResult
+{
+    CMPCT_FILL_OK           = 0,
+    CMPCT_FILL_INVALID      = 1,    // malformed message
+    CMPCT_FILL_COLLISION    = 2,    // short ids collide within the block, the full block is needed
+};
+
+/** Block relayed in a 'cmpctblock' message: the header and signature, the coinbase and coinstake,
+ *  and salted short ids of the other txns, which the receiver should have in its mempool. */
+class CBlockCompact
+{
+public:
+    CBlockHeader header;
+    std::vector<unsigned char> vchBlockSig;
+    uint64_t nSalt;
+    std::vector<uint64_t> vShortTxIds;      // in block order, skipping the prefilled txns
+    std::vector<CPrefilledTx> vPrefilledTxn;
+
+    CBlockCompact() : nSalt(0) {};
+    CBlockCompact(const CBlock& block);
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(header);
+        READWRITE(vchBlockSig);
+        READWRITE(nSalt);
+        READWRITE(vShortTxIds);
+        READWRITE(vPrefilledTxn);
+    )
+
+    static uint64_t GetShortTxId(const uint256& txid, uint64_t nSalt);
+
+    /** Rebuild the block from the prefilled txns and the mempool.
+     *  Returns a CompactBlockFillResult, on CMPCT_FILL_OK vMissing gets the indexes of the txns not found. */
+    int FillBlock(CBlock& block, std::vector<uint32_t>& vMissing) const;
+};
+
+/** 'getblocktxn' asks for the txns of a compact block that could not be filled */
+class CBlockTxnRequest
+{
+public:
+    uint256 hashBlock;
+    std::vector<uint32_t> vIndexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vIndexes);
+    )
+};
+
+/** 'blocktxn' answers a getblocktxn, the txns in the order they were asked for */
+class CBlockTxn
+{
+public:
+    uint256 hashBlock;
+    std::vector<CTransaction> vtx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hashBlock);
+        READWRITE(vtx);
+    )
+};
+
 #endif
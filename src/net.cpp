@@ -12,6 +12,12 @@
 
 #ifdef WIN32
 #include <string.h>
+#else
+#include <sys/uio.h>
+#endif
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
 #endif
 
 #ifdef USE_UPNP
@@ -31,6 +37,11 @@ static const int MAX_OUTBOUND_CONNECTIONS = 16;
 
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
 
+#ifdef USE_EPOLL
+static bool SocketEventsAdd(SOCKET hSocket, CNode* pnode);
+static void SocketEventsRemove(SOCKET hSocket);
+#endif
+
 
 //
 // Global state variables
@@ -54,6 +65,18 @@ CCriticalSection cs_vNodes;
 CCriticalSection cs_connectNode;
 map<CInv, CDataStream> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
+
+class CRelayEntry
+{
+public:
+    CInv inv;
+    int64_t nExpire;
+    boost::shared_ptr<const CTransaction> ptx; // for bloom filter matching
+};
+
+// transactions to announce, peers pick them up by sequence number in SendMessages
+static deque<CRelayEntry> vRelayQueue;
+static uint64_t nRelayQueueSeq = 1; // sequence number of vRelayQueue.front()
 CCriticalSection cs_mapRelay;
 map<CInv, int64_t> mapAlreadyAskedFor;
 
@@ -454,6 +477,9 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+#ifdef USE_EPOLL
+        SocketEventsAdd(hSocket, pnode);
+#endif
 
         pnode->nTimeConnected = GetTime();
         return pnode;
@@ -472,6 +498,10 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         LogPrint("net", "disconnecting node %s\n", addrName);
+#ifdef USE_EPOLL
+        // explicitly, a forked child (-blocknotify) may hold the socket open
+        SocketEventsRemove(hSocket);
+#endif
         closesocket(hSocket);
         hSocket = INVALID_SOCKET;
     }
@@ -618,6 +648,11 @@ void CNode::copyStats(CNodeStats &stats)
     X(nMisbehavior);
     X(nSendBytes);
     X(nRecvBytes);
+    X(nRecvSize);
+    {
+        LOCK(cs_msgStats);
+        X(mapMsgStats);
+    }
     stats.fSyncNode = (this == pnodeSync);
 
     // It is common for nodes with good ping times to suddenly become lagged,
@@ -640,8 +675,70 @@ void CNode::copyStats(CNodeStats &stats)
 }
 #undef X
 
+void CMessageStats::AddRecv(unsigned int nBytes, int64_t nUsec)
+{
+    nRecv++;
+    nRecvBytes += nBytes;
+    nProcessUsec += nUsec;
+
+    unsigned int nBucket = 0;
+    while (nBucket < MSG_TIME_BUCKET_COUNT - 1 && nUsec > MSG_TIME_BUCKETS[nBucket])
+        nBucket++;
+    vProcessBuckets[nBucket]++;
+}
+
+static CCriticalSection cs_msgStatsTotal;
+static MessageStatsMap mapMsgStatsTotal;
+
+// Entry for strCommand, bounding the number of commands a peer can make us track
+static CMessageStats& GetMessageStatsEntry(MessageStatsMap& mapStats, const std::string& strCommand)
+{
+    MessageStatsMap::iterator mi = mapStats.find(strCommand);
+    if (mi != mapStats.end())
+        return mi->second;
+    if (mapStats.size() >= MAX_MSG_STATS_COMMANDS)
+        return mapStats["other"];
+    return mapStats[strCommand];
+}
+
+void RecordMessageRecv(CNode* pnode, const std::string& strCommand, unsigned int nBytes, int64_t nUsec)
+{
+    {
+        LOCK(pnode->cs_msgStats);
+        GetMessageStatsEntry(pnode->mapMsgStats, strCommand).AddRecv(nBytes, nUsec);
+    }
+    {
+        LOCK(cs_msgStatsTotal);
+        GetMessageStatsEntry(mapMsgStatsTotal, strCommand).AddRecv(nBytes, nUsec);
+    }
+}
+
+void RecordMessageSent(CNode* pnode, const char* pchHeader, unsigned int nBytes)
+{
+    const char* pchCommand = pchHeader + MESSAGE_START_SIZE;
+    std::string strCommand(pchCommand, std::find(pchCommand, pchCommand + CMessageHeader::COMMAND_SIZE, '\0'));
+    {
+        LOCK(pnode->cs_msgStats);
+        CMessageStats& stats = GetMessageStatsEntry(pnode->mapMsgStats, strCommand);
+        stats.nSent++;
+        stats.nSentBytes += nBytes;
+    }
+    {
+        LOCK(cs_msgStatsTotal);
+        CMessageStats& stats = GetMessageStatsEntry(mapMsgStatsTotal, strCommand);
+        stats.nSent++;
+        stats.nSentBytes += nBytes;
+    }
+}
+
+void GetMessageStats(MessageStatsMap& mapStats)
+{
+    LOCK(cs_msgStatsTotal);
+    mapStats = mapMsgStatsTotal;
+}
+
 // requires LOCK(cs_vRecvMsg)
-bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
+bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& fComplete)
 {
     while (nBytes > 0) {
 
@@ -666,7 +763,10 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         nBytes -= handled;
 
         if (msg.complete())
+        {
             msg.nTime = GetTimeMicros();
+            fComplete = true;
+        };
     }
 
     return true;
@@ -675,19 +775,20 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
+    unsigned int nRemaining = sizeof(hdrbuf) - nHdrPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
     memcpy(&hdrbuf[nHdrPos], pch, nCopy);
     nHdrPos += nCopy;
 
     // if header incomplete, exit
-    if (nHdrPos < 24)
+    if (nHdrPos < sizeof(hdrbuf))
         return nCopy;
 
     // deserialize to CMessageHeader
     try {
-        hdrbuf >> hdr;
+        CBufferReader ssHdr(hdrbuf, hdrbuf + sizeof(hdrbuf), vRecv.nType, vRecv.nVersion);
+        ssHdr >> hdr;
     }
     catch (std::exception &e) {
         return -1;
@@ -700,6 +801,8 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
     // switch state to reading message data
     in_data = true;
 
+    TakeRecvBuffer(hdr.nMessageSize, vRecv);
+
     return nCopy;
 }
 
@@ -709,8 +812,8 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
     if (vRecv.size() < nDataPos + nCopy) {
-        // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        // Allocate up to RECV_BUFFER_STEP ahead, but never more than the total message size.
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + RECV_BUFFER_STEP));
     }
 
     memcpy(&vRecv[nDataPos], pch, nCopy);
@@ -719,6 +822,54 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     return nCopy;
 }
 
+// Receive buffers of consumed messages, for all peers
+static CCriticalSection cs_recvPool;
+static std::vector<CSerializeData> vRecvPoolSmall;
+static std::vector<CSerializeData> vRecvPoolLarge;
+
+void TakeRecvBuffer(unsigned int nMessageSize, CDataStream& vRecv)
+{
+    if (nMessageSize == 0 || nMessageSize > RECV_BUFFER_STEP)
+        return;
+
+    LOCK(cs_recvPool);
+    std::vector<CSerializeData>& vPool = nMessageSize <= RECV_BUFFER_SMALL ? vRecvPoolSmall : vRecvPoolLarge;
+    if (vPool.empty())
+        return;
+    vRecv.SwapBuffer(vPool.back());
+    vPool.pop_back();
+}
+
+void ReturnRecvBuffer(CDataStream& vRecv)
+{
+    CSerializeData data;
+    vRecv.SwapBuffer(data);
+
+    size_t nCapacity = data.capacity();
+    if (nCapacity == 0 || nCapacity > RECV_BUFFER_STEP)
+        return;
+
+    LOCK(cs_recvPool);
+    std::vector<CSerializeData>& vPool = nCapacity <= RECV_BUFFER_SMALL ? vRecvPoolSmall : vRecvPoolLarge;
+    if (vPool.size() >= (nCapacity <= RECV_BUFFER_SMALL ? MAX_RECV_POOL_SMALL : MAX_RECV_POOL_LARGE))
+        return;
+    if (vPool.capacity() == 0)
+        vPool.reserve(std::max(MAX_RECV_POOL_SMALL, MAX_RECV_POOL_LARGE)); // never copy the buffers on growth
+    vPool.push_back(CSerializeData());
+    vPool.back().swap(data);
+}
+
+bool CNetMessage::CheckChecksum()
+{
+    uint256 hash = Hash(vRecv.begin(), vRecv.begin() + hdr.nMessageSize);
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+
+    fChecksumOk = (nChecksum == hdr.nChecksum);
+    fChecked = true;
+    return fChecksumOk;
+}
+
 
 
 
@@ -730,23 +881,59 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSendMsg>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+#ifdef WIN32
+        const CSerializeData &data = it->Get();
         assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        size_t nWant = data.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nWant, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // -- gather the queued messages into one call
+        struct iovec iov[MAX_SEND_IOV];
+        size_t nIov = 0;
+        size_t nWant = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CSendMsg>::iterator iti = it; iti != pnode->vSendMsg.end() && nIov < MAX_SEND_IOV; ++iti, ++nIov)
+        {
+            const CSerializeData &data = iti->Get();
+            assert(data.size() > nOffset);
+            iov[nIov].iov_base = (void*)&data[nOffset];
+            iov[nIov].iov_len = data.size() - nOffset;
+            nWant += iov[nIov].iov_len;
+            nOffset = 0;
+        };
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                const CSerializeData &data = it->Get();
+                size_t nLeft = data.size() - pnode->nSendOffset;
+                if (nSent < nLeft) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nLeft;
                 pnode->nSendOffset = 0;
                 pnode->nSendSize -= data.size();
+                pnode->RecycleSendBuffer(*it);
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+
+            if ((size_t)nBytes < nWant) {
+                // could not send everything; stop sending more
+                pnode->fSocketWritable = false;
                 break;
             }
         } else {
@@ -760,6 +947,7 @@ void SocketSendData(CNode *pnode)
                 }
             }
             // couldn't send anything at all
+            pnode->fSocketWritable = false;
             break;
         }
     }
@@ -773,76 +961,428 @@ void SocketSendData(CNode *pnode)
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+static void SocketDisconnectNodes(unsigned int& nPrevNodeCount)
 {
-    unsigned int nPrevNodeCount = 0;
-
-    while (true)
     {
-        //
-        // Disconnect nodes
-        //
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-                    pnode->Cleanup();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+                pnode->Cleanup();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
                 }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
+                }
+            }
+        }
+    }
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+static CNode* SocketAcceptConnection(SOCKET hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %d\n", nErr);
+        return NULL;
+    }
+
+    if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+        LogPrintf("Warning: Unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
+    {
+        closesocket(hSocket);
+        return NULL;
+    }
+
+    if (CNode::IsBanned(addr))
+    {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        closesocket(hSocket);
+        return NULL;
+    }
+
+    LogPrint("net", "accepted connection %s\n", addr.ToString());
+    CNode* pnode = new CNode(hSocket, addr, "", true);
+    pnode->AddRef();
+    {
+        LOCK(cs_vNodes);
+        vNodes.push_back(pnode);
+    }
+    return pnode;
+}
+
+static void QueueMessageCheck(CNode* pnode);
+
+// Takes cs_vRecvMsg, fComplete is set when a message was completed
+static bool SocketRecvBytes(CNode* pnode, bool& fComplete)
+{
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    if (!lockRecv)
+        return true;
+
+    pnode->RecalcRecvSize();
+    if (pnode->nRecvSize > ReceiveFloodSize()) {
+        if (!pnode->fDisconnect)
+            LogPrintf("socket recv flood control disconnect (%u bytes)\n", pnode->nRecvSize);
+        pnode->CloseSocketDisconnect();
+        return false;
+    }
+
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, fComplete))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return nBytes == (int)sizeof(pchBuf);
+    }
+
+    if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %d\n", nErr);
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+// Read once from the socket, returns true if there may be more to read now:
+// the read filled the buffer, or the node was busy and nothing was read.
+static bool SocketRecvData(CNode* pnode)
+{
+    bool fComplete = false;
+    bool fMore = SocketRecvBytes(pnode, fComplete);
+
+    // outside cs_vRecvMsg
+    if (fComplete)
+        QueueMessageCheck(pnode);
+    return fMore;
+}
+
+static void SocketCheckInactivity(CNode* pnode, int64_t nTime)
+{
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %ds\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket receive timeout: %ds\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+static int hEpoll = -1;
+
+// Node sockets are edge-triggered, epoll_event.data.ptr is the CNode.
+// Listening sockets are level-triggered with a NULL data.ptr.
+static bool SocketEventsAdd(SOCKET hSocket, CNode* pnode)
+{
+    if (hEpoll == -1)
+        return false;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = pnode ? (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET) : EPOLLIN;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hSocket, &event) != 0)
+    {
+        LogPrintf("epoll_ctl add failed, error %d\n", errno);
+        return false;
+    }
+    return true;
+}
+
+static void SocketEventsRemove(SOCKET hSocket)
+{
+    if (hEpoll == -1)
+        return;
+
+    struct epoll_event event; // ignored, but must be non-NULL before 2.6.9
+    if (epoll_ctl(hEpoll, EPOLL_CTL_DEL, hSocket, &event) != 0)
+        LogPrint("net", "epoll_ctl del failed, error %d\n", errno);
+}
+
+static bool SocketEventsInit()
+{
+    hEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpoll == -1)
+    {
+        LogPrintf("epoll_create1 failed, error %d, falling back to select()\n", errno);
+        return false;
+    }
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        if (hListenSocket != INVALID_SOCKET)
+            SocketEventsAdd(hListenSocket, NULL);
+    return true;
+}
+
+static void ThreadSocketHandlerEpoll()
+{
+    unsigned int nPrevNodeCount = 0;
+    int64_t nLastHousekeeping = 0;
+
+    // Nodes with readiness not yet used up: data left to read, or an
+    // EPOLLOUT that could not be applied because cs_vSend was busy.
+    // Each entry holds a reference so the node can't be deleted meanwhile.
+    std::set<CNode*> setRecvReady;
+    std::set<CNode*> setSendReady;
+
+    // Nodes in setRecvReady left unread last round while their send queue drains
+    size_t nRecvDeferred = 0;
+
+    static const int MAX_EVENTS = 256;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (true)
+    {
+        //
+        // Disconnect nodes and check timeouts, O(vNodes) so not every event
+        //
+        int64_t nTimeMillis = GetTimeMillis();
+        if (nTimeMillis - nLastHousekeeping >= 100)
+        {
+            nLastHousekeeping = nTimeMillis;
+            SocketDisconnectNodes(nPrevNodeCount);
+
+            int64_t nTime = GetTime();
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                if (pnode->hSocket != INVALID_SOCKET)
+                    SocketCheckInactivity(pnode, nTime);
+        }
+
+        // Poll only when nothing is left over from the last round, a drained
+        // send queue raises EPOLLOUT to wake up the deferred reads
+        int nTimeout = (setRecvReady.size() == nRecvDeferred && setSendReady.empty()) ? 100 : 0;
+        int nEvents = epoll_wait(hEpoll, events, MAX_EVENTS, nTimeout);
+        boost::this_thread::interruption_point();
+
+        if (nEvents < 0)
+        {
+            if (errno != EINTR)
+            {
+                LogPrintf("socket epoll_wait error %d\n", errno);
+                MilliSleep(50);
+            }
+            nEvents = 0;
+        }
+
+        {
+            LOCK(cs_vNodes);
+            for (int i = 0; i < nEvents; i++)
+            {
+                CNode* pnode = (CNode*)events[i].data.ptr;
+                if (!pnode)
+                    continue;
+                if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    && setRecvReady.insert(pnode).second)
+                    pnode->AddRef();
+                if ((events[i].events & EPOLLOUT)
+                    && setSendReady.insert(pnode).second)
+                    pnode->AddRef();
+            }
+        }
+
+        //
+        // Accept new connections
+        //
+        for (int i = 0; i < nEvents; i++)
+        {
+            if (events[i].data.ptr)
+                continue;
+            BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+            {
+                if (hListenSocket == INVALID_SOCKET)
+                    continue;
+                CNode* pnode = SocketAcceptConnection(hListenSocket);
+                if (pnode)
+                    SocketEventsAdd(pnode->hSocket, pnode);
+            }
+            break;
+        }
+
+        //
+        // Service ready sockets
+        //
+        std::vector<CNode*> vNodesDone;
+        for (std::set<CNode*>::iterator it = setSendReady.begin(); it != setSendReady.end(); ++it)
+        {
+            CNode* pnode = *it;
+            if (pnode->hSocket != INVALID_SOCKET)
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (!lockSend)
+                    continue;
+                pnode->fSocketWritable = true;
+                if (!pnode->vSendMsg.empty())
+                {
+                    size_t nSendSizeBefore = pnode->nSendSize;
+                    SocketSendData(pnode);
+
+                    // ProcessGetData stops while the send buffer is full
+                    if (nSendSizeBefore >= SendBufferSize() && pnode->nSendSize < SendBufferSize())
+                        WakeMessageHandler();
+                };
             }
+            vNodesDone.push_back(pnode);
+        }
+        BOOST_FOREACH(CNode* pnode, vNodesDone)
+            setSendReady.erase(pnode);
+
+        std::vector<CNode*> vNodesRecvDone;
+        nRecvDeferred = 0;
+        for (std::set<CNode*>::iterator it = setRecvReady.begin(); it != setRecvReady.end(); ++it)
+        {
+            boost::this_thread::interruption_point();
+
+            CNode* pnode = *it;
+            if (pnode->hSocket != INVALID_SOCKET)
+            {
+                // do not read, if draining write queue, the node stays ready for a later round
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (!lockSend)
+                    continue;
+                if (!pnode->vSendMsg.empty())
+                {
+                    nRecvDeferred++;
+                    continue;
+                };
+            };
+
+            // A few reads per round, so one fast peer can't starve the rest
+            bool fMore = false;
+            for (int n = 0; n < 4 && pnode->hSocket != INVALID_SOCKET; n++)
+                if (!(fMore = SocketRecvData(pnode)))
+                    break;
+            if (!fMore || pnode->hSocket == INVALID_SOCKET)
+                vNodesRecvDone.push_back(pnode);
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+        BOOST_FOREACH(CNode* pnode, vNodesRecvDone)
+            setRecvReady.erase(pnode);
+        vNodesDone.insert(vNodesDone.end(), vNodesRecvDone.begin(), vNodesRecvDone.end());
+
+        if (!vNodesDone.empty())
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesDone)
+                pnode->Release();
         }
 
+        // Work left over is only lock contention or a busy peer, give the
+        // other threads a moment before retrying.
+        if (setRecvReady.size() > nRecvDeferred || !setSendReady.empty())
+            MilliSleep(1);
+    } // main loop
+}
+#endif
+
+static void ThreadSocketHandlerSelect()
+{
+    unsigned int nPrevNodeCount = 0;
+
+    while (true)
+    {
+        //
+        // Disconnect nodes
+        //
+        SocketDisconnectNodes(nPrevNodeCount);
+
 
         //
         // Find which sockets have data to receive
@@ -911,50 +1451,7 @@ void ThreadSocketHandler()
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
         if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
-        {
-            struct sockaddr_storage sockaddr;
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    LogPrintf("Warning: Unknown socket family\n");
-
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    LogPrintf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
-            {
-                closesocket(hSocket);
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                closesocket(hSocket);
-            }
-            else
-            {
-                LogPrint("net", "accepted connection %s\n", addr.ToString());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
-        }
+            SocketAcceptConnection(hListenSocket);
 
 
         //
@@ -977,48 +1474,7 @@ void ThreadSocketHandler()
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (pnode->GetTotalRecvSize() > ReceiveFloodSize()) {
-                        if (!pnode->fDisconnect)
-                            LogPrintf("socket recv flood control disconnect (%u bytes)\n", pnode->GetTotalRecvSize());
-                        pnode->CloseSocketDisconnect();
-                    }
-                    else {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
-            }
+                SocketRecvData(pnode);
 
             //
             // Send
@@ -1029,36 +1485,20 @@ void ThreadSocketHandler()
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
+                {
+                    size_t nSendSizeBefore = pnode->nSendSize;
                     SocketSendData(pnode);
+
+                    // ProcessGetData stops while the send buffer is full
+                    if (nSendSizeBefore >= SendBufferSize() && pnode->nSendSize < SendBufferSize())
+                        WakeMessageHandler();
+                };
             }
 
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %ds\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-				else if (nTime - pnode->nLastRecv > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket receive timeout: %ds\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            SocketCheckInactivity(pnode, GetTime());
         }
         {
             LOCK(cs_vNodes);
@@ -1070,6 +1510,18 @@ void ThreadSocketHandler()
     } // main loop
 }
 
+void ThreadSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (hEpoll != -1)
+    {
+        ThreadSocketHandlerEpoll();
+        return;
+    }
+#endif
+    ThreadSocketHandlerSelect();
+}
+
 
 
 
@@ -1480,12 +1932,105 @@ static int64_t NodeSyncScore(const CNode *pnode) {
 }
 
 
+static boost::mutex mutexMsgHandler;
+static boost::condition_variable condMsgHandler;
+static bool fMsgHandlerWake = false;
+
+static boost::mutex mutexMsgCheck;
+static boost::condition_variable condMsgCheck;
+static std::deque<NodeId> vMsgCheckQueue;
+static int nMsgCheckThreads = 0;
+
+void WakeMessageHandler()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(mutexMsgHandler);
+        fMsgHandlerWake = true;
+    }
+    condMsgHandler.notify_one();
+}
+
+// A message from pnode is complete, have it verified or handled
+static void QueueMessageCheck(CNode* pnode)
+{
+    if (nMsgCheckThreads < 1)
+    {
+        WakeMessageHandler();
+        return;
+    };
+
+    {
+        boost::unique_lock<boost::mutex> lock(mutexMsgCheck);
+        vMsgCheckQueue.push_back(pnode->GetId());
+    }
+    condMsgCheck.notify_one();
+}
+
+// Verify the checksums of received messages ahead of ThreadMessageHandler,
+// hashing a large message shouldn't delay the peers queued behind it.
+void ThreadMessageCheck()
+{
+    while (true)
+    {
+        NodeId id;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMsgCheck);
+            while (vMsgCheckQueue.empty())
+                condMsgCheck.wait(lock);
+            id = vMsgCheckQueue.front();
+            vMsgCheckQueue.pop_front();
+        }
+
+        CNode* pnode = NULL;
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnodeFind, vNodes)
+            {
+                if (pnodeFind->GetId() != id)
+                    continue;
+                pnode = pnodeFind->AddRef();
+                break;
+            };
+        }
+        if (!pnode)
+            continue;
+
+        {
+            // if busy, ProcessMessages is at it and checks inline
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv)
+            {
+                BOOST_FOREACH(CNetMessage& msg, pnode->vRecvMsg)
+                {
+                    if (!msg.complete())
+                        break;
+                    if (!msg.fChecked)
+                        msg.CheckChecksum();
+                };
+            };
+        }
+
+        {
+            LOCK(cs_vNodes);
+            pnode->Release();
+        }
+
+        WakeMessageHandler();
+    };
+}
+
 void ThreadMessageHandler()
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
     {
         boost::this_thread::interruption_point();
+        {
+            // anything arriving from here on cuts the wait below short
+            boost::unique_lock<boost::mutex> lock(mutexMsgHandler);
+            fMsgHandlerWake = false;
+        }
+
         vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
@@ -1540,8 +2085,14 @@ void ThreadMessageHandler()
                 pnode->Release();
         } // cs_vNodes
 
+        // Wait for a message to arrive or for something to send, SendMessages
+        // still runs at least every 100ms for pings and the inventory trickle.
         if (fSleep)
-            MilliSleep(100);
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMsgHandler);
+            if (!fMsgHandlerWake)
+                condMsgHandler.timed_wait(lock, boost::posix_time::milliseconds(100));
+        };
     };
 }
 
@@ -1732,7 +2283,16 @@ void StartNode(boost::thread_group& threadGroup)
 
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
+    // Verify received messages for the message handler
+    nMsgCheckThreads = std::max(0, std::min(8, (int)GetArg("-msghandlerthreads", DEFAULT_MSGHANDLER_THREADS)));
+    for (int i = 0; i < nMsgCheckThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgcheck", &ThreadMessageCheck));
+
     // Send and receive from sockets, accept connections
+#ifdef USE_EPOLL
+    if (hEpoll == -1)
+        SocketEventsInit();
+#endif
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
     // Initiate outbound connections from -addnode
@@ -1777,6 +2337,11 @@ public:
                 if (closesocket(hListenSocket) == SOCKET_ERROR)
                     LogPrintf("closesocket(hListenSocket) failed with error %d\n", WSAGetLastError());
 
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
+            close(hEpoll);
+#endif
+
 #ifdef WIN32
         // Shutdown Windows Sockets
         WSACleanup();
@@ -1796,37 +2361,75 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash)
 void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
 {
     CInv inv(MSG_TX, hash);
+    LOCK(cs_mapRelay);
+    // Expire old relay messages
+    int64_t nNow = GetTime();
+    while (!vRelayExpiration.empty() && vRelayExpiration.front().first < nNow)
+    {
+        mapRelay.erase(vRelayExpiration.front().second);
+        vRelayExpiration.pop_front();
+    }
+
+    // Save original serialized message so newer versions are preserved
+    mapRelay.insert(std::make_pair(inv, ss));
+    vRelayExpiration.push_back(std::make_pair(nNow + 15 * 60, inv));
+
+    // -- peers are not visited here, each picks up the queue on its next inv flush
+    while (!vRelayQueue.empty() && vRelayQueue.front().nExpire < nNow)
+    {
+        vRelayQueue.pop_front();
+        nRelayQueueSeq++;
+    };
+
+    CRelayEntry entry;
+    entry.inv = inv;
+    entry.nExpire = nNow + RELAY_QUEUE_EXPIRY;
+    entry.ptx.reset(new CTransaction(tx));
+    vRelayQueue.push_back(entry);
+}
+
+void PullRelayedInventory(CNode* pnode)
+{
+    std::vector<CRelayEntry> vEntries;
     {
         LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
+        uint64_t nSeqEnd = nRelayQueueSeq + vRelayQueue.size();
+        if (pnode->nRelaySeq == 0)
         {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
-        }
+            // -- new peers only get transactions relayed after they connected
+            pnode->nRelaySeq = nSeqEnd;
+            return;
+        };
+
+        if (pnode->nRelaySeq < nRelayQueueSeq)
+            pnode->nRelaySeq = nRelayQueueSeq;
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+        if (pnode->fRelayTxes)
+            vEntries.assign(vRelayQueue.begin() + (pnode->nRelaySeq - nRelayQueueSeq), vRelayQueue.end());
+        pnode->nRelaySeq = nSeqEnd;
     }
 
-    LOCK(cs_vNodes);
-    BOOST_FOREACH(CNode* pnode, vNodes)
+    if (vEntries.empty())
+        return;
+
+    LOCK2(pnode->cs_filter, pnode->cs_inventory);
+    BOOST_FOREACH(const CRelayEntry& entry, vEntries)
     {
-        if(!pnode->fRelayTxes)
+        if (pnode->pfilter
+            && !pnode->pfilter->IsRelevantAndUpdate(*entry.ptx))
             continue;
-        LOCK(pnode->cs_filter);
-        if (pnode->pfilter)
-        {
-            if (pnode->pfilter->IsRelevantAndUpdate(tx))
-                pnode->PushInventory(inv);
-        } else
-        {
-            pnode->PushInventory(inv);
-        };
+        if (!pnode->setInventoryKnown.count(entry.inv))
+            pnode->vInventoryToSend.push_back(entry.inv);
     };
 }
 
+int64_t PoissonNextSend(int64_t nNow, int nAverageIntervalSeconds)
+{
+    // -- -ln(U) for uniform U in (0, 1] gives exponentially distributed intervals
+    double dUniform = (GetRand(1ULL << 48) + 1) / (double)(1ULL << 48);
+    return nNow + (int64_t)(-log(dUniform) * nAverageIntervalSeconds * 1000000.0 + 0.5);
+}
+
 void CNode::RecordBytesRecv(uint64_t bytes)
 {
     LOCK(cs_totalBytesRecv);
@@ -8,6 +8,7 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 #include <openssl/rand.h>
 
@@ -46,6 +47,32 @@ static const bool DEFAULT_UPNP = USE_UPNP;
 #else
 static const bool DEFAULT_UPNP = false;
 #endif
+/** -msghandlerthreads default, threads verifying received messages for ThreadMessageHandler */
+static const int DEFAULT_MSGHANDLER_THREADS = 2;
+/** Messages gathered into one sendmsg() call */
+static const unsigned int MAX_SEND_IOV = 64;
+/** Sent message buffers kept per peer for reuse, and the largest buffer kept */
+static const unsigned int MAX_SEND_POOL = 8;
+static const size_t MAX_SEND_POOL_BUFFER = 256 * 1024;
+/** Receive buffers are allocated in steps of RECV_BUFFER_STEP. Buffers of consumed messages are
+ *  pooled for all peers in two classes, up to RECV_BUFFER_SMALL bytes and up to RECV_BUFFER_STEP */
+static const unsigned int RECV_BUFFER_STEP = 256 * 1024;
+static const unsigned int RECV_BUFFER_SMALL = 4 * 1024;
+static const unsigned int MAX_RECV_POOL_SMALL = 64;
+static const unsigned int MAX_RECV_POOL_LARGE = 8;
+/** Upper bounds of the message processing time histogram buckets in microseconds, the last bucket is unbounded */
+static const int64_t MSG_TIME_BUCKETS[] = {10, 100, 1000, 10000, 100000, 1000000};
+static const unsigned int MSG_TIME_BUCKET_COUNT = sizeof(MSG_TIME_BUCKETS) / sizeof(MSG_TIME_BUCKETS[0]) + 1;
+/** Commands tracked per peer and globally, further commands are counted as "other" */
+static const unsigned int MAX_MSG_STATS_COMMANDS = 64;
+/** Average seconds between transaction inv flushes to an inbound peer, outbound peers get half */
+static const int INVENTORY_BROADCAST_INTERVAL = 5;
+/** -invrate* defaults, transaction announcements per second by peer class */
+static const int DEFAULT_INV_RATE_INBOUND = 7;
+static const int DEFAULT_INV_RATE_OUTBOUND = 14;
+static const int DEFAULT_INV_RATE_THIN = 7;
+/** Seconds a relayed transaction stays in the relay queue for peers to pick up */
+static const int RELAY_QUEUE_EXPIRY = 15 * 60;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
@@ -63,6 +90,7 @@ bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::str
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+void WakeMessageHandler();
 
 // Signals for message handling
 struct CNodeSignals
@@ -180,6 +208,39 @@ public:
     std::vector<int> vHeightInFlight;
 };
 
+/** Counters for one message command */
+class CMessageStats
+{
+public:
+    uint64_t nRecv;
+    uint64_t nRecvBytes;
+    uint64_t nSent;
+    uint64_t nSentBytes;
+    int64_t nProcessUsec;                           // total time in ProcessMessage
+    uint64_t vProcessBuckets[MSG_TIME_BUCKET_COUNT];  // messages by processing time, not cumulative
+
+    CMessageStats()
+    {
+        nRecv = 0;
+        nRecvBytes = 0;
+        nSent = 0;
+        nSentBytes = 0;
+        nProcessUsec = 0;
+        memset(vProcessBuckets, 0, sizeof(vProcessBuckets));
+    }
+
+    void AddRecv(unsigned int nBytes, int64_t nUsec);
+};
+
+typedef std::map<std::string, CMessageStats> MessageStatsMap;
+
+/** Count a received message and the time it took to process, requires the node's cs_vRecvMsg */
+void RecordMessageRecv(CNode* pnode, const std::string& strCommand, unsigned int nBytes, int64_t nUsec);
+/** Count a message queued to a node, from its serialized header */
+void RecordMessageSent(CNode* pnode, const char* pchHeader, unsigned int nBytes);
+/** Counters summed over all peers, including disconnected ones */
+void GetMessageStats(MessageStatsMap& mapStats);
+
 class CNodeStats
 {
 public:
@@ -198,6 +259,8 @@ public:
     int nMisbehavior;
     uint64_t nSendBytes;
     uint64_t nRecvBytes;
+    unsigned int nRecvSize;
+    MessageStatsMap mapMsgStats;
     bool fSyncNode;
     double dPingTime;
     double dPingWait;
@@ -205,12 +268,57 @@ public:
 };
 
 
+/** A complete serialized message, header included, that can be queued to several peers */
+typedef boost::shared_ptr<const CSerializeData> CSharedMessage;
+
+/** Set the size and checksum in the header of a message serialized after a CMessageHeader */
+inline void CompleteMessageHeader(CDataStream& ss)
+{
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
+/** Serialize a message once, for CNode::PushSharedMessage */
+template<typename T>
+CSharedMessage MakeSharedMessage(const char* pszCommand, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(pszCommand, 0) << obj;
+    CompleteMessageHeader(ss);
+
+    boost::shared_ptr<CSerializeData> pdata(new CSerializeData());
+    ss.GetAndClear(*pdata);
+    return pdata;
+}
+
+/** Give vRecv a pooled buffer for a message of nMessageSize bytes, vRecv must be empty */
+void TakeRecvBuffer(unsigned int nMessageSize, CDataStream& vRecv);
+/** Return the buffer of vRecv to the pool, vRecv is left empty */
+void ReturnRecvBuffer(CDataStream& vRecv);
+
+/** Queued outgoing message, owned by the peer or shared with other peers */
+class CSendMsg
+{
+public:
+    CSerializeData data;
+    CSharedMessage pshared;
+
+    const CSerializeData& Get() const { return pshared ? *pshared : data; }
+};
+
+
 class CNetMessage
 {
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
-    CDataStream hdrbuf;             // partially received header
+    char hdrbuf[CMessageHeader::HEADER_SIZE]; // partially received header
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
@@ -219,13 +327,17 @@ public:
 
     int64_t nTime;                  // time (in microseconds) of message receipt.
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn)
+    bool fChecked;                  // checksum verified, by a msgcheck thread or ProcessMessages
+    bool fChecksumOk;
+
+    CNetMessage(int nTypeIn, int nVersionIn) : vRecv(nTypeIn, nVersionIn)
     {
-        hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
         nTime = 0;
+        fChecked = false;
+        fChecksumOk = false;
     }
 
     bool complete() const
@@ -235,14 +347,21 @@ public:
         return (hdr.nMessageSize == nDataPos);
     }
 
+    ~CNetMessage()
+    {
+        ReturnRecvBuffer(vRecv);
+    }
+
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    // requires complete()
+    bool CheckChecksum();
 };
 
 
@@ -282,15 +401,22 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSendMsg> vSendMsg;
+    std::vector<CSerializeData> vSendPool; // emptied buffers of sent messages
     CCriticalSection cs_vSend;
+    bool fSocketWritable; // epoll: set on EPOLLOUT, cleared when send() would block
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
     uint64_t nRecvBytes;
+    unsigned int nRecvSize; // bytes buffered in vRecvMsg, as of the last RecalcRecvSize
     int nRecvVersion;
 
+    MessageStatsMap mapMsgStats;
+    CCriticalSection cs_msgStats;
+    std::vector<std::pair<int64_t, int> > vMsgRate; // per message handler: minute started, messages in it; requires cs_vRecvMsg
+
     int64_t nLastSend;
     int64_t nLastRecv;
     
@@ -343,7 +469,11 @@ public:
     mruset<CInv> setInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
+    uint64_t nRelaySeq;     // next entry of the relay queue to pick up, 0 before the first pick up
+    int64_t nNextInvSend;   // time of the next transaction inv flush, in microseconds
+    int64_t nLastInvSend;
     std::multimap<int64_t, CInv> mapAskFor;
+    mruset<uint256> setCmpctBlocksAsked; // cmpctblock is only accepted for these, message handler thread only
 
     SecMsgNode smsgData;
 
@@ -370,6 +500,7 @@ public:
         nLastRecv = 0;
         nSendBytes = 0;
         nRecvBytes = 0;
+        nRecvSize = 0;
         nLastSendEmpty = GetTime();
         nTimeConnected = GetTime();
         nTimeOffset = 0;
@@ -388,6 +519,8 @@ public:
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
+        vSendPool.reserve(MAX_SEND_POOL);
+        fSocketWritable = false;
         hashContinue = 0;
         pindexLastGetBlocksBegin = 0;
         pindexLastGetBlockThinsBegin = 0;
@@ -396,6 +529,10 @@ public:
         fGetAddr = false;
         nMisbehavior = 0;
         setInventoryKnown.max_size(SendBufferSize() / 1000);
+        setCmpctBlocksAsked.max_size(16);
+        nRelaySeq = 0;
+        nNextInvSend = 0;
+        nLastInvSend = 0;
         pfilter = NULL;
         nPingNonceSent = 0;
         nPingUsecStart = 0;
@@ -441,7 +578,7 @@ public:
     }
 
     // requires LOCK(cs_vRecvMsg)
-    unsigned int GetTotalRecvSize()
+    unsigned int GetTotalRecvSize() const
     {
         unsigned int total = 0;
         BOOST_FOREACH(const CNetMessage &msg, vRecvMsg) 
@@ -449,8 +586,14 @@ public:
         return total;
     }
 
+    // requires LOCK(cs_vRecvMsg), refreshes nRecvSize for the node stats
+    void RecalcRecvSize()
+    {
+        nRecvSize = GetTotalRecvSize();
+    }
+
     // requires LOCK(cs_vRecvMsg)
-    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
+    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& fComplete);
 
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
@@ -503,6 +646,10 @@ public:
             if (!setInventoryKnown.count(inv))
                 vInventoryToSend.push_back(inv);
         }
+
+        // Transactions wait for the trickle, anything else goes out on the next round
+        if (inv.type != MSG_TX)
+            WakeMessageHandler();
     }
 
     void AskFor(const CInv& inv)
@@ -559,30 +706,61 @@ public:
         if (ssSend.size() == 0)
             return;
 
-        // Set the size
-        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-        memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+        CompleteMessageHeader(ssSend);
 
-        // Set the checksum
-        uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+        LogPrint("net", "(%d bytes)\n", ssSend.size() - CMessageHeader::HEADER_SIZE);
+        RecordMessageSent(this, &ssSend[0], ssSend.size());
 
-        LogPrint("net", "(%d bytes)\n", nSize);
-
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        // Move the message into the send queue. With a recycled buffer in vSendPool the
+        // buffers are swapped: the queue takes ssSend's buffer and ssSend gets the empty
+        // pooled one. With the pool empty the message is copied and ssSend keeps its buffer.
+        std::deque<CSendMsg>::iterator it = vSendMsg.insert(vSendMsg.end(), CSendMsg());
+        if (!vSendPool.empty())
+        {
+            CSerializeData& buffer = vSendPool.back();
+            ssSend.SwapAndClear(buffer);
+            it->data.swap(buffer);
+            vSendPool.pop_back();
+        } else
+        {
+            ssSend.GetAndClear(it->data);
+        };
+        nSendSize += it->data.size();
 
-        // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        // If write queue empty, or the socket is known to have room, attempt "optimistic write"
+        if (it == vSendMsg.begin() || fSocketWritable)
             SocketSendData(this);
 
         LEAVE_CRITICAL_SECTION(cs_vSend);
     }
 
+    // Queue a message serialized once for several peers
+    void PushSharedMessage(const CSharedMessage& msg)
+    {
+        LOCK(cs_vSend);
+        std::deque<CSendMsg>::iterator it = vSendMsg.insert(vSendMsg.end(), CSendMsg());
+        it->pshared = msg;
+        nSendSize += msg->size();
+        RecordMessageSent(this, &(*msg)[0], msg->size());
+
+        LogPrint("net", "sending: shared message (%d bytes)\n", msg->size() - CMessageHeader::HEADER_SIZE);
+
+        if (it == vSendMsg.begin() || fSocketWritable)
+            SocketSendData(this);
+    }
+
+    // Keep the buffer of a sent message for reuse, requires cs_vSend
+    void RecycleSendBuffer(CSendMsg& msg)
+    {
+        if (msg.pshared
+            || vSendPool.size() >= MAX_SEND_POOL
+            || msg.data.capacity() > MAX_SEND_POOL_BUFFER)
+            return;
+        msg.data.clear();
+        vSendPool.push_back(CSerializeData());
+        vSendPool.back().swap(msg.data);
+    }
+
     void PushVersion();
 
 
@@ -835,6 +1013,10 @@ public:
 class CTransaction;
 void RelayTransaction(const CTransaction& tx, const uint256& hash);
 void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss);
+/** Move transactions relayed since the last call into the node's vInventoryToSend */
+void PullRelayedInventory(CNode* pnode);
+/** Time of the next event of a Poisson process with the given average interval, in microseconds */
+int64_t PoissonNextSend(int64_t nNow, int nAverageIntervalSeconds);
 
 
 #endif
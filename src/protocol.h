@@ -147,6 +147,8 @@ enum
     // Nodes may always request a MSG_FILTERED_BLOCK in a getdata, however,
     // MSG_FILTERED_BLOCK should not appear in any invs except as a part of getdata.
     MSG_FILTERED_BLOCK,
+    // Only in getdata, asks for the block as a cmpctblock message
+    MSG_CMPCT_BLOCK,
 };
 
 #endif // __INCLUDED_PROTOCOL_H__
@@ -8,6 +8,8 @@
 #include "main.h"
 #include "chainparams.h"
 
+#include <algorithm>
+
 #include <openssl/err.h>
 #include <openssl/rand.h>
 #include <openssl/ec.h>
@@ -21,6 +23,137 @@ static BN_CTX   *bnCtx   = NULL;
 static BIGNUM   *bnOrder = NULL;
 
 
+/** Decompressed public keys and Hp(P) of recently seen ring members.
+ *  Popular anon outputs appear as decoys in many rings, decoding and hashing them to the
+ *  curve once saves most of the work of verifying those rings again.
+ *  Points are stored affine, entries are evicted oldest first. */
+class CRingMemberCache
+{
+public:
+    class CEntry
+    {
+    public:
+        CEntry() : ptPk(NULL), ptHp(NULL), fV3(false) {};
+
+        EC_POINT *ptPk;
+        EC_POINT *ptHp;
+        bool fV3;       // Hp(P) depends on hashToEC mode
+    };
+
+    CRingMemberCache() : nMaxSize(DEFAULT_RING_MEMBER_CACHE_SIZE), nHits(0), nMisses(0), nEvictions(0) {};
+    ~CRingMemberCache() { Clear(); };
+
+    void SetMaxSize(size_t nMaxSizeIn)
+    {
+        LOCK(cs);
+        nMaxSize = nMaxSizeIn;
+        while (queue.size() > nMaxSize)
+            EvictOldest();
+    }
+
+    // - copy the cached points into ptPk and ptHp, both must already exist
+    bool Get(const ec_point &pkKey, bool fV3, EC_POINT *ptPk, EC_POINT *ptHp)
+    {
+        LOCK(cs);
+        std::map<ec_point, CEntry>::iterator mi = map.find(pkKey);
+        if (mi == map.end()
+          ||mi->second.fV3 != fV3
+          ||!EC_POINT_copy(ptPk, mi->second.ptPk)
+          ||!EC_POINT_copy(ptHp, mi->second.ptHp))
+        {
+            nMisses++;
+            return false;
+        };
+        nHits++;
+        return true;
+    }
+
+    void Set(const ec_point &pkKey, bool fV3, const EC_POINT *ptPk, const EC_POINT *ptHp)
+    {
+        LOCK(cs);
+        if (nMaxSize == 0)
+            return;
+
+        std::map<ec_point, CEntry>::iterator mi = map.find(pkKey);
+        if (mi == map.end())
+        {
+            if (queue.size() >= nMaxSize)
+                EvictOldest();
+            mi = map.insert(std::make_pair(pkKey, CEntry())).first;
+            queue.push_back(pkKey);
+        };
+
+        CEntry &entry = mi->second;
+        if ((!entry.ptPk && !(entry.ptPk = EC_POINT_new(ecGrp)))
+          ||(!entry.ptHp && !(entry.ptHp = EC_POINT_new(ecGrp)))
+          ||!EC_POINT_copy(entry.ptPk, ptPk)
+          ||!EC_POINT_copy(entry.ptHp, ptHp))
+        {
+            // - leave no partial entry behind
+            EC_POINT_free(entry.ptPk);
+            EC_POINT_free(entry.ptHp);
+            map.erase(mi);
+            std::deque<ec_point>::iterator qi = std::find(queue.begin(), queue.end(), pkKey);
+            if (qi != queue.end())
+                queue.erase(qi);
+            return;
+        };
+        entry.fV3 = fV3;
+    }
+
+    void Clear()
+    {
+        LOCK(cs);
+        for (std::map<ec_point, CEntry>::iterator mi = map.begin(); mi != map.end(); ++mi)
+        {
+            EC_POINT_free(mi->second.ptPk);
+            EC_POINT_free(mi->second.ptHp);
+        };
+        map.clear();
+        queue.clear();
+    }
+
+    void GetStats(CRingMemberCacheStats &stats)
+    {
+        LOCK(cs);
+        stats.nEntries = map.size();
+        stats.nMaxEntries = nMaxSize;
+        stats.nHits = nHits;
+        stats.nMisses = nMisses;
+        stats.nEvictions = nEvictions;
+    }
+
+private:
+    void EvictOldest()
+    {
+        std::map<ec_point, CEntry>::iterator mi = map.find(queue.front());
+        if (mi != map.end())
+        {
+            EC_POINT_free(mi->second.ptPk);
+            EC_POINT_free(mi->second.ptHp);
+            map.erase(mi);
+        };
+        queue.pop_front();
+        nEvictions++;
+    }
+
+    CCriticalSection cs;
+    std::map<ec_point, CEntry> map;
+    std::deque<ec_point> queue;
+    size_t nMaxSize;
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nEvictions;
+};
+
+static CRingMemberCache ringMemberCache;
+
+void GetRingMemberCacheStats(CRingMemberCacheStats &stats)
+{
+    ringMemberCache.GetStats(stats);
+}
+
+
 int initialiseRingSigs()
 {
     int rv = 0;
@@ -43,6 +176,8 @@ int initialiseRingSigs()
 
     BN_CTX_end(bnCtx);
 
+    ringMemberCache.SetMaxSize(GetArg("-ringmembercache", DEFAULT_RING_MEMBER_CACHE_SIZE));
+
     return rv;
 }
 
@@ -51,6 +186,8 @@ int finaliseRingSigs()
     if (fDebugRingSig)
         LogPrintf("finaliseRingSigs()\n");
 
+    ringMemberCache.Clear();
+
     BN_free(bnOrder);
     BN_CTX_free(bnCtx);
     EC_GROUP_clear_free(ecGrp);
@@ -159,19 +296,23 @@ int getOldKeyImage(CPubKey &publicKey, ec_point &keyImage)
     return 0;
 }
 
-static int hashToEC(const uint8_t *p, uint32_t len, BIGNUM *bnTmp, EC_POINT *ptRet, bool fNew=false)
+static int hashToEC(const uint8_t *p, uint32_t len, BIGNUM *bnTmp, EC_POINT *ptRet, bool fNew=false, BN_CTX *ctx=NULL)
 {
     // - bn(hash(data)) * (G + bn1)
+    // - ctx must be started by the caller, defaults to the shared bnCtx
+    if (!ctx)
+        ctx = bnCtx;
+
     int count = 0;
     uint256 pkHash = Hash(p, p + len);
-    BIGNUM *bnOne = BN_CTX_get(bnCtx);
+    BIGNUM *bnOne = BN_CTX_get(ctx);
     BN_one(bnOne);
 
     if (!bnTmp || !BN_bin2bn(pkHash.begin(), EC_SECRET_SIZE, bnTmp))
         return errorN(1, "%s: BN_bin2bn failed.", __func__);
 
     if (fNew || Params().IsProtocolV3(nBestHeight))
-        while(!EC_POINT_set_compressed_coordinates_GFp(ecGrp, ptRet, bnTmp, 0, bnCtx) && count < 100)
+        while(!EC_POINT_set_compressed_coordinates_GFp(ecGrp, ptRet, bnTmp, 0, ctx) && count < 100)
         {
             count += 1;
 
@@ -181,7 +322,7 @@ static int hashToEC(const uint8_t *p, uint32_t len, BIGNUM *bnTmp, EC_POINT *ptR
             BN_add(bnTmp, bnTmp, bnOne);
         }
     else
-        if (!EC_POINT_mul(ecGrp, ptRet, bnTmp, NULL, NULL, bnCtx))
+        if (!EC_POINT_mul(ecGrp, ptRet, bnTmp, NULL, NULL, ctx))
             return errorN(1, "%s: EC_POINT_mul failed.", __func__);
 
     return 0;
@@ -1132,3 +1273,397 @@ int verifyRingSignatureAB(data_chunk &keyImage, uint256 &txnHash, int nRingSize,
     return rv;
 }
 
+
+namespace {
+
+// Decompressed public key and Hp(P) of a ring member, shared by every ring of a batch that references it
+class CRingMemberPoints
+{
+public:
+    CRingMemberPoints() : ptPk(NULL), ptHp(NULL) {};
+
+    EC_POINT *ptPk;
+    EC_POINT *ptHp;
+};
+
+typedef std::map<ec_point, CRingMemberPoints> RingMemberMap;
+
+static void freeRingMembers(RingMemberMap &mapMembers)
+{
+    for (RingMemberMap::iterator it = mapMembers.begin(); it != mapMembers.end(); ++it)
+    {
+        EC_POINT_free(it->second.ptPk);
+        EC_POINT_free(it->second.ptHp);
+    };
+    mapMembers.clear();
+}
+
+static void freePoints(std::vector<EC_POINT*> &vPoints)
+{
+    for (size_t i = 0; i < vPoints.size(); ++i)
+        EC_POINT_free(vPoints[i]);
+    vPoints.clear();
+}
+
+static int decodeRingMembers(const std::vector<CRingSigCheck> &vChecks, RingMemberMap &mapMembers, BN_CTX *ctx)
+{
+    std::vector<EC_POINT*> vNew;
+    std::vector<RingMemberMap::iterator> vNewMembers;
+    BIGNUM *bnT = BN_CTX_get(ctx);
+    if (!bnT)
+        return errorN(1, "%s: BN_CTX_get failed.", __func__);
+
+    bool fV3 = Params().IsProtocolV3(nBestHeight);
+
+    for (size_t k = 0; k < vChecks.size(); ++k)
+    {
+        const CRingSigCheck &check = vChecks[k];
+        for (int i = 0; i < check.nRingSize; ++i)
+        {
+            const uint8_t *pPk = &check.pPubkeys[i * EC_COMPRESSED_SIZE];
+            ec_point pkKey(pPk, pPk + EC_COMPRESSED_SIZE);
+
+            std::pair<RingMemberMap::iterator, bool> ret = mapMembers.insert(std::make_pair(pkKey, CRingMemberPoints()));
+            if (!ret.second)
+                continue;
+
+            CRingMemberPoints &member = ret.first->second;
+            if (!(member.ptPk = EC_POINT_new(ecGrp))
+              ||!(member.ptHp = EC_POINT_new(ecGrp)))
+                return errorN(1, "%s: EC_POINT_new failed.", __func__);
+
+            if (ringMemberCache.Get(pkKey, fV3, member.ptPk, member.ptHp))
+                continue;
+
+            if (!EC_POINT_oct2point(ecGrp, member.ptPk, pPk, EC_COMPRESSED_SIZE, ctx))
+                return errorN(1, "%s: EC_POINT_oct2point failed.", __func__);
+
+            BN_CTX_start(ctx);
+            int rv = hashToEC(pPk, EC_COMPRESSED_SIZE, bnT, member.ptHp, fV3, ctx);
+            BN_CTX_end(ctx);
+            if (rv != 0)
+                return errorN(1, "%s: hashToEC failed.", __func__);
+
+            vNew.push_back(member.ptHp);
+            vNewMembers.push_back(ret.first);
+        };
+    };
+
+    // -- one field inversion for all Hp(P) instead of one per point
+    if (vNew.size() > 0
+        && !EC_POINTs_make_affine(ecGrp, vNew.size(), &vNew[0], ctx))
+        return errorN(1, "%s: EC_POINTs_make_affine failed.", __func__);
+
+    for (size_t k = 0; k < vNewMembers.size(); ++k)
+        ringMemberCache.Set(vNewMembers[k]->first, fV3, vNewMembers[k]->second.ptPk, vNewMembers[k]->second.ptHp);
+
+    return 0;
+}
+
+static int verifyRingSig1(const CRingSigCheck &check, RingMemberMap &mapMembers, std::vector<EC_POINT*> &vPoints, BN_CTX *ctx)
+{
+    // Li = ci * Pi + ri * G
+    // Ri = ci * I + ri * Hp(Pi)
+    int rv = 0;
+    int nRingSize = check.nRingSize;
+    uint8_t tempData[66]; // hold raw point data to hash
+    uint256 commitHash;
+    CHashWriter ssCommitHash(SER_GETHASH, PROTOCOL_VERSION);
+    ssCommitHash << check.txnHash;
+
+    BN_CTX_start(ctx);
+    BIGNUM   *bnT   = BN_CTX_get(ctx);
+    BIGNUM   *bnH   = BN_CTX_get(ctx);
+    BIGNUM   *bnC   = BN_CTX_get(ctx);
+    BIGNUM   *bnR   = BN_CTX_get(ctx);
+    BIGNUM   *bnSum = BN_CTX_get(ctx);
+    EC_POINT *ptKi  = NULL;
+
+    const EC_POINT *pts[2];
+    const BIGNUM *scalars[2];
+
+    if (!bnSum || !(BN_zero(bnSum)))
+    {
+        LogPrintf("%s: BN_zero failed.\n", __func__);
+        rv = 1; goto End;
+    }
+
+    // -- L and R of every member, grown to the largest ring of the batch
+    while (vPoints.size() < (size_t)nRingSize * 2)
+    {
+        EC_POINT *pt = EC_POINT_new(ecGrp);
+        if (!pt)
+        {
+            LogPrintf("%s: EC_POINT_new failed.\n", __func__);
+            rv = 1; goto End;
+        }
+        vPoints.push_back(pt);
+    };
+
+    if (!(ptKi = EC_POINT_new(ecGrp))
+      ||!EC_POINT_oct2point(ecGrp, ptKi, &check.keyImage[0], EC_COMPRESSED_SIZE, ctx))
+    {
+        LogPrintf("%s: extract ptKi failed.\n", __func__);
+        rv = 1; goto End;
+    }
+
+    for (int i = 0; i < nRingSize; ++i)
+    {
+        if (!BN_bin2bn(&check.pSigc[i * EC_SECRET_SIZE], EC_SECRET_SIZE, bnC)
+          ||!BN_bin2bn(&check.pSigr[i * EC_SECRET_SIZE], EC_SECRET_SIZE, bnR))
+        {
+            LogPrintf("%s: extract bnC and bnR failed.\n", __func__);
+            rv = 1; goto End;
+        }
+
+        const uint8_t *pPk = &check.pPubkeys[i * EC_COMPRESSED_SIZE];
+        const CRingMemberPoints &member = mapMembers[ec_point(pPk, pPk + EC_COMPRESSED_SIZE)];
+
+        // L = ri * G + ci * Pi, as one simultaneous multiplication
+        if (!EC_POINT_mul(ecGrp, vPoints[i * 2], bnR, member.ptPk, bnC, ctx))
+        {
+            LogPrintf("%s: EC_POINT_mul failed.\n", __func__);
+            rv = 1; goto End;
+        }
+
+        // R = ci * I + ri * Hp(Pi)
+        pts[0] = ptKi;          scalars[0] = bnC;
+        pts[1] = member.ptHp;   scalars[1] = bnR;
+        if (!EC_POINTs_mul(ecGrp, vPoints[i * 2 + 1], NULL, 2, pts, scalars, ctx))
+        {
+            LogPrintf("%s: EC_POINTs_mul failed.\n", __func__);
+            rv = 1; goto End;
+        }
+
+        // sum = (sum + ci) % N
+        if (!BN_mod_add(bnSum, bnSum, bnC, bnOrder, ctx))
+        {
+            LogPrintf("%s: BN_mod_add failed.\n", __func__);
+            rv = 1; goto End;
+        }
+    };
+
+    // -- convert every L and R with a single inversion before encoding them
+    if (!EC_POINTs_make_affine(ecGrp, nRingSize * 2, &vPoints[0], ctx))
+    {
+        LogPrintf("%s: EC_POINTs_make_affine failed.\n", __func__);
+        rv = 1; goto End;
+    }
+
+    for (int i = 0; i < nRingSize; ++i)
+    {
+        if (!(EC_POINT_point2oct(ecGrp, vPoints[i * 2],     POINT_CONVERSION_COMPRESSED, &tempData[0],  33, ctx) == (int) EC_COMPRESSED_SIZE)
+          ||!(EC_POINT_point2oct(ecGrp, vPoints[i * 2 + 1], POINT_CONVERSION_COMPRESSED, &tempData[33], 33, ctx) == (int) EC_COMPRESSED_SIZE))
+        {
+            LogPrintf("%s: extract ptL and ptR failed.\n", __func__);
+            rv = 1; goto End;
+        }
+
+        ssCommitHash.write((const char*)&tempData[0], 66);
+    };
+
+    commitHash = ssCommitHash.GetHash();
+
+    if (!BN_bin2bn(commitHash.begin(), EC_SECRET_SIZE, bnH)
+      ||!BN_mod(bnH, bnH, bnOrder, ctx)
+      ||!BN_mod_sub(bnT, bnH, bnSum, bnOrder, ctx))
+    {
+        LogPrintf("%s: commitHash -> bnH failed.\n", __func__);
+        rv = 1; goto End;
+    }
+
+    // test bnT == 0  (bnSum == bnH)
+    if (!BN_is_zero(bnT))
+    {
+        LogPrintf("%s: signature does not verify.\n", __func__);
+        rv = 2;
+    }
+
+    End:
+    EC_POINT_free(ptKi);
+    BN_CTX_end(ctx);
+
+    return rv;
+}
+
+static int verifyRingSig2(const CRingSigCheck &check, RingMemberMap &mapMembers, BN_CTX *ctx)
+{
+    // e_i = s_i*G + c_i*P_i, E_i = s_i*H(P_i) + c_i*I, c_{i+1} = h(P_1,...,P_n,e_i,E_i)
+    // check c_{n+1} == c_1
+    int rv = 0;
+    int nRingSize = check.nRingSize;
+    uint8_t tempData[66]; // hold raw point data to hash
+    uint256 tmpPkHash;
+    uint256 tmpHash;
+    CHashWriter ssPkHash(SER_GETHASH, PROTOCOL_VERSION);
+
+    for (int i = 0; i < nRingSize; ++i)
+        ssPkHash.write((const char*)&check.pPubkeys[i * EC_COMPRESSED_SIZE], EC_COMPRESSED_SIZE);
+    tmpPkHash = ssPkHash.GetHash();
+
+    BN_CTX_start(ctx);
+    BIGNUM   *bnC  = BN_CTX_get(ctx);
+    BIGNUM   *bnC1 = BN_CTX_get(ctx);
+    BIGNUM   *bnT  = BN_CTX_get(ctx);
+    BIGNUM   *bnS  = BN_CTX_get(ctx);
+    EC_POINT *ptKi = NULL;
+    EC_POINT *ptT1 = NULL;
+    EC_POINT *ptT2 = NULL;
+
+    const EC_POINT *pts[2];
+    const BIGNUM *scalars[2];
+
+    if (!(ptKi = EC_POINT_new(ecGrp))
+      ||!(ptT1 = EC_POINT_new(ecGrp))
+      ||!(ptT2 = EC_POINT_new(ecGrp)))
+    {
+        LogPrintf("%s: EC_POINT_new failed.\n", __func__);
+        rv = 1; goto End;
+    }
+
+    if (!EC_POINT_oct2point(ecGrp, ptKi, &check.keyImage[0], EC_COMPRESSED_SIZE, ctx))
+    {
+        LogPrintf("%s: extract ptKi failed.\n", __func__);
+        rv = 1; goto End;
+    }
+
+    if (!bnS
+      ||!BN_bin2bn(check.pSigc, EC_SECRET_SIZE, bnC1)
+      ||!BN_copy(bnC, bnC1))
+    {
+        LogPrintf("%s: BN_bin2bn failed.\n", __func__);
+        rv = 1; goto End;
+    }
+
+    for (int i = 0; i < nRingSize; ++i)
+    {
+        if (!BN_bin2bn(&check.pSigr[i * EC_SECRET_SIZE], EC_SECRET_SIZE, bnS))
+        {
+            LogPrintf("%s: BN_bin2bn failed.\n", __func__);
+            rv = 1; goto End;
+        }
+
+        const uint8_t *pPk = &check.pPubkeys[i * EC_COMPRESSED_SIZE];
+        const CRingMemberPoints &member = mapMembers[ec_point(pPk, pPk + EC_COMPRESSED_SIZE)];
+
+        // ptT1 = e_i=s_i*G+c_i*P_i
+        if (!EC_POINT_mul(ecGrp, ptT1, bnS, member.ptPk, bnC, ctx))
+        {
+            LogPrintf("%s: EC_POINT_mul failed.\n", __func__);
+            rv = 1; goto End;
+        }
+
+        // ptT2 = E_i=s_i*H(P_i)+c_i*I_j
+        pts[0] = member.ptHp;   scalars[0] = bnS;
+        pts[1] = ptKi;          scalars[1] = bnC;
+        if (!EC_POINTs_mul(ecGrp, ptT2, NULL, 2, pts, scalars, ctx))
+        {
+            LogPrintf("%s: EC_POINTs_mul failed.\n", __func__);
+            rv = 1; goto End;
+        }
+
+        if (!(EC_POINT_point2oct(ecGrp, ptT1, POINT_CONVERSION_COMPRESSED, &tempData[0],  33, ctx) == (int) EC_COMPRESSED_SIZE)
+          ||!(EC_POINT_point2oct(ecGrp, ptT2, POINT_CONVERSION_COMPRESSED, &tempData[33], 33, ctx) == (int) EC_COMPRESSED_SIZE))
+        {
+            LogPrintf("%s: extract ptT1 and ptT2 failed.\n", __func__);
+            rv = 1; goto End;
+        }
+
+        CHashWriter ssCHash(SER_GETHASH, PROTOCOL_VERSION);
+        ssCHash.write((const char*)tmpPkHash.begin(), 32);
+        ssCHash.write((const char*)&tempData[0], 66);
+        tmpHash = ssCHash.GetHash();
+
+        if (!BN_bin2bn(tmpHash.begin(), EC_SECRET_SIZE, bnC)
+          ||!BN_mod(bnC, bnC, bnOrder, ctx))
+        {
+            LogPrintf("%s: tmpHash -> bnC failed.\n", __func__);
+            rv = 1; goto End;
+        }
+    };
+
+    // bnT = (bnC - bnC1) % N
+    if (!BN_mod_sub(bnT, bnC, bnC1, bnOrder, ctx))
+    {
+        LogPrintf("%s: BN_mod_sub failed.\n", __func__);
+        rv = 1; goto End;
+    }
+
+    // test bnT == 0  (bnC == bnC1)
+    if (!BN_is_zero(bnT))
+    {
+        LogPrintf("%s: signature does not verify.\n", __func__);
+        rv = 2;
+    }
+
+    End:
+    EC_POINT_free(ptKi);
+    EC_POINT_free(ptT1);
+    EC_POINT_free(ptT2);
+    BN_CTX_end(ctx);
+
+    return rv;
+}
+
+}; // end of anonymous namespace
+
+int verifyRingSignatures(const std::vector<CRingSigCheck> &vChecks, size_t &nFailed)
+{
+    // - members referenced by several rings are decoded and hashed to the curve once,
+    //   and each member costs two simultaneous multiplications instead of four
+    // - uses its own BN_CTX, so may be called without holding the lock guarding bnCtx
+    nFailed = 0;
+
+    if (vChecks.size() == 0)
+        return 0;
+
+    for (size_t k = 0; k < vChecks.size(); ++k)
+    {
+        const CRingSigCheck &check = vChecks[k];
+        if (check.nRingSize < 1
+          ||check.keyImage.size() != EC_COMPRESSED_SIZE
+          ||!check.pPubkeys || !check.pSigc || !check.pSigr)
+        {
+            nFailed = k;
+            return errorN(1, "%s: Invalid check %u.", __func__, k);
+        };
+    };
+
+    BN_CTX *ctx = BN_CTX_new();
+    if (!ctx)
+        return errorN(1, "%s: BN_CTX_new failed.", __func__);
+
+    int rv = 0;
+    RingMemberMap mapMembers;
+    std::vector<EC_POINT*> vPoints;
+
+    BN_CTX_start(ctx);
+    if (decodeRingMembers(vChecks, mapMembers, ctx) != 0)
+    {
+        rv = 1;
+    } else
+    {
+        for (size_t k = 0; k < vChecks.size(); ++k)
+        {
+            const CRingSigCheck &check = vChecks[k];
+            rv = check.nType == RING_SIG_2
+                ? verifyRingSig2(check, mapMembers, ctx)
+                : verifyRingSig1(check, mapMembers, vPoints, ctx);
+            if (rv != 0)
+            {
+                nFailed = k;
+                break;
+            };
+        };
+    };
+    BN_CTX_end(ctx);
+
+    if (fDebugRingSig)
+        LogPrintf("%s: %u rings, %u distinct members, rv %d.\n", __func__, vChecks.size(), mapMembers.size(), rv);
+
+    freePoints(vPoints);
+    freeRingMembers(mapMembers);
+    BN_CTX_free(ctx);
+
+    return rv;
+}
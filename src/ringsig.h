@@ -24,6 +24,8 @@ const uint32_t MIN_RING_SIZE = 3;
 const uint32_t MAX_RING_SIZE_OLD = 200;
 const uint32_t MAX_RING_SIZE = 32; // already overkill
 
+const uint32_t DEFAULT_RING_MEMBER_CACHE_SIZE = 20000; // ~10MB
+
 const int MIN_ANON_SPEND_DEPTH = 10;
 const int ANON_TXN_VERSION = 1000;
 
@@ -44,6 +46,49 @@ int verifyRingSignature(data_chunk &keyImage, uint256 &txnHash, int nRingSize, c
 int generateRingSignatureAB(data_chunk &keyImage, uint256 &txnHash, int nRingSize, int nSecretOffset, ec_secret secret, const uint8_t *pPubkeys, data_chunk &sigC, uint8_t *pSigS);
 int verifyRingSignatureAB(data_chunk &keyImage, uint256 &txnHash, int nRingSize, const uint8_t *pPubkeys, const data_chunk &sigC, const uint8_t *pSigS);
 
+/** A ring signature queued for verifyRingSignatures().
+ *  pPubkeys, pSigc and pSigr point into the spending txn and are not copied.
+ *  For RING_SIG_2 (AB) pSigc is the single sigC and pSigr the s values. */
+class CRingSigCheck
+{
+public:
+    CRingSigCheck() : nType(RING_SIG_1), nRingSize(0), pPubkeys(NULL), pSigc(NULL), pSigr(NULL), nInput(0) {};
+
+    CRingSigCheck(int nTypeIn, const data_chunk &keyImageIn, const uint256 &txnHashIn, int nRingSizeIn,
+        const uint8_t *pPubkeysIn, const uint8_t *pSigcIn, const uint8_t *pSigrIn, uint32_t nInputIn)
+        : nType(nTypeIn), keyImage(keyImageIn), txnHash(txnHashIn), nRingSize(nRingSizeIn),
+          pPubkeys(pPubkeysIn), pSigc(pSigcIn), pSigr(pSigrIn), nInput(nInputIn) {};
+
+    int nType;
+    data_chunk keyImage;
+    uint256 txnHash;            // preimage signed by the ring
+    int nRingSize;
+    const uint8_t *pPubkeys;
+    const uint8_t *pSigc;
+    const uint8_t *pSigr;
+    uint32_t nInput;            // txn input index, for logging
+};
+
+/** Verify a set of ring signatures, eg: all anon inputs of a txn or a block, sharing the
+ *  decompressed ring members and Hp(P) between rings.
+ *  @return 0 if all verify, 2 if a signature does not verify, 1 on error. nFailed is set to the failing check. */
+int verifyRingSignatures(const std::vector<CRingSigCheck> &vChecks, size_t &nFailed);
+
+class CRingMemberCacheStats
+{
+public:
+    CRingMemberCacheStats() : nEntries(0), nMaxEntries(0), nHits(0), nMisses(0), nEvictions(0) {};
+
+    size_t nEntries;
+    size_t nMaxEntries;
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nEvictions;
+};
+
+/** Counters of the cache of decompressed ring members and Hp(P) used by verifyRingSignatures(). */
+void GetRingMemberCacheStats(CRingMemberCacheStats &stats);
+
 
 #endif  // USC_RINGSIG_H
 
@@ -7,6 +7,7 @@
 #include "rpcserver.h"
 #include "init.h"
 #include "txdb.h"
+#include "smessage.h"
 #include "kernel.h"
 #include "checkpoints.h"
 #include <errno.h>
@@ -807,6 +808,84 @@ Value getcheckpoint(const Array& params, bool fHelp)
     return result;
 }
 
+Value getringmembercacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getringmembercacheinfo\n"
+            "Show usage of the cache of decoded ring members used to verify ring signatures.\n");
+
+    CRingMemberCacheStats stats;
+    GetRingMemberCacheStats(stats);
+
+    Object result;
+    result.push_back(Pair("entries", (uint64_t)stats.nEntries));
+    result.push_back(Pair("maxentries", (uint64_t)stats.nMaxEntries));
+    result.push_back(Pair("hits", stats.nHits));
+    result.push_back(Pair("misses", stats.nMisses));
+    result.push_back(Pair("evictions", stats.nEvictions));
+
+    uint64_t nLookups = stats.nHits + stats.nMisses;
+    result.push_back(Pair("hitrate", nLookups ? (double)stats.nHits / nLookups : 0.0));
+
+    return result;
+}
+
+Value getdbstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getdbstats [txdb|smsg]\n"
+            "Show LevelDB internal stats and approximate on-disk sizes of the txdb (default) or the smsgDB.\n");
+
+    std::string sDb = params.size() > 0 ? params[0].get_str() : "txdb";
+
+    CLevelDBStats stats;
+    if (sDb == "txdb")
+    {
+        if (nNodeMode != NT_FULL)
+            throw runtime_error("Must be in full mode.");
+
+        CTxDB txdb("r");
+        txdb.GetStats(stats);
+    } else
+    if (sDb == "smsg")
+    {
+        LOCK(cs_smsgDB);
+        SecMsgDB db;
+        if (!fSecMsgEnabled || !db.Open("r"))
+            throw runtime_error("Secure messaging is disabled.");
+
+        std::vector<std::pair<std::string, std::string> > vPrefixes;
+        vPrefixes.push_back(std::make_pair("pubkeys", "pk"));
+        vPrefixes.push_back(std::make_pair("inbox", "im"));
+        vPrefixes.push_back(std::make_pair("outbox", "sm"));
+        vPrefixes.push_back(std::make_pair("sendqueue", "qm"));
+        GetLevelDBStats(db.pdb, vPrefixes, stats);
+    } else
+    {
+        throw runtime_error("Unknown database, use txdb or smsg.");
+    };
+
+    Object result;
+    result.push_back(Pair("database", sDb));
+    result.push_back(Pair("approximatesize", (uint64_t)stats.nTotalSize));
+
+    Object sizes;
+    for (size_t i = 0; i < stats.vPrefixSizes.size(); ++i)
+        sizes.push_back(Pair(stats.vPrefixSizes[i].first, (uint64_t)stats.vPrefixSizes[i].second));
+    result.push_back(Pair("approximatesizes", sizes));
+
+    Array files;
+    for (size_t i = 0; i < stats.vFilesAtLevel.size(); ++i)
+        files.push_back(atoi(stats.vFilesAtLevel[i]));
+    result.push_back(Pair("filesatlevel", files));
+
+    result.push_back(Pair("stats", stats.sStats));
+
+    return result;
+}
+
 
 
 Value thinscanmerkleblocks(const Array& params, bool fHelp)
@@ -105,6 +105,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
 {
     { "stop", 0 },
     { "getaddednodeinfo", 0 },
+    { "getmessagestats", 0 },
     { "sendtoaddress", 1 },
     { "settxfee", 0 },
     { "getreceivedbyaddress", 1 },
@@ -143,6 +144,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "sendmany", 2 },
     { "reservebalance", 0 },
     { "reservebalance", 1 },
+    { "selectcoins", 0 },
     { "addmultisigaddress", 0 },
     { "addmultisigaddress", 1 },
     { "createmultisig", 0 },
@@ -80,6 +80,8 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("lastrecv", (int64_t)stats.nLastRecv));
         obj.push_back(Pair("bytessent", (int64_t)stats.nSendBytes));
         obj.push_back(Pair("bytesrecv", (int64_t)stats.nRecvBytes));
+        obj.push_back(Pair("recvbuffer", (int64_t)stats.nRecvSize));
+        obj.push_back(Pair("recvbufferlimit", (int64_t)ReceiveFloodSize()));
         obj.push_back(Pair("conntime", (int64_t)stats.nTimeConnected));
         obj.push_back(Pair("timeoffset", stats.nTimeOffset));
         obj.push_back(Pair("pingtime", stats.dPingTime));
@@ -309,6 +311,131 @@ Value getnettotals(const Array& params, bool fHelp)
 }
 
 
+static Object MessageStatsToJSON(const MessageStatsMap& mapStats)
+{
+    Object obj;
+    for (MessageStatsMap::const_iterator it = mapStats.begin(); it != mapStats.end(); ++it)
+    {
+        const CMessageStats& stats = it->second;
+        Object entry;
+        entry.push_back(Pair("recv", (int64_t)stats.nRecv));
+        entry.push_back(Pair("bytesrecv", (int64_t)stats.nRecvBytes));
+        entry.push_back(Pair("sent", (int64_t)stats.nSent));
+        entry.push_back(Pair("bytessent", (int64_t)stats.nSentBytes));
+        entry.push_back(Pair("processtime", (double)stats.nProcessUsec / 1e6));
+
+        Object histogram;
+        for (unsigned int i = 0; i < MSG_TIME_BUCKET_COUNT; ++i)
+        {
+            std::string strBound = i < MSG_TIME_BUCKET_COUNT - 1 ? strprintf("%d", MSG_TIME_BUCKETS[i]) : "inf";
+            histogram.push_back(Pair(strBound, (int64_t)stats.vProcessBuckets[i]));
+        };
+        entry.push_back(Pair("processhistogram", histogram));
+
+        obj.push_back(Pair(it->first, entry));
+    };
+    return obj;
+}
+
+Value getmessagestats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "getmessagestats [peers=false]\n"
+            "Returns counters per message command: messages and bytes received and sent,\n"
+            "seconds spent processing and a histogram of processing times in microseconds.\n"
+            "With peers true the counters of each connected peer are included.");
+
+    bool fPeers = params.size() > 0 ? params[0].get_bool() : false;
+
+    MessageStatsMap mapStats;
+    GetMessageStats(mapStats);
+
+    Object obj;
+    obj.push_back(Pair("total", MessageStatsToJSON(mapStats)));
+
+    if (fPeers)
+    {
+        vector<CNodeStats> vstats;
+        CopyNodeStats(vstats);
+
+        Array peers;
+        BOOST_FOREACH(const CNodeStats& stats, vstats)
+        {
+            Object peer;
+            peer.push_back(Pair("id", stats.nodeid));
+            peer.push_back(Pair("addr", stats.addrName));
+            peer.push_back(Pair("messages", MessageStatsToJSON(stats.mapMsgStats)));
+            peers.push_back(peer);
+        };
+        obj.push_back(Pair("peers", peers));
+    };
+
+    return obj;
+}
+
+static std::string PrometheusLabel(const std::string& str)
+{
+    std::string strOut;
+    BOOST_FOREACH(char c, str)
+    {
+        if (c == '\\' || c == '"')
+            strOut += '\\';
+        strOut += c;
+    };
+    return strOut;
+}
+
+std::string GetPrometheusMetrics()
+{
+    MessageStatsMap mapStats;
+    GetMessageStats(mapStats);
+
+    std::string str;
+    str += "# TYPE net_bytes_recv_total counter\n";
+    str += strprintf("net_bytes_recv_total %d\n", CNode::GetTotalBytesRecv());
+    str += "# TYPE net_bytes_sent_total counter\n";
+    str += strprintf("net_bytes_sent_total %d\n", CNode::GetTotalBytesSent());
+    {
+        LOCK(cs_vNodes);
+        str += "# TYPE net_peers gauge\n";
+        str += strprintf("net_peers %u\n", vNodes.size());
+    }
+
+    MessageStatsMap::const_iterator it;
+    str += "# TYPE net_messages_recv_total counter\n";
+    for (it = mapStats.begin(); it != mapStats.end(); ++it)
+        str += strprintf("net_messages_recv_total{command=\"%s\"} %d\n", PrometheusLabel(it->first), it->second.nRecv);
+    str += "# TYPE net_message_bytes_recv_total counter\n";
+    for (it = mapStats.begin(); it != mapStats.end(); ++it)
+        str += strprintf("net_message_bytes_recv_total{command=\"%s\"} %d\n", PrometheusLabel(it->first), it->second.nRecvBytes);
+    str += "# TYPE net_messages_sent_total counter\n";
+    for (it = mapStats.begin(); it != mapStats.end(); ++it)
+        str += strprintf("net_messages_sent_total{command=\"%s\"} %d\n", PrometheusLabel(it->first), it->second.nSent);
+    str += "# TYPE net_message_bytes_sent_total counter\n";
+    for (it = mapStats.begin(); it != mapStats.end(); ++it)
+        str += strprintf("net_message_bytes_sent_total{command=\"%s\"} %d\n", PrometheusLabel(it->first), it->second.nSentBytes);
+
+    str += "# TYPE net_message_process_seconds histogram\n";
+    for (it = mapStats.begin(); it != mapStats.end(); ++it)
+    {
+        const CMessageStats& stats = it->second;
+        std::string strLabel = PrometheusLabel(it->first);
+        uint64_t nCumulative = 0;
+        for (unsigned int i = 0; i < MSG_TIME_BUCKET_COUNT; ++i)
+        {
+            nCumulative += stats.vProcessBuckets[i];
+            std::string strBound = i < MSG_TIME_BUCKET_COUNT - 1 ? strprintf("%g", MSG_TIME_BUCKETS[i] / 1e6) : "+Inf";
+            str += strprintf("net_message_process_seconds_bucket{command=\"%s\",le=\"%s\"} %d\n", strLabel, strBound, nCumulative);
+        };
+        str += strprintf("net_message_process_seconds_sum{command=\"%s\"} %f\n", strLabel, stats.nProcessUsec / 1e6);
+        str += strprintf("net_message_process_seconds_count{command=\"%s\"} %d\n", strLabel, stats.nRecv);
+    };
+
+    return str;
+}
+
+
 static Array GetNetworksInfo()
 {
     Array networks;
@@ -52,7 +52,8 @@ static std::string rfc1123Time()
     return DateTimeStrFormat("%a, %d %b %Y %H:%M:%S +0000", GetTime());
 }
 
-std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive)
+std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive,
+                      const std::string& strContentType)
 {
     if (nStatus == HTTP_UNAUTHORIZED)
         return strprintf("HTTP/1.0 401 Authorization Required\r\n"
@@ -83,7 +84,7 @@ std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive)
             "Date: %s\r\n"
             "Connection: %s\r\n"
             "Content-Length: %u\r\n"
-            "Content-Type: application/json\r\n"
+            "Content-Type: %s\r\n"
             "Server: shadow-json-rpc/%s\r\n"
             "\r\n"
             "%s",
@@ -92,6 +93,7 @@ std::string HTTPReply(int nStatus, const std::string& strMsg, bool keepalive)
         rfc1123Time(),
         keepalive ? "keep-alive" : "close",
         strMsg.size(),
+        strContentType,
         FormatFullVersion(),
         strMsg);
 }
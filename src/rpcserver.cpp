@@ -199,7 +199,8 @@ string CRPCTable::help(string strCommand) const
                 && strMethod != "estimateanonfee"
                 && strMethod != "anonoutputs"
                 && strMethod != "anoninfo"
-                && strMethod != "reloadanondata")
+                && strMethod != "reloadanondata"
+                && strMethod != "getringmembercacheinfo")
             continue;
         } else
         if (strCommand != "" && strMethod != strCommand)
@@ -278,6 +279,7 @@ static const CRPCCommand vRPCCommands[] =
     { "getaddednodeinfo",       &getaddednodeinfo,       true,      true,      false },
     { "ping",                   &ping,                   true,      false,     false },
     { "getnettotals",           &getnettotals,           true,      true,      false },
+    { "getmessagestats",        &getmessagestats,        true,      true,      false },
     { "getdifficulty",          &getdifficulty,          true,      false,     false },
     { "getinfo",                &getinfo,                true,      false,     false },
     { "getsubsidy",             &getsubsidy,             true,      true,      false },
@@ -342,7 +344,9 @@ static const CRPCCommand vRPCCommands[] =
     { "signrawtransaction",     &signrawtransaction,     false,     false,     false },
     { "sendrawtransaction",     &sendrawtransaction,     false,     false,     false },
     { "getcheckpoint",          &getcheckpoint,          true,      false,     false },
+    { "getdbstats",             &getdbstats,             true,      false,     false },
     { "reservebalance",         &reservebalance,         false,     true,      false },
+    { "selectcoins",            &selectcoins,            false,     false,     false },
     { "checkwallet",            &checkwallet,            false,     true,      false },
     { "repairwallet",           &repairwallet,           false,     true,      false },
     { "resendtx",               &resendtx,               false,     true,      false },
@@ -368,6 +372,7 @@ static const CRPCCommand vRPCCommands[] =
     { "anonoutputs",            &anonoutputs,            false,     false,     false },
     { "anoninfo",               &anoninfo,               false,     false,     false },
     { "reloadanondata",         &reloadanondata,         false,     false,     false },
+    { "getringmembercacheinfo", &getringmembercacheinfo, true,      true,      false },
 
     { "txnreport",              &txnreport,              false,     false,     false },
 
@@ -832,7 +837,9 @@ void ServiceConnection(AcceptedConnection *conn)
         // Read HTTP message headers and body
         ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto);
 
-        if (strURI != "/") {
+        // -rpcmetrics serves the network metrics in the Prometheus text format at /metrics
+        bool fMetrics = strURI == "/metrics" && GetBoolArg("-rpcmetrics", false);
+        if (strURI != "/" && !fMetrics) {
             conn->stream() << HTTPReply(HTTP_NOT_FOUND, "", false) << std::flush;
             break;
         }
@@ -858,6 +865,12 @@ void ServiceConnection(AcceptedConnection *conn)
         if (mapHeaders["connection"] == "close")
             fRun = false;
 
+        if (fMetrics)
+        {
+            conn->stream() << HTTPReply(HTTP_OK, GetPrometheusMetrics(), fRun, "text/plain; version=0.0.4") << std::flush;
+            continue;
+        };
+
         JSONRequest jreq;
         try
         {
@@ -126,6 +126,8 @@ extern json_spirit::Value ping(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value addnode(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getaddednodeinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getnettotals(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getmessagestats(const json_spirit::Array& params, bool fHelp);
+extern std::string GetPrometheusMetrics();
 
 extern json_spirit::Value dumpwallet(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value importwallet(const json_spirit::Array& params, bool fHelp);
@@ -179,6 +181,7 @@ extern json_spirit::Value encryptwallet(const json_spirit::Array& params, bool f
 extern json_spirit::Value validateaddress(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value reservebalance(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value selectcoins(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value checkwallet(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value repairwallet(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value resendtx(const json_spirit::Array& params, bool fHelp);
@@ -206,6 +209,7 @@ extern json_spirit::Value setbestblockbyheight(const json_spirit::Array& params,
 extern json_spirit::Value rewindchain(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value nextorphan(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getcheckpoint(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getdbstats(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value getnewstealthaddress(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value liststealthaddresses(const json_spirit::Array& params, bool fHelp);
@@ -222,6 +226,7 @@ extern json_spirit::Value estimateanonfee(const json_spirit::Array& params, bool
 extern json_spirit::Value anonoutputs(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value anoninfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value reloadanondata(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getringmembercacheinfo(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value txnreport(const json_spirit::Array& params, bool fHelp);
 
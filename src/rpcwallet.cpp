@@ -12,6 +12,7 @@
 #include "stealth.h"
 #include "ringsig.h"
 #include "smessage.h"
+#include "coincontrol.h"
 #include <sstream>
 
 using namespace json_spirit;
@@ -1889,6 +1890,61 @@ Value reservebalance(const Array& params, bool fHelp)
 }
 
 
+Value selectcoins(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw std::runtime_error(
+            "selectcoins <amount> [strategy]\n"
+            "<amount> is a real and is rounded to the nearest 0.000001\n"
+            "[strategy] is one of default, knapsack, bnb, largestfirst or consolidate, defaults to -coinselection.\n"
+            "Show the inputs a send of <amount> would spend, with the estimated size and fee.\n"
+            "Nothing is sent or locked.\n");
+
+    int64_t nAmount = AmountFromValue(params[0]);
+    if (nAmount <= 0)
+        throw JSONRPCError(RPC_TYPE_ERROR, "Invalid amount");
+
+    CCoinControl coinControl;
+    if (params.size() > 1
+        && !ParseCoinSelection(params[1].get_str(), coinControl.nCoinSelection))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown coin selection strategy: " + params[1].get_str());
+
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+
+    CCoinSelectionParams selectionParams;
+    pwalletMain->GetCoinSelectionParams(selectionParams, &coinControl);
+
+    // -- CreateTransaction starts from the same target, a single output paying nAmount
+    int64_t nTargetValue = nAmount + nTransactionFee;
+    std::set<std::pair<const CWalletTx*,unsigned int> > setCoins;
+    int64_t nValueIn = 0;
+    CCoinSelectionResult selection;
+    if (!pwalletMain->SelectCoins(nTargetValue, GetAdjustedTime(), setCoins, nValueIn, &coinControl, &selectionParams, &selection))
+        throw JSONRPCError(RPC_WALLET_INSUFFICIENT_FUNDS, "Insufficient funds");
+
+    Array inputs;
+    for (std::set<std::pair<const CWalletTx*,unsigned int> >::iterator it = setCoins.begin(); it != setCoins.end(); ++it)
+    {
+        Object entry;
+        entry.push_back(Pair("txid", it->first->GetHash().GetHex()));
+        entry.push_back(Pair("vout", (int)it->second));
+        entry.push_back(Pair("amount", ValueFromAmount(it->first->vout[it->second].nValue)));
+        inputs.push_back(entry);
+    };
+
+    Object result;
+    result.push_back(Pair("strategy", GetCoinSelectionName(selection.nStrategy)));
+    result.push_back(Pair("inputs", inputs));
+    result.push_back(Pair("total", ValueFromAmount(nValueIn)));
+    result.push_back(Pair("change", ValueFromAmount(selection.fChange ? nValueIn - nTargetValue : 0)));
+    result.push_back(Pair("estimatedsize", (int)selection.nEstimatedSize));
+    result.push_back(Pair("estimatedfee", ValueFromAmount(selection.nEstimatedFee)));
+    result.push_back(Pair("tries", (int)selection.nTries));
+    result.push_back(Pair("timedout", selection.fTimedOut));
+    return result;
+}
+
+
 // ppcoin: check wallet integrity
 Value checkwallet(const Array& params, bool fHelp)
 {
@@ -2355,6 +2411,7 @@ Value clearwallettransactions(const Array& params, bool fHelp)
                             LogPrintf("Delete transaction failed %d, %s\n", ret, db_strerror(ret));
                             continue;
                         }
+                        pwalletMain->InvalidateTxCaches();
                         pwalletMain->mapWallet.erase(hash);
                         pwalletMain->NotifyTransactionChanged(pwalletMain, hash, CT_DELETED);
                         nTransactions++;
@@ -2368,6 +2425,7 @@ Value clearwallettransactions(const Array& params, bool fHelp)
                     continue;
                 }
 
+                pwalletMain->InvalidateTxCaches();
                 pwalletMain->mapWallet.erase(hash);
                 pwalletMain->NotifyTransactionChanged(pwalletMain, hash, CT_DELETED);
 
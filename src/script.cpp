@@ -4,8 +4,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
+#include <boost/thread/once.hpp>
 
 using namespace std;
 using namespace boost;
@@ -1281,6 +1280,7 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
         return 1;
     }
     CTransaction txTmp(txTo);
+    txTmp.ClearHashCache(); // modified below
 
     // In case concatenating two scripts ends up with two codeseparators,
     // or an extra one at the end, this prevents all those possible incompatibilities.
@@ -1335,67 +1335,97 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 }
 
 
-// Valid signature cache, to avoid doing expensive ECDSA signature checking
-// twice for every transaction (once when accepted into memory pool, and
-// again when accepted into the block chain)
+// Salt of the signature cache entries, seeded on first use rather than during static
+// initialisation, where GetRandHash() may run before what it depends on is set up
+static uint256 sigCacheNonce;
+static boost::once_flag sigCacheNonceInitFlag = BOOST_ONCE_INIT;
 
-class CSignatureCache
+static void SigCacheNonceInit()
 {
-private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    sigCacheNonce = GetRandHash();
+}
 
-public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+void CSignatureCache::ComputeEntry(uint256 &entry, const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+{
+    boost::call_once(&SigCacheNonceInit, sigCacheNonceInitFlag);
+
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, sigCacheNonce.begin(), sizeof(sigCacheNonce));
+    SHA256_Update(&ctx, hash.begin(), sizeof(hash));
+    SHA256_Update(&ctx, vchSig.empty() ? NULL : &vchSig[0], vchSig.size());
+    SHA256_Update(&ctx, pubKey.begin(), pubKey.size());
+    SHA256_Final(entry.begin(), &ctx);
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
-        return false;
-    }
+CSignatureCache::CShard &CSignatureCache::GetShard(const uint256 &entry)
+{
+    return shards[entry.Get64(1) % N_SHARDS];
+}
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
-    {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+size_t CSignatureCache::GetMaxShardEntries()
+{
+    // DoS prevention: limit cache size, in megabytes shared evenly between shards.
+    // There are a maximum of 20,000 signature operations per block, the default
+    // holds several blocks worth.
+    int64_t nMaxCacheSize = GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE);
+    if (nMaxCacheSize <= 0)
+        return 0;
+    return std::max((size_t)1, (size_t)((nMaxCacheSize << 20) / N_ENTRY_BYTES / N_SHARDS));
+}
 
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+bool CSignatureCache::Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+{
+    uint256 entry;
+    ComputeEntry(entry, hash, vchSig, pubKey);
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
-        {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
-        }
+    CShard &shard = GetShard(entry);
+    boost::shared_lock<boost::shared_mutex> lock(shard.cs);
+    return shard.setValid.count(entry) > 0;
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
-    }
-};
+void CSignatureCache::Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+{
+    size_t nMaxShardEntries = GetMaxShardEntries();
+    if (nMaxShardEntries == 0)
+        return;
+
+    uint256 entry;
+    ComputeEntry(entry, hash, vchSig, pubKey);
+
+    CShard &shard = GetShard(entry);
+    boost::unique_lock<boost::shared_mutex> lock(shard.cs);
+
+    while (shard.setValid.size() >= nMaxShardEntries)
+    {
+        // Evict a random entry. Random because that helps
+        // foil would-be DoS attackers who might try to pre-generate
+        // and re-use a set of valid signatures just-slightly-greater
+        // than our cache size.
+        entry_set::size_type s = GetRand(shard.setValid.bucket_count());
+        entry_set::local_iterator it = shard.setValid.begin(s);
+        if (it != shard.setValid.end(s))
+            shard.setValid.erase(*it);
+    };
+
+    shard.setValid.insert(entry);
+}
+
+void CSignatureCache::GetShardSizes(std::vector<size_t> &vSizes)
+{
+    vSizes.resize(N_SHARDS);
+    for (unsigned int i = 0; i < N_SHARDS; ++i)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(shards[i].cs);
+        vSizes[i] = shards[i].setValid.size();
+    };
+}
+
+static CSignatureCache signatureCache;
 
 bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
               const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
 {
-    static CSignatureCache signatureCache;
-
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
         return false;
@@ -12,6 +12,8 @@
 #include <stdint.h>
 
 #include <boost/foreach.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/unordered_set.hpp>
 #include <boost/variant.hpp>
 
 #include "stealth.h"
@@ -26,6 +28,7 @@ class CTransaction;
 
 static const unsigned int MAX_SCRIPT_ELEMENT_SIZE = 520; // bytes
 static const unsigned int MAX_OP_RETURN_RELAY = 48;      // bytes
+static const int64_t DEFAULT_MAX_SIG_CACHE_SIZE = 32;    // MiB, valid signature cache
 
 template <typename T>
 std::vector<unsigned char> ToByteVector(const T& in)
@@ -747,4 +750,50 @@ CScript CombineSignatures(CScript scriptPubKey, const CTransaction& txTo, unsign
 
 CScript GetScriptForMultisig(int nRequired, const std::vector<CPubKey>& keys);
 
+/** Valid signature cache, to avoid doing expensive ECDSA signature checking
+ *  twice for every transaction (once when accepted into memory pool, and
+ *  again when accepted into the block chain). */
+class CSignatureCache
+{
+public:
+    // Split into shards, each behind its own lock, so that script check threads
+    // and mempool acceptance don't contend on one mutex
+    static const unsigned int N_SHARDS = 16;
+
+    // Approximate bytes used by an entry: the hash, a node and bucket pointers
+    static const size_t N_ENTRY_BYTES = sizeof(uint256) + 3 * sizeof(void*);
+
+    bool Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey);
+    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey);
+
+    // Most entries a shard holds under -maxsigcachesize, 0 when the cache is disabled
+    static size_t GetMaxShardEntries();
+    void GetShardSizes(std::vector<size_t> &vSizes);
+
+private:
+    // Entries are a salted hash of (signature hash, signature, public key), the salt
+    // keeps entries and bucket placement unpredictable to peers
+    class CEntryHasher
+    {
+    public:
+        size_t operator()(const uint256 &entry) const
+        {
+            return (size_t)entry.Get64(0);
+        }
+    };
+    typedef boost::unordered_set<uint256, CEntryHasher> entry_set;
+
+    class CShard
+    {
+    public:
+        boost::shared_mutex cs;
+        entry_set setValid;
+    };
+
+    CShard shards[N_SHARDS];
+
+    void ComputeEntry(uint256 &entry, const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const;
+    CShard &GetShard(const uint256 &entry);
+};
+
 #endif
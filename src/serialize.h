@@ -1127,6 +1127,20 @@ public:
         data.insert(data.end(), begin(), end());
         clear();
     }
+
+    // Exchange buffers with an empty data, the stream is emptied
+    void SwapBuffer(CSerializeData &data) {
+        assert(data.empty());
+        clear();
+        vch.swap(data);
+    }
+
+    // Move the contents into an empty data, the stream keeps data's buffer
+    void SwapAndClear(CSerializeData &data) {
+        assert(data.empty() && nReadPos == 0);
+        vch.swap(data);
+        clear();
+    }
 };
 
 
@@ -1253,4 +1267,44 @@ public:
     }
 };
 
+/** Stream subset for unserializing from memory owned by someone else, eg: a memory
+ *  mapped file, without copying it into a CDataStream first.
+ *  Reading past the end throws.
+ */
+class CBufferReader
+{
+private:
+    const char* pbegin;
+    const char* pend;
+
+public:
+    int nType;
+    int nVersion;
+
+    CBufferReader(const char* pbeginIn, const char* pendIn, int nTypeIn, int nVersionIn)
+        : pbegin(pbeginIn), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    int GetType()                { return nType; }
+    int GetVersion()             { return nVersion; }
+    size_t size() const          { return pend - pbegin; }
+    bool empty() const           { return pbegin == pend; }
+
+    CBufferReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > (size_t)(pend - pbegin))
+            throw std::ios_base::failure("CBufferReader::read : end of data");
+        memcpy(pch, pbegin, nSize);
+        pbegin += nSize;
+        return (*this);
+    }
+
+    template<typename T>
+    CBufferReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 #endif
@@ -51,6 +51,9 @@ Notes:
 #include <boost/algorithm/string/predicate.hpp>
 #include <boost/algorithm/string/replace.hpp>
 
+#include <leveldb/cache.h>
+#include <leveldb/filter_policy.h>
+
 #include "base58.h"
 #include "db.h"
 #include "init.h" // pwalletMain
@@ -82,6 +85,15 @@ CCriticalSection cs_smsgDB;
 CCriticalSection cs_smsgThreads;
 
 leveldb::DB *smsgDB = NULL;
+static leveldb::Options smsgDBOptions;
+
+// Frees the cache and filter policy GetLevelDBOptions allocated for smsgDB
+static void FreeSmsgDBOptions()
+{
+    delete smsgDBOptions.filter_policy;
+    delete smsgDBOptions.block_cache;
+    smsgDBOptions = leveldb::Options();
+};
 
 
 namespace fs = boost::filesystem;
@@ -214,13 +226,14 @@ bool SecMsgDB::Open(const char* pszMode)
         return false;
     };
 
-    leveldb::Options options;
-    options.create_if_missing = fCreate;
-    leveldb::Status s = leveldb::DB::Open(options, fullpath.string(), &smsgDB);
+    smsgDBOptions = GetLevelDBOptions(SMSG_DB_CACHE_SIZE, false);
+    smsgDBOptions.create_if_missing = fCreate;
+    leveldb::Status s = leveldb::DB::Open(smsgDBOptions, fullpath.string(), &smsgDB);
 
     if (!s.ok())
     {
         LogPrintf("SecMsgDB::open() - Error opening db: %s.\n", s.ToString().c_str());
+        FreeSmsgDBOptions();
         return false;
     };
 
@@ -355,7 +368,7 @@ bool SecMsgDB::ReadPK(CKeyID& addr, CPubKey& pubkey)
     };
 
     try {
-        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        CBufferReader ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
         ssValue >> pubkey;
     } catch (std::exception& e) {
         LogPrintf("SecMsgDB::ReadPK() unserialize threw: %s.\n", e.what());
@@ -441,7 +454,7 @@ bool SecMsgDB::NextSmesg(leveldb::Iterator* it, std::string& prefix, uint8_t* ch
     memcpy(chKey, it->key().data(), 18);
 
     try {
-        CDataStream ssValue(it->value().data(), it->value().data() + it->value().size(), SER_DISK, CLIENT_VERSION);
+        CBufferReader ssValue(it->value().data(), it->value().data() + it->value().size(), SER_DISK, CLIENT_VERSION);
         ssValue >> smsgStored;
     } catch (std::exception& e) {
         LogPrintf("SecMsgDB::NextSmesg() unserialize threw: %s.\n", e.what());
@@ -503,7 +516,7 @@ bool SecMsgDB::ReadSmesg(uint8_t* chKey, SecMsgStored& smsgStored)
     };
 
     try {
-        CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+        CBufferReader ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
         ssValue >> smsgStored;
     } catch (std::exception& e) {
         LogPrintf("SecMsgDB::ReadSmesg() unserialize threw: %s.\n", e.what());
@@ -1195,6 +1208,7 @@ bool SecureMsgShutdown()
         LOCK(cs_smsgDB);
         delete smsgDB;
         smsgDB = NULL;
+        FreeSmsgDBOptions();
     };
 
     return true;
@@ -1314,6 +1328,7 @@ bool SecureMsgDisable()
         LOCK(cs_smsgDB);
         delete smsgDB;
         smsgDB = NULL;
+        FreeSmsgDBOptions();
     };
 
 
@@ -32,6 +32,8 @@ const unsigned int SMSG_MAX_AMSG_BYTES = 512;               // the user input pa
 // max size of payload worst case compression
 const unsigned int SMSG_MAX_MSG_WORST = LZ4_COMPRESSBOUND(SMSG_MAX_MSG_BYTES+SMSG_PL_HDR_LEN);
 
+const unsigned int SMSG_DB_CACHE_SIZE  = 8 * 1024 * 1024;   // block cache of smsgDB, in bytes
+
 #define SMSG_MASK_UNREAD            (1 << 0)
 
 extern bool fSecMsgEnabled;
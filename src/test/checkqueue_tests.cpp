@@ -0,0 +1,65 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+#include "checkqueue.h"
+
+using namespace std;
+
+class CTestCheck
+{
+public:
+    bool fOk;
+
+    CTestCheck() : fOk(true) {}
+    CTestCheck(bool fOkIn) : fOk(fOkIn) {}
+
+    bool operator()() const { return fOk; }
+    void swap(CTestCheck &check) { std::swap(fOk, check.fOk); }
+};
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+BOOST_AUTO_TEST_CASE(checkqueue_serial)
+{
+    // -- without a queue the control object must succeed trivially
+    CCheckQueueControl<CTestCheck> control(NULL);
+    vector<CTestCheck> vChecks(10, CTestCheck(false));
+    control.Add(vChecks);
+    BOOST_CHECK(control.Wait());
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_workers)
+{
+    CCheckQueue<CTestCheck> queue(16);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < 3; ++i)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CTestCheck>::Thread, &queue));
+
+    for (int n = 0; n < 50; ++n)
+    {
+        bool fExpect = (n % 3 != 0);
+        CCheckQueueControl<CTestCheck> control(&queue);
+        for (int b = 0; b < 4; ++b)
+        {
+            vector<CTestCheck> vChecks(250);
+            if (!fExpect && b == 2)
+                vChecks[n].fOk = false;
+            control.Add(vChecks);
+        };
+        BOOST_CHECK(control.Wait() == fExpect);
+    };
+
+    // -- the queue must be reusable after a failed batch
+    {
+        CCheckQueueControl<CTestCheck> control(&queue);
+        vector<CTestCheck> vChecks(1);
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
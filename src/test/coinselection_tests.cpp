@@ -0,0 +1,144 @@
+#include <boost/test/unit_test.hpp>
+
+#include "coinselection.h"
+#include "util.h"
+
+using namespace std;
+
+static vector<CSelectCandidate> vCandidates;
+
+static void add_candidate(int64_t nValue)
+{
+    vCandidates.push_back(CSelectCandidate(nValue, vCandidates.size()));
+}
+
+static int64_t sum_selected(const CCoinSelectionResult& result)
+{
+    // -- nIndex was assigned in insertion order, so look values up by index
+    int64_t nTotal = 0;
+    for (unsigned int i = 0; i < result.vSelected.size(); ++i)
+        for (unsigned int k = 0; k < vCandidates.size(); ++k)
+            if (vCandidates[k].nIndex == result.vSelected[i])
+                nTotal += vCandidates[k].nValue;
+    return nTotal;
+}
+
+BOOST_AUTO_TEST_SUITE(coinselection_tests)
+
+BOOST_AUTO_TEST_CASE(coinselection_bnb)
+{
+    CCoinSelectionParams params;
+    params.nStrategy = COINSELECT_BNB;
+    params.nCostOfChange = 0;
+    CCoinSelectionResult result;
+
+    vCandidates.clear();
+    add_candidate(1 * CENT);
+    add_candidate(2 * CENT);
+    add_candidate(3 * CENT);
+    add_candidate(4 * CENT);
+
+    // exact matches
+    BOOST_CHECK(SelectCandidates(vCandidates, 5 * CENT, params, result));
+    BOOST_CHECK_EQUAL(result.nValue, 5 * CENT);
+    BOOST_CHECK_EQUAL(sum_selected(result), 5 * CENT);
+    BOOST_CHECK_EQUAL(result.vSelected.size(), 2U);
+    BOOST_CHECK(!result.fChange);
+
+    BOOST_CHECK(SelectCandidates(vCandidates, 10 * CENT, params, result));
+    BOOST_CHECK_EQUAL(result.vSelected.size(), 4U);
+
+    // no exact subset, fails without a window
+    BOOST_CHECK(!SelectCandidates(vCandidates, 11 * CENT, params, result));
+    BOOST_CHECK(result.vSelected.empty());
+
+    add_candidate(20 * CENT);
+    BOOST_CHECK(!SelectCandidates(vCandidates, 10 * CENT + 1, params, result));
+
+    // within the cost of change
+    params.nCostOfChange = CENT;
+    BOOST_CHECK(SelectCandidates(vCandidates, 9 * CENT + 1, params, result));
+    BOOST_CHECK_EQUAL(result.nValue, 10 * CENT);
+    BOOST_CHECK(!result.fChange);
+
+    // default falls back to knapsack
+    params.nStrategy = COINSELECT_DEFAULT;
+    params.nCostOfChange = 0;
+    BOOST_CHECK(SelectCandidates(vCandidates, 15 * CENT, params, result));
+    BOOST_CHECK_EQUAL(result.nStrategy, COINSELECT_KNAPSACK);
+    BOOST_CHECK(result.nValue >= 15 * CENT);
+    BOOST_CHECK(result.fChange);
+
+    BOOST_CHECK(!SelectCandidates(vCandidates, 31 * CENT, params, result));
+}
+
+BOOST_AUTO_TEST_CASE(coinselection_bnb_bounded)
+{
+    CCoinSelectionParams params;
+    params.nStrategy = COINSELECT_BNB;
+    params.nMaxTries = 1000;
+    params.nMaxTime = 0;
+    CCoinSelectionResult result;
+
+    // -- all even values, an odd target can never match
+    vCandidates.clear();
+    for (int i = 0; i < 10000; ++i)
+        add_candidate(2 * (1000 + i));
+
+    BOOST_CHECK(!SelectCandidates(vCandidates, 2 * 1000 * 50 + 1, params, result));
+    BOOST_CHECK_EQUAL(result.nTries, 1000U);
+}
+
+BOOST_AUTO_TEST_CASE(coinselection_largest_first)
+{
+    CCoinSelectionParams params;
+    params.nStrategy = COINSELECT_LARGEST_FIRST;
+    CCoinSelectionResult result;
+
+    vCandidates.clear();
+    for (int i = 1; i <= 100; ++i)
+        add_candidate(i * CENT);
+
+    BOOST_CHECK(SelectCandidates(vCandidates, 150 * CENT, params, result));
+    BOOST_CHECK_EQUAL(result.vSelected.size(), 2U);
+    BOOST_CHECK_EQUAL(result.nValue, 199 * CENT);
+    BOOST_CHECK_EQUAL(sum_selected(result), 199 * CENT);
+
+    BOOST_CHECK(!SelectCandidates(vCandidates, 5051 * CENT, params, result));
+}
+
+BOOST_AUTO_TEST_CASE(coinselection_consolidate)
+{
+    CCoinSelectionParams params;
+    params.nStrategy = COINSELECT_CONSOLIDATE;
+    params.nMaxInputs = 10;
+    CCoinSelectionResult result;
+
+    vCandidates.clear();
+    add_candidate(COIN);
+    for (int i = 0; i < 50; ++i)
+        add_candidate(CENT);
+    add_candidate(1); // dust, worth less than the fee to spend it
+
+    BOOST_CHECK(SelectCandidates(vCandidates, COIN / 2, params, result));
+    BOOST_CHECK_EQUAL(result.vSelected.size(), 10U);
+    BOOST_CHECK_EQUAL(result.nValue, COIN + 9 * CENT);
+    BOOST_CHECK(result.fChange);
+
+    // -- estimates follow CreateTransaction's fee per started 1000 bytes
+    BOOST_CHECK_EQUAL(result.nEstimatedSize, params.nBaseSize + 10 * COINSELECT_INPUT_SIZE + COINSELECT_OUTPUT_SIZE);
+    BOOST_CHECK_EQUAL(result.nEstimatedFee, params.nFeePerKB * (1 + (int64_t)result.nEstimatedSize / 1000));
+}
+
+BOOST_AUTO_TEST_CASE(coinselection_names)
+{
+    int nStrategy = -1;
+    for (int i = COINSELECT_DEFAULT; i <= COINSELECT_CONSOLIDATE; ++i)
+    {
+        BOOST_CHECK(ParseCoinSelection(GetCoinSelectionName(i), nStrategy));
+        BOOST_CHECK_EQUAL(nStrategy, i);
+    };
+    BOOST_CHECK(!ParseCoinSelection("smallestfirst", nStrategy));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,159 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txmempool.h"
+
+using namespace std;
+
+extern std::map<uint256, CTransaction> mapOrphanTransactions;
+
+static CBlock MakeBlock(unsigned int nTxns)
+{
+    CBlock block;
+    block.nVersion = 7;
+    block.nTime = 1400000000;
+
+    CTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vout.resize(1);
+    block.vtx.push_back(txCoinBase);
+
+    for (unsigned int i = 0; i < nTxns; ++i)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(uint256(i + 1), 0);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = (i + 1) * CENT;
+        block.vtx.push_back(tx);
+    };
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static void AddToMempool(const CBlock& block)
+{
+    LOCK(mempool.cs);
+    for (unsigned int i = 1; i < block.vtx.size(); ++i)
+    {
+        CTransaction tx = block.vtx[i];
+        mempool.addUnchecked(tx.GetHash(), tx);
+    };
+}
+
+static void ClearMempool(const CBlock& block)
+{
+    for (unsigned int i = 1; i < block.vtx.size(); ++i)
+        mempool.remove(block.vtx[i]);
+}
+
+BOOST_AUTO_TEST_SUITE(compactblock_tests)
+
+BOOST_AUTO_TEST_CASE(compactblock_fill)
+{
+    LOCK(cs_main);
+
+    CBlock block = MakeBlock(5);
+    AddToMempool(block);
+
+    // -- through the wire, as a peer would send it
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CBlockCompact(block);
+    CBlockCompact cmpctBlock;
+    ss >> cmpctBlock;
+    BOOST_CHECK_EQUAL(cmpctBlock.vPrefilledTxn.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctBlock.vShortTxIds.size(), 5U);
+
+    CBlock blockFilled;
+    vector<uint32_t> vMissing;
+    BOOST_CHECK_EQUAL(cmpctBlock.FillBlock(blockFilled, vMissing), CMPCT_FILL_OK);
+    BOOST_CHECK(vMissing.empty());
+    BOOST_CHECK(blockFilled.GetHash() == block.GetHash());
+    BOOST_CHECK(blockFilled.BuildMerkleTree() == block.hashMerkleRoot);
+    BOOST_CHECK_EQUAL(blockFilled.vtx.size(), block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size() && i < blockFilled.vtx.size(); ++i)
+        BOOST_CHECK(blockFilled.vtx[i] == block.vtx[i]);
+
+    ClearMempool(block);
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_missing)
+{
+    LOCK(cs_main);
+
+    CBlock block = MakeBlock(5);
+    AddToMempool(block);
+    mempool.remove(block.vtx[2]);
+    mempool.remove(block.vtx[4]);
+
+    CBlockCompact cmpctBlock(block);
+    CBlock blockFilled;
+    vector<uint32_t> vMissing;
+    BOOST_CHECK_EQUAL(cmpctBlock.FillBlock(blockFilled, vMissing), CMPCT_FILL_OK);
+    BOOST_CHECK_EQUAL(vMissing.size(), 2U);
+    BOOST_CHECK(vMissing.size() == 2 && vMissing[0] == 2 && vMissing[1] == 4);
+
+    // -- answer the getblocktxn as ProcessGetBlockTxnMessage would
+    CBlockTxnRequest req;
+    req.hashBlock = block.GetHash();
+    req.vIndexes = vMissing;
+
+    CBlockTxn resp;
+    resp.hashBlock = req.hashBlock;
+    BOOST_FOREACH(uint32_t nIndex, req.vIndexes)
+        resp.vtx.push_back(block.vtx[nIndex]);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << resp;
+    CBlockTxn respRead;
+    ss >> respRead;
+    BOOST_CHECK(respRead.hashBlock == block.GetHash());
+    BOOST_CHECK_EQUAL(respRead.vtx.size(), vMissing.size());
+
+    BOOST_CHECK(blockFilled.BuildMerkleTree() != block.hashMerkleRoot);
+    for (unsigned int i = 0; i < vMissing.size() && i < respRead.vtx.size(); ++i)
+        blockFilled.vtx[vMissing[i]] = respRead.vtx[i];
+    BOOST_CHECK(blockFilled.BuildMerkleTree() == block.hashMerkleRoot);
+
+    ClearMempool(block);
+}
+
+BOOST_AUTO_TEST_CASE(compactblock_collisions)
+{
+    LOCK(cs_main);
+
+    CBlock block = MakeBlock(4);
+    AddToMempool(block);
+
+    CBlockCompact cmpctBlock(block);
+    CBlock blockFilled;
+    vector<uint32_t> vMissing;
+
+    // -- the same short id twice in one block, only the full block can settle it
+    CBlockCompact cmpctDup = cmpctBlock;
+    cmpctDup.vShortTxIds[2] = cmpctDup.vShortTxIds[1];
+    BOOST_CHECK_EQUAL(cmpctDup.FillBlock(blockFilled, vMissing), CMPCT_FILL_COLLISION);
+
+    // -- a short id matched by more than one known txn is asked for
+    mapOrphanTransactions[block.vtx[3].GetHash()] = block.vtx[3];
+    BOOST_CHECK_EQUAL(cmpctBlock.FillBlock(blockFilled, vMissing), CMPCT_FILL_OK);
+    BOOST_CHECK_EQUAL(vMissing.size(), 1U);
+    BOOST_CHECK(vMissing.size() == 1 && vMissing[0] == 3);
+    mapOrphanTransactions.erase(block.vtx[3].GetHash());
+
+    // -- malformed: prefilled txn out of range, or no txns at all
+    CBlockCompact cmpctBad = cmpctBlock;
+    cmpctBad.vPrefilledTxn[0].nIndex = block.vtx.size();
+    BOOST_CHECK_EQUAL(cmpctBad.FillBlock(blockFilled, vMissing), CMPCT_FILL_INVALID);
+
+    cmpctBad = cmpctBlock;
+    cmpctBad.vShortTxIds.clear();
+    cmpctBad.vPrefilledTxn.clear();
+    BOOST_CHECK_EQUAL(cmpctBad.FillBlock(blockFilled, vMissing), CMPCT_FILL_INVALID);
+
+    ClearMempool(block);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
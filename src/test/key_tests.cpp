@@ -4,6 +4,7 @@
 #include <vector>
 
 #include "key.h"
+#include "eckey.h"
 #include "base58.h"
 #include "uint256.h"
 #include "util.h"
@@ -160,4 +161,35 @@ BOOST_AUTO_TEST_CASE(key_test1)
     }
 }
 
+BOOST_AUTO_TEST_CASE(key_ecc_shared_group)
+{
+    // -- TestingSetup starts the shared group, it must be the named curve
+    const EC_GROUP *group = GetSecp256k1Group();
+    BOOST_REQUIRE(group != NULL);
+    EC_GROUP *groupNamed = EC_GROUP_new_by_curve_name(NID_secp256k1);
+    BOOST_REQUIRE(groupNamed != NULL);
+    BOOST_CHECK(EC_GROUP_cmp(group, groupNamed, NULL) == 0);
+    EC_GROUP_free(groupNamed);
+
+    // -- signatures made on the shared group verify on a key built from the named curve
+    uint256 hashMsg = Hash(strSecret1.begin(), strSecret1.end());
+    for (int i = 0; i < 16; ++i)
+    {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        CPubKey pubkey = key.GetPubKey();
+
+        vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hashMsg, vchSig));
+        BOOST_CHECK(pubkey.Verify(hashMsg, vchSig));
+
+        EC_KEY *pkey = EC_KEY_new_by_curve_name(NID_secp256k1);
+        BOOST_REQUIRE(pkey != NULL);
+        const unsigned char *pbegin = pubkey.begin();
+        BOOST_CHECK(o2i_ECPublicKey(&pkey, &pbegin, pubkey.size()) != NULL);
+        BOOST_CHECK(ECDSA_verify(0, hashMsg.begin(), 32, &vchSig[0], vchSig.size(), pkey) == 1);
+        EC_KEY_free(pkey);
+    };
+}
+
 BOOST_AUTO_TEST_SUITE_END()
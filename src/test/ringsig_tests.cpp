@@ -20,8 +20,33 @@ using namespace boost::chrono;
 
 clock_t totalGenerate;
 clock_t totalVerify;
+clock_t totalVerifyBatch;
 clock_t start, stop;
 
+void testRingSigBatch(std::vector<CRingSigCheck> &vChecks)
+{
+    // -- the same ring twice shares all members, then break the second
+    size_t nFailed;
+    vChecks.push_back(vChecks[0]);
+
+    start = clock();
+    BOOST_CHECK(0 == verifyRingSignatures(vChecks, nFailed));
+    stop = clock();
+    totalVerifyBatch += stop - start;
+
+    // -- members are decoded once, then served from the ring member cache
+    CRingMemberCacheStats statsBefore, statsAfter;
+    GetRingMemberCacheStats(statsBefore);
+
+    *vChecks[1].txnHash.begin() ^= 1;
+    BOOST_CHECK(2 == verifyRingSignatures(vChecks, nFailed));
+    BOOST_CHECK(1 == nFailed);
+
+    GetRingMemberCacheStats(statsAfter);
+    BOOST_CHECK(statsAfter.nHits - statsBefore.nHits == (uint64_t)vChecks[0].nRingSize);
+    BOOST_CHECK(statsAfter.nMisses == statsBefore.nMisses);
+};
+
 void testRingSigs(int nRingSize)
 {
     uint8_t *pPubkeys = (uint8_t*) malloc(sizeof(uint8_t) * EC_COMPRESSED_SIZE * nRingSize);
@@ -70,6 +95,10 @@ void testRingSigs(int nRingSize)
     stop = clock();
     totalVerify += stop - start;
 
+    std::vector<CRingSigCheck> vChecks;
+    vChecks.push_back(CRingSigCheck(RING_SIG_1, keyImage, preimage, nRingSize, pPubkeys, pSigc, pSigr, 0));
+    testRingSigBatch(vChecks);
+
     int sigSize = EC_COMPRESSED_SIZE + EC_SECRET_SIZE + (EC_SECRET_SIZE + EC_SECRET_SIZE + EC_COMPRESSED_SIZE) * nRingSize;
 
     BOOST_MESSAGE("nRingSize " << nRingSize << ", sigSize: " << bytesReadable(sigSize));
@@ -129,6 +158,10 @@ void testRingSigABs(int nRingSize)
     stop = clock();
     totalVerify += stop - start;
 
+    std::vector<CRingSigCheck> vChecks;
+    vChecks.push_back(CRingSigCheck(RING_SIG_2, keyImage, preimage, nRingSize, pPubkeys, &pSigC[0], pSigS, 0));
+    testRingSigBatch(vChecks);
+
     int sigSize = EC_COMPRESSED_SIZE + EC_SECRET_SIZE + EC_SECRET_SIZE + (EC_SECRET_SIZE + EC_COMPRESSED_SIZE) * nRingSize;
 
     BOOST_MESSAGE("nRingSize " << nRingSize << ", sigSize: " << bytesReadable(sigSize));
@@ -160,9 +193,11 @@ BOOST_AUTO_TEST_CASE(ringsig)
 
     BOOST_MESSAGE("totalGenerate " << (double(totalGenerate) / CLOCKS_PER_SEC));
     BOOST_MESSAGE("totalVerify   " << (double(totalVerify)   / CLOCKS_PER_SEC));
+    BOOST_MESSAGE("totalVerifyBatch (2x) " << (double(totalVerifyBatch) / CLOCKS_PER_SEC));
 
     totalGenerate = 0;
     totalVerify = 0;
+    totalVerifyBatch = 0;
     BOOST_MESSAGE("testRingSigABs");
 
     for (int k = 2; k < 6; ++k)
@@ -175,6 +210,7 @@ BOOST_AUTO_TEST_CASE(ringsig)
 
     BOOST_MESSAGE("totalGenerate " << (double(totalGenerate) / CLOCKS_PER_SEC));
     BOOST_MESSAGE("totalVerify   " << (double(totalVerify)   / CLOCKS_PER_SEC));
+    BOOST_MESSAGE("totalVerifyBatch (2x) " << (double(totalVerifyBatch) / CLOCKS_PER_SEC));
 
     BOOST_CHECK(0 == finaliseRingSigs());
 
@@ -448,4 +448,50 @@ BOOST_AUTO_TEST_CASE(script_combineSigs)
     BOOST_CHECK(combined == partial3c);
 }
 
+BOOST_AUTO_TEST_CASE(script_sigcache)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+    vector<unsigned char> vchSig(72, 0x30);
+
+    mapArgs["-maxsigcachesize"] = "1";
+    size_t nMaxShardEntries = CSignatureCache::GetMaxShardEntries();
+    BOOST_CHECK_EQUAL(nMaxShardEntries, (1U << 20) / CSignatureCache::N_ENTRY_BYTES / CSignatureCache::N_SHARDS);
+
+    // -- twice what the cache can hold, spread over the shards
+    CSignatureCache cache;
+    uint64_t nEntries = 2 * nMaxShardEntries * CSignatureCache::N_SHARDS;
+    for (uint64_t i = 0; i < nEntries; ++i)
+        cache.Set(uint256(i), vchSig, pubkey);
+
+    vector<size_t> vSizes;
+    cache.GetShardSizes(vSizes);
+    BOOST_CHECK_EQUAL(vSizes.size(), CSignatureCache::N_SHARDS);
+    for (unsigned int i = 0; i < vSizes.size(); ++i)
+        BOOST_CHECK_EQUAL(vSizes[i], nMaxShardEntries);
+
+    // -- the newest entry is kept, older ones were evicted to make room
+    BOOST_CHECK(cache.Get(uint256(nEntries - 1), vchSig, pubkey));
+    uint64_t nFound = 0;
+    for (uint64_t i = 0; i < nEntries; ++i)
+        if (cache.Get(uint256(i), vchSig, pubkey))
+            nFound++;
+    BOOST_CHECK_EQUAL(nFound, nMaxShardEntries * CSignatureCache::N_SHARDS);
+
+    // -- the entry covers the signature and the key, not just the hash
+    vector<unsigned char> vchSigOther(72, 0x31);
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+    BOOST_CHECK(!cache.Get(uint256(nEntries - 1), vchSigOther, pubkey));
+    BOOST_CHECK(!cache.Get(uint256(nEntries - 1), vchSig, keyOther.GetPubKey()));
+
+    // -- a size of 0 disables the cache
+    mapArgs["-maxsigcachesize"] = "0";
+    BOOST_CHECK_EQUAL(CSignatureCache::GetMaxShardEntries(), 0U);
+    cache.Set(uint256(nEntries), vchSig, pubkey);
+    BOOST_CHECK(!cache.Get(uint256(nEntries), vchSig, pubkey));
+    mapArgs.erase("-maxsigcachesize");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
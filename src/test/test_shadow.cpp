@@ -33,6 +33,7 @@ struct TestingSetup {
         fDebugPoS = true;
         
         noui_connect();
+        ECC_Start();
         bitdb.MakeMock();
         
         LoadBlockIndex(true);
@@ -45,6 +46,7 @@ struct TestingSetup {
         delete pwalletMain;
         pwalletMain = NULL;
         bitdb.Flush(true);
+        ECC_Stop();
     }
 };
 
@@ -161,6 +161,45 @@ BOOST_AUTO_TEST_CASE(basic_transaction_tests)
     stream >> tx;
     BOOST_CHECK_MESSAGE(tx.CheckTransaction(), "Simple deserialized transaction should be valid.");
 
+    // Reading in place, as from a mapped block file, gives the same transaction
+    CTransaction txMapped;
+    CBufferReader reader((const char*)&vch[0], (const char*)&vch[0] + vch.size(), SER_DISK, CLIENT_VERSION);
+    reader >> txMapped;
+    BOOST_CHECK(txMapped == tx);
+    BOOST_CHECK(reader.size() == stream.size());
+
+    // ... and throws instead of reading past the end
+    CBufferReader readerShort((const char*)&vch[0], (const char*)&vch[0] + vch.size() - 1, SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK_THROW(readerShort >> txMapped, std::ios_base::failure);
+
+    // The hash of a deserialized transaction is memoised as it is read, copies share it
+    BOOST_CHECK(tx.fHashCached);
+    uint256 hashTx = tx.GetHash();
+    BOOST_CHECK(hashTx == SerializeHash(tx));
+    CTransaction txCopy(tx);
+    BOOST_CHECK(txCopy.fHashCached && txCopy.GetHash() == hashTx);
+
+    // ... until the transaction is modified in place
+    txCopy.nLockTime++;
+    txCopy.ClearHashCache();
+    BOOST_CHECK(txCopy.GetHash() == SerializeHash(txCopy));
+    BOOST_CHECK(txCopy.GetHash() != hashTx);
+    BOOST_CHECK(!txCopy.fHashCached);
+
+    // Transactions built up in place are never memoised
+    CTransaction txNew;
+    txNew.vin.push_back(tx.vin[0]);
+    txNew.GetHash();
+    BOOST_CHECK(!txNew.fHashCached);
+
+    // Reading over a transaction replaces the memo
+    CDataStream ssNew(SER_DISK, CLIENT_VERSION);
+    ssNew << txNew;
+    txCopy.SetNull();
+    BOOST_CHECK(!txCopy.fHashCached);
+    ssNew >> txCopy;
+    BOOST_CHECK(txCopy.fHashCached && txCopy.GetHash() == SerializeHash(txNew));
+
     // Check that duplicate txins fail
     tx.vin.push_back(tx.vin[0]);
     BOOST_CHECK_MESSAGE(!tx.CheckTransaction(), "Transaction with duplicate txins should be invalid.");
@@ -261,4 +300,42 @@ BOOST_AUTO_TEST_CASE(test_GetThrow)
     BOOST_CHECK_THROW(t1.GetValueIn(missingInputs), runtime_error);
 }
 
+BOOST_AUTO_TEST_CASE(block_header_hash_memo)
+{
+    CBlock block;
+    block.nVersion = 7;
+    block.hashPrevBlock = uint256(1);
+    block.nTime = 1400000000;
+    block.nBits = 0x1d00ffff;
+    block.nNonce = 42;
+    CTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vout.resize(1);
+    block.vtx.push_back(txCoinBase);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    BOOST_CHECK(!block.fHashCached);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+    CBlock blockRead;
+    ss >> blockRead;
+    BOOST_CHECK(blockRead.fHashCached);
+    BOOST_CHECK(blockRead.GetHash() == block.GetHash());
+
+    // Modifying the header after it was read, as submitblock does, bypasses the memo
+    CTransaction txExtra;
+    txExtra.vin.resize(1);
+    txExtra.vout.resize(1);
+    blockRead.vtx.push_back(txExtra);
+    blockRead.hashMerkleRoot = blockRead.BuildMerkleTree();
+    BOOST_CHECK(blockRead.GetHash() != block.GetHash());
+    BOOST_CHECK(blockRead.GetHash() == Hash(BEGIN(blockRead.nVersion), END(blockRead.nNonce)));
+
+    CBlock blockCopy(blockRead);
+    BOOST_CHECK(blockCopy.GetHash() == blockRead.GetHash());
+    blockCopy.nNonce++;
+    BOOST_CHECK(blockCopy.GetHash() != blockRead.GetHash());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
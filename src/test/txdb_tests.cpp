@@ -0,0 +1,180 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txdb.h"
+#include "key.h"
+
+#include <leveldb/db.h>
+
+using namespace std;
+
+extern leveldb::DB *txdb;
+
+// true if key has reached the LevelDB, rather than sitting in the write-back cache
+static bool OnDisk(const CPubKey& pkCoin)
+{
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << make_pair(string("ao"), pkCoin);
+    string strValue;
+    return txdb->Get(leveldb::ReadOptions(), ssKey.str(), &strValue).ok();
+}
+
+static bool FindStats(CTxDB& db, int64_t nValue, CAnonOutputCount& aoc)
+{
+    vector<CAnonOutputCount> vStats;
+    BOOST_CHECK(db.ReadAnonStats(vStats));
+    for (unsigned int i = 0; i < vStats.size(); ++i)
+    {
+        if (vStats[i].nValue != nValue)
+            continue;
+        aoc = vStats[i];
+        return true;
+    };
+    return false;
+}
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+BOOST_AUTO_TEST_CASE(anon_index_write_cache)
+{
+    const int64_t nValue = 3 * COIN + 17; // not a denomination, no other outputs share it
+
+    CTxDB db("cr+");
+    BOOST_CHECK(db.Flush());
+
+    vector<CPubKey> vpkCoins;
+    for (int i = 0; i < 3; ++i)
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        vpkCoins.push_back(key.GetPubKey());
+    };
+
+    BOOST_CHECK(db.TxnBegin());
+    for (int i = 0; i < 3; ++i)
+    {
+        COutPoint outpoint(uint256(i + 1), i);
+        CAnonOutput ao(outpoint, nValue, 100 + i, i == 2 ? 1 : 0);
+        BOOST_CHECK(db.WriteAnonOutput(vpkCoins[i], ao));
+    };
+    BOOST_CHECK(db.TxnCommit());
+
+    // -- committed, but still only in the write-back cache
+    BOOST_CHECK(!OnDisk(vpkCoins[0]));
+
+    vector<CPubKey> vpkList;
+    BOOST_CHECK(db.ListAnonOutputs(nValue, 0, 1000, vpkList));
+    BOOST_CHECK_EQUAL(vpkList.size(), 2U); // compromised output left out
+
+    vpkList.clear();
+    BOOST_CHECK(db.ListAnonOutputs(nValue, 101, 1000, vpkList));
+    BOOST_CHECK_EQUAL(vpkList.size(), 1U);
+    BOOST_CHECK(vpkList.size() == 1 && vpkList[0] == vpkCoins[1]);
+
+    int nCount, nCompromised, nHeight;
+    BOOST_CHECK(db.CountAnonOutputs(nValue, 0, 1000, nCount, nCompromised));
+    BOOST_CHECK_EQUAL(nCount, 3);
+    BOOST_CHECK_EQUAL(nCompromised, 1);
+
+    BOOST_CHECK(db.ReadLastAnonOutputHeight(nValue, 1000, nHeight));
+    BOOST_CHECK_EQUAL(nHeight, 102);
+    BOOST_CHECK(db.ReadLastAnonOutputHeight(nValue, 101, nHeight));
+    BOOST_CHECK_EQUAL(nHeight, 101);
+    BOOST_CHECK(db.ReadLastAnonOutputHeight(nValue, 99, nHeight));
+    BOOST_CHECK_EQUAL(nHeight, -1);
+
+    CAnonOutputCount aoc;
+    BOOST_CHECK(FindStats(db, nValue, aoc));
+    BOOST_CHECK_EQUAL(aoc.nExists, 3);
+    BOOST_CHECK_EQUAL(aoc.nCompromised, 1);
+
+    // -- none of the reads above flushed the cache
+    BOOST_CHECK(!OnDisk(vpkCoins[0]));
+
+    // -- erases in the cache must hide what is on disk
+    BOOST_CHECK(db.Flush());
+    BOOST_CHECK(OnDisk(vpkCoins[0]));
+
+    BOOST_CHECK(db.TxnBegin());
+    BOOST_CHECK(db.EraseAnonOutput(vpkCoins[0]));
+    BOOST_CHECK(db.EraseAnonOutput(vpkCoins[2]));
+    BOOST_CHECK(db.TxnCommit());
+    BOOST_CHECK(OnDisk(vpkCoins[0]));
+
+    vpkList.clear();
+    BOOST_CHECK(db.ListAnonOutputs(nValue, 0, 1000, vpkList));
+    BOOST_CHECK_EQUAL(vpkList.size(), 1U);
+
+    BOOST_CHECK(db.CountAnonOutputs(nValue, 0, 1000, nCount, nCompromised));
+    BOOST_CHECK_EQUAL(nCount, 1);
+    BOOST_CHECK_EQUAL(nCompromised, 0);
+
+    BOOST_CHECK(db.ReadLastAnonOutputHeight(nValue, 1000, nHeight));
+    BOOST_CHECK_EQUAL(nHeight, 101);
+
+    BOOST_CHECK(FindStats(db, nValue, aoc));
+    BOOST_CHECK_EQUAL(aoc.nExists, 1);
+    BOOST_CHECK_EQUAL(aoc.nCompromised, 0);
+
+    BOOST_CHECK(db.TxnBegin());
+    BOOST_CHECK(db.EraseAnonOutput(vpkCoins[1]));
+    BOOST_CHECK(db.TxnCommit());
+    BOOST_CHECK(!FindStats(db, nValue, aoc));
+    BOOST_CHECK(db.Flush());
+}
+
+BOOST_AUTO_TEST_CASE(anon_index_batch_stats)
+{
+    const int64_t nValue = 5 * COIN + 23;
+
+    CTxDB db("cr+");
+
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pkCoin = key.GetPubKey();
+    ec_point keyImage(pkCoin.begin(), pkCoin.end());
+    uint256 txnHash(7);
+
+    // -- several changes to one output and key image in a batch, read back before the commit
+    BOOST_CHECK(db.TxnBegin());
+    COutPoint outpoint(uint256(1), 0);
+    CAnonOutput ao(outpoint, nValue, 200, 0);
+    BOOST_CHECK(db.WriteAnonOutput(pkCoin, ao));
+    ao.nCompromised = 1;
+    BOOST_CHECK(db.WriteAnonOutput(pkCoin, ao));
+
+    CAnonOutput aoRead;
+    BOOST_CHECK(db.ReadAnonOutput(pkCoin, aoRead));
+    BOOST_CHECK_EQUAL(aoRead.nCompromised, 1);
+
+    CKeyImageSpent kis(txnHash, 0, nValue), kisRead;
+    BOOST_CHECK(db.WriteKeyImage(keyImage, kis));
+    BOOST_CHECK(db.WriteKeyImage(keyImage, kis));
+    BOOST_CHECK(db.ReadKeyImage(keyImage, kisRead));
+    BOOST_CHECK(kisRead.txnHash == txnHash);
+    BOOST_CHECK(db.TxnCommit());
+
+    CAnonOutputCount aoc;
+    BOOST_CHECK(FindStats(db, nValue, aoc));
+    BOOST_CHECK_EQUAL(aoc.nExists, 1);
+    BOOST_CHECK_EQUAL(aoc.nSpends, 1);
+    BOOST_CHECK_EQUAL(aoc.nCompromised, 1);
+
+    // -- an aborted batch leaves nothing behind
+    BOOST_CHECK(db.TxnBegin());
+    BOOST_CHECK(db.EraseAnonOutput(pkCoin));
+    BOOST_CHECK(!db.ReadAnonOutput(pkCoin, aoRead));
+    BOOST_CHECK(db.TxnAbort());
+    BOOST_CHECK(db.ReadAnonOutput(pkCoin, aoRead));
+
+    BOOST_CHECK(db.TxnBegin());
+    BOOST_CHECK(db.EraseAnonOutput(pkCoin));
+    BOOST_CHECK(db.EraseKeyImage(keyImage));
+    BOOST_CHECK(!db.ReadKeyImage(keyImage, kisRead));
+    BOOST_CHECK(db.TxnCommit());
+    BOOST_CHECK(!FindStats(db, nValue, aoc));
+    BOOST_CHECK(!db.ReadAnonOutput(pkCoin, aoRead));
+    BOOST_CHECK(db.Flush());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
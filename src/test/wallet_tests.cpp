@@ -311,5 +311,86 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     delete pwallet;
 }
 
+// true if AvailableCoins() lists output n of hash
+static bool HasCoin(const CWallet& wallet, const uint256& hash, unsigned int n)
+{
+    vector<COutput> vAvailable;
+    wallet.AvailableCoins(vAvailable);
+    BOOST_FOREACH(const COutput& out, vAvailable)
+        if (out.tx->GetHash() == hash && out.i == (int)n)
+            return true;
+    return false;
+}
+
+BOOST_AUTO_TEST_CASE(wallet_coin_index_and_balance_cache)
+{
+    CWallet wallet("walletUT_cache.dat");
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(wallet.AddKey(key));
+    RegisterWallet(&wallet);
+
+    CTransaction tx;
+    tx.vout.resize(2);
+    tx.vout[0].nValue = 3 * COIN;
+    tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    tx.vout[1].nValue = 2 * COIN;
+    tx.vout[1].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+    uint256 hash = tx.GetHash();
+
+    // -- a block holding only tx on top of the chain, the empty merkle branch of tx is its hash
+    CBlockIndex* pindexPrev = pindexBest;
+    uint256 hashBlock = ~hash;
+    CBlockIndex* pindex = new CBlockIndex();
+    pindex->phashBlock = &hashBlock;
+    pindex->pprev = pindexPrev;
+    pindex->nHeight = pindexPrev->nHeight + 1;
+    pindex->nTime = pindexPrev->nTime + 60;
+    pindex->hashMerkleRoot = hash;
+    mapBlockIndex[hashBlock] = pindex;
+    pindexBest = pindex;
+
+    CWalletTx wtxIn(&wallet, tx);
+    wtxIn.hashBlock = hashBlock;
+    wtxIn.nIndex = 0;
+    BOOST_CHECK(wallet.AddToWallet(wtxIn, hash));
+    CWalletTx& wtx = wallet.mapWallet[hash];
+
+    // -- settled by the first query, then kept current by MarkSpent and MarkUnspent
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 5 * COIN);
+    BOOST_CHECK(HasCoin(wallet, hash, 0) && HasCoin(wallet, hash, 1));
+
+    wtx.MarkSpent(0);
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 2 * COIN);
+    BOOST_CHECK(!HasCoin(wallet, hash, 0));
+    BOOST_CHECK(HasCoin(wallet, hash, 1));
+
+    wtx.MarkUnspent(0);
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 5 * COIN);
+    BOOST_CHECK(HasCoin(wallet, hash, 0));
+
+    // -- a copy is not the wallet's transaction, marking it leaves the caches alone
+    CWalletTx wtxCopy = wtx;
+    wtxCopy.MarkSpent(1);
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 5 * COIN);
+    BOOST_CHECK(HasCoin(wallet, hash, 1));
+
+    // -- disconnecting the block drops what was settled against it
+    pindexBest = pindexPrev;
+    SyncWithWallets(tx, NULL, false, false);
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 0);
+    BOOST_CHECK(!HasCoin(wallet, hash, 0) && !HasCoin(wallet, hash, 1));
+
+    // -- and is settled again once the block is back
+    pindexBest = pindex;
+    BOOST_CHECK_EQUAL(wallet.GetBalance(), 5 * COIN);
+    BOOST_CHECK(HasCoin(wallet, hash, 0) && HasCoin(wallet, hash, 1));
+
+    pindexBest = pindexPrev;
+    mapBlockIndex.erase(hashBlock);
+    delete pindex;
+    UnregisterWallet(&wallet);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
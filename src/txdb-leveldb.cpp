@@ -25,14 +25,242 @@ namespace fs = boost::filesystem;
 
 leveldb::DB *txdb; // global pointer for LevelDB object instance
 
-static leveldb::Options GetOptions() {
+// Write-back cache of committed transactions, shared by all CTxDB instances
+class CPendingWrite
+{
+public:
+    CPendingWrite() : fErase(false) {};
+
+    bool fErase;
+    std::string value;
+};
+
+static CCriticalSection cs_pendingWrites;
+static std::map<std::string, CPendingWrite> mapPendingWrites;
+static int64_t nPendingWritesBytes = 0;
+static int64_t nMaxPendingWritesBytes = 0;
+static int64_t nLastFlushTime = 0;
+
+// Approximate memory used by a map node and its strings, besides the key and value data
+static const int64_t PENDING_WRITE_OVERHEAD = 96;
+
+// Merges a committed batch into mapPendingWrites, caller must hold cs_pendingWrites
+class CPendingMerger : public leveldb::WriteBatch::Handler {
+public:
+    virtual void Put(const leveldb::Slice& key, const leveldb::Slice& value) {
+        CPendingWrite &pw = Insert(key);
+        pw.fErase = false;
+        pw.value.assign(value.data(), value.size());
+        nPendingWritesBytes += pw.value.size();
+    }
+
+    virtual void Delete(const leveldb::Slice& key) {
+        CPendingWrite &pw = Insert(key);
+        pw.fErase = true;
+        pw.value.clear();
+    }
+
+private:
+    CPendingWrite &Insert(const leveldb::Slice& key) {
+        std::pair<std::map<std::string, CPendingWrite>::iterator, bool> ret
+            = mapPendingWrites.insert(std::make_pair(key.ToString(), CPendingWrite()));
+        if (ret.second)
+            nPendingWritesBytes += key.size() + PENDING_WRITE_OVERHEAD;
+        else
+            nPendingWritesBytes -= ret.first->second.value.size();
+        return ret.first->second;
+    }
+};
+
+// Write all pending writes as one atomic batch, caller must hold cs_pendingWrites
+static bool FlushPendingWrites(leveldb::DB *pdb)
+{
+    nLastFlushTime = GetTime();
+    if (mapPendingWrites.empty())
+        return true;
+
+    int64_t nStart = GetTimeMillis();
+    leveldb::WriteBatch batch;
+    for (std::map<std::string, CPendingWrite>::iterator it = mapPendingWrites.begin(); it != mapPendingWrites.end(); ++it)
+    {
+        if (it->second.fErase)
+            batch.Delete(it->first);
+        else
+            batch.Put(it->first, it->second.value);
+    };
+
+    leveldb::WriteOptions writeOptions;
+    writeOptions.sync = true;
+    leveldb::Status status = pdb->Write(writeOptions, &batch);
+    if (!status.ok())
+    {
+        // - keep the writes, the next flush retries them
+        LogPrintf("LevelDB flush failure: %s\n", status.ToString());
+        return false;
+    };
+
+    if (fDebug)
+        LogPrintf("CTxDB: Flushed %u writes, %d KiB, in %dms\n",
+            mapPendingWrites.size(), nPendingWritesBytes / 1024, GetTimeMillis() - nStart);
+
+    mapPendingWrites.clear();
+    nPendingWritesBytes = 0;
+    return true;
+}
+
+// Forward iterator over the keys starting with strPrefix, with mapPendingWrites laid
+// over the disk so a range scan sees the write-back cache without flushing it.
+// Pending entries of the range are copied when it is created, later writes are not seen.
+class CPendingOverlayIterator
+{
+public:
+    CPendingOverlayIterator(leveldb::DB *pdb, const std::string &strPrefixIn)
+        : strPrefix(strPrefixIn), nPending(0), fPendingCurrent(false)
+    {
+        // - take the disk iterator and the pending copy together, a flush can't come between them
+        LOCK(cs_pendingWrites);
+        piter = pdb->NewIterator(leveldb::ReadOptions());
+        std::map<std::string, CPendingWrite>::iterator it = mapPendingWrites.lower_bound(strPrefix);
+        for (; it != mapPendingWrites.end() && it->first.compare(0, strPrefix.size(), strPrefix) == 0; ++it)
+            vPending.push_back(*it);
+    };
+
+    ~CPendingOverlayIterator()
+    {
+        delete piter;
+    };
+
+    void Seek(const std::string &strKey)
+    {
+        piter->Seek(strKey);
+        nPending = 0;
+        while (nPending < vPending.size() && vPending[nPending].first < strKey)
+            nPending++;
+        Settle();
+    };
+
+    bool Valid() const
+    {
+        return fPendingCurrent || (piter->Valid() && piter->key().starts_with(strPrefix));
+    };
+
+    void Next()
+    {
+        if (fPendingCurrent)
+        {
+            // - the pending entry replaces a disk entry with the same key
+            if (piter->Valid() && piter->key() == leveldb::Slice(vPending[nPending].first))
+                piter->Next();
+            nPending++;
+        } else
+        {
+            piter->Next();
+        };
+        Settle();
+    };
+
+    leveldb::Slice key() const
+    {
+        return fPendingCurrent ? leveldb::Slice(vPending[nPending].first) : piter->key();
+    };
+
+    leveldb::Slice value() const
+    {
+        return fPendingCurrent ? leveldb::Slice(vPending[nPending].second.value) : piter->value();
+    };
+
+private:
+    // Point at the lower of the disk and pending keys, skipping pending erases and what they hide
+    void Settle()
+    {
+        fPendingCurrent = false;
+        while (nPending < vPending.size())
+        {
+            int c = piter->Valid() ? piter->key().compare(vPending[nPending].first) : 1;
+            if (c < 0)
+                return;
+
+            if (!vPending[nPending].second.fErase)
+            {
+                fPendingCurrent = true;
+                return;
+            };
+
+            if (c == 0)
+                piter->Next();
+            nPending++;
+        };
+    };
+
+    std::string strPrefix;
+    leveldb::Iterator *piter;
+    std::vector<std::pair<std::string, CPendingWrite> > vPending;
+    size_t nPending;
+    bool fPendingCurrent;
+};
+
+leveldb::Options GetLevelDBOptions(size_t nCacheSize, bool fBulkLoad)
+{
     leveldb::Options options;
-    int nCacheSizeMB = GetArg("-dbcache", 25);
-    options.block_cache = leveldb::NewLRUCache(nCacheSizeMB * 1048576);
+    options.block_cache = leveldb::NewLRUCache(nCacheSize);
     options.filter_policy = leveldb::NewBloomFilterPolicy(10);
+
+    int64_t nWriteBufferMB = GetArg("-dbwritebuffer", DEFAULT_DB_WRITE_BUFFER);
+    if (fBulkLoad)
+        nWriteBufferMB = std::max(nWriteBufferMB, DB_BULK_LOAD_WRITE_BUFFER);
+    options.write_buffer_size = std::max((int64_t)1, nWriteBufferMB) * 1048576;
+
+    options.max_open_files = std::max((int64_t)64, GetArg("-dbmaxopenfiles", DEFAULT_DB_MAX_OPEN_FILES));
+    options.block_size = std::max((int64_t)1, GetArg("-dbblocksize", DEFAULT_DB_BLOCK_SIZE)) * 1024;
+    options.compression = GetBoolArg("-dbcompression", true) ? leveldb::kSnappyCompression : leveldb::kNoCompression;
     return options;
 }
 
+static leveldb::Options GetOptions(bool fBulkLoad)
+{
+    int nCacheSizeMB = GetArg("-dbcache", 25);
+    return GetLevelDBOptions(nCacheSizeMB * 1048576, fBulkLoad);
+}
+
+// Approximate size of the keys starting with sPrefix
+static uint64_t GetPrefixSize(leveldb::DB *pdb, const std::string &sPrefix)
+{
+    // - limit is the first key after all keys starting with sPrefix
+    std::string sLimit = sPrefix;
+    while (sLimit.size() > 0 && (uint8_t)sLimit[sLimit.size()-1] == 0xff)
+        sLimit.erase(sLimit.size()-1);
+    if (sLimit.size() > 0)
+        sLimit[sLimit.size()-1]++;
+    else
+        sLimit = std::string(8, '\xff');
+
+    leveldb::Range range(sPrefix, sLimit);
+    uint64_t nSize = 0;
+    pdb->GetApproximateSizes(&range, 1, &nSize);
+    return nSize;
+}
+
+void GetLevelDBStats(leveldb::DB *pdb, const std::vector<std::pair<std::string, std::string> > &vPrefixes, CLevelDBStats &stats)
+{
+    if (!pdb->GetProperty("leveldb.stats", &stats.sStats))
+        stats.sStats = "";
+
+    for (int i = 0; ; ++i)
+    {
+        // - fails past the last level
+        std::string sFiles;
+        if (!pdb->GetProperty(strprintf("leveldb.num-files-at-level%d", i), &sFiles))
+            break;
+        stats.vFilesAtLevel.push_back(sFiles);
+    };
+
+    stats.vPrefixSizes.clear();
+    for (size_t i = 0; i < vPrefixes.size(); ++i)
+        stats.vPrefixSizes.push_back(std::make_pair(vPrefixes[i].first, GetPrefixSize(pdb, vPrefixes[i].second)));
+
+    stats.nTotalSize = GetPrefixSize(pdb, "");
+}
+
 static void init_blockindex(leveldb::Options& options, bool fRemoveOld = false)
 {
     // First time init.
@@ -64,9 +292,18 @@ CTxDB::CTxDB(const char* pszMode)
 
     bool fCreate = strchr(pszMode, 'c');
 
-    options = GetOptions();
+    // - use the bulk load profile when the chain is loaded from scratch
+    bool fBulkLoad = GetBoolArg("-dbbulkload", mapArgs.count("-reindex")
+        || !fs::exists(GetDataDir() / "txleveldb" / "CURRENT"));
+    if (fBulkLoad)
+        LogPrintf("Using LevelDB bulk load profile.\n");
+
+    options = GetOptions(fBulkLoad);
     options.create_if_missing = fCreate;
 
+    nMaxPendingWritesBytes = GetArg("-dbwritecache", DEFAULT_DB_WRITE_CACHE) * 1048576;
+    nLastFlushTime = GetTime();
+
     init_blockindex(options); // Init directory
     pdb = txdb;
 
@@ -75,6 +312,9 @@ CTxDB::CTxDB(const char* pszMode)
 
 void CTxDB::Close()
 {
+    if (pdb)
+        Flush();
+
     delete txdb;
     txdb = pdb = NULL;
     delete options.filter_policy;
@@ -100,16 +340,87 @@ bool CTxDB::TxnBegin()
 bool CTxDB::TxnCommit()
 {
     assert(activeBatch);
-    leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
+
+    // -- apply the stats changes of the batch, one read per denomination
+    for (std::map<int64_t, CAnonOutputCount>::iterator mi = mapBatchAnonStats.begin(); mi != mapBatchAnonStats.end(); ++mi)
+    {
+        CAnonOutputCount aoc;
+        if (!Read(make_pair(string("as"), mi->first), aoc, false))
+            aoc.nValue = mi->first;
+
+        aoc.nExists += mi->second.nExists;
+        aoc.nSpends += mi->second.nSpends;
+        aoc.nCompromised += mi->second.nCompromised;
+
+        if (aoc.nExists == 0 && aoc.nSpends == 0)
+            Erase(make_pair(string("as"), mi->first));
+        else
+            Write(make_pair(string("as"), mi->first), aoc);
+    };
+    mapBatchAnonOutputs.clear();
+    mapBatchKeyImages.clear();
+    mapBatchAnonStats.clear();
+
+    if (nMaxPendingWritesBytes <= 0)
+    {
+        leveldb::Status status = pdb->Write(leveldb::WriteOptions(), activeBatch);
+        delete activeBatch;
+        activeBatch = NULL;
+        if (!status.ok()) {
+            LogPrintf("LevelDB batch commit failure: %s\n", status.ToString());
+            return false;
+        }
+        return true;
+    };
+
+    LOCK(cs_pendingWrites);
+    CPendingMerger merger;
+    leveldb::Status status = activeBatch->Iterate(&merger);
     delete activeBatch;
     activeBatch = NULL;
     if (!status.ok()) {
         LogPrintf("LevelDB batch commit failure: %s\n", status.ToString());
         return false;
     }
+
+    // - the batch is committed once merged, a failed flush keeps the writes
+    //   pending and the next commit or Flush() retries them
+    if ((nPendingWritesBytes > nMaxPendingWritesBytes
+        || GetTime() - nLastFlushTime >= DB_WRITE_CACHE_FLUSH_INTERVAL)
+        && !FlushPendingWrites(pdb))
+        LogPrintf("TxnCommit(): write-back cache flush failed, %d KiB pending\n", nPendingWritesBytes / 1024);
+
     return true;
 }
 
+bool CTxDB::Flush()
+{
+    LOCK(cs_pendingWrites);
+    return FlushPendingWrites(pdb);
+}
+
+leveldb::DB* CTxDB::GetInstance()
+{
+    Flush();
+    return pdb;
+}
+
+void CTxDB::GetStats(CLevelDBStats &stats)
+{
+    const char *aPrefixes[] = {"tx", "bidx", "bhdx", "ki", "ao", "an", "as"};
+
+    std::vector<std::pair<std::string, std::string> > vPrefixes;
+    for (size_t i = 0; i < sizeof(aPrefixes) / sizeof(aPrefixes[0]); ++i)
+    {
+        // - keys start with the serialised prefix string
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << string(aPrefixes[i]);
+        vPrefixes.push_back(std::make_pair(string(aPrefixes[i]), ssKey.str()));
+    };
+
+    GetLevelDBStats(pdb, vPrefixes, stats);
+}
+
 class CBatchScanner : public leveldb::WriteBatch::Handler {
 public:
     std::string needle;
@@ -154,6 +465,32 @@ bool CTxDB::ScanBatch(const CDataStream &key, string *value, bool *deleted) cons
     return scanner.foundEntry;
 }
 
+bool CTxDB::ScanPending(const CDataStream &key, string *value, bool *deleted)
+{
+    LOCK(cs_pendingWrites);
+    *deleted = false;
+    std::map<std::string, CPendingWrite>::iterator it = mapPendingWrites.find(key.str());
+    if (it == mapPendingWrites.end())
+        return false;
+
+    if (it->second.fErase)
+        *deleted = true;
+    else
+        *value = it->second.value;
+    return true;
+}
+
+void CTxDB::ErasePending(const CDataStream &key)
+{
+    LOCK(cs_pendingWrites);
+    std::map<std::string, CPendingWrite>::iterator it = mapPendingWrites.find(key.str());
+    if (it == mapPendingWrites.end())
+        return;
+
+    nPendingWritesBytes -= it->first.size() + it->second.value.size() + PENDING_WRITE_OVERHEAD;
+    mapPendingWrites.erase(it);
+}
+
 int CTxDB::CheckVersion()
 {
     if (Exists(string("version")))
@@ -165,6 +502,17 @@ int CTxDB::CheckVersion()
         {
             LogPrintf("Required index version is %d.\n", DATABASE_VERSION);
 
+            if (nVersion >= DATABASE_VERSION_MIN_UPGRADE)
+            {
+                bool fTmp = fReadOnly;
+                fReadOnly = false;
+                bool fUpgraded = BuildAnonOutputIndex()
+                    && WriteVersion(DATABASE_VERSION);
+                fReadOnly = fTmp;
+                if (fUpgraded)
+                    return 0;
+            };
+
             RecreateDB();
 
             return 2;
@@ -183,11 +531,23 @@ int CTxDB::RecreateDB()
 {
     LogPrintf("Recreating TXDB.\n");
 
+    {
+        LOCK(cs_pendingWrites);
+        mapPendingWrites.clear();
+        nPendingWritesBytes = 0;
+    }
+
     delete txdb;
     txdb = pdb = NULL;
     delete activeBatch;
     activeBatch = NULL;
 
+    // - the txdb is loaded from scratch
+    delete options.filter_policy;
+    delete options.block_cache;
+    options = GetOptions(GetBoolArg("-dbbulkload", true));
+    options.create_if_missing = true;
+
     init_blockindex(options, true); // Remove directory and create new database
     pdb = txdb;
 
@@ -201,36 +561,396 @@ int CTxDB::RecreateDB()
 
 bool CTxDB::WriteKeyImage(ec_point& keyImage, CKeyImageSpent& keyImageSpent)
 {
+    CKeyImageSpent kisOld;
+    if (!ReadKeyImage(keyImage, kisOld)
+        && !UpdateAnonStats(keyImageSpent.nValue, 0, 1, 0))
+        return false;
+    if (activeBatch)
+        mapBatchKeyImages[keyImage] = make_pair(true, keyImageSpent);
     return Write(make_pair(string("ki"), keyImage), keyImageSpent);
 };
 
 bool CTxDB::ReadKeyImage(ec_point& keyImage, CKeyImageSpent& keyImageSpent)
 {
-    return Read(make_pair(string("ki"), keyImage), keyImageSpent);
+    if (activeBatch)
+    {
+        std::map<ec_point, std::pair<bool, CKeyImageSpent> >::iterator mi = mapBatchKeyImages.find(keyImage);
+        if (mi != mapBatchKeyImages.end())
+        {
+            if (!mi->second.first)
+                return false;
+            keyImageSpent = mi->second.second;
+            return true;
+        };
+    };
+    return Read(make_pair(string("ki"), keyImage), keyImageSpent, false);
 };
 
 bool CTxDB::EraseKeyImage(ec_point& keyImage)
 {
+    CKeyImageSpent kis;
+    if (ReadKeyImage(keyImage, kis))
+        UpdateAnonStats(kis.nValue, 0, -1, 0);
+    if (activeBatch)
+        mapBatchKeyImages[keyImage] = make_pair(false, CKeyImageSpent());
     return Erase(make_pair(string("ki"), keyImage));
 }
 
+// "an" keys index anon outputs by denomination then height, the value is nCompromised.
+// The height is stored big endian, so an iterator walks the outputs of a denomination in height order.
+typedef std::pair<std::string, std::pair<int64_t, std::pair<uint32_t, CPubKey> > > AnonIndexKey;
+
+static inline uint32_t SwapHeight(uint32_t n)
+{
+    return (n >> 24) | ((n >> 8) & 0xff00) | ((n << 8) & 0xff0000) | (n << 24);
+}
+
+static AnonIndexKey MakeAnonIndexKey(int64_t nValue, int nBlockHeight, const CPubKey& pkCoin)
+{
+    return make_pair(string("an"), make_pair(nValue, make_pair(SwapHeight(nBlockHeight), pkCoin)));
+}
+
+// Start of the "an" keys of nValue.
+static std::string AnonIndexPrefix(int64_t nValue)
+{
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << string("an") << nValue;
+    return ssPrefix.str();
+}
+
+// Reads the denomination and height of an "an" key, false for other keys.
+static bool ReadAnonIndexKey(CDataStream& ssKey, int64_t& nValue, int& nHeight)
+{
+    string strType;
+    ssKey >> strType;
+    if (strType != "an")
+        return false;
+
+    uint32_t nHeightBE;
+    ssKey >> nValue >> nHeightBE;
+    nHeight = (int)SwapHeight(nHeightBE);
+    return true;
+}
+
 bool CTxDB::WriteAnonOutput(CPubKey& pkCoin, CAnonOutput& ao)
 {
+    // -- an output already stored may have moved to another height or become compromised
+    CAnonOutput aoOld;
+    if (ReadAnonOutput(pkCoin, aoOld))
+    {
+        if (aoOld.nValue != ao.nValue || aoOld.nBlockHeight != ao.nBlockHeight)
+            Erase(MakeAnonIndexKey(aoOld.nValue, aoOld.nBlockHeight, pkCoin));
+        if (aoOld.nValue != ao.nValue || aoOld.nCompromised != ao.nCompromised)
+        {
+            if (!UpdateAnonStats(aoOld.nValue, -1, 0, -aoOld.nCompromised)
+                || !UpdateAnonStats(ao.nValue, 1, 0, ao.nCompromised))
+                return false;
+        };
+    } else
+    if (!UpdateAnonStats(ao.nValue, 1, 0, ao.nCompromised))
+        return false;
+
+    if (!Write(MakeAnonIndexKey(ao.nValue, ao.nBlockHeight, pkCoin), ao.nCompromised))
+        return false;
+    if (activeBatch)
+        mapBatchAnonOutputs[pkCoin] = make_pair(true, ao);
     return Write(make_pair(string("ao"), pkCoin), ao);
 };
 
 bool CTxDB::ReadAnonOutput(CPubKey& pkCoin, CAnonOutput& ao)
 {
-    return Read(make_pair(string("ao"), pkCoin), ao);
+    if (activeBatch)
+    {
+        std::map<CPubKey, std::pair<bool, CAnonOutput> >::iterator mi = mapBatchAnonOutputs.find(pkCoin);
+        if (mi != mapBatchAnonOutputs.end())
+        {
+            if (!mi->second.first)
+                return false;
+            ao = mi->second.second;
+            return true;
+        };
+    };
+    return Read(make_pair(string("ao"), pkCoin), ao, false);
 };
 
 bool CTxDB::EraseAnonOutput(CPubKey& pkCoin)
 {
+    CAnonOutput ao;
+    if (ReadAnonOutput(pkCoin, ao))
+    {
+        Erase(MakeAnonIndexKey(ao.nValue, ao.nBlockHeight, pkCoin));
+        UpdateAnonStats(ao.nValue, -1, 0, -ao.nCompromised);
+    };
+    if (activeBatch)
+        mapBatchAnonOutputs[pkCoin] = make_pair(false, CAnonOutput());
     return Erase(make_pair(string("ao"), pkCoin));
 };
 
+bool CTxDB::BuildAnonOutputIndex()
+{
+    LogPrintf("Building anon output index.\n");
+    int64_t nStart = GetTimeMillis();
+
+    uint32_t nErased = 0;
+    if (!EraseRange(string("as"), nErased))
+        return false;
+
+    std::map<int64_t, CAnonOutputCount> mapStats;
+
+    TxnBegin();
+    uint32_t nOutputs = 0;
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << string("ao");
+    for (iterator->Seek(ssStartKey.str()); iterator->Valid(); iterator->Next())
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        string strType;
+        ssKey >> strType;
+        if (strType != "ao")
+            break;
+
+        CPubKey pkCoin;
+        CAnonOutput ao;
+        ssKey >> pkCoin;
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.write(iterator->value().data(), iterator->value().size());
+        ssValue >> ao;
+
+        Write(MakeAnonIndexKey(ao.nValue, ao.nBlockHeight, pkCoin), ao.nCompromised);
+
+        CAnonOutputCount& aoc = mapStats[ao.nValue];
+        aoc.nValue = ao.nValue;
+        aoc.nExists++;
+        aoc.nCompromised += ao.nCompromised;
+        nOutputs++;
+    };
+
+    ssStartKey.clear();
+    ssStartKey << string("ki");
+    for (iterator->Seek(ssStartKey.str()); iterator->Valid(); iterator->Next())
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        string strType;
+        ssKey >> strType;
+        if (strType != "ki")
+            break;
+
+        CKeyImageSpent kis;
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.write(iterator->value().data(), iterator->value().size());
+        ssValue >> kis;
+
+        CAnonOutputCount& aoc = mapStats[kis.nValue];
+        aoc.nValue = kis.nValue;
+        aoc.nSpends++;
+    };
+    delete iterator;
+
+    for (std::map<int64_t, CAnonOutputCount>::iterator mi = mapStats.begin(); mi != mapStats.end(); ++mi)
+        Write(make_pair(string("as"), mi->first), mi->second);
+
+    if (!TxnCommit())
+        return error("%s: TxnCommit failed.", __func__);
+
+    LogPrintf("Indexed %u anon outputs of %u values in %dms.\n", nOutputs, mapStats.size(), GetTimeMillis() - nStart);
+    return true;
+};
+
+bool CTxDB::ListAnonOutputs(int64_t nValue, int nMinHeight, int nMaxHeight, std::vector<CPubKey>& vpkCoins)
+{
+    if (nMaxHeight < nMinHeight)
+        return true;
+
+    CPubKey pkZero;
+    pkZero.SetZero();
+
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << MakeAnonIndexKey(nValue, nMinHeight, pkZero);
+
+    CPendingOverlayIterator iterator(pdb, AnonIndexPrefix(nValue));
+    for (iterator.Seek(ssStartKey.str()); iterator.Valid(); iterator.Next())
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator.key().data(), iterator.key().size());
+
+        int64_t nKeyValue;
+        int nHeight;
+        if (!ReadAnonIndexKey(ssKey, nKeyValue, nHeight)
+            || nKeyValue != nValue
+            || nHeight > nMaxHeight)
+            break;
+
+        if (iterator.value().size() != 1
+            || iterator.value().data()[0] != 0) // nCompromised
+            continue;
+
+        CPubKey pkCoin;
+        ssKey >> pkCoin;
+        vpkCoins.push_back(pkCoin);
+    };
+
+    return true;
+};
+
+bool CTxDB::CountAnonOutputs(int64_t nValue, int nMinHeight, int nMaxHeight, int& nCount, int& nCompromised)
+{
+    nCount = 0;
+    nCompromised = 0;
+    if (nMaxHeight < nMinHeight)
+        return true;
+
+    CPubKey pkZero;
+    pkZero.SetZero();
+
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << MakeAnonIndexKey(nValue, nMinHeight, pkZero);
+
+    CPendingOverlayIterator iterator(pdb, AnonIndexPrefix(nValue));
+    for (iterator.Seek(ssStartKey.str()); iterator.Valid(); iterator.Next())
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator.key().data(), iterator.key().size());
+
+        int64_t nKeyValue;
+        int nHeight;
+        if (!ReadAnonIndexKey(ssKey, nKeyValue, nHeight)
+            || nKeyValue != nValue
+            || nHeight > nMaxHeight)
+            break;
+
+        nCount++;
+        if (iterator.value().size() == 1
+            && iterator.value().data()[0] != 0)
+            nCompromised++;
+    };
+
+    return true;
+};
+
+bool CTxDB::ReadLastAnonOutputHeight(int64_t nValue, int nMaxHeight, int& nHeight)
+{
+    nHeight = -1;
+    if (nMaxHeight < 0)
+        return true;
+
+    CPubKey pkZero;
+    pkZero.SetZero();
+
+    std::string strPrefix = AnonIndexPrefix(nValue);
+
+    // -- keys at or below nMaxHeight sort before the first possible key at nMaxHeight + 1
+    CDataStream ssEndKey(SER_DISK, CLIENT_VERSION);
+    ssEndKey << MakeAnonIndexKey(nValue, nMaxHeight + 1, pkZero);
+    std::string strEnd = ssEndKey.str();
+
+    std::string strLast;
+
+    // - read the disk and the write-back cache together, a flush can't come between them
+    LOCK(cs_pendingWrites);
+
+    // -- highest key on disk that isn't erased in the cache
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    iterator->Seek(strEnd);
+    if (iterator->Valid())
+        iterator->Prev();
+    else
+        iterator->SeekToLast();
+
+    for (; iterator->Valid() && iterator->key().starts_with(strPrefix); iterator->Prev())
+    {
+        std::map<std::string, CPendingWrite>::iterator mi = mapPendingWrites.find(iterator->key().ToString());
+        if (mi != mapPendingWrites.end() && mi->second.fErase)
+            continue;
+        strLast = iterator->key().ToString();
+        break;
+    };
+    delete iterator;
+
+    // -- highest key written to the cache
+    std::map<std::string, CPendingWrite>::iterator mi = mapPendingWrites.lower_bound(strEnd);
+    while (mi != mapPendingWrites.begin())
+    {
+        --mi;
+        if (mi->first.compare(0, strPrefix.size(), strPrefix) != 0)
+            break;
+        if (mi->second.fErase)
+            continue;
+        if (mi->first > strLast)
+            strLast = mi->first;
+        break;
+    };
+
+    if (strLast.empty())
+        return true;
+
+    CDataStream ssKey(strLast.data(), strLast.data() + strLast.size(), SER_DISK, CLIENT_VERSION);
+    int64_t nKeyValue;
+    int nKeyHeight;
+    if (ReadAnonIndexKey(ssKey, nKeyValue, nKeyHeight)
+        && nKeyValue == nValue)
+        nHeight = nKeyHeight;
+
+    return true;
+};
+
+bool CTxDB::UpdateAnonStats(int64_t nValue, int nExists, int nSpends, int nCompromised)
+{
+    if (activeBatch)
+    {
+        CAnonOutputCount& aocDelta = mapBatchAnonStats[nValue];
+        aocDelta.nExists += nExists;
+        aocDelta.nSpends += nSpends;
+        aocDelta.nCompromised += nCompromised;
+        return true;
+    };
+
+    CAnonOutputCount aoc;
+    if (!Read(make_pair(string("as"), nValue), aoc))
+        aoc.nValue = nValue;
+
+    aoc.nExists += nExists;
+    aoc.nSpends += nSpends;
+    aoc.nCompromised += nCompromised;
+
+    if (aoc.nExists == 0 && aoc.nSpends == 0)
+        return Erase(make_pair(string("as"), nValue));
+    return Write(make_pair(string("as"), nValue), aoc);
+};
+
+bool CTxDB::ReadAnonStats(std::vector<CAnonOutputCount>& vStats)
+{
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << string("as");
+
+    CPendingOverlayIterator iterator(pdb, ssStartKey.str());
+    for (iterator.Seek(ssStartKey.str()); iterator.Valid(); iterator.Next())
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator.key().data(), iterator.key().size());
+        string strType;
+        ssKey >> strType;
+        if (strType != "as")
+            break;
+
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.write(iterator.value().data(), iterator.value().size());
+        CAnonOutputCount aoc;
+        ssValue >> aoc;
+        vStats.push_back(aoc);
+    };
+
+    return true;
+};
+
 bool CTxDB::EraseRange(const std::string &sPrefix, uint32_t &nAffected)
 {
+    // - the iterator only sees what is on disk
+    if (!Flush())
+        return false;
 
     TxnBegin();
 
@@ -421,6 +1141,7 @@ bool CTxDB::LoadBlockIndex()
     // The block index is an in-memory structure that maps hashes to on-disk
     // locations where the contents of the block can be found. Here, we scan it
     // out of the DB and into mapBlockIndex.
+    Flush();
     leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
     // Seek to start key.
     CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
@@ -433,11 +1154,11 @@ bool CTxDB::LoadBlockIndex()
     {
         count++;
         boost::this_thread::interruption_point();
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
+        // Unpack keys and values, reading from the iterator's slices in place.
+        leveldb::Slice slKey = iterator->key();
+        leveldb::Slice slValue = iterator->value();
+        CBufferReader ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+        CBufferReader ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
         string strType;
         ssKey >> strType;
         // Did we reach the end of the data to read?
@@ -18,6 +18,18 @@
 
 #include "ringsig.h"
 
+/** Defaults for -dbwritebuffer (MiB), -dbmaxopenfiles and -dbblocksize (KiB) */
+static const int64_t DEFAULT_DB_WRITE_BUFFER = 8;
+static const int64_t DEFAULT_DB_MAX_OPEN_FILES = 1000;
+static const int64_t DEFAULT_DB_BLOCK_SIZE = 4;
+/** Minimum write buffer of the bulk load profile, in megabytes */
+static const int64_t DB_BULK_LOAD_WRITE_BUFFER = 64;
+
+/** Default for -dbwritecache, in megabytes */
+static const int64_t DEFAULT_DB_WRITE_CACHE = 32;
+/** Seconds between flushes of the committed writes held in memory */
+static const int64_t DB_WRITE_CACHE_FLUSH_INTERVAL = 5 * 60;
+
 /*
 prefixes
     ao
@@ -37,6 +49,26 @@ prefixes
         blockindex
 */
 
+/** LevelDB options shared by the txdb and smsgDB, tuned by the -db* arguments.
+ *  The bulk load profile, used for -reindex and a new txdb, takes larger write buffers
+ *  so fewer, larger level-0 files are flushed and compacted while loading the chain. */
+leveldb::Options GetLevelDBOptions(size_t nCacheSize, bool fBulkLoad);
+
+/** LevelDB internals, reported by the getdbstats RPC */
+class CLevelDBStats
+{
+public:
+    CLevelDBStats() : nTotalSize(0) {};
+
+    std::string sStats;                                         // leveldb.stats
+    std::vector<std::string> vFilesAtLevel;                     // leveldb.num-files-at-levelN
+    std::vector<std::pair<std::string, uint64_t> > vPrefixSizes;
+    uint64_t nTotalSize;
+};
+
+/** Fill stats from pdb, vPrefixes pairs a name with a raw key prefix to report the approximate size of. */
+void GetLevelDBStats(leveldb::DB *pdb, const std::vector<std::pair<std::string, std::string> > &vPrefixes, CLevelDBStats &stats);
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -49,6 +81,15 @@ prefixes
 // together when too many files stack up.
 //
 // Learn more: http://code.google.com/p/leveldb/
+//
+// Committed transactions are not written straight to the LevelDB. They are
+// merged into a write-back cache shared by all CTxDB instances, which is
+// written out as one atomic batch when it grows past -dbwritecache, every
+// DB_WRITE_CACHE_FLUSH_INTERVAL seconds, before iterating the database and
+// on Close(). Reads see the active batch, then the cache, then the disk.
+// The anon output range scans lay the cache over the disk instead of flushing.
+// As a whole batch is flushed at once the database on disk always holds a
+// consistent chain state, a crash only loses the most recent blocks.
 class CTxDB
 {
 public:
@@ -69,6 +110,13 @@ private:
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
     leveldb::WriteBatch *activeBatch;
+
+    // Anon outputs and key images written or erased (false) in activeBatch, and the
+    // changes to the "as" stats, folded in once at TxnCommit.
+    std::map<CPubKey, std::pair<bool, CAnonOutput> > mapBatchAnonOutputs;
+    std::map<ec_point, std::pair<bool, CKeyImageSpent> > mapBatchKeyImages;
+    std::map<int64_t, CAnonOutputCount> mapBatchAnonStats;
+
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
@@ -79,8 +127,15 @@ protected:
     // delete for it.
     bool ScanBatch(const CDataStream &key, std::string *value, bool *deleted) const;
 
+    // As ScanBatch, for the committed writes not yet flushed to disk.
+    static bool ScanPending(const CDataStream &key, std::string *value, bool *deleted);
+
+    // Drop any pending write of key, before writing it directly to disk.
+    static void ErasePending(const CDataStream &key);
+
+    // fScanBatch = false skips activeBatch, for keys whose batched changes are kept in the maps above.
     template<typename K, typename T>
-    bool Read(const K& key, T& value)
+    bool Read(const K& key, T& value, bool fScanBatch = true)
     {
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
@@ -88,7 +143,7 @@ protected:
         std::string strValue;
 
         bool readFromDb = true;
-        if (activeBatch)
+        if (activeBatch && fScanBatch)
         {
             // First we must search for it in the currently pending set of
             // changes to the db. If not found in the batch, go on to read disk.
@@ -100,6 +155,14 @@ protected:
             }
         };
 
+        if (readFromDb)
+        {
+            bool deleted = false;
+            readFromDb = ScanPending(ssKey, &strValue, &deleted) == false;
+            if (deleted)
+                return false;
+        };
+
         if (readFromDb)
         {
             leveldb::Status status = pdb->Get(leveldb::ReadOptions(),
@@ -113,10 +176,10 @@ protected:
                 return false;
             }
         }
-        // Unserialize value
+        // Unserialize value straight out of strValue, no need to copy it
         try {
-            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(),
-                                SER_DISK, CLIENT_VERSION);
+            CBufferReader ssValue(strValue.data(), strValue.data() + strValue.size(),
+                                  SER_DISK, CLIENT_VERSION);
             ssValue >> value;
         } catch (std::exception &e)
         {
@@ -144,6 +207,7 @@ protected:
             return true;
         };
 
+        ErasePending(ssKey);
         leveldb::Status status = pdb->Put(leveldb::WriteOptions(), ssKey.str(), ssValue.str());
         if (!status.ok())
         {
@@ -171,6 +235,7 @@ protected:
             return true;
         };
 
+        ErasePending(ssKey);
         leveldb::Status status = pdb->Delete(leveldb::WriteOptions(), ssKey.str());
         return (status.ok() || status.IsNotFound());
     }
@@ -183,14 +248,12 @@ protected:
         ssKey << key;
         std::string unused;
 
-        if (activeBatch)
-        {
-            bool deleted;
-            if (ScanBatch(ssKey, &unused, &deleted) && !deleted)
-            {
-                return true;
-            }
-        }
+        bool deleted;
+        if (activeBatch && ScanBatch(ssKey, &unused, &deleted))
+            return !deleted;
+
+        if (ScanPending(ssKey, &unused, &deleted))
+            return !deleted;
 
         leveldb::Status status = pdb->Get(leveldb::ReadOptions(), ssKey.str(), &unused);
         return status.IsNotFound() == false;
@@ -204,13 +267,20 @@ public:
     {
         delete activeBatch;
         activeBatch = NULL;
+        mapBatchAnonOutputs.clear();
+        mapBatchKeyImages.clear();
+        mapBatchAnonStats.clear();
         return true;
     }
 
-    leveldb::DB* GetInstance()
-    {
-        return pdb;
-    }
+    // Write the committed transactions held in memory to disk.
+    bool Flush();
+
+    // Flushes first, so iterators over the instance see all committed writes.
+    leveldb::DB* GetInstance();
+
+    // Stats of what is on disk, sized by record type.
+    void GetStats(CLevelDBStats &stats);
 
     bool ReadVersion(int& nVersion)
     {
@@ -234,6 +304,16 @@ public:
     bool WriteAnonOutput(CPubKey& pkCoin, CAnonOutput& ao);
     bool ReadAnonOutput(CPubKey& pkCoin, CAnonOutput& ao);
     bool EraseAnonOutput(CPubKey& pkCoin);
+    bool BuildAnonOutputIndex();
+    // Anon outputs of nValue in blocks nMinHeight to nMaxHeight, that are not compromised.
+    bool ListAnonOutputs(int64_t nValue, int nMinHeight, int nMaxHeight, std::vector<CPubKey>& vpkCoins);
+    bool CountAnonOutputs(int64_t nValue, int nMinHeight, int nMaxHeight, int& nCount, int& nCompromised);
+    // Height of the highest anon output of nValue at or below nMaxHeight, -1 if there is none.
+    bool ReadLastAnonOutputHeight(int64_t nValue, int nMaxHeight, int& nHeight);
+
+    // Per denomination counts of anon outputs and spends, kept up to date by the writes above.
+    bool UpdateAnonStats(int64_t nValue, int nExists, int nSpends, int nCompromised);
+    bool ReadAnonStats(std::vector<CAnonOutputCount>& vStats);
 
     bool EraseRange(const std::string &sPrefix, uint32_t &nAffected);
 
@@ -25,13 +25,15 @@ extern const std::string CLIENT_LAST_COPYRIGHT;
 //
 // database format versioning
 //
-static const int DATABASE_VERSION = 70511;
+static const int DATABASE_VERSION = 70513;
+// oldest version upgraded in place, by rebuilding the anon output index and stats
+static const int DATABASE_VERSION_MIN_UPGRADE = 70511;
 
 //
 // network protocol versioning
 //
 
-static const int PROTOCOL_VERSION = 60018;
+static const int PROTOCOL_VERSION = 60019;
 
 // intial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -45,6 +47,7 @@ static const int CADDR_TIME_VERSION = 31402;
 
 static const int MIN_THIN_VERSION = 60014;
 static const int MIN_MBLK_VERSION = 60015;
+static const int MIN_CMPCT_VERSION = 60019;
 
 // BIP 0031, pong message, is enabled for all versions AFTER this one
 static const int BIP0031_VERSION = 60000;
@@ -23,15 +23,6 @@ using namespace std;
 // mapWallet
 //
 
-struct CompareValueOnly
-{
-    bool operator()(const pair<int64_t, pair<const CWalletTx*, unsigned int> >& t1,
-                    const pair<int64_t, pair<const CWalletTx*, unsigned int> >& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-
 CPubKey CWallet::GenerateNewKey()
 {
     //assert(false); // [rm] replace with HD - needed for NewKeyPool from EncryptWallet
@@ -183,6 +174,7 @@ bool CWallet::AddCScript(const CScript& redeemScript)
 // provides no real security
 bool fWalletUnlockStakingOnly = false;
 bool fWalletUnlockMessagingEnabled = false;
+int nCoinSelection = COINSELECT_DEFAULT;
 
 bool CWallet::LoadCScript(const CScript& redeemScript)
 {
@@ -612,11 +604,114 @@ void CWallet::MarkDirty()
 {
     {
         LOCK(cs_wallet);
+        InvalidateTxCaches();
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
     }
 }
 
+void CWallet::MarkTxDirty(const CWalletTx* pwtx) const
+{
+    LOCK(cs_wallet);
+    if (!fBalanceCacheValid && !fCoinIndexValid)
+        return;
+
+    std::map<const CWalletTx*, std::pair<int64_t, int64_t> >::iterator mi = mapBalanceSettled.find(pwtx);
+    if (mi != mapBalanceSettled.end())
+    {
+        nSettledBalance -= mi->second.first;
+        nSettledShadowBalance -= mi->second.second;
+        mapBalanceSettled.erase(mi);
+    } else
+    if (!setBalancePending.count(pwtx))
+    {
+        // -- copies of wallet transactions are not tracked
+        WalletTxMap::const_iterator wi = mapWallet.find(pwtx->GetHash());
+        if (wi == mapWallet.end() || &wi->second != pwtx)
+            return;
+    };
+
+    if (fBalanceCacheValid)
+        setBalancePending.insert(pwtx);
+    if (fCoinIndexValid)
+        setCoinsDirty.insert(pwtx);
+}
+
+void CWallet::InvalidateTxCaches() const
+{
+    LOCK(cs_wallet);
+    fBalanceCacheValid = false;
+    nSettledBalance = 0;
+    nSettledShadowBalance = 0;
+    mapBalanceSettled.clear();
+    setBalancePending.clear();
+
+    fCoinIndexValid = false;
+    mapWalletCoins.clear();
+    setCoinsDirty.clear();
+}
+
+void CWallet::UpdateBalanceCache() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (!fBalanceCacheValid)
+    {
+        for (WalletTxMap::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setBalancePending.insert(&it->second);
+        fBalanceCacheValid = true;
+    };
+
+    // -- settle transactions that can no longer change bucket as the chain grows
+    for (std::set<const CWalletTx*>::iterator it = setBalancePending.begin(); it != setBalancePending.end(); )
+    {
+        const CWalletTx* pcoin = *it;
+        if (!pcoin->IsFinal()
+            || pcoin->GetBlocksToMaturity() > 0
+            || pcoin->GetDepthInMainChain() < 1)
+        {
+            ++it;
+            continue;
+        };
+
+        int64_t nCredit = pcoin->GetAvailableCredit();
+        int64_t nShadowCredit = pcoin->nVersion == ANON_TXN_VERSION ? pcoin->GetAvailableShadowCredit() : 0;
+        nSettledBalance += nCredit;
+        nSettledShadowBalance += nShadowCredit;
+        mapBalanceSettled[pcoin] = std::make_pair(nCredit, nShadowCredit);
+        setBalancePending.erase(it++);
+    };
+}
+
+void CWallet::UpdateCoinIndex() const
+{
+    AssertLockHeld(cs_wallet);
+
+    if (!fCoinIndexValid)
+    {
+        mapWalletCoins.clear();
+        setCoinsDirty.clear();
+        for (WalletTxMap::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            setCoinsDirty.insert(&it->second);
+        fCoinIndexValid = true;
+    };
+
+    for (std::set<const CWalletTx*>::iterator it = setCoinsDirty.begin(); it != setCoinsDirty.end(); ++it)
+    {
+        const CWalletTx* pcoin = *it;
+        uint256 hash = pcoin->GetHash();
+        for (unsigned int i = 0; i < pcoin->vout.size(); i++)
+        {
+            if (!pcoin->IsSpent(i) && IsMine(pcoin->vout[i]))
+                mapWalletCoins[COutPoint(hash, i)] = pcoin;
+            else
+                mapWalletCoins.erase(COutPoint(hash, i));
+        };
+    };
+    setCoinsDirty.clear();
+}
+
 bool CWallet::AddToWallet(const CWalletTx& wtxIn, const uint256& hashIn)
 {
     //uint256 hashIn = wtxIn.GetHash();
@@ -922,6 +1017,7 @@ bool CWallet::EraseFromWallet(uint256 hash)
 
     {
         LOCK(cs_wallet);
+        InvalidateTxCaches();
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
     }
@@ -1539,9 +1635,11 @@ int64_t CWallet::GetBalance() const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (WalletTxMap::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateBalanceCache();
+        nTotal = nSettledBalance;
+        for (std::set<const CWalletTx*>::const_iterator it = setBalancePending.begin(); it != setBalancePending.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = *it;
             if (pcoin->IsTrusted())
                 nTotal += pcoin->GetAvailableCredit();
         };
@@ -1556,9 +1654,11 @@ int64_t CWallet::GetShadowBalance() const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (WalletTxMap::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateBalanceCache();
+        nTotal = nSettledShadowBalance;
+        for (std::set<const CWalletTx*>::const_iterator it = setBalancePending.begin(); it != setBalancePending.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = *it;
             if (pcoin->IsTrusted() && pcoin->nVersion == ANON_TXN_VERSION)
                 nTotal += pcoin->GetAvailableShadowCredit();
         };
@@ -1573,9 +1673,10 @@ int64_t CWallet::GetUnconfirmedBalance() const
     int64_t nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (WalletTxMap::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateBalanceCache(); // settled transactions are confirmed
+        for (std::set<const CWalletTx*>::const_iterator it = setBalancePending.begin(); it != setBalancePending.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = *it;
             if (!pcoin->IsFinal() || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
                 nTotal += pcoin->GetAvailableCredit();
         };
@@ -1588,9 +1689,10 @@ int64_t CWallet::GetImmatureBalance() const
     int64_t nTotal = 0;
     {
         LOCK2(cs_main, cs_wallet);
-        for (WalletTxMap::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateBalanceCache(); // settled transactions are mature
+        for (std::set<const CWalletTx*>::const_iterator it = setBalancePending.begin(); it != setBalancePending.end(); ++it)
         {
-            const CWalletTx& pcoin = (*it).second;
+            const CWalletTx& pcoin = **it;
             if (pcoin.IsCoinBase() && pcoin.GetBlocksToMaturity() > 0 && pcoin.IsInMainChain())
                 nTotal += GetCredit(pcoin);
         }
@@ -1605,28 +1707,31 @@ void CWallet::AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed,
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (WalletTxMap::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-
-            if (!pcoin->IsFinal())
-                continue;
-
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
+        UpdateCoinIndex();
 
-            if ((pcoin->IsCoinBase()||pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+        // -- outputs of a transaction are adjacent, the checks per transaction are made once
+        const CWalletTx* pcoin = NULL;
+        bool fUsable = false;
+        int nDepth = 0;
+        for (std::map<COutPoint, const CWalletTx*>::const_iterator it = mapWalletCoins.begin(); it != mapWalletCoins.end(); ++it)
+        {
+            if (it->second != pcoin)
+            {
+                pcoin = it->second;
+                nDepth = pcoin->GetDepthInMainChain();
+                fUsable = pcoin->IsFinal()
+                    && (!fOnlyConfirmed || pcoin->IsTrusted())
+                    && !((pcoin->IsCoinBase() || pcoin->IsCoinStake()) && pcoin->GetBlocksToMaturity() > 0)
+                    && nDepth >= 0;
+            };
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 0)
+            if (!fUsable)
                 continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue >= nMinimumInputValue &&
-                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
-                    vCoins.push_back(COutput(pcoin, i, nDepth));
-
+            unsigned int i = it->first.n;
+            if (pcoin->vout[i].nValue >= nMinimumInputValue &&
+                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(it->first.hash, i)))
+                vCoins.push_back(COutput(pcoin, i, nDepth));
         }
     }
 }
@@ -1637,80 +1742,45 @@ void CWallet::AvailableCoinsForStaking(std::vector<COutput>& vCoins, unsigned in
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (WalletTxMap::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateCoinIndex();
+
+        const CWalletTx* pcoin = NULL;
+        bool fUsable = false;
+        int nDepth = 0;
+        for (std::map<COutPoint, const CWalletTx*>::const_iterator it = mapWalletCoins.begin(); it != mapWalletCoins.end(); ++it)
         {
-            const CWalletTx* pcoin = &(*it).second;
+            if (it->second != pcoin)
+            {
+                pcoin = it->second;
 
-            // Filtering by tx timestamp instead of block timestamp may give false positives but never false negatives
-            if (pcoin->nTime + nStakeMinAge > nSpendTime)
-                continue;
+                // Filtering by tx timestamp instead of block timestamp may give false positives but never false negatives
+                fUsable = pcoin->nTime + nStakeMinAge <= nSpendTime
+                    && pcoin->GetBlocksToMaturity() <= 0
+                    && (nDepth = pcoin->GetDepthInMainChain()) >= 1;
+            };
 
-            if (pcoin->GetBlocksToMaturity() > 0)
+            if (!fUsable)
                 continue;
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 1)
+            unsigned int i = it->first.n;
+            if (pcoin->nVersion == ANON_TXN_VERSION
+                && pcoin->vout[i].IsAnonOutput())
                 continue;
-
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++)
-            {
-                if (pcoin->nVersion == ANON_TXN_VERSION
-                    && pcoin->vout[i].IsAnonOutput())
-                    continue;
-                if (!(pcoin->IsSpent(i)) && IsMine(pcoin->vout[i]) && pcoin->vout[i].nValue >= nMinimumInputValue)
-                    vCoins.push_back(COutput(pcoin, i, nDepth));
-            };
+            if (pcoin->vout[i].nValue >= nMinimumInputValue)
+                vCoins.push_back(COutput(pcoin, i, nDepth));
         };
     }
 }
 
-static void ApproximateBestSubset(
-    std::vector<pair<int64_t, pair<const CWalletTx*,unsigned int> > >vValue, int64_t nTotalLower, int64_t nTargetValue,
-    std::vector<char>& vfBest, int64_t& nBest, int iterations = 1000)
-{
-    std::vector<char> vfIncluded;
-
-    vfBest.assign(vValue.size(), true);
-    nBest = nTotalLower;
-
-    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
-    {
-        vfIncluded.assign(vValue.size(), false);
-        int64_t nTotal = 0;
-        bool fReachedTarget = false;
-        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
-        {
-            for (unsigned int i = 0; i < vValue.size(); i++)
-            {
-                if (nPass == 0 ? rand() % 2 : !vfIncluded[i])
-                {
-                    nTotal += vValue[i].first;
-                    vfIncluded[i] = true;
-                    if (nTotal >= nTargetValue)
-                    {
-                        fReachedTarget = true;
-                        if (nTotal < nBest)
-                        {
-                            nBest = nTotal;
-                            vfBest = vfIncluded;
-                        }
-                        nTotal -= vValue[i].first;
-                        vfIncluded[i] = false;
-                    }
-                }
-            }
-        }
-    }
-}
-
 // ppcoin: total coins staked (non-spendable until maturity)
 int64_t CWallet::GetStake() const
 {
     int64_t nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (WalletTxMap::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    UpdateBalanceCache(); // settled transactions are mature
+    for (std::set<const CWalletTx*>::const_iterator it = setBalancePending.begin(); it != setBalancePending.end(); ++it)
     {
-        const CWalletTx* pcoin = &(*it).second;
+        const CWalletTx* pcoin = *it;
         if (pcoin->IsCoinStake() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
             nTotal += CWallet::GetCredit(*pcoin);
     };
@@ -1721,143 +1791,102 @@ int64_t CWallet::GetNewMint() const
 {
     int64_t nTotal = 0;
     LOCK2(cs_main, cs_wallet);
-    for (WalletTxMap::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    UpdateBalanceCache(); // settled transactions are mature
+    for (std::set<const CWalletTx*>::const_iterator it = setBalancePending.begin(); it != setBalancePending.end(); ++it)
     {
-        const CWalletTx* pcoin = &(*it).second;
+        const CWalletTx* pcoin = *it;
         if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0 && pcoin->GetDepthInMainChain() > 0)
             nTotal += CWallet::GetCredit(*pcoin);
     };
     return nTotal;
 }
 
-bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const
+bool CWallet::SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet,
+    const CCoinSelectionParams* pParams, CCoinSelectionResult* pSelection) const
 {
     setCoinsRet.clear();
     nValueRet = 0;
 
-    // List of values less than target
-    pair<int64_t, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
-    coinLowestLarger.first = std::numeric_limits<int64_t>::max();
-    coinLowestLarger.second.first = NULL;
-    std::vector<std::pair<int64_t, std::pair<const CWalletTx*,unsigned int> > > vValue;
-    int64_t nTotalLower = 0;
-
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
-
-    BOOST_FOREACH(COutput output, vCoins)
+    std::vector<CSelectCandidate> vCandidates;
+    vCandidates.reserve(vCoins.size());
+    for (unsigned int k = 0; k < vCoins.size(); ++k)
     {
+        const COutput& output = vCoins[k];
         const CWalletTx *pcoin = output.tx;
 
         if (output.nDepth < (pcoin->IsFromMe() ? nConfMine : nConfTheirs))
             continue;
 
-        int i = output.i;
-
         // Follow the timestamp rules
         if (pcoin->nTime > nSpendTime)
             continue;
 
-        int64_t n = pcoin->vout[i].nValue;
-
-        pair<int64_t,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
-
-        if (n == nTargetValue)
-        {
-            setCoinsRet.insert(coin.second);
-            nValueRet += coin.first;
-            return true;
-        }
-        else if (n < nTargetValue + CENT)
-        {
-            vValue.push_back(coin);
-            nTotalLower += n;
-        }
-        else if (n < coinLowestLarger.first)
-        {
-            coinLowestLarger = coin;
-        }
-    }
+        vCandidates.push_back(CSelectCandidate(pcoin->vout[output.i].nValue, k));
+    };
 
-    if (nTotalLower == nTargetValue)
-    {
-        for (unsigned int i = 0; i < vValue.size(); ++i)
-        {
-            setCoinsRet.insert(vValue[i].second);
-            nValueRet += vValue[i].first;
-        }
-        return true;
-    }
+    CCoinSelectionParams params;
+    CCoinSelectionResult selection;
+    CCoinSelectionResult& result = pSelection ? *pSelection : selection;
+    if (!SelectCandidates(vCandidates, nTargetValue, pParams ? *pParams : params, result))
+        return false;
 
-    if (nTotalLower < nTargetValue)
+    for (unsigned int k = 0; k < result.vSelected.size(); ++k)
     {
-        if (coinLowestLarger.second.first == NULL)
-            return false;
-        setCoinsRet.insert(coinLowestLarger.second);
-        nValueRet += coinLowestLarger.first;
-        return true;
-    }
-
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
-    std::vector<char> vfBest;
-    int64_t nBest;
+        const COutput& output = vCoins[result.vSelected[k]];
+        setCoinsRet.insert(make_pair(output.tx, output.i));
+    };
+    nValueRet = result.nValue;
 
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
+    return true;
+}
 
-    // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
-    //                                   or the next bigger coin is closer), return the bigger coin
-    if (coinLowestLarger.second.first &&
-        ((nBest != nTargetValue && nBest < nTargetValue + CENT) || coinLowestLarger.first <= nBest))
-    {
-        setCoinsRet.insert(coinLowestLarger.second);
-        nValueRet += coinLowestLarger.first;
-    }
-    else
-	{
-        for (unsigned int i = 0; i < vValue.size(); i++)
-            if (vfBest[i])
-            {
-                setCoinsRet.insert(vValue[i].second);
-                nValueRet += vValue[i].first;
-            }
+void CWallet::GetCoinSelectionParams(CCoinSelectionParams& params, const CCoinControl* coinControl) const
+{
+    params.SetNull();
 
-        if (fDebug && GetBoolArg("-printpriority"))
-        {
-            //// debug print
-            LogPrintf("SelectCoins() best subset: ");
-            for (unsigned int i = 0; i < vValue.size(); i++)
-                if (vfBest[i])
-                    LogPrintf("%s ", FormatMoney(vValue[i].first).c_str());
-            LogPrintf("total %s\n", FormatMoney(nBest).c_str());
-        }
-    }
+    params.nStrategy = (coinControl && coinControl->nCoinSelection >= 0) ? coinControl->nCoinSelection : nCoinSelection;
+    params.nFeePerKB = nTransactionFee;
+    params.nMinFee = MIN_TX_FEE;
 
-    return true;
+    // -- a change output costs its own bytes now and an input's worth when it is spent
+    params.nCostOfChange = (nTransactionFee * (COINSELECT_OUTPUT_SIZE + COINSELECT_INPUT_SIZE)) / 1000;
+    params.nMaxSize = MAX_BLOCK_SIZE_GEN/5;
 }
 
-bool CWallet::SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl* coinControl) const
+bool CWallet::SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl* coinControl,
+    const CCoinSelectionParams* pParams, CCoinSelectionResult* pSelection) const
 {
     std::vector<COutput> vCoins;
     AvailableCoins(vCoins, true, coinControl);
 
+    CCoinSelectionParams params;
+    if (pParams)
+        params = *pParams;
+    else
+        GetCoinSelectionParams(params, coinControl);
+
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected())
     {
-        BOOST_FOREACH(const COutput& out, vCoins)
+        CCoinSelectionResult selection;
+        CCoinSelectionResult& result = pSelection ? *pSelection : selection;
+        result.SetNull();
+        for (unsigned int k = 0; k < vCoins.size(); ++k)
         {
+            const COutput& out = vCoins[k];
             nValueRet += out.tx->vout[out.i].nValue;
             setCoinsRet.insert(make_pair(out.tx, out.i));
-        }
+            result.vSelected.push_back(k);
+        };
+        result.nValue = nValueRet;
+        result.fChange = nValueRet - nTargetValue > params.nCostOfChange;
+        EstimateSelectionFee(params, result);
         return (nValueRet >= nTargetValue);
-    }
-
-    boost::function<bool (const CWallet*, int64_t, unsigned int, int, int, std::vector<COutput>, std::set<std::pair<const CWalletTx*,unsigned int> >&, int64_t&)> f = &CWallet::SelectCoinsMinConf;
+    };
 
-    return (f(this, nTargetValue, nSpendTime, 1, 10, vCoins, setCoinsRet, nValueRet) ||
-            f(this, nTargetValue, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet) ||
-            f(this, nTargetValue, nSpendTime, 0, 1, vCoins, setCoinsRet, nValueRet));
+    return (SelectCoinsMinConf(nTargetValue, nSpendTime, 1, 10, vCoins, setCoinsRet, nValueRet, &params, pSelection) ||
+            SelectCoinsMinConf(nTargetValue, nSpendTime, 1, 1, vCoins, setCoinsRet, nValueRet, &params, pSelection) ||
+            SelectCoinsMinConf(nTargetValue, nSpendTime, 0, 1, vCoins, setCoinsRet, nValueRet, &params, pSelection));
 }
 
 // Select some coins without random shuffle or best subset approximation
@@ -1921,6 +1950,9 @@ bool CWallet::CreateTransaction(const std::vector<std::pair<CScript, int64_t> >&
         // txdb must be opened before the mapWallet lock
         CTxDB txdb("r");
         {
+            CCoinSelectionParams selectionParams;
+            GetCoinSelectionParams(selectionParams, coinControl);
+
             nFeeRet = nTransactionFee;
             while (true)
             {
@@ -1939,7 +1971,9 @@ bool CWallet::CreateTransaction(const std::vector<std::pair<CScript, int64_t> >&
                 // Choose coins to use
                 set<pair<const CWalletTx*,unsigned int> > setCoins;
                 int64_t nValueIn = 0;
-                if (!SelectCoins(nTotalValue, wtxNew.nTime, setCoins, nValueIn, coinControl))
+                CCoinSelectionResult selection;
+                selectionParams.nBaseSize = ::GetSerializeSize(*(CTransaction*)&wtxNew, SER_NETWORK, PROTOCOL_VERSION);
+                if (!SelectCoins(nTotalValue, wtxNew.nTime, setCoins, nValueIn, coinControl, &selectionParams, &selection))
                     return false;
 
                 BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
@@ -1949,6 +1983,14 @@ bool CWallet::CreateTransaction(const std::vector<std::pair<CScript, int64_t> >&
                 };
 
                 int64_t nChange = nValueIn - nValue - nFeeRet;
+
+                // -- excess below the cost of a change output is left to the fee
+                if (nChange > 0 && !selection.fChange)
+                {
+                    nFeeRet += nChange;
+                    nChange = 0;
+                };
+
                 // if sub-cent change is required, the fee must be raised to at least MIN_TX_FEE
                 // or until nChange becomes zero
                 // NOTE: this depends on the exact behaviour of GetMinFee
@@ -3133,6 +3175,7 @@ bool CWallet::UndoAnonTransaction(const CTransaction& tx)
         return false;
     };
 
+    InvalidateTxCaches();
     mapWallet.erase(txnHash);
 
     return true;
@@ -4166,67 +4209,19 @@ int CWallet::PickHidingOutputs(int64_t nValue, int nRingSize, CPubKey& pkCoin, i
     if (fDebug)
         LogPrintf("PickHidingOutputs() %d, %d\n", nValue, nRingSize);
 
-    // TODO: process multiple inputs in 1 db loop?
-
     // -- offset skip is pre filled with the real coin
 
     LOCK(cs_main);
     CTxDB txdb("r");
 
-    leveldb::DB* pdb = txdb.GetInstance();
-    if (!pdb)
-        throw runtime_error("CWallet::PickHidingOutputs() : cannot get leveldb instance");
-
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-
+    // -- range scan of the "an" index over mature outputs of this denomination
     std::vector<CPubKey> vHideKeys;
+    if (!txdb.ListAnonOutputs(nValue, 1, nBestHeight - MIN_ANON_SPEND_DEPTH, vHideKeys))
+        throw runtime_error("CWallet::PickHidingOutputs() : ListAnonOutputs failed");
 
-    // Seek to start key.
-    CPubKey pkZero;
-    pkZero.SetZero();
-
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("ao"), pkZero);
-    iterator->Seek(ssStartKey.str());
-
-    CPubKey pkAo;
-    CAnonOutput anonOutput;
-    while (iterator->Valid())
-    {
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        string strType;
-        ssKey >> strType;
-
-        if (strType != "ao")
-            break;
-
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-
-
-        ssKey >> pkAo;
-
-        if (pkAo != pkCoin
-            && pkAo.IsValid())
-        {
-            ssValue >> anonOutput;
-
-            if ((anonOutput.nBlockHeight > 0 && nBestHeight - anonOutput.nBlockHeight >= MIN_ANON_SPEND_DEPTH)
-                && anonOutput.nValue == nValue
-                && anonOutput.nCompromised == 0)
-                try { vHideKeys.push_back(pkAo); } catch (std::exception& e)
-                {
-                    LogPrintf("Error: PickHidingOutputs() vHideKeys.push_back threw: %s.\n", e.what());
-                    return 1;
-                }
-        }
-
-        iterator->Next();
-    };
-
-    delete iterator;
+    std::vector<CPubKey>::iterator itCoin = std::find(vHideKeys.begin(), vHideKeys.end(), pkCoin);
+    if (itCoin != vHideKeys.end())
+        vHideKeys.erase(itCoin);
 
     if ((int)vHideKeys.size() < nRingSize-1)
         return errorN(1, "%s: Not enough keys found.", __func__);
@@ -4243,10 +4238,10 @@ int CWallet::PickHidingOutputs(int64_t nValue, int nRingSize, CPubKey& pkCoin, i
 
         memcpy(p + i * 33, vHideKeys[pick].begin(), 33);
 
-        vHideKeys.erase(vHideKeys.begin()+pick);
+        vHideKeys[pick] = vHideKeys.back();
+        vHideKeys.pop_back();
     };
 
-
     return 0;
 };
 
@@ -5279,182 +5274,76 @@ int CWallet::CountAnonOutputs(std::map<int64_t, int>& mOutputCounts, bool fMatur
     LOCK(cs_main);
     CTxDB txdb("r");
 
-    leveldb::DB* pdb = txdb.GetInstance();
-    if (!pdb)
-        throw runtime_error("CWallet::CountAnonOutputs() : cannot get leveldb instance");
-
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-
-
-    // Seek to start key.
-    CPubKey pkZero;
-    pkZero.SetZero();
+    // -- per value from the "an" index, the write-back cache is read through, not flushed
+    int nMinHeight = fMatureOnly ? 1 : 0;
+    int nMaxHeight = fMatureOnly ? nBestHeight - MIN_ANON_SPEND_DEPTH : std::numeric_limits<int>::max();
+    bool fSkipCompromised = Params().IsProtocolV3(nBestHeight);
 
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("ao"), pkZero);
-    iterator->Seek(ssStartKey.str());
-
-
-    while (iterator->Valid())
+    for (std::map<int64_t, int>::iterator mi = mOutputCounts.begin(); mi != mOutputCounts.end(); ++mi)
     {
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        string strType;
-        ssKey >> strType;
-
-        if (strType != "ao")
-            break;
+        int nCount, nCompromised;
+        if (!txdb.CountAnonOutputs(mi->first, nMinHeight, nMaxHeight, nCount, nCompromised))
+            return errorN(1, "%s: CountAnonOutputs failed.", __func__);
 
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-
-        CAnonOutput anonOutput;
-        ssValue >> anonOutput;
-
-
-        if ((!fMatureOnly
-           ||(anonOutput.nBlockHeight > 0 && nBestHeight - anonOutput.nBlockHeight >= MIN_ANON_SPEND_DEPTH))
-          && (Params().IsProtocolV3(nBestHeight) ? anonOutput.nCompromised == 0 : true))
-        {
-            std::map<int64_t, int>::iterator mi = mOutputCounts.find(anonOutput.nValue);
-            if (mi != mOutputCounts.end())
-                mi->second++;
-        };
-
-        iterator->Next();
+        mi->second += fSkipCompromised ? nCount - nCompromised : nCount;
     };
 
-    delete iterator;
-
     return 0;
 };
 
+static bool CompareAnonOutputCountValue(const CAnonOutputCount& a, const CAnonOutputCount& b)
+{
+    return a.nValue < b.nValue;
+}
+
 int CWallet::CountAllAnonOutputs(std::list<CAnonOutputCount>& lOutputCounts, bool fMatureOnly)
 {
     if (fDebugRingSig)
         LogPrintf("CountAllAnonOutputs()\n");
 
-    // TODO: there are few enough possible coin values to preinitialise a vector with all of them
-
     LOCK(cs_main);
     CTxDB txdb("r");
 
-    leveldb::DB* pdb = txdb.GetInstance();
-    if (!pdb)
-        throw runtime_error("CWallet::CountAnonOutputs() : cannot get leveldb instance");
-
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-
-
-    // Seek to start key.
-    CPubKey pkZero;
-    pkZero.SetZero();
-
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("ao"), pkZero);
-    iterator->Seek(ssStartKey.str());
+    // -- counts are kept per value in txdb, only depths and immature outputs need the index
+    std::vector<CAnonOutputCount> vStats;
+    if (!txdb.ReadAnonStats(vStats))
+        return errorN(1, "%s: ReadAnonStats failed.", __func__);
 
+    std::sort(vStats.begin(), vStats.end(), CompareAnonOutputCountValue);
 
-    while (iterator->Valid())
+    int nMaxMatureHeight = nBestHeight - MIN_ANON_SPEND_DEPTH;
+    for (std::vector<CAnonOutputCount>::iterator it = vStats.begin(); it != vStats.end(); ++it)
     {
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        string strType;
-        ssKey >> strType;
-
-        if (strType != "ao")
-            break;
-
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
+        int nUnconfirmed, nUnconfirmedCompromised;
+        if (!txdb.CountAnonOutputs(it->nValue, 0, 0, nUnconfirmed, nUnconfirmedCompromised))
+            return errorN(1, "%s: CountAnonOutputs failed.", __func__);
 
-        CAnonOutput ao;
-        ssValue >> ao;
-
-        if (strType != "ao")
-            break;
-
-        int nHeight = ao.nBlockHeight > 0 ? nBestHeight - ao.nBlockHeight : 0;
-
-
-        if (fMatureOnly
-            && nHeight < MIN_ANON_SPEND_DEPTH)
+        int nLastHeight;
+        if (fMatureOnly)
         {
-            // -- skip
+            int nImmature, nImmatureCompromised;
+            if (!txdb.CountAnonOutputs(it->nValue, std::max(1, nMaxMatureHeight + 1), nBestHeight, nImmature, nImmatureCompromised)
+                || !txdb.ReadLastAnonOutputHeight(it->nValue, nMaxMatureHeight, nLastHeight))
+                return errorN(1, "%s: Reading anon output index failed.", __func__);
+
+            it->nExists -= nUnconfirmed + nImmature;
+            it->nCompromised -= nUnconfirmedCompromised + nImmatureCompromised;
+            if (it->nExists < 1)
+                continue;
+            it->nLeastDepth = nLastHeight > 0 ? nBestHeight - nLastHeight : 0;
         } else
         {
-            // -- insert by nValue asc
-            bool fProcessed = false;
-            for (std::list<CAnonOutputCount>::iterator it = lOutputCounts.begin(); it != lOutputCounts.end(); ++it)
-            {
-                if (ao.nValue == it->nValue)
-                {
-                    it->nExists++;
-                    it->nCompromised += ao.nCompromised;
-                    if (it->nLeastDepth > nHeight)
-                        it->nLeastDepth = nHeight;
-                    fProcessed = true;
-                    break;
-                };
-                if (ao.nValue > it->nValue)
-                    continue;
-                lOutputCounts.insert(it, CAnonOutputCount(ao.nValue, 1, 0, 0, nHeight, ao.nCompromised));
-                fProcessed = true;
-                break;
-            };
-            if (!fProcessed)
-                lOutputCounts.push_back(CAnonOutputCount(ao.nValue, 1, 0, 0, nHeight, ao.nCompromised));
-        };
-
-        iterator->Next();
-    };
-
-    delete iterator;
-
-
-    // -- count spends
-
-    iterator = pdb->NewIterator(leveldb::ReadOptions());
-    ssStartKey.clear();
-    ssStartKey << make_pair(string("ki"), pkZero);
-    iterator->Seek(ssStartKey.str());
+            if (!txdb.ReadLastAnonOutputHeight(it->nValue, nBestHeight, nLastHeight))
+                return errorN(1, "%s: ReadLastAnonOutputHeight failed.", __func__);
 
-    while (iterator->Valid())
-    {
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        string strType;
-        ssKey >> strType;
-
-        if (strType != "ki")
-            break;
-
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-
-        CKeyImageSpent kis;
-        ssValue >> kis;
-
-
-        bool fProcessed = false;
-        for (std::list<CAnonOutputCount>::iterator it = lOutputCounts.begin(); it != lOutputCounts.end(); ++it)
-        {
-            if (kis.nValue != it->nValue)
+            if (it->nExists < 1)
                 continue;
-            it->nSpends++;
-            fProcessed = true;
-            break;
+            it->nLeastDepth = (nUnconfirmed > 0 || nLastHeight < 1) ? 0 : nBestHeight - nLastHeight;
         };
-        if (!fProcessed)
-            LogPrintf("WARNING: CountAllAnonOutputs found keyimage without matching anon output value.\n");
 
-        iterator->Next();
+        lOutputCounts.push_back(*it);
     };
 
-    delete iterator;
-
     return 0;
 };
 
@@ -5546,6 +5435,9 @@ bool CWallet::EraseAllAnonData()
 
     LogPrintf("Erasing anon outputs.\n");
     txdb.EraseRange(std::string("ao"), nAo);
+    uint32_t nAn = 0;
+    txdb.EraseRange(std::string("an"), nAn);
+    txdb.EraseRange(std::string("as"), nAn);
     LogPrintf("Erasing spent key images.\n");
     txdb.EraseRange(std::string("ki"), nKi);
 
@@ -21,11 +21,13 @@
 #include "walletdb.h"
 #include "stealth.h"
 #include "smessage.h"
+#include "coinselection.h"
 
 
 extern bool fWalletUnlockStakingOnly;
 extern bool fWalletUnlockMessagingEnabled;
 extern bool fConfChange;
+extern int nCoinSelection;
 class CAccountingEntry;
 class CWalletTx;
 class CReserveKey;
@@ -87,7 +89,8 @@ class CWallet : public CCryptoKeyStore
 {
 public:
     bool SelectCoinsForStaking(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
-    bool SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl=NULL) const;
+    bool SelectCoins(int64_t nTargetValue, unsigned int nSpendTime, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet, const CCoinControl *coinControl=NULL,
+        const CCoinSelectionParams* pParams=NULL, CCoinSelectionResult* pSelection=NULL) const;
 
     CWalletDB *pwalletdbEncryption;
 
@@ -129,6 +132,21 @@ public:
     
     WalletTxMap mapWallet;
     int64_t nOrderPosNext;
+
+    // Balance cache, guarded by cs_wallet. Transactions that are final, confirmed and mature can't
+    // move between balance buckets, their available credit is summed into nSettledBalance until
+    // they change. The others stay in setBalancePending and are looked at on each query.
+    mutable bool fBalanceCacheValid;
+    mutable int64_t nSettledBalance;
+    mutable int64_t nSettledShadowBalance;
+    mutable std::map<const CWalletTx*, std::pair<int64_t, int64_t> > mapBalanceSettled;
+    mutable std::set<const CWalletTx*> setBalancePending;
+
+    // Unspent outputs paying to the wallet, for coin selection, guarded by cs_wallet.
+    // Transactions in setCoinsDirty have changed and their outputs are refreshed on the next use.
+    mutable bool fCoinIndexValid;
+    mutable std::map<COutPoint, const CWalletTx*> mapWalletCoins;
+    mutable std::set<const CWalletTx*> setCoinsDirty;
     std::map<uint256, int> mapRequestCount;
 
     std::map<CTxDestination, std::string> mapAddressBook;
@@ -161,6 +179,10 @@ public:
         nOrderPosNext = 0;
         nTimeFirstKey = 0;
         nLastFilteredHeight = 0;
+        fBalanceCacheValid = false;
+        nSettledBalance = 0;
+        nSettledShadowBalance = 0;
+        fCoinIndexValid = false;
         
     }
     
@@ -171,7 +193,9 @@ public:
 
     void AvailableCoinsForStaking(std::vector<COutput>& vCoins, unsigned int nSpendTime) const;
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl=NULL) const;
-    bool SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet) const;
+    bool SelectCoinsMinConf(int64_t nTargetValue, unsigned int nSpendTime, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, int64_t& nValueRet,
+        const CCoinSelectionParams* pParams=NULL, CCoinSelectionResult* pSelection=NULL) const;
+    void GetCoinSelectionParams(CCoinSelectionParams& params, const CCoinControl* coinControl=NULL) const;
 
     // keystore implementation
     // Generate a new key
@@ -221,6 +245,10 @@ public:
     TxItems OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount = "", bool fShowCoinstake = true);
 
     void MarkDirty();
+    void MarkTxDirty(const CWalletTx* pwtx) const;
+    void InvalidateTxCaches() const;
+    void UpdateBalanceCache() const;
+    void UpdateCoinIndex() const;
     bool AddToWallet(const CWalletTx& wtxIn, const uint256& hashIn);
     bool AddToWalletIfInvolvingMe(const CTransaction& tx, const uint256& hash, const void* pblock, bool fUpdate = false, bool fFindBlock = false);
     
@@ -748,6 +776,8 @@ public:
                 fAvailableCreditCached = false;
             };
         };
+        if (fReturn && pwallet)
+            pwallet->MarkTxDirty(this);
         return fReturn;
     }
 
@@ -760,6 +790,8 @@ public:
         fDebitCached = false;
         fChangeCached = false;
         fCreditSplitCached = false;
+        if (pwallet)
+            pwallet->MarkTxDirty(this);
     }
     
     bool ForceUpdate()
@@ -783,6 +815,8 @@ public:
         {
             vfSpent[nOut] = true;
             fAvailableCreditCached = false;
+            if (pwallet)
+                pwallet->MarkTxDirty(this);
         };
     }
 
@@ -796,6 +830,8 @@ public:
         {
             vfSpent[nOut] = false;
             fAvailableCreditCached = false;
+            if (pwallet)
+                pwallet->MarkTxDirty(this);
         };
     }
 
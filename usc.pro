@@ -218,6 +218,7 @@ HEADERS += \
     src/bignum.h \
     src/chainparams.h \
     src/checkpoints.h \
+    src/checkqueue.h \
     src/compat.h \
     src/coincontrol.h \
     src/sync.h \
@@ -239,6 +240,7 @@ HEADERS += \
     src/db.h \
     src/txdb.h \
     src/walletdb.h \
+    src/coinselection.h \
     src/script.h \
     src/stealth.h \
     src/ringsig.h  \
@@ -325,6 +327,7 @@ SOURCES += \
     src/core.cpp  \
     src/txmempool.cpp  \
     src/wallet.cpp \
+    src/coinselection.cpp \
     src/keystore.cpp \
     src/state.cpp \
     src/bloom.cpp \